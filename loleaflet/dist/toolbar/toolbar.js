@@ -178,9 +178,6 @@ function onSearch(e) {
 		toolbar.enable('searchnext');
 		toolbar.show('cancelsearch');
 	}
-	else {
-		map.fire('requestloksession');
-	}
 }
 
 function onClick(id) {
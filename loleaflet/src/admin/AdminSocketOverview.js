@@ -16,6 +16,7 @@ var AdminSocketOverview = AdminSocketBase.extend({
 		this.socket.send('total_mem');
 		this.socket.send('active_docs_count');
 		this.socket.send('active_users_count');
+		this.socket.send('tile_cache_usage');
 	},
 
 	onSocketOpen: function() {
@@ -193,6 +194,15 @@ var AdminSocketOverview = AdminSocketBase.extend({
 			}
 			document.getElementById(sCommand).innerHTML = nData;
 		}
+		else if (textMsg.startsWith('tile_cache_usage')) {
+			// used and maximum kB, and the number of documents
+			textMsg = textMsg.split(' ');
+			var sUsage = Util.humanizeMem(parseInt(textMsg[1]));
+			if (parseInt(textMsg[2]) > 0) {
+				sUsage += ' / ' + Util.humanizeMem(parseInt(textMsg[2]));
+			}
+			document.getElementById('tile_cache_usage').innerHTML = sUsage;
+		}
 		else if (textMsg.startsWith('rmdoc')) {
 			textMsg = textMsg.substring('rmdoc'.length);
 			docProps = textMsg.trim().split(' ');
@@ -50,9 +50,6 @@ L.Control.Search = L.Control.extend({
 			this._updateDisabled();
 			this._refocusOnMap();
 		}
-		else {
-			this._map._socket.sendMessage('requestloksession');
-		}
 	},
 
 	_searchResultFound: function (e) {
@@ -5,7 +5,6 @@ L.Map.include({
 	setPermission: function (perm) {
 		this._permission = perm;
 		if (perm === 'edit') {
-			this._socket.sendMessage('requestloksession');
 			this.dragging.disable();
 		}
 		else if (perm === 'view' || perm === 'readonly') {
@@ -23,7 +22,6 @@ L.Map.include({
 		if (this._permission === 'edit') {
 			return;
 		}
-		this._socket.sendMessage('requestloksession');
 		this.dragging.disable();
 	},
 
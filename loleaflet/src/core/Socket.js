@@ -4,7 +4,7 @@
 
 /* global _ vex */
 L.Socket = L.Class.extend({
-	ProtocolVersionNumber: '0.1',
+	ProtocolVersionNumber: '0.3',
 
 	initialize: function (map) {
 		this._map = map;
@@ -161,13 +161,21 @@ L.Socket = L.Class.extend({
 			textMsg = decodeURIComponent(window.escape(textMsg));
 		}
 		else {
-			var data = imgBytes.subarray(index + 1);
-			// read the tile data
-			var strBytes = '';
-			for (var i = 0; i < data.length; i++) {
-				strBytes += String.fromCharCode(data[i]);
+			var img;
+			var tileColor = textMsg.indexOf(' color=') !== -1 ? this.parseServerCmd(textMsg) : {};
+			if (tileColor.color !== undefined) {
+				// a tile of a single color comes without an image
+				img = this._getColorImage(tileColor.color, tileColor.width, tileColor.height);
+			}
+			else {
+				var data = imgBytes.subarray(index + 1);
+				// read the tile data
+				var strBytes = '';
+				for (var i = 0; i < data.length; i++) {
+					strBytes += String.fromCharCode(data[i]);
+				}
+				img = 'data:image/png;base64,' + window.btoa(strBytes);
 			}
-			var img = 'data:image/png;base64,' + window.btoa(strBytes);
 		}
 
 		if (textMsg.startsWith('status:') && !this._map._docLayer) {
@@ -240,6 +248,25 @@ L.Socket = L.Class.extend({
 		}
 	},
 
+	_getColorImage: function (color, width, height) {
+		// made once for each color and size, and the same URL lets the browser reuse the image
+		var key = color + ' ' + width + 'x' + height;
+		if (!this._colorImages) {
+			this._colorImages = {};
+		}
+		if (!this._colorImages[key]) {
+			var canvas = document.createElement('canvas');
+			canvas.width = width;
+			canvas.height = height;
+			var context = canvas.getContext('2d');
+			var rgba = color.match(/../g).map(function (hex) { return parseInt(hex, 16); });
+			context.fillStyle = 'rgba(' + rgba[0] + ',' + rgba[1] + ',' + rgba[2] + ',' + rgba[3] / 255 + ')';
+			context.fillRect(0, 0, width, height);
+			this._colorImages[key] = canvas.toDataURL('image/png');
+		}
+		return this._colorImages[key];
+	},
+
 	_onSocketError: function () {
 		this.hideBusy();
 		this.fire('error', {msg: _('Oops, there is a problem connecting to LibreOffice Online. Please contact your webmaster.'), cmd: 'socket', kind: 'failed', id: 3});
@@ -284,6 +311,9 @@ L.Socket = L.Class.extend({
 			else if (tokens[i].substring(0, 7) === 'height=') {
 				command.height = parseInt(tokens[i].substring(7));
 			}
+			else if (tokens[i].substring(0, 6) === 'color=') {
+				command.color = tokens[i].substring(6);
+			}
 			else if (tokens[i].substring(0, 5) === 'part=') {
 				command.part = parseInt(tokens[i].substring(5));
 			}
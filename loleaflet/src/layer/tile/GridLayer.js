@@ -529,6 +529,9 @@ L.GridLayer = L.Layer.extend({
 		}
 
 		if (queue.length !== 0) {
+			// the server renders the tiles in view first
+			this._sendClientVisibleArea(pixelBounds);
+
 			if (newView) {
 				// we know that a new set of tiles that cover the whole view has been requested
 				// so we're able to cancel the previous requests that are being processed
@@ -558,6 +561,18 @@ L.GridLayer = L.Layer.extend({
 		}
 	},
 
+	_sendClientVisibleArea: function (pixelBounds) {
+		var pos = this._pixelsToTwips(pixelBounds.min);
+		var size = this._pixelsToTwips(pixelBounds.getSize());
+		var payload = 'clientvisiblearea x=' + Math.round(pos.x) + ' y=' + Math.round(pos.y) +
+			' width=' + Math.round(size.x) + ' height=' + Math.round(size.y);
+		if (payload !== this._clientVisibleAreaPayload) {
+			this._map._socket.sendMessage(payload);
+			this._clientVisibleAreaPayload = payload;
+		}
+		this._clientVisibleArea = false;
+	},
+
 	_updateOnChangePart: function () {
 		var map = this._map;
 		if (!map || this._documentInfo === '') {
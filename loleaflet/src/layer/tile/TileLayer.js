@@ -160,7 +160,6 @@ L.TileLayer = L.GridLayer.extend({
 		map.on('zoomend', this._updateClientZoom, this);
 		map.on('resize zoomend', this._invalidateClientVisibleArea, this);
 		map.on('dragstart', this._onDragStart, this);
-		map.on('requestloksession', this._onRequestLOKSession, this);
 		map.on('error', this._mapOnError, this);
 		if (map.options.autoFitWidth !== false) {
 			map.on('resize', this._fitWidthZoom, this);
@@ -817,13 +816,7 @@ L.TileLayer = L.GridLayer.extend({
 		}
 		if (this._clientVisibleArea) {
 			// Visible area is dirty, update it on the server.
-			var visibleArea = this._map._container.getBoundingClientRect();
-			var pos = this._pixelsToTwips(new L.Point(visibleArea.left, visibleArea.top));
-			var size = this._pixelsToTwips(new L.Point(visibleArea.width, visibleArea.height));
-			var payload = 'clientvisiblearea x=' + Math.round(pos.x) + ' y=' + Math.round(pos.y) +
-				' width=' + Math.round(size.x) + ' height=' + Math.round(size.y);
-			this._map._socket.sendMessage(payload);
-			this._clientVisibleArea = false;
+			this._sendClientVisibleArea(this._map.getPixelBounds());
 		}
 		this._map._socket.sendMessage('key type=' + type +
 				' char=' + charcode + ' key=' + keycode);
@@ -1190,10 +1183,6 @@ L.TileLayer = L.GridLayer.extend({
 		this._map.on('moveend', this._updateScrollOffset, this);
 	},
 
-	_onRequestLOKSession: function () {
-		this._map._socket.sendMessage('requestloksession');
-	},
-
 	_fitWidthZoom: function (e, maxZoom) {
 		var size = e ? e.newSize : this._map.getSize();
 		var widthTwips = size.x * this._map.options.tileWidthTwips / this._tileSize;
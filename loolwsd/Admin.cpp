@@ -31,6 +31,7 @@
 #include "Common.hpp"
 #include "FileServer.hpp"
 #include "TileCache.hpp"
+#include "TileCacheAccountant.hpp"
 #include "Storage.hpp"
 #include "LOOLProtocol.hpp"
 #include "LOOLWSD.hpp"
@@ -147,6 +148,16 @@ void AdminRequestHandler::handleWSRequests(HTTPServerRequest& request, HTTPServe
                         std::string responseFrame = "total_mem " + std::to_string(totalMem);
                         sendTextFrame(ws, responseFrame);
                     }
+                    else if (tokens[0] == "tile_cache_usage")
+                    {
+                        // In kB, like total_mem.
+                        TileCacheAccountant& accountant = TileCacheAccountant::instance();
+                        const std::string responseFrame = "tile_cache_usage " +
+                                                          std::to_string(accountant.getUsedBytes() / 1024) + " " +
+                                                          std::to_string(TileCacheAccountant::MaxBytes / 1024) + " " +
+                                                          std::to_string(accountant.getDocumentCount());
+                        sendTextFrame(ws, responseFrame);
+                    }
                     else if (tokens[0] == "kill" && tokens.count() == 2)
                     {
                         try
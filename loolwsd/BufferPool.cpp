@@ -0,0 +1,269 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "BufferPool.hpp"
+
+#include <unistd.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <utility>
+
+constexpr size_t BufferPool::MinSize;
+constexpr size_t BufferPool::SizeClasses;
+
+namespace
+{
+
+/// The class of the smallest size at least size, SizeClasses when too large.
+size_t getSizeClass(const size_t size, const size_t sizeClasses)
+{
+    size_t sizeClass = 0;
+    while (sizeClass < sizeClasses && (BufferPool::MinSize << sizeClass) < size)
+    {
+        ++sizeClass;
+    }
+
+    return sizeClass;
+}
+
+/// The kB of a line like "VmRSS:   1234 kB" of /proc/self/status, or "?".
+std::string getStatus(const std::string& name)
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, name.size() + 1, name + ":") == 0)
+        {
+            std::istringstream iss(line.substr(name.size() + 1));
+            std::string kb;
+            iss >> kb;
+            return kb;
+        }
+    }
+
+    return "?";
+}
+
+}
+
+BufferPool::Pixmap::Pixmap(BufferPool& pool, unsigned char* data, const size_t size, const size_t sizeClass) :
+    _pool(&pool),
+    _data(data),
+    _size(size),
+    _sizeClass(sizeClass)
+{
+}
+
+BufferPool::Pixmap::Pixmap(Pixmap&& other) :
+    _pool(other._pool),
+    _data(other._data),
+    _size(other._size),
+    _sizeClass(other._sizeClass)
+{
+    other._pool = nullptr;
+    other._data = nullptr;
+    other._size = 0;
+}
+
+BufferPool::Pixmap& BufferPool::Pixmap::operator=(Pixmap&& other)
+{
+    if (this != &other)
+    {
+        if (_pool != nullptr)
+            _pool->putPixmap(_data, _sizeClass);
+
+        _pool = other._pool;
+        _data = other._data;
+        _size = other._size;
+        _sizeClass = other._sizeClass;
+        other._pool = nullptr;
+        other._data = nullptr;
+        other._size = 0;
+    }
+
+    return *this;
+}
+
+BufferPool::Pixmap::~Pixmap()
+{
+    if (_pool != nullptr)
+        _pool->putPixmap(_data, _sizeClass);
+}
+
+BufferPool::Output::Output(BufferPool* pool, std::vector<char>&& output) :
+    _pool(pool),
+    _output(std::move(output))
+{
+}
+
+BufferPool::Output::Output(Output&& other) :
+    _pool(other._pool),
+    _output(std::move(other._output))
+{
+    other._pool = nullptr;
+}
+
+BufferPool::Output& BufferPool::Output::operator=(Output&& other)
+{
+    if (this != &other)
+    {
+        if (_pool != nullptr)
+            _pool->putOutput(std::move(_output));
+
+        _pool = other._pool;
+        _output = std::move(other._output);
+        other._pool = nullptr;
+    }
+
+    return *this;
+}
+
+BufferPool::Output::~Output()
+{
+    if (_pool != nullptr)
+        _pool->putOutput(std::move(_output));
+}
+
+BufferPool::BufferPool(const size_t maxIdleBytes) :
+    _maxIdleBytes(maxIdleBytes),
+    _idleBytes(0),
+    _allocated(0),
+    _reused(0)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    for (const auto& pixmaps : _idlePixmaps)
+    {
+        for (unsigned char* data : pixmaps)
+        {
+            std::free(data);
+        }
+    }
+}
+
+BufferPool& BufferPool::get()
+{
+    // Enough for a couple of combined renders and their PNGs.
+    static BufferPool pool(64 * 1024 * 1024);
+    return pool;
+}
+
+BufferPool::Pixmap BufferPool::getPixmap(const size_t size)
+{
+    const size_t sizeClass = getSizeClass(size, SizeClasses);
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (sizeClass < SizeClasses && !_idlePixmaps[sizeClass].empty())
+        {
+            unsigned char* data = _idlePixmaps[sizeClass].back();
+            _idlePixmaps[sizeClass].pop_back();
+            _idleBytes -= MinSize << sizeClass;
+            ++_reused;
+            return Pixmap(*this, data, size, sizeClass);
+        }
+
+        ++_allocated;
+    }
+
+    // Only the pages painted become resident, so rounding up to the class costs address space.
+    const size_t allocation = sizeClass < SizeClasses ? MinSize << sizeClass : size;
+    void* data = nullptr;
+    if (posix_memalign(&data, sysconf(_SC_PAGESIZE), allocation) != 0)
+        throw std::bad_alloc();
+
+    return Pixmap(*this, static_cast<unsigned char*>(data), size, sizeClass);
+}
+
+BufferPool::Output BufferPool::getOutput(const size_t size)
+{
+    const size_t sizeClass = getSizeClass(size, SizeClasses);
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (sizeClass < SizeClasses && !_idleOutputs[sizeClass].empty())
+        {
+            std::vector<char> output = std::move(_idleOutputs[sizeClass].back());
+            _idleOutputs[sizeClass].pop_back();
+            _idleBytes -= output.capacity();
+            ++_reused;
+            return Output(this, std::move(output));
+        }
+
+        ++_allocated;
+    }
+
+    std::vector<char> output;
+    output.reserve(sizeClass < SizeClasses ? MinSize << sizeClass : size);
+    return Output(this, std::move(output));
+}
+
+size_t BufferPool::getIdleBytes()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _idleBytes;
+}
+
+std::string BufferPool::getMetrics()
+{
+    std::ostringstream oss;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        oss << _allocated << " buffers allocated, " << _reused << " reused, "
+            << _idleBytes / 1024 << " kB idle";
+    }
+
+    oss << ", RSS " << getStatus("VmRSS") << " kB, peak " << getStatus("VmHWM") << " kB";
+    return oss.str();
+}
+
+void BufferPool::putPixmap(unsigned char* data, const size_t sizeClass)
+{
+    if (sizeClass < SizeClasses)
+    {
+        const size_t size = MinSize << sizeClass;
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_idleBytes + size <= _maxIdleBytes)
+        {
+            _idlePixmaps[sizeClass].push_back(data);
+            _idleBytes += size;
+            return;
+        }
+    }
+
+    std::free(data);
+}
+
+void BufferPool::putOutput(std::vector<char>&& output)
+{
+    // By what it can hold now, as encoding may have grown it.
+    if (output.capacity() < MinSize)
+        return;
+
+    size_t sizeClass = getSizeClass(output.capacity(), SizeClasses);
+    if ((MinSize << sizeClass) > output.capacity())
+        --sizeClass;
+
+    if (sizeClass < SizeClasses)
+    {
+        output.clear();
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_idleBytes + output.capacity() <= _maxIdleBytes)
+        {
+            _idleBytes += output.capacity();
+            _idleOutputs[sizeClass].push_back(std::move(output));
+        }
+    }
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
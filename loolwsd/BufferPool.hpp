@@ -0,0 +1,133 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_BUFFERPOOL_HPP
+#define INCLUDED_BUFFERPOOL_HPP
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/** Reusable buffers for rendering and encoding tiles in the kit.
+
+Every tile request needs a pixmap to paint into and a vector to encode the
+PNG into, several MB for a combined render. Allocating and freeing them
+per request churns the allocator, and the large ones are mapped afresh
+each time, so every page faults again. Instead the buffers given back are
+kept by size class, powers of two from MinSize, up to MaxIdleBytes in
+total, and handed out again for requests of the same class.
+
+Pixmaps are page aligned and not cleared, paintTile overwrites them.
+*/
+class BufferPool
+{
+public:
+    static constexpr size_t MinSize = 64 * 1024;
+
+    /// Memory to paint into, given back to the pool when destroyed.
+    class Pixmap
+    {
+    public:
+        Pixmap() :
+            _pool(nullptr),
+            _data(nullptr),
+            _size(0),
+            _sizeClass(0)
+        {
+        }
+
+        Pixmap(Pixmap&& other);
+        Pixmap& operator=(Pixmap&& other);
+        ~Pixmap();
+
+        Pixmap(const Pixmap&) = delete;
+        Pixmap& operator=(const Pixmap&) = delete;
+
+        unsigned char* data() const { return _data; }
+        size_t size() const { return _size; }
+
+    private:
+        friend class BufferPool;
+
+        Pixmap(BufferPool& pool, unsigned char* data, size_t size, size_t sizeClass);
+
+        BufferPool* _pool;
+        unsigned char* _data;
+        size_t _size;
+        size_t _sizeClass;
+    };
+
+    /// A vector to encode into, given back to the pool when destroyed.
+    class Output
+    {
+    public:
+        Output() :
+            _pool(nullptr)
+        {
+        }
+
+        Output(Output&& other);
+        Output& operator=(Output&& other);
+        ~Output();
+
+        Output(const Output&) = delete;
+        Output& operator=(const Output&) = delete;
+
+        std::vector<char>& get() { return _output; }
+
+    private:
+        friend class BufferPool;
+
+        Output(BufferPool* pool, std::vector<char>&& output);
+
+        BufferPool* _pool;
+        std::vector<char> _output;
+    };
+
+    explicit BufferPool(size_t maxIdleBytes);
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    /// The pool of this process.
+    static BufferPool& get();
+
+    /// A page-aligned pixmap of size bytes, with whatever its last user left in it.
+    Pixmap getPixmap(size_t size);
+
+    /// An empty vector with room for at least size bytes.
+    Output getOutput(size_t size);
+
+    /// The bytes kept for reuse.
+    size_t getIdleBytes();
+
+    /// The buffers allocated and reused, and the current and peak RSS of the process.
+    std::string getMetrics();
+
+private:
+    void putPixmap(unsigned char* data, size_t sizeClass);
+    void putOutput(std::vector<char>&& output);
+
+private:
+    static constexpr size_t SizeClasses = 12;
+
+    const size_t _maxIdleBytes;
+    std::mutex _mutex;
+    size_t _idleBytes;
+    size_t _allocated;
+    size_t _reused;
+    std::vector<unsigned char*> _idlePixmaps[SizeClasses];
+    std::vector<std::vector<char>> _idleOutputs[SizeClasses];
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
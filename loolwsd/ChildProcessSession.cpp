@@ -9,7 +9,11 @@
 
 #include "config.h"
 
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <thread>
 
 #include <Poco/Exception.h>
@@ -23,11 +27,17 @@
 #include <Poco/StringTokenizer.h>
 #include <Poco/URI.h>
 
+#include "BufferPool.hpp"
 #include "ChildProcessSession.hpp"
 #include "Common.hpp"
 #include "LOKitHelper.hpp"
 #include "LOOLProtocol.hpp"
+#include "MessageQueue.hpp"
 #include "Rectangle.hpp"
+#include "ThreadPool.hpp"
+#include "TileClusters.hpp"
+#include "TileColors.hpp"
+#include "Unpremultiply.hpp"
 #include "Util.hpp"
 
 using namespace LOOLProtocol;
@@ -45,6 +55,44 @@ using Poco::StringTokenizer;
 using Poco::Timestamp;
 using Poco::URI;
 
+namespace
+{
+
+/// The most a combined render paints at once, 128 tiles of 256x256 pixels.
+constexpr size_t MaxCombinedPixmapBytes = 32 * 1024 * 1024;
+
+/// The color= parameter of the tile message for an area of a single color, or empty.
+std::string getTileColor(const unsigned char* pixmap, const int startX, const int startY,
+                         const int width, const int height, const int bufferWidth,
+                         const LibreOfficeKitTileMode mode)
+{
+    if (!TileColors::isUniform(pixmap, startX, startY, width, height, bufferWidth))
+        return std::string();
+
+    unsigned char rgba[4];
+    std::memcpy(rgba, pixmap + (startY * bufferWidth + startX) * 4, sizeof(rgba));
+    if (mode == LOK_TILEMODE_BGRA)
+        Unpremultiply::toRGBA(rgba, 1);
+
+    std::ostringstream oss;
+    oss << "color=" << std::hex << std::setfill('0');
+    for (const unsigned char channel : rgba)
+    {
+        oss << std::setw(2) << static_cast<unsigned>(channel);
+    }
+
+    return oss.str();
+}
+
+/// The pool encoding the tiles of combined renders, with the calling thread one of up to 4.
+ThreadPool& getEncodePool()
+{
+    static ThreadPool pool(std::min(std::max(std::thread::hardware_concurrency(), 1U), 4U) - 1, "kit_encoder");
+    return pool;
+}
+
+}
+
 class CallbackNotification: public Notification
 {
 public:
@@ -141,6 +189,7 @@ public:
             }
             break;
         case LOK_CALLBACK_INVALIDATE_VISIBLE_CURSOR:
+            _session.updateCursorPosition(rPayload);
             _session.sendTextFrame("invalidatecursor: " + rPayload);
             break;
         case LOK_CALLBACK_TEXT_SELECTION:
@@ -269,6 +318,8 @@ ChildProcessSession::ChildProcessSession(const std::string& id,
     _jailId(jailId),
     _viewId(0),
     _clientPart(0),
+    _hasPageRectangles(false),
+    _isBackgroundUniform(true),
     _onLoad(onLoad),
     _onUnload(onUnload),
     _callbackWorker(new CallbackWorker(_callbackQueue, *this))
@@ -635,10 +686,85 @@ bool ChildProcessSession::getPartPageRectangles(const char* /*buffer*/, int /*le
     if (_multiView)
         _loKitDocument->pClass->setView(_loKitDocument, _viewId);
 
-    sendTextFrame("partpagerectangles: " + std::string(_loKitDocument->pClass->getPartPageRectangles(_loKitDocument)));
+    const std::string rectangles = _loKitDocument->pClass->getPartPageRectangles(_loKitDocument);
+    setPageRectangles(rectangles);
+
+    sendTextFrame("partpagerectangles: " + rectangles);
     return true;
 }
 
+void ChildProcessSession::setPageRectangles(const std::string& rectangles)
+{
+    // "x, y, width, height; x, y, width, height; ..." in twips.
+    _pageRectangles.clear();
+    StringTokenizer pages(rectangles, ";", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+    for (const auto& page : pages)
+    {
+        StringTokenizer values(page, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+        int x, y, width, height;
+        if (values.count() == 4 &&
+            stringToInteger(values[0], x) && stringToInteger(values[1], y) &&
+            stringToInteger(values[2], width) && stringToInteger(values[3], height))
+        {
+            _pageRectangles.emplace_back(x, y, width, height);
+        }
+    }
+
+    _hasPageRectangles = true;
+
+    // What was background may be a page now, learn it anew.
+    _backgroundColor.clear();
+    _isBackgroundUniform = true;
+}
+
+bool ChildProcessSession::isOutsidePages(const Util::Rectangle& area)
+{
+    if (_docType != "text")
+        return false;
+
+    if (!_hasPageRectangles)
+        setPageRectangles(_loKitDocument->pClass->getPartPageRectangles(_loKitDocument));
+
+    if (_pageRectangles.empty())
+        return false;
+
+    // Page shadows and the like are drawn next to the pages, so keep a tile away from them.
+    const int width = area._x2 - area._x1;
+    const int height = area._y2 - area._y1;
+    const Util::Rectangle nearby(area._x1 - width, area._y1 - height, 3 * width, 3 * height);
+    for (const auto& page : _pageRectangles)
+    {
+        if (page.intersects(nearby))
+            return false;
+    }
+
+    return true;
+}
+
+std::string ChildProcessSession::predictTileColor(const Util::Rectangle& area)
+{
+    if (_isBackgroundUniform && !_backgroundColor.empty() && isOutsidePages(area))
+        return _backgroundColor;
+
+    return std::string();
+}
+
+void ChildProcessSession::learnTileColor(const Util::Rectangle& area, const std::string& color)
+{
+    if (!_isBackgroundUniform || !isOutsidePages(area))
+        return;
+
+    if (color.empty() || (!_backgroundColor.empty() && color != _backgroundColor))
+    {
+        // Something is drawn outside the pages, we can't tell what without painting.
+        Log::debug("Tiles outside the pages differ, not predicting them.");
+        _isBackgroundUniform = false;
+        return;
+    }
+
+    _backgroundColor = color;
+}
+
 void ChildProcessSession::sendTile(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
 {
     int part, width, height, tilePosX, tilePosY, tileWidth, tileHeight;
@@ -673,15 +799,9 @@ void ChildProcessSession::sendTile(const char* /*buffer*/, int /*length*/, Strin
     if (_multiView)
         _loKitDocument->pClass->setView(_loKitDocument, _viewId);
 
-    const std::string response = "tile: " + Poco::cat(std::string(" "), tokens.begin() + 1, tokens.end()) + "\n";
-
-    std::vector<char> output;
-    output.reserve(response.size() + (4 * width * height));
-    output.resize(response.size());
-    std::memcpy(output.data(), response.data(), response.size());
+    const std::string params = "tile: " + Poco::cat(std::string(" "), tokens.begin() + 1, tokens.end());
 
-    std::vector<unsigned char> pixmap;
-    pixmap.resize(4 * width * height);
+    BufferPool::Output output;
 
 #if ENABLE_DEBUG
     bool makeSlow = false;
@@ -697,17 +817,39 @@ void ChildProcessSession::sendTile(const char* /*buffer*/, int /*length*/, Strin
         _loKitDocument->pClass->setPart(_loKitDocument, part);
     }
 
-    Timestamp timestamp;
-    _loKitDocument->pClass->paintTile(_loKitDocument, pixmap.data(), width, height, tilePosX, tilePosY, tileWidth, tileHeight);
-    Log::trace() << "paintTile at [" << tilePosX << ", " << tilePosY
-                 << "] rendered in " << (timestamp.elapsed()/1000.) << " ms" << Log::end;
+    // Tiles of a single color, blank paper or the background, are sent as just the color.
+    const Util::Rectangle area(tilePosX, tilePosY, tileWidth, tileHeight);
+    std::string color = predictTileColor(area);
+    if (color.empty())
+    {
+        const BufferPool::Pixmap pixmap = BufferPool::get().getPixmap(4 * width * height);
+
+        Timestamp timestamp;
+        _loKitDocument->pClass->paintTile(_loKitDocument, pixmap.data(), width, height, tilePosX, tilePosY, tileWidth, tileHeight);
+        Log::trace() << "paintTile at [" << tilePosX << ", " << tilePosY
+                     << "] rendered in " << (timestamp.elapsed()/1000.) << " ms" << Log::end;
 
-    const LibreOfficeKitTileMode mode =
-            static_cast<LibreOfficeKitTileMode>(_loKitDocument->pClass->getTileMode(_loKitDocument));
-    if (!Util::encodeBufferToPNG(pixmap.data(), width, height, output, mode))
+        const LibreOfficeKitTileMode mode =
+                static_cast<LibreOfficeKitTileMode>(_loKitDocument->pClass->getTileMode(_loKitDocument));
+        color = getTileColor(pixmap.data(), 0, 0, width, height, width, mode);
+        learnTileColor(area, color);
+
+        if (color.empty())
+        {
+            const std::string response = params + "\n";
+            output = BufferPool::get().getOutput(response.size() + 4 * width * height);
+            output.get().assign(response.begin(), response.end());
+
+            if (!Util::encodeBufferToPNG(pixmap.data(), width, height, output.get(), mode))
+            {
+                sendTextFrame("error: cmd=tile kind=failure");
+                return;
+            }
+        }
+    }
+    else
     {
-        sendTextFrame("error: cmd=tile kind=failure");
-        return;
+        Log::trace() << "Tile at [" << tilePosX << ", " << tilePosY << "] is outside the pages, not painted." << Log::end;
     }
 
 #if ENABLE_DEBUG
@@ -718,7 +860,14 @@ void ChildProcessSession::sendTile(const char* /*buffer*/, int /*length*/, Strin
     }
 #endif
 
-    sendBinaryFrame(output.data(), output.size());
+    if (!color.empty())
+    {
+        const std::string message = params + " " + color + "\n";
+        sendBinaryFrame(message.data(), message.size());
+        return;
+    }
+
+    sendBinaryFrame(output.get().data(), output.get().size());
 }
 
 void ChildProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
@@ -751,8 +900,6 @@ void ChildProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*length
     if (tokens.count() > 8)
         getTokenString(tokens[8], "timestamp", reqTimestamp);
 
-    Util::Rectangle renderArea;
-
     StringTokenizer positionXtokens(tilePositionsX, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
     StringTokenizer positionYtokens(tilePositionsY, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
 
@@ -783,19 +930,34 @@ void ChildProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*length
             return;
         }
 
-        Util::Rectangle rectangle(x, y, tileWidth, tileHeight);
+        tiles.push_back(Util::Rectangle(x, y, tileWidth, tileHeight));
+    }
 
-        if (tiles.empty())
-        {
-            renderArea = rectangle;
-        }
-        else
-        {
-            renderArea.extend(rectangle);
-        }
+    // Scattered tiles are painted in clusters, rather than everything between them.
+    const size_t tileBytes = 4 * pixelWidth * pixelHeight;
+    const TileClusters clusters(tiles, tileWidth, tileHeight,
+                                std::max<size_t>(1, MaxCombinedPixmapBytes / tileBytes));
+    Log::trace() << "Combined " << tiles.size() << " tiles into " << clusters.getClusters().size()
+                 << " areas." << Log::end;
 
-        tiles.push_back(rectangle);
+    for (const auto& cluster : clusters.getClusters())
+    {
+        sendTileCluster(tiles, cluster._tiles, cluster._area, part, pixelWidth, pixelHeight,
+                        tileWidth, tileHeight, reqTimestamp);
     }
+}
+
+void ChildProcessSession::sendTileCluster(const std::vector<Util::Rectangle>& tiles,
+                                          const std::vector<size_t>& indices,
+                                          Util::Rectangle renderArea, const int part,
+                                          const int pixelWidth, const int pixelHeight,
+                                          const int tileWidth, const int tileHeight,
+                                          const std::string& reqTimestamp)
+{
+    std::unique_lock<std::recursive_mutex> lock(Mutex);
+
+    if (_multiView)
+        _loKitDocument->pClass->setView(_loKitDocument, _viewId);
 
     if (_docType != "text" && part != _loKitDocument->pClass->getPart(_loKitDocument))
     {
@@ -810,21 +972,44 @@ void ChildProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*length
     int pixmapWidth = tilesByX * pixelWidth;
     int pixmapHeight = tilesByY * pixelHeight;
 
-    const size_t pixmapSize = 4 * pixmapWidth * pixmapHeight;
+    // Tiles of a single color are sent as just the color, and when that's known
+    // for all of them, there is nothing to paint.
+    std::vector<std::string> colors;
+    bool paint = false;
+    for (const size_t index : indices)
+    {
+        colors.push_back(predictTileColor(tiles[index]));
+        paint = paint || colors.back().empty();
+    }
 
-    std::vector<unsigned char> pixmap(pixmapSize, 0);
+    BufferPool::Pixmap pixmap;
+    if (paint)
+    {
+        // Not cleared, paintTile overwrites all of it.
+        pixmap = BufferPool::get().getPixmap(4 * pixmapWidth * pixmapHeight);
 
-    Timestamp timestamp;
-    _loKitDocument->pClass->paintTile(_loKitDocument, pixmap.data(), pixmapWidth, pixmapHeight,
-                                      renderArea.getLeft(), renderArea.getTop(),
-                                      renderArea.getWidth(), renderArea.getHeight());
+        Timestamp timestamp;
+        _loKitDocument->pClass->paintTile(_loKitDocument, pixmap.data(), pixmapWidth, pixmapHeight,
+                                          renderArea.getLeft(), renderArea.getTop(),
+                                          renderArea.getWidth(), renderArea.getHeight());
 
-    Log::debug() << "paintTile (combined) called, tile at [" << renderArea.getLeft() << ", " << renderArea.getTop() << "]"
-                << " (" << renderArea.getWidth() << ", " << renderArea.getHeight() << ") rendered in "
-                << double(timestamp.elapsed())/1000 <<  "ms" << Log::end;
+        Log::debug() << "paintTile (combined) called, tile at [" << renderArea.getLeft() << ", " << renderArea.getTop() << "]"
+                    << " (" << renderArea.getWidth() << ", " << renderArea.getHeight() << ") rendered in "
+                    << double(timestamp.elapsed())/1000 <<  "ms" << Log::end;
+    }
+    else
+    {
+        Log::trace() << "Combined tiles at [" << renderArea.getLeft() << ", " << renderArea.getTop()
+                     << "] are outside the pages, not painted." << Log::end;
+    }
 
-    for (Util::Rectangle& tileRect : tiles)
+    // Only painting needs the document, the tiles are encoded in parallel,
+    // each sent as soon as it's done.
+    std::vector<ThreadPool::Job> jobs;
+    std::atomic<bool> failed(false);
+    for (size_t i = 0; i < indices.size(); ++i)
     {
+        Util::Rectangle tileRect = tiles[indices[i]];
         std::string response = "tile: part=" + std::to_string(part) +
                                " width=" + std::to_string(pixelWidth) +
                                " height=" + std::to_string(pixelHeight) +
@@ -836,25 +1021,51 @@ void ChildProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*length
         if (reqTimestamp != "")
             response += " timestamp=" + reqTimestamp;
 
-        response += "\n";
-
-        std::vector<char> output;
-        output.reserve(pixelWidth * pixelHeight * 4 + response.size());
-        output.resize(response.size());
-
-        std::copy(response.begin(), response.end(), output.begin());
-
         int positionX = (tileRect.getLeft() - renderArea.getLeft()) / tileWidth;
         int positionY = (tileRect.getTop() - renderArea.getTop())  / tileHeight;
 
-        if (!Util::encodeSubBufferToPNG(pixmap.data(), positionX * pixelWidth, positionY * pixelHeight, pixelWidth, pixelHeight, pixmapWidth, pixmapHeight, output, mode))
+        std::string& color = colors[i];
+        if (color.empty())
         {
-            sendTextFrame("error: cmd=tile kind=failure");
-            return;
+            color = getTileColor(pixmap.data(), positionX * pixelWidth, positionY * pixelHeight,
+                                 pixelWidth, pixelHeight, pixmapWidth, mode);
+            learnTileColor(tileRect, color);
+        }
+
+        if (!color.empty())
+        {
+            response += " " + color + "\n";
+            sendBinaryFrame(response.data(), response.size());
+            continue;
         }
 
-        sendBinaryFrame(output.data(), output.size());
+        response += "\n";
+
+        // Encoding only reads the pixmap, so the tiles can share it.
+        jobs.push_back([this, &pixmap, &failed, response, positionX, positionY,
+                        pixelWidth, pixelHeight, pixmapWidth, pixmapHeight, mode]()
+        {
+            BufferPool::Output output = BufferPool::get().getOutput(pixelWidth * pixelHeight * 4 + response.size());
+            output.get().assign(response.begin(), response.end());
+
+            if (!Util::encodeSubBufferToPNG(pixmap.data(), positionX * pixelWidth, positionY * pixelHeight, pixelWidth, pixelHeight, pixmapWidth, pixmapHeight, output.get(), mode))
+            {
+                failed = true;
+                return;
+            }
+
+            sendBinaryFrame(output.get().data(), output.get().size());
+        });
     }
+
+    lock.unlock();
+
+    Timestamp timestamp;
+    getEncodePool().run(jobs);
+    Log::trace() << jobs.size() << " tiles encoded in " << double(timestamp.elapsed())/1000 << " ms" << Log::end;
+
+    if (failed)
+        sendTextFrame("error: cmd=tile kind=failure");
 }
 
 bool ChildProcessSession::clientZoom(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
@@ -1284,13 +1495,45 @@ bool ChildProcessSession::setPage(const char* /*buffer*/, int /*length*/, String
         _loKitDocument->pClass->setView(_loKitDocument, _viewId);
 
     _loKitDocument->pClass->setPart(_loKitDocument, page);
+    _hasPageRectangles = false;
     return true;
 }
 
 void ChildProcessSession::loKitCallback(const int nType, const char *pPayload)
 {
+    // Right away, as the tiles painted before the notification is handled mustn't be predicted
+    // with the old pages.
+    if (nType == LOK_CALLBACK_DOCUMENT_SIZE_CHANGED)
+        _hasPageRectangles = false;
+
     auto pNotif = new CallbackNotification(nType, pPayload ? pPayload : "(nil)");
     _callbackQueue.enqueueNotification(pNotif);
 }
 
+void ChildProcessSession::setTileQueue(const std::shared_ptr<TileQueue>& queue)
+{
+    std::unique_lock<std::recursive_mutex> lock(Mutex);
+    _tileQueue = queue;
+}
+
+void ChildProcessSession::updateCursorPosition(const std::string& payload)
+{
+    std::unique_lock<std::recursive_mutex> lock(Mutex);
+    const auto queue = _tileQueue.lock();
+    if (!queue)
+        return;
+
+    // "x, y, width, height" in twips, or "EMPTY" when there is no cursor.
+    StringTokenizer tokens(payload, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+    if (tokens.count() == 4)
+    {
+        queue->updateCursorPosition(Util::Rectangle(std::stoi(tokens[0]), std::stoi(tokens[1]),
+                                                    std::stoi(tokens[2]), std::stoi(tokens[3])));
+    }
+    else
+    {
+        queue->updateCursorPosition(Util::Rectangle());
+    }
+}
+
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -10,7 +10,10 @@
 #ifndef INCLUDED_CHILDPROCESSSESSION_HPP
 #define INCLUDED_CHILDPROCESSSESSION_HPP
 
+#include <atomic>
 #include <mutex>
+#include <string>
+#include <vector>
 
 #define LOK_USE_UNSTABLE_API
 #include <LibreOfficeKit/LibreOfficeKit.h>
@@ -21,8 +24,10 @@
 
 #include "Common.hpp"
 #include "LOOLSession.hpp"
+#include "Rectangle.hpp"
 
 class CallbackWorker;
+class TileQueue;
 
 class ChildProcessSession final : public LOOLSession
 {
@@ -60,6 +65,12 @@ public:
 
     std::unique_lock<std::recursive_mutex> getLock() { return std::unique_lock<std::recursive_mutex>(Mutex); }
 
+    /// The queue of the requests of this view, to prioritize the tiles at the cursor.
+    void setTileQueue(const std::shared_ptr<TileQueue>& queue);
+
+    /// Passes the cursor of an invalidatecursor callback on to the tile queue.
+    void updateCursorPosition(const std::string& payload);
+
  protected:
     virtual bool loadDocument(const char *buffer, int length, Poco::StringTokenizer& tokens) override;
 
@@ -90,6 +101,22 @@ private:
 
     virtual bool _handleInput(const char *buffer, int length) override;
 
+    void setPageRectangles(const std::string& rectangles);
+
+    /// True if the area, in twips, is well away from all pages of a text document.
+    bool isOutsidePages(const Util::Rectangle& area);
+
+    /// The color= parameter of the tile at area, if it's known without painting it.
+    std::string predictTileColor(const Util::Rectangle& area);
+
+    /// Remembers the color of a painted tile, empty if it has more, to predict others.
+    void learnTileColor(const Util::Rectangle& area, const std::string& color);
+
+    /// Paints renderArea and sends the tiles at the indices, as a tilecombine response.
+    void sendTileCluster(const std::vector<Util::Rectangle>& tiles, const std::vector<size_t>& indices,
+                         Util::Rectangle renderArea, int part, int pixelWidth, int pixelHeight,
+                         int tileWidth, int tileHeight, const std::string& reqTimestamp);
+
 private:
     LibreOfficeKitDocument *_loKitDocument;
     std::string _docType;
@@ -98,9 +125,21 @@ private:
     /// View ID, returned by createView() or 0 by default.
     int _viewId;
     int _clientPart;
+
+    /// The pages of a text document in twips, for telling where there is only background.
+    std::vector<Util::Rectangle> _pageRectangles;
+    /// Cleared when the pages change, so they are read again before predicting a tile.
+    std::atomic<bool> _hasPageRectangles;
+    /// The color= parameter of the tiles outside the pages, once one is painted.
+    std::string _backgroundColor;
+    /// False once tiles outside the pages turned out to have different colors.
+    bool _isBackgroundUniform;
+
     std::function<LibreOfficeKitDocument*(const std::string&, const std::string&, const std::string&, bool)> _onLoad;
     std::function<void(const std::string&)> _onUnload;
 
+    std::weak_ptr<TileQueue> _tileQueue;
+
     std::unique_ptr<CallbackWorker> _callbackWorker;
     Poco::Thread _callbackThread;
     Poco::NotificationQueue _callbackQueue;
@@ -20,6 +20,10 @@ constexpr int WSD_SLEEP_SECS = 2;
 constexpr int CHILD_TIMEOUT_SECS = 10;
 constexpr int POLL_TIMEOUT_MS = 1000;
 constexpr int COMMAND_TIMEOUT_MS = 5000;
+/// How long a peer may stall in the middle of a message before it's given up.
+constexpr int RECEIVE_TIMEOUT_MS = 60000;
+/// How long a client may not read what's sent to it before it's given up.
+constexpr int SEND_TIMEOUT_MS = 30000;
 
 /// Pipe and Socket read buffer size.
 /// Should be large enough for ethernet packets
@@ -29,7 +33,14 @@ constexpr int READ_BUFFER_SIZE = 2048;
 /// 'nextmessage' frame to let the receiver know in advance
 /// the size of larger coming message. All messages up to this
 /// size are considered small messages.
+/// Only for peers that don't reassemble fragmented messages.
 constexpr int SMALL_MESSAGE_SIZE = READ_BUFFER_SIZE / 2;
+/// The largest frame sent to a peer that reassembles fragmented
+/// messages. Larger messages go in frames of this size.
+constexpr int MAX_FRAME_SIZE = READ_BUFFER_SIZE * 100;
+/// The largest message received, be it in several frames or announced
+/// by a 'nextmessage', so a peer can't take all the memory.
+constexpr int MAX_MESSAGE_SIZE = 64 * 1024 * 1024;
 
 constexpr auto FIFO_LOOLWSD = "loolwsdfifo";
 constexpr auto FIFO_PATH = "pipe";
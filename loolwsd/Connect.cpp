@@ -94,7 +94,8 @@ public:
                     std::string firstLine = getFirstLine(buffer, n);
                     StringTokenizer tokens(firstLine, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
 
-                    if (std::getenv("DISPLAY") != nullptr && tokens[0] == "tile:")
+                    if (std::getenv("DISPLAY") != nullptr && tokens[0] == "tile:" &&
+                        n > static_cast<int>(firstLine.size()) + 1)
                     {
                         TemporaryFile pngFile;
                         std::ofstream pngStream(pngFile.path(), std::ios::binary);
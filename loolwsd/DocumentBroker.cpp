@@ -97,6 +97,25 @@ void DocumentBroker::validate(const Poco::URI& uri)
     }
 }
 
+bool DocumentBroker::openCache()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (!_tileCache)
+    {
+        auto storage = StorageBase::create("", "", _uriPublic);
+        if (!storage)
+            return false;
+
+        const auto fileInfo = storage->getFileInfo(_uriPublic);
+        _tileCache.reset(new TileCache(_uriPublic.toString(), fileInfo._version, _cacheRoot));
+        _filename = fileInfo._filename;
+    }
+
+    return !_tileCache->isPasswordProtected() &&
+           !_tileCache->getTextFile("status.txt").empty();
+}
+
 bool DocumentBroker::load(const std::string& jailId)
 {
     Log::debug("Loading from URI: " + _uriPublic.toString());
@@ -130,7 +149,12 @@ bool DocumentBroker::load(const std::string& jailId)
     if (storage)
     {
         const auto fileInfo = storage->getFileInfo(_uriPublic);
-        _tileCache.reset(new TileCache(_uriPublic.toString(), fileInfo._modifiedTime, _cacheRoot));
+        if (!_tileCache)
+        {
+            // Unless the sessions used it without us so far.
+            _tileCache.reset(new TileCache(_uriPublic.toString(), fileInfo._version, _cacheRoot));
+        }
+
         _filename = fileInfo._filename;
         _storage = StorageBase::create(jailRoot, jailPath.toString(), _uriPublic);
 
@@ -154,7 +178,19 @@ bool DocumentBroker::save()
     if (_storage->saveLocalFileToStorage())
     {
         _lastSaveTime = std::chrono::steady_clock::now();
-        _tileCache->documentSaved();
+
+        // The cache now represents the new version of the document.
+        std::string version;
+        try
+        {
+            version = _storage->getFileInfo(_uriPublic)._version;
+        }
+        catch (const std::exception& exc)
+        {
+            Log::warn("Failed to get the version of the saved document [" + uri + "]: " + exc.what());
+        }
+
+        _tileCache->documentSaved(version);
         Log::debug("Saved to URI [" + uri + "] and updated tile cache.");
         _saveCV.notify_all();
         return true;
@@ -173,6 +209,12 @@ bool DocumentBroker::autoSave(const bool force)
         return false;
     }
 
+    if (!_childProcess)
+    {
+        // Nobody could have edited it.
+        return false;
+    }
+
     // Find the most recent activity.
     double inactivityTimeMs = std::numeric_limits<double>::max();
     for (auto& sessionIt: _sessions)
@@ -280,12 +322,38 @@ size_t DocumentBroker::addSession(std::shared_ptr<MasterProcessSession>& session
         session->sendTextFrame("editlock: 1");
     }
 
+    return _sessions.size();
+}
+
+void DocumentBroker::setChild(const std::shared_ptr<ChildProcess>& childProcess)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _childProcess = childProcess;
+}
+
+void DocumentBroker::connectSession(const std::string& id)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    assert(_childProcess);
+
     // Request a new session from the child kit.
     const std::string aMessage = "session " + id + " " + _docKey + "\n";
     Log::debug("DocBroker to Child: " + aMessage.substr(0, aMessage.length() - 1));
     _childProcess->getWebSocket()->sendFrame(aMessage.data(), aMessage.size());
+}
 
-    return _sessions.size();
+void DocumentBroker::connectOtherSessions(const std::string& id)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto& it : _sessions)
+    {
+        if (it.first == id || it.second->hasPeer())
+            continue;
+
+        // Each connects where its messages are handled, as that may take a while.
+        Log::debug("Connecting session " + it.first + " to the kit of doc [" + _docKey + "].");
+        it.second->requestKit();
+    }
 }
 
 size_t DocumentBroker::removeSession(const std::string& id)
@@ -129,6 +129,11 @@ public:
 
     void validate(const Poco::URI& uri);
 
+    /// Opens the tile cache of the document, without loading the document.
+    /// Returns true if the cache is up to date and has what's needed to show
+    /// the document, so its sessions can do without a kit until they need one.
+    bool openCache();
+
     /// Loads a document from the public URI into the jail.
     bool load(const std::string& jailId);
 
@@ -169,8 +174,30 @@ public:
     /// except this one
     void takeEditLock(const std::string& id);
 
+    /// Whether a kit hosts the document, as it only gets one when needed.
+    bool hasChild() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _childProcess != nullptr;
+    }
+
+    void setChild(const std::shared_ptr<ChildProcess>& childProcess);
+
+    /// Held while getting a kit for the document, so it only gets one.
+    std::unique_lock<std::mutex> getChildLock()
+    {
+        return std::unique_lock<std::mutex>(_childMutex);
+    }
+
     /// Add a new session. Returns the new number of sessions.
     size_t addSession(std::shared_ptr<MasterProcessSession>& session);
+
+    /// Asks the kit for a session to connect the session id to.
+    void connectSession(const std::string& id);
+
+    /// Has the sessions other than id connect to the kit too, so
+    /// they learn about changes to the document from now on.
+    void connectOtherSessions(const std::string& id);
     /// Removes a session by ID. Returns the new number of sessions.
     size_t removeSession(const std::string& id);
 
@@ -191,6 +218,7 @@ private:
     std::unique_ptr<StorageBase> _storage;
     std::unique_ptr<TileCache> _tileCache;
     std::shared_ptr<ChildProcess> _childProcess;
+    std::mutex _childMutex;
     bool _markToDestroy;
     mutable std::mutex _mutex;
     std::condition_variable _saveCV;
@@ -9,6 +9,7 @@
 
 #include <sys/poll.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
@@ -17,6 +18,7 @@
 #include <sstream>
 #include <string>
 
+#include <Poco/Buffer.h>
 #include <Poco/StringTokenizer.h>
 #include <Poco/Net/Socket.h>
 #include <Poco/Net/WebSocket.h>
@@ -27,6 +29,7 @@
 #include "Common.hpp"
 #include "LOOLProtocol.hpp"
 #include "IoUtil.hpp"
+#include "PerMessageDeflate.hpp"
 #include "Util.hpp"
 
 using Poco::Net::NetException;
@@ -34,9 +37,155 @@ using Poco::Net::Socket;
 using Poco::Net::WebSocket;
 using Poco::Net::WebSocketException;
 
+namespace
+{
+
+/// Appends the next frame to payload, whatever its size up to the maximum payload size of ws.
+/// Returns its size, or -1 when it's over that.
+int receiveFrame(WebSocket& ws, std::vector<char>& payload, int& flags)
+{
+    Poco::Buffer<char> buffer(0);
+    int n;
+    try
+    {
+        n = ws.receiveFrame(buffer, flags);
+    }
+    catch (const WebSocketException& exc)
+    {
+        if (exc.code() != WebSocket::WS_ERR_PAYLOAD_TOO_BIG)
+            throw;
+
+        Log::error("Frame over " + std::to_string(MAX_MESSAGE_SIZE) + " bytes, closing.");
+        flags = 0;
+        return -1;
+    }
+
+    if (n > 0)
+        payload.insert(payload.end(), buffer.begin(), buffer.begin() + n);
+
+    return n;
+}
+
+}
+
 namespace IoUtil
 {
 
+Received receiveMessage(WebSocket& ws, std::vector<char>& payload, int& flags,
+                        PerMessageDeflate* deflate)
+{
+    // A frame is read whole, as not every peer splits a large message in frames, or announces it.
+    ws.setMaxPayloadSize(MAX_MESSAGE_SIZE);
+
+    payload.resize(0);
+    int n = receiveFrame(ws, payload, flags);
+
+    if ((flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_PING)
+    {
+        return Received::Ping;
+    }
+    else if ((flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_PONG)
+    {
+        // In case we do send pings in the future.
+        return Received::Control;
+    }
+    else if (n <= 0 || ((flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_CLOSE))
+    {
+        return Received::Closed;
+    }
+
+    assert(n > 0);
+
+    // Set on the first frame of a compressed message only.
+    const bool compressed = (deflate && (flags & WebSocket::FRAME_FLAG_RSV1));
+
+    const std::string firstLine = LOOLProtocol::getFirstLine(payload);
+    if ((flags & WebSocket::FrameFlags::FRAME_FLAG_FIN) != WebSocket::FrameFlags::FRAME_FLAG_FIN)
+    {
+        // One WS message split into multiple frames, each read in place after the previous one.
+        while (true)
+        {
+            n = receiveFrame(ws, payload, flags);
+            if (n <= 0 || (flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_CLOSE)
+            {
+                Log::warn("Connection closed while reading multiframe message.");
+                return Received::Closed;
+            }
+
+            if (payload.size() > static_cast<size_t>(MAX_MESSAGE_SIZE))
+            {
+                Log::error("Multiframe message over " + std::to_string(MAX_MESSAGE_SIZE) + " bytes, closing.");
+                return Received::Closed;
+            }
+
+            if ((flags & WebSocket::FrameFlags::FRAME_FLAG_FIN) == WebSocket::FrameFlags::FRAME_FLAG_FIN)
+            {
+                // No more frames.
+                break;
+            }
+        }
+    }
+    else if (!compressed)
+    {
+        int size = 0;
+        Poco::StringTokenizer tokens(firstLine, " ", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
+        if (tokens.count() == 2 &&
+            tokens[0] == "nextmessage:" && LOOLProtocol::getTokenInteger(tokens[1], "size", size) && size > 0)
+        {
+            // Check if it is a "nextmessage:" and in that case read the large
+            // follow-up message separately, and handle that only.
+            if (size > MAX_MESSAGE_SIZE)
+            {
+                Log::error("Announced message of " + std::to_string(size) + " bytes is over " +
+                           std::to_string(MAX_MESSAGE_SIZE) + ", closing.");
+                return Received::Closed;
+            }
+
+            payload.resize(size);
+
+            n = ws.receiveFrame(payload.data(), size, flags);
+            if (n <= 0 || (flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_CLOSE)
+                return Received::Closed;
+
+            payload.resize(n);
+        }
+    }
+
+    if (compressed && !deflate->inflate(payload))
+        return Received::Closed;
+
+    return Received::Message;
+}
+
+void sendMessage(WebSocket& ws, const char* data, const int length, const int flags,
+                 const bool fragment)
+{
+    if (!fragment)
+    {
+        if (length > SMALL_MESSAGE_SIZE)
+        {
+            const std::string nextmessage = "nextmessage: size=" + std::to_string(length);
+            ws.sendFrame(nextmessage.data(), nextmessage.size());
+        }
+
+        ws.sendFrame(data, length, flags);
+        return;
+    }
+
+    // Each frame has to fit the buffer of a receiver reading into one of a fixed size.
+    int offset = 0;
+    do
+    {
+        const int size = std::min(length - offset, MAX_FRAME_SIZE);
+        const int opcode = (offset == 0 ? flags & ~WebSocket::FRAME_FLAG_FIN
+                                        : static_cast<int>(WebSocket::FRAME_OP_CONT));
+        offset += size;
+        ws.sendFrame(data + offset - size, size,
+                     opcode | (offset == length ? WebSocket::FRAME_FLAG_FIN : 0));
+    }
+    while (offset < length);
+}
+
 // Synchronously process WebSocket requests and dispatch to handler.
 // Handler returns false to end.
 void SocketProcessor(std::shared_ptr<WebSocket> ws,
@@ -46,16 +195,14 @@ void SocketProcessor(std::shared_ptr<WebSocket> ws,
 {
     Log::info("SocketProcessor starting.");
 
-    // Timeout given is in microseconds.
-    const Poco::Timespan waitTime(POLL_TIMEOUT_MS * 1000);
     try
     {
         ws->setReceiveTimeout(0);
+        const int fd = ws->impl()->sockfd();
 
         int flags = 0;
-        int n = 0;
         bool stop = false;
-        std::vector<char> payload(READ_BUFFER_SIZE * 100);
+        std::vector<char> payload(MAX_FRAME_SIZE);
         payload.resize(0);
 
         for (;;)
@@ -67,79 +214,32 @@ void SocketProcessor(std::shared_ptr<WebSocket> ws,
                 break;
             }
 
-            if (!ws->poll(waitTime, Poco::Net::Socket::SELECT_READ))
+            // Termination wakes us up, the timeout is for the other stop conditions.
+            // Data buffered by TLS doesn't show on the socket, so look for that first.
+            if (!ws->poll(Poco::Timespan(0), Poco::Net::Socket::SELECT_READ) &&
+                pollRead(fd, POLL_TIMEOUT_MS) <= 0)
             {
                 // Wait some more.
                 continue;
             }
 
-            payload.resize(payload.capacity());
-            n = ws->receiveFrame(payload.data(), payload.capacity(), flags);
-            payload.resize(n > 0 ? n : 0);
-
-            if ((flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_PING)
+            const Received received = receiveMessage(*ws, payload, flags);
+            if (received == Received::Ping)
             {
                 // Echo back the ping payload as pong.
                 // Technically, we should send back a PONG control frame.
                 // However Firefox (probably) or Node.js (possibly) doesn't
                 // like that and closes the socket when we do.
                 // Echoing the payload as a normal frame works with Firefox.
-                ws->sendFrame(payload.data(), n /*, WebSocket::FRAME_OP_PONG*/);
+                ws->sendFrame(payload.data(), payload.size() /*, WebSocket::FRAME_OP_PONG*/);
+                payload.resize(0);
                 continue;
             }
-            else if ((flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_PONG)
+            else if (received == Received::Control)
             {
-                // In case we do send pings in the future.
                 continue;
             }
-            else if (n <= 0 || ((flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_CLOSE))
-            {
-                closeFrame();
-                Log::warn("Connection closed.");
-                break;
-            }
-
-            assert(n > 0);
-
-            const std::string firstLine = LOOLProtocol::getFirstLine(payload);
-            if ((flags & WebSocket::FrameFlags::FRAME_FLAG_FIN) != WebSocket::FrameFlags::FRAME_FLAG_FIN)
-            {
-                // One WS message split into multiple frames.
-                while (true)
-                {
-                    char buffer[READ_BUFFER_SIZE * 10];
-                    n = ws->receiveFrame(buffer, sizeof(buffer), flags);
-                    if (n <= 0 || (flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_CLOSE)
-                    {
-                        closeFrame();
-                        Log::warn("Connection closed while reading multiframe message.");
-                        break;
-                    }
-
-                    payload.insert(payload.end(), buffer, buffer + n);
-                    if ((flags & WebSocket::FrameFlags::FRAME_FLAG_FIN) == WebSocket::FrameFlags::FRAME_FLAG_FIN)
-                    {
-                        // No more frames.
-                        break;
-                    }
-                }
-            }
-            else
-            {
-                int size = 0;
-                Poco::StringTokenizer tokens(firstLine, " ", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
-                if (tokens.count() == 2 &&
-                    tokens[0] == "nextmessage:" && LOOLProtocol::getTokenInteger(tokens[1], "size", size) && size > 0)
-                {
-                    // Check if it is a "nextmessage:" and in that case read the large
-                    // follow-up message separately, and handle that only.
-                    payload.resize(size);
-
-                    n = ws->receiveFrame(payload.data(), size, flags);
-                }
-            }
-
-            if (n <= 0 || (flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_CLOSE)
+            else if (received == Received::Closed)
             {
                 closeFrame();
                 Log::warn("Connection closed.");
@@ -158,7 +258,6 @@ void SocketProcessor(std::shared_ptr<WebSocket> ws,
         }
 
         Log::info() << "SocketProcessor finishing. TerminationFlag: " << stop
-                     << ", n: " << n
                      << ", payload size: " << payload.size()
                      << ", flags: " << std::hex << flags << Log::end;
 
@@ -182,6 +281,26 @@ void SocketProcessor(std::shared_ptr<WebSocket> ws,
     Log::info("SocketProcessor finished.");
 }
 
+int pollRead(const int fd, const int timeoutMs)
+{
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    // Once flagged, the caller knows, so the readable eventfd mustn't turn this into a spin.
+    fds[1].fd = (TerminationFlag ? -1 : Util::getTerminationFd());
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+
+    const int ready = poll(fds, 2, timeoutMs);
+    if (ready < 0)
+    {
+        return (errno == EINTR ? 0 : ready);
+    }
+
+    return fds[0].revents;
+}
+
 void shutdownWebSocket(std::shared_ptr<Poco::Net::WebSocket> ws)
 {
     try
@@ -260,10 +379,8 @@ int PipeReader::readLine(std::string& line,
         return 1;
     }
 
-    // Poll in short intervals to check for stop condition.
-    const auto pollTimeoutMs = 500;
-    auto maxPollCount = POLL_TIMEOUT_MS / pollTimeoutMs;
-    while (maxPollCount-- > 0)
+    // Termination wakes the poll up, the timeout only gives the caller a turn.
+    while (true)
     {
         if (stopPredicate())
         {
@@ -271,22 +388,21 @@ int PipeReader::readLine(std::string& line,
             return -1;
         }
 
-        struct pollfd pipe;
-        pipe.fd = _pipe;
-        pipe.events = POLLIN;
-        pipe.revents = 0;
-        const int ready = poll(&pipe, 1, pollTimeoutMs);
+        const int ready = pollRead(_pipe, POLL_TIMEOUT_MS);
         if (ready == 0)
         {
-            // Timeout.
-            continue;
+            // Timeout or termination.
+            if (stopPredicate())
+                continue;
+
+            break;
         }
         else if (ready < 0)
         {
             // error.
             return ready;
         }
-        else if (pipe.revents & (POLLIN | POLLPRI))
+        else if (ready & (POLLIN | POLLPRI))
         {
             char buffer[READ_BUFFER_SIZE];
             const auto bytes = readFIFO(_pipe, buffer, sizeof(buffer));
@@ -315,7 +431,7 @@ int PipeReader::readLine(std::string& line,
                 Log::trace() << "data appended to pipe: " << _name << ", data: " << _data << Log::end;
             }
         }
-        else if (pipe.revents & (POLLERR | POLLHUP | POLLNVAL))
+        else if (ready & (POLLERR | POLLHUP | POLLNVAL))
         {
             return -1;
         }
@@ -13,14 +13,42 @@
 #include <functional>
 #include <string>
 #include <memory>
+#include <vector>
 
 #include <sys/poll.h>
 
 #include <Poco/Net/WebSocket.h>
 #include <Poco/Logger.h>
 
+class PerMessageDeflate;
+
 namespace IoUtil
 {
+    /// What receiveMessage() got.
+    enum class Received
+    {
+        /// A message for the handler, in the payload.
+        Message,
+        /// A ping, in the payload, for the caller to answer through whatever writes to the socket.
+        Ping,
+        /// A pong.
+        Control,
+        /// The socket closed.
+        Closed
+    };
+
+    /// Reads the next message off a readable socket into payload, the frames of a fragmented
+    /// one, or the large one a "nextmessage:" announces. Frames are read whole, whatever their
+    /// size. Compressed ones are inflated with deflate, if the extension was negotiated. A
+    /// message over MAX_MESSAGE_SIZE is Closed.
+    Received receiveMessage(Poco::Net::WebSocket& ws, std::vector<char>& payload, int& flags,
+                            PerMessageDeflate* deflate = nullptr);
+
+    /// Sends a message, in frames of up to MAX_FRAME_SIZE if fragment, for peers that reassemble
+    /// them, else in one, after a "nextmessage:" announcing it if it's large.
+    void sendMessage(Poco::Net::WebSocket& ws, const char* data, int length, int flags,
+                     bool fragment);
+
     /// Synchronously process WebSocket requests and dispatch to handler.
     //. Handler returns false to end.
     void SocketProcessor(std::shared_ptr<Poco::Net::WebSocket> ws,
@@ -28,6 +56,11 @@ namespace IoUtil
                          std::function<void()> closeFrame,
                          std::function<bool()> stopPredicate);
 
+    /// Waits up to timeoutMs, -1 for no limit, for fd to be readable, waking up early when
+    /// termination is flagged. Returns the revents of fd, 0 on timeout, termination or EINTR,
+    /// and <0 on error.
+    int pollRead(int fd, int timeoutMs);
+
     /// Call WebSocket::shutdown() ignoring Poco::IOException.
     void shutdownWebSocket(std::shared_ptr<Poco::Net::WebSocket> ws);
 
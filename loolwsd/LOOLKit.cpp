@@ -44,6 +44,7 @@
 #include <Poco/Util/Application.h>
 #include <Poco/URI.h>
 
+#include "BufferPool.hpp"
 #include "ChildProcessSession.hpp"
 #include "Common.hpp"
 #include "IoUtil.hpp"
@@ -277,6 +278,7 @@ public:
         try
         {
             auto queue = std::make_shared<TileQueue>();
+            _session->setTileQueue(queue);
             QueueHandler handler(queue, _session, "kit_queue_" + _session->getId());
 
             Thread queueHandlerThread;
@@ -296,6 +298,11 @@ public:
             queue->put("eof");
             queueHandlerThread.join();
 
+            Log::debug() << "Tile requests switched part or zoom " << queue->getSwitches()
+                         << " times, " << queue->getSwitchesAvoided()
+                         << " fewer than in the order they came." << Log::end;
+            Log::debug() << "Dropped " << queue->getCoalesced() << " obsolete requests." << Log::end;
+
             if (session->isCloseFrame())
             {
                 Log::trace("Normal close handshake.");
@@ -374,6 +381,8 @@ public:
     {
         Log::info("~Document dtor for url [" + _url + "] on child [" + _jailId +
                   "]. There are " + std::to_string(_clientViews) + " views.");
+        Log::info("Tiles encoded by color type: " + Util::getPngMetrics() + ".");
+        Log::info("Render buffers: " + BufferPool::get().getMetrics() + ".");
 
         // Flag all connections to stop.
         for (auto aIterator : _connections)
@@ -1013,6 +1022,7 @@ void lokit_main(const std::string& childRoot,
         ws->setReceiveTimeout(0);
 
         const std::string socketName = "ChildControllerWS";
+        Timestamp lastMetrics;
         IoUtil::SocketProcessor(ws,
                 [&socketName, &ws, &document, &loKit](const std::vector<char>& data)
                 {
@@ -1052,7 +1062,7 @@ void lokit_main(const std::string& childRoot,
                     }
                     else if (document && document->canDiscard())
                     {
-                        TerminationFlag = true;
+                        Util::setTerminationFlag();
                     }
                     else
                     {
@@ -1062,10 +1072,16 @@ void lokit_main(const std::string& childRoot,
                     return true;
                 },
                 []() {},
-                [&document]()
+                [&document, &lastMetrics]()
                 {
+                    if (lastMetrics.isElapsed(60 * Timestamp::resolution()))
+                    {
+                        Log::debug("Render buffers: " + BufferPool::get().getMetrics() + ".");
+                        lastMetrics.update();
+                    }
+
                     if (document && document->canDiscard())
-                        TerminationFlag = true;
+                        Util::setTerminationFlag();
                     return TerminationFlag;
                 });
 
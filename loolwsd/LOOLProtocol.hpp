@@ -21,7 +21,15 @@ namespace LOOLProtocol
     // Protocol Version Number.
     // See protocol.txt.
     constexpr unsigned ProtocolMajorVersionNumber = 0;
-    constexpr unsigned ProtocolMinorVersionNumber = 1;
+    constexpr unsigned ProtocolMinorVersionNumber = 3;
+
+    // The minor version from which clients reassemble large messages
+    // sent in several frames, without a nextmessage: before them.
+    constexpr unsigned ProtocolFragmentMinorVersionNumber = 2;
+
+    // The minor version from which clients draw tiles of a single color
+    // sent as their color= parameter, without a PNG.
+    constexpr unsigned ProtocolTileColorMinorVersionNumber = 3;
 
     inline
     std::string GetProtocolVersion()
@@ -36,6 +36,7 @@
 #include "TileCache.hpp"
 #include "IoUtil.hpp"
 #include "Util.hpp"
+#include "WorkerPool.hpp"
 
 using namespace LOOLProtocol;
 
@@ -57,6 +58,8 @@ LOOLSession::LOOLSession(const std::string& id, const Kind kind,
     _isDocLoaded(false),
     _isDocPasswordProtected(false),
     _isCloseFrame(false),
+    // The processes of wsd are of the same build, clients have to tell.
+    _fragment(kind != Kind::ToClient),
     _disconnected(false),
     _lastActivityTime(std::chrono::steady_clock::now())
 {
@@ -81,57 +84,105 @@ void LOOLSession::sendTextFrame(const std::string& text)
     else
         Log::trace(getName() + " Send: " + getAbbreviatedMessage(text.c_str(), text.size()));
 
-    std::unique_lock<std::mutex> lock(_mutex);
+    sendFrame(text.data(), text.size(), WebSocket::FRAME_TEXT);
+}
 
-    try
+void LOOLSession::sendBinaryFrame(const char *buffer, int length)
+{
+    if (!_ws || _ws->poll(Poco::Timespan(0), Socket::SelectMode::SELECT_ERROR))
+    {
+        Log::error("Socket error to send binary frame of " + std::to_string(length) + " bytes to.");
+        return;
+    }
+    else
+        Log::trace(getName() + " Send: " + std::to_string(length) + " bytes");
+
+    sendFrame(buffer, length, WebSocket::FRAME_BINARY);
+}
+
+void LOOLSession::setFragment(const bool fragment)
+{
+    _fragment = fragment;
+    if (_senderQueue)
+        _senderQueue->setFragment(fragment);
+}
+
+void LOOLSession::sendFrame(const char *buffer, const int length, const int flags)
+{
+    if (_senderQueue)
     {
-        const int length = text.size();
-        if ( length > SMALL_MESSAGE_SIZE )
+        switch (_senderQueue->push(buffer, length, flags))
         {
-            const std::string nextmessage = "nextmessage: size=" + std::to_string(length);
-            _ws->sendFrame(nextmessage.data(), nextmessage.size());
+        case SenderQueue::Pushed::Wake:
+            scheduleSend();
+            break;
+        case SenderQueue::Pushed::Overflow:
+            // Not keeping up, so it's rather let go, which ends the session when its socket
+            // poll finds it closed.
+            Log::error() << getName() << ": Disconnecting slow peer, outbound queue: "
+                         << _senderQueue->getMetrics() << Log::end;
+            try
+            {
+                _ws->impl()->shutdown();
+            }
+            catch (const Exception& exc)
+            {
+                Log::warn("LOOLSession::sendFrame: Exception: " + exc.displayText());
+            }
+            break;
+        default:
+            break;
         }
 
-        _ws->sendFrame(text.data(), length);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    try
+    {
+        IoUtil::sendMessage(*_ws, buffer, length, flags, _fragment);
     }
     catch (const Exception& exc)
     {
-        Log::warn() << "LOOLSession::sendTextFrame: "
+        Log::warn() << "LOOLSession::sendFrame: "
                     << "Exception: " << exc.displayText()
                     << (exc.nested() ? "( " + exc.nested()->displayText() + ")" : "");
     }
 }
 
-void LOOLSession::sendBinaryFrame(const char *buffer, int length)
+void LOOLSession::shutdown(const Poco::UInt16 statusCode, const std::string& statusMessage)
 {
-    if (!_ws || _ws->poll(Poco::Timespan(0), Socket::SelectMode::SELECT_ERROR))
+    if (_senderQueue)
     {
-        Log::error("Socket error to send binary frame of " + std::to_string(length) + " bytes to.");
+        // After what's queued. A send gives up after SEND_TIMEOUT_MS, so this ends even if the
+        // peer stopped reading.
+        if (_senderQueue->pushClose(statusCode, statusMessage) == SenderQueue::Pushed::Wake)
+            scheduleSend();
+
+        _senderQueue->waitSent();
         return;
     }
-    else
-        Log::trace(getName() + " Send: " + std::to_string(length) + " bytes");
 
     std::unique_lock<std::mutex> lock(_mutex);
 
     try
     {
-        if ( length > SMALL_MESSAGE_SIZE )
-        {
-            const std::string nextmessage = "nextmessage: size=" + std::to_string(length);
-            _ws->sendFrame(nextmessage.data(), nextmessage.size());
-        }
-
-        _ws->sendFrame(buffer, length, WebSocket::FRAME_BINARY);
+        _ws->shutdown(statusCode, statusMessage);
     }
     catch (const Exception& exc)
     {
-        Log::warn() << "LOOLSession::sendBinaryFrame: "
-                    << "Exception: " << exc.displayText()
-                    << (exc.nested() ? "( " + exc.nested()->displayText() + ")" : "");
+        Log::warn("LOOLSession::shutdown: Exception: " + exc.displayText());
     }
 }
 
+void LOOLSession::scheduleSend()
+{
+    const auto ws = _ws;
+    const auto queue = _senderQueue;
+    WorkerPool::get().post([ws, queue]() { queue->send(*ws); });
+}
+
 void LOOLSession::parseDocOptions(const StringTokenizer& tokens, int& part, std::string& timestamp)
 {
     // First token is the "load" command itself.
@@ -24,6 +24,7 @@
 #include <Poco/Types.h>
 
 #include "MessageQueue.hpp"
+#include "SenderQueue.hpp"
 #include "TileCache.hpp"
 
 class LOOLSession
@@ -64,9 +65,20 @@ public:
         return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
     }
 
+    /// The queue of the messages to the peer, null if sent right away.
+    const std::shared_ptr<SenderQueue>& getSenderQueue() const { return _senderQueue; }
+
+    /// Whether the peer reassembles large messages sent in several frames, rather than
+    /// expecting a "nextmessage:" before each.
+    void setFragment(bool fragment);
+
     void closeFrame() { _isCloseFrame = true; };
     bool isCloseFrame() const { return _isCloseFrame; }
 
+    /// Sends the close frame, after the messages queued, and waits until they are sent.
+    void shutdown(Poco::UInt16 statusCode = Poco::Net::WebSocket::WS_NORMAL_CLOSE,
+                  const std::string& statusMessage = "");
+
 protected:
     LOOLSession(const std::string& id, const Kind kind,
                 std::shared_ptr<Poco::Net::WebSocket> ws);
@@ -132,10 +144,22 @@ protected:
     // Whether websocket received close frame.  Closing Handshake
     std::atomic<bool> _isCloseFrame;
 
+    /// When set, messages are queued here and sent on the WorkerPool, so the sender doesn't
+    /// wait for the peer.
+    std::shared_ptr<SenderQueue> _senderQueue;
+
+    std::atomic<bool> _fragment;
+
 private:
 
     virtual bool _handleInput(const char *buffer, int length) = 0;
 
+    /// Queues or sends the message.
+    void sendFrame(const char *buffer, int length, int flags);
+
+    /// Sends what's queued on the WorkerPool, for when the SenderQueue asks for it.
+    void scheduleSend();
+
 private:
     /// A session ID specific to an end-to-end connection (from user to lokit).
     std::string _id;
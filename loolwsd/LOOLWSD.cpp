@@ -15,14 +15,17 @@
 
 #include <errno.h>
 #include <locale.h>
+#include <signal.h>
 #include <unistd.h>
 
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <time.h>
 
+#include <algorithm>
 #include <cassert>
 #include <condition_variable>
 #include <cstdlib>
@@ -89,8 +92,12 @@
 #include "LOOLSession.hpp"
 #include "LOOLWSD.hpp"
 #include "MasterProcessSession.hpp"
+#include "PerMessageDeflate.hpp"
 #include "QueueHandler.hpp"
+#include "SocketPoll.hpp"
 #include "Storage.hpp"
+#include "TileCache.hpp"
+#include "TileCacheAccountant.hpp"
 #include "UserMessages.hpp"
 #include "Util.hpp"
 #include "Unit.hpp"
@@ -155,11 +162,15 @@ static std::mutex newChildrenMutex;
 static std::condition_variable newChildrenCV;
 static std::map<std::string, std::shared_ptr<DocumentBroker>> docBrokers;
 static std::mutex docBrokersMutex;
+/// Notified when a DocumentBroker is removed.
+static std::condition_variable docBrokersCV;
 // Sessions to pre-spawned child processes that have connected but are not yet assigned a
 // document to work on.
 static std::mutex AvailableChildSessionMutex;
 static std::condition_variable AvailableChildSessionCV;
 static std::map<std::string, std::shared_ptr<MasterProcessSession>> AvailableChildSessions;
+/// An eventfd signalled on SIGCHLD, to wake up the main loop.
+static int ChildSignalFd = -1;
 
 #if ENABLE_DEBUG
 static int careerSpanSeconds = 0;
@@ -215,6 +226,75 @@ static std::shared_ptr<ChildProcess> getNewChild()
     return nullptr;
 }
 
+static bool waitBridgeCompleted(const std::shared_ptr<MasterProcessSession>& clientSession,
+                                const std::shared_ptr<DocumentBroker>& docBroker)
+{
+    int retries = 5;
+    bool isFound = false;
+
+    // Wait until the client has connected with a prison socket.
+    std::shared_ptr<MasterProcessSession> prisonSession;
+    std::unique_lock<std::mutex> lock(AvailableChildSessionMutex);
+
+    Log::debug() << "Waiting for client session [" << clientSession->getId() << "] to connect." << Log::end;
+    while (!TerminationFlag && retries-- && !isFound)
+    {
+        AvailableChildSessionCV.wait_for(
+            lock,
+            std::chrono::milliseconds(COMMAND_TIMEOUT_MS),
+            [&isFound, &clientSession]
+            {
+                return (isFound = AvailableChildSessions.find(clientSession->getId()) != AvailableChildSessions.end());
+            });
+
+            if (!isFound)
+            {
+                Log::info() << "Retrying client permission... " << retries << Log::end;
+                // request again new URL session
+                const std::string message = "request " + clientSession->getId() + " " + docBroker->getDocKey() + '\n';
+                Log::trace("MasterToBroker: " + message.substr(0, message.length()-1));
+                IoUtil::writeFIFO(LOOLWSD::ForKitWritePipe, message);
+            }
+    }
+
+    if (isFound)
+    {
+        Log::debug("Waiting child session permission, done!");
+        prisonSession = AvailableChildSessions[clientSession->getId()];
+        AvailableChildSessions.erase(clientSession->getId());
+        AvailableChildSessionCV.notify_all();
+
+        clientSession->setPeer(prisonSession);
+        prisonSession->setPeer(clientSession);
+        Log::debug("Connected " + clientSession->getName() + " - " + prisonSession->getName() + ".");
+    }
+
+    return isFound;
+}
+
+bool LOOLWSD::connectToKit(const std::shared_ptr<MasterProcessSession>& session,
+                           const std::shared_ptr<DocumentBroker>& docBroker)
+{
+    {
+        auto lock = docBroker->getChildLock();
+        if (!docBroker->hasChild())
+        {
+            // Request a kit process for this doc.
+            auto child = getNewChild();
+            if (!child)
+            {
+                Log::error("Failed to get new child.");
+                return false;
+            }
+
+            docBroker->setChild(child);
+        }
+    }
+
+    docBroker->connectSession(session->getId());
+    return waitBridgeCompleted(session, docBroker);
+}
+
 /// Handles the filename part of the convert-to POST request payload.
 class ConvertToPartHandler : public PartHandler
 {
@@ -257,51 +337,6 @@ class ClientRequestHandler: public HTTPRequestHandler
 {
 private:
 
-    static bool waitBridgeCompleted(const std::shared_ptr<MasterProcessSession>& clientSession,
-                                    const std::shared_ptr<DocumentBroker>& docBroker)
-    {
-        int retries = 5;
-        bool isFound = false;
-
-        // Wait until the client has connected with a prison socket.
-        std::shared_ptr<MasterProcessSession> prisonSession;
-        std::unique_lock<std::mutex> lock(AvailableChildSessionMutex);
-
-        Log::debug() << "Waiting for client session [" << clientSession->getId() << "] to connect." << Log::end;
-        while (!TerminationFlag && retries-- && !isFound)
-        {
-            AvailableChildSessionCV.wait_for(
-                lock,
-                std::chrono::milliseconds(COMMAND_TIMEOUT_MS),
-                [&isFound, &clientSession]
-                {
-                    return (isFound = AvailableChildSessions.find(clientSession->getId()) != AvailableChildSessions.end());
-                });
-
-                if (!isFound)
-                {
-                    Log::info() << "Retrying client permission... " << retries << Log::end;
-                    // request again new URL session
-                    const std::string message = "request " + clientSession->getId() + " " + docBroker->getDocKey() + '\n';
-                    Log::trace("MasterToBroker: " + message.substr(0, message.length()-1));
-                    IoUtil::writeFIFO(LOOLWSD::ForKitWritePipe, message);
-                }
-        }
-
-        if (isFound)
-        {
-            Log::debug("Waiting child session permission, done!");
-            prisonSession = AvailableChildSessions[clientSession->getId()];
-            AvailableChildSessions.erase(clientSession->getId());
-
-            clientSession->setPeer(prisonSession);
-            prisonSession->setPeer(clientSession);
-            Log::debug("Connected " + clientSession->getName() + " - " + prisonSession->getName() + ".");
-        }
-
-        return isFound;
-    }
-
     /// Handle POST requests.
     /// Always throw on error, do not set response status here.
     /// Returns true if a response has been sent.
@@ -350,7 +385,7 @@ private:
                     lock.unlock();
                     Log::trace(docKey + ", ws_sessions++: " + std::to_string(sessionsCount));
 
-                    if (!waitBridgeCompleted(session, docBroker))
+                    if (!LOOLWSD::connectToKit(session, docBroker))
                     {
                         // Let the client know we can't serve now.
                         throw std::runtime_error("Failed to connect to lokit child.");
@@ -388,6 +423,7 @@ private:
                     {
                         Log::debug("Removing DocumentBroker for docKey [" + docKey + "].");
                         docBrokers.erase(docKey);
+                        docBrokersCV.notify_all();
                     }
                 }
 
@@ -464,7 +500,8 @@ private:
     }
 
     /// Handle GET requests.
-    static void handleGetRequest(HTTPServerRequest& request, std::shared_ptr<WebSocket>& ws, const std::string& id)
+    static void handleGetRequest(HTTPServerRequest& request, std::shared_ptr<WebSocket>& ws, const std::string& id,
+                                 const std::shared_ptr<PerMessageDeflate>& deflate)
     {
         Log::info("Starting GET request handler for session [" + id + "].");
 
@@ -476,6 +513,8 @@ private:
         }
 
         // indicator to the client that document broker is searching
+        // Nothing else writes to the socket before the session is made, from then on all goes
+        // through its queue.
         std::string status("statusindicator: find");
         ws->sendFrame(status.data(), (int) status.size());
 
@@ -499,17 +538,10 @@ private:
             if (docBroker->isMarkedToDestroy())
             {
                 Log::debug("Document [" + docKey + "] is marked to destroy, waiting to load.");
-                const auto timeout = POLL_TIMEOUT_MS / 2;
-                for (size_t i = 0; i < COMMAND_TIMEOUT_MS / timeout; ++i)
+                if (docBrokersCV.wait_for(docBrokersLock, std::chrono::milliseconds(COMMAND_TIMEOUT_MS),
+                                          [&docKey]() { return docBrokers.find(docKey) == docBrokers.end(); }))
                 {
-                    docBrokersLock.unlock();
-                    std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
-                    docBrokersLock.lock();
-                    if (docBrokers.find(docKey) == docBrokers.end())
-                    {
-                        docBroker.reset();
-                        break;
-                    }
+                    docBroker.reset();
                 }
 
                 if (docBroker)
@@ -522,18 +554,9 @@ private:
 
         if (!docBroker)
         {
-            // Request a kit process for this doc.
-            auto child = getNewChild();
-            if (!child)
-            {
-                // Let the client know we can't serve now.
-                Log::error("Failed to get new child. Client cannot serve now.");
-                throw WebSocketErrorMessageException(SERVICE_UNAVALABLE_INTERNAL_ERROR);
-            }
-
-            // Set one we just created.
+            // The kit process for this doc is requested when connecting to it.
             Log::debug("New DocumentBroker for docKey [" + docKey + "].");
-            docBroker = std::make_shared<DocumentBroker>(uriPublic, docKey, LOOLWSD::ChildRoot, child);
+            docBroker = std::make_shared<DocumentBroker>(uriPublic, docKey, LOOLWSD::ChildRoot, nullptr);
             docBrokers.emplace(docKey, docBroker);
         }
 
@@ -541,46 +564,98 @@ private:
         docBroker->validate(uriPublic);
         Log::debug("Validated [" + uriPublic.toString() + "].");
 
-        // For ToClient sessions, we store incoming messages in a queue and have a separate
-        // thread that handles them. This is so that we can empty the queue when we get a
-        // "canceltiles" message.
+        // For ToClient sessions, we store incoming messages in a queue and handle them on the
+        // worker pool. This is so that we can empty the queue when we get a "canceltiles"
+        // message.
         auto queue = std::make_shared<BasicTileQueue>();
         auto session = std::make_shared<MasterProcessSession>(id, LOOLSession::Kind::ToClient, ws, docBroker, queue);
-        auto sessionsCount = docBroker->addSession(session);
+        session->getSenderQueue()->setDeflate(deflate);
+        const auto sessionsCount = docBroker->addSession(session);
         docBrokersLock.unlock();
         Log::trace(docKey + ", ws_sessions++: " + std::to_string(sessionsCount));
 
-        // indicator to a client that is waiting to connect to lokit process
-        status = "statusindicator: connect";
-        ws->sendFrame(status.data(), (int) status.size());
+        // Without a kit yet, see if we can do without one for now. Opening the cache asks the
+        // storage, so not with all the documents locked, and meanwhile a kit may have come.
+        bool cacheOnly = false;
+        if (LOOLWSD::LazyKit && !docBroker->hasChild())
+        {
+            try
+            {
+                cacheOnly = (docBroker->openCache() && !docBroker->hasChild());
+            }
+            catch (const std::exception& exc)
+            {
+                // The session is added, so leave it to the kit to fail with the storage.
+                Log::warn(session->getName() + ": Failed to open the tile cache: " + exc.what());
+            }
+        }
 
-        if (!waitBridgeCompleted(session, docBroker))
+        if (cacheOnly)
         {
-            // Let the client know we can't serve now.
-            Log::error(session->getName() + ": Failed to connect to lokit process. Client cannot serve now.");
-            throw WebSocketErrorMessageException(SERVICE_UNAVALABLE_INTERNAL_ERROR);
+            Log::info(session->getName() + ": Serving from the tile cache until a kit is needed.");
+        }
+        else
+        {
+            // indicator to a client that is waiting to connect to lokit process
+            status = "statusindicator: connect";
+            session->sendTextFrame(status);
+
+            if (!LOOLWSD::connectToKit(session, docBroker))
+            {
+                // Let the client know we can't serve now.
+                Log::error(session->getName() + ": Failed to connect to lokit process. Client cannot serve now.");
+
+                docBrokersLock.lock();
+                if (docBroker->removeSession(id) == 0)
+                {
+                    docBrokers.erase(docKey);
+                    docBrokersCV.notify_all();
+                }
+                docBrokersLock.unlock();
+
+                // The error goes out after what's queued.
+                session->getSenderQueue()->waitSent();
+                throw WebSocketErrorMessageException(SERVICE_UNAVALABLE_INTERNAL_ERROR);
+            }
         }
 
         // Now the bridge beetween the client and kit process is connected
         // Let messages flow
         status = "statusindicator: ready";
-        ws->sendFrame(status.data(), (int) status.size());
+        session->sendTextFrame(status);
 
-        QueueHandler handler(queue, session, "wsd_queue_" + session->getId());
-
-        Thread queueHandlerThread;
-        queueHandlerThread.start(handler);
+        // The socket is polled with those of the other sessions and its messages are handled on
+        // the worker pool, this thread is done once it's registered, and the teardown runs when
+        // the socket is no longer polled.
+        auto dispatcher = std::make_shared<QueueDispatcher>(queue, session,
+            [ws]()
+            {
+                // The session is done, so is its socket.
+                SocketPoll::get().remove(ws);
+            });
+        session->setDispatcher(dispatcher);
 
-        IoUtil::SocketProcessor(ws,
-            [&queue](const std::vector<char>& payload)
+        SocketPoll::get().add(ws, session,
+            [dispatcher](const std::vector<char>& payload)
             {
-                queue->put(payload);
+                dispatcher->put(payload);
                 return true;
             },
-            [&session]() { session->closeFrame(); },
-            [&queueHandlerThread]() { return TerminationFlag && queueHandlerThread.isRunning(); });
+            [session]() { session->closeFrame(); },
+            [id, docKey, docBroker, queue, session, dispatcher]()
+            {
+                finishClientSession(id, docKey, docBroker, queue, session, *dispatcher);
+            });
+    }
 
-        docBrokersLock.lock();
+    /// Saves if it's the last session of the document, then tears down the session.
+    static void finishClientSession(const std::string& id, const std::string& docKey,
+                                    const std::shared_ptr<DocumentBroker>& docBroker,
+                                    const std::shared_ptr<BasicTileQueue>& queue,
+                                    const std::shared_ptr<MasterProcessSession>& session,
+                                    QueueDispatcher& dispatcher)
+    {
+        std::unique_lock<std::mutex> docBrokersLock(docBrokersMutex);
         const bool canDestroy = docBroker->canDestroy();
         docBrokersLock.unlock();
 
@@ -605,17 +680,29 @@ private:
             queue->clear();
         }
 
-        Log::info("Finishing GET request handler for session [" + id + "]. Joining the queue.");
-        queue->put("eof");
-        queueHandlerThread.join();
+        Log::info("Finishing session [" + id + "]. Draining the queue.");
+        dispatcher.finish();
+        Log::debug() << "Dropped " << queue->getCoalesced() << " obsolete requests of session ["
+                     << id << "]." << Log::end;
+        if (session->getSenderQueue())
+        {
+            Log::debug() << "Outbound queue of session [" << id << "]: "
+                         << session->getSenderQueue()->getMetrics() << Log::end;
+            if (session->getSenderQueue()->getDeflate())
+            {
+                Log::info() << "Compression of session [" << id << "]: "
+                            << session->getSenderQueue()->getDeflate()->getMetrics() << Log::end;
+            }
+        }
 
         docBrokersLock.lock();
-        sessionsCount = docBroker->removeSession(id);
+        const auto sessionsCount = docBroker->removeSession(id);
         Log::trace(docKey + ", ws_sessions--: " + std::to_string(sessionsCount));
         if (sessionsCount == 0)
         {
             Log::debug("Removing DocumentBroker for docKey [" + docKey + "].");
             docBrokers.erase(docKey);
+            docBrokersCV.notify_all();
             Log::info("Removing complete doc [" + docKey + "] from Admin.");
             Admin::instance().rmDoc(docKey);
         }
@@ -627,8 +714,8 @@ private:
             if (session->shutdownPeer(WebSocket::WS_NORMAL_CLOSE, ""))
             {
                 // Client initiated close handshake
-                // respond close frame
-                ws->shutdown();
+                // respond close frame, after what's queued
+                session->shutdown();
             }
         }
         else
@@ -636,7 +723,7 @@ private:
             // something wrong, with internal exceptions
             Log::trace("Abnormal close handshake.");
             session->closeFrame();
-            ws->shutdown(WebSocket::WS_ENDPOINT_GOING_AWAY, SERVICE_UNAVALABLE_INTERNAL_ERROR);
+            session->shutdown(WebSocket::WS_ENDPOINT_GOING_AWAY, SERVICE_UNAVALABLE_INTERNAL_ERROR);
             session->shutdownPeer(WebSocket::WS_ENDPOINT_GOING_AWAY, SERVICE_UNAVALABLE_INTERNAL_ERROR);
         }
     }
@@ -718,11 +805,24 @@ public:
             }
             else
             {
+                // Poco leaves the extensions to us, and sends what's set on the response.
+                std::shared_ptr<PerMessageDeflate> deflate;
+                if (request.has("Sec-WebSocket-Extensions"))
+                {
+                    std::string extensions;
+                    deflate = PerMessageDeflate::negotiate(request.get("Sec-WebSocket-Extensions"), extensions);
+                    if (deflate)
+                    {
+                        Log::debug("Accepted WebSocket extension [" + extensions + "].");
+                        response.set("Sec-WebSocket-Extensions", extensions);
+                    }
+                }
+
                 auto ws = std::make_shared<WebSocket>(request, response);
                 try
                 {
                     responded = true; // After upgrading to WS we should not set HTTP response.
-                    handleGetRequest(request, ws, id);
+                    handleGetRequest(request, ws, id, deflate);
                 }
                 catch (const WebSocketErrorMessageException& exc)
                 {
@@ -786,19 +886,19 @@ public:
     static bool waitBridgeCompleted(const std::shared_ptr<MasterProcessSession>& prisonSession)
     {
         // time to live, if the kit process cannot connect to a client session.
-        int ttl = 180;
-        bool isFound = true;
-        // Wait until the prison has connected with a client socket.
-        Log::debug() << "Waiting for prison session [" << prisonSession->getId() << "] to connect." << Log::end;
-        while (!TerminationFlag &&
-                (isFound = AvailableChildSessions.find(prisonSession->getId()) != AvailableChildSessions.end()) &&
-                ttl--)
-        {
-            std::this_thread::sleep_for(std::chrono::milliseconds(POLL_TIMEOUT_MS));
-            Log::debug() << "Sleeping prison session [" << prisonSession->getId() << "] to connect." << Log::end;
-        }
+        const auto ttl = std::chrono::milliseconds(180 * POLL_TIMEOUT_MS);
+        const auto id = prisonSession->getId();
 
-        return isFound;
+        // Wait until the prison has connected with a client socket, which takes it out of
+        // the available ones.
+        Log::debug() << "Waiting for prison session [" << id << "] to connect." << Log::end;
+        std::unique_lock<std::mutex> lock(AvailableChildSessionMutex);
+        AvailableChildSessionCV.wait_for(lock, ttl, [&id]()
+            {
+                return TerminationFlag || AvailableChildSessions.find(id) == AvailableChildSessions.end();
+            });
+
+        return AvailableChildSessions.find(id) != AvailableChildSessions.end();
     }
 
     void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override
@@ -856,6 +956,7 @@ public:
         std::string sessionId;
         std::string jailId;
         std::string docKey;
+        bool polled = false;
         try
         {
             const auto params = Poco::URI(request.getURI()).getQueryParameters();
@@ -920,7 +1021,7 @@ public:
                         << " into _availableChildSessions, size=" << AvailableChildSessions.size() << Log::end;
 
             lock.unlock();
-            AvailableChildSessionCV.notify_one();
+            AvailableChildSessionCV.notify_all();
 
             const auto uri = request.getURI();
 
@@ -949,32 +1050,39 @@ public:
 
             UnitWSD::get().onChildConnected(pid, sessionId);
 
-            IoUtil::SocketProcessor(ws,
-                [&session](const std::vector<char>& payload)
+            SocketPoll::get().add(ws, session,
+                [session](const std::vector<char>& payload)
                 {
                     return session->handleInput(payload.data(), payload.size());
                 },
-                [&session]() { session->closeFrame(); },
-                []() { return TerminationFlag; });
-
-            if (session->isCloseFrame())
-            {
-                Log::trace("Normal close handshake.");
-                if (session->shutdownPeer(WebSocket::WS_NORMAL_CLOSE, ""))
+                [session]() { session->closeFrame(); },
+                [docKey, sessionId, session]()
                 {
-                    // LOKit initiated close handshake
-                    // respond close frame
-                    ws->shutdown();
-                }
-            }
-            else
-            {
-                // something wrong, with internal exceptions
-                Log::trace("Abnormal close handshake.");
-                session->closeFrame();
-                ws->shutdown(WebSocket::WS_ENDPOINT_GOING_AWAY, SERVICE_UNAVALABLE_INTERNAL_ERROR);
-                session->shutdownPeer(WebSocket::WS_ENDPOINT_GOING_AWAY, SERVICE_UNAVALABLE_INTERNAL_ERROR);
-            }
+                    if (session->isCloseFrame())
+                    {
+                        Log::trace("Normal close handshake.");
+                        if (session->shutdownPeer(WebSocket::WS_NORMAL_CLOSE, ""))
+                        {
+                            // LOKit initiated close handshake
+                            // respond close frame
+                            session->shutdown();
+                        }
+                    }
+                    else
+                    {
+                        // something wrong, with internal exceptions
+                        Log::trace("Abnormal close handshake.");
+                        session->closeFrame();
+                        session->shutdown(WebSocket::WS_ENDPOINT_GOING_AWAY, SERVICE_UNAVALABLE_INTERNAL_ERROR);
+                        session->shutdownPeer(WebSocket::WS_ENDPOINT_GOING_AWAY, SERVICE_UNAVALABLE_INTERNAL_ERROR);
+                    }
+
+                    Log::info("Removing doc " + docKey + " from Admin");
+                    Admin::instance().rmDoc(docKey, sessionId);
+                });
+
+            // Polled now, the rest is up to its finish.
+            polled = true;
         }
         catch (const Exception& exc)
         {
@@ -991,7 +1099,7 @@ public:
             Log::error("PrisonerRequestHandler::handleRequest:: Unexpected exception");
         }
 
-        if (!jailId.empty())
+        if (!jailId.empty() && !polled)
         {
             Log::info("Removing doc " + docKey + " from Admin");
             Admin::instance().rmDoc(docKey, sessionId);
@@ -1093,6 +1201,7 @@ bool LOOLWSD::SSLEnabled =
 #else
     false;
 #endif
+bool LOOLWSD::LazyKit = false;
 static std::string UnitTestLibrary;
 
 unsigned int LOOLWSD::NumPreSpawnedChildren = 0;
@@ -1185,6 +1294,18 @@ void LOOLWSD::initialize(Application& self)
         NumPreSpawnedChildren = config().getUInt("num_prespawn_children", 1);
     }
 
+    TileCache::MaxMemoryBytes = config().getUInt("tile_cache_memory.max_document_bytes", TileCache::MaxMemoryBytes);
+    TileCache::MaxTotalMemoryBytes = config().getUInt("tile_cache_memory.max_total_bytes", TileCache::MaxTotalMemoryBytes);
+    TileCache::MaxPendingBytes = config().getUInt("tile_cache_pending_writes", TileCache::MaxPendingBytes);
+    TileCache::PackTiles = config().getBool("tile_cache_pack", TileCache::PackTiles);
+    TileCacheAccountant::MaxBytes = static_cast<uint64_t>(config().getUInt("tile_cache_quota.max_size_mb", 0)) * 1024 * 1024;
+    TileCacheAccountant::IntervalSecs = config().getUInt("tile_cache_quota.check_interval_secs", TileCacheAccountant::IntervalSecs);
+    TileCacheAccountant::ZoomIdleSecs = config().getUInt("tile_cache_quota.zoom_idle_secs", TileCacheAccountant::ZoomIdleSecs);
+    LazyKit = config().getBool("lazy_kit", LazyKit);
+    PerMessageDeflate::Enabled = config().getBool("websocket_deflate.enable", PerMessageDeflate::Enabled);
+    PerMessageDeflate::MinSize = config().getUInt("websocket_deflate.min_size", PerMessageDeflate::MinSize);
+    PerMessageDeflate::ContextTakeover = config().getBool("websocket_deflate.context_takeover", PerMessageDeflate::ContextTakeover);
+
     StorageBase::initialize();
 
     ServerApplication::initialize(self);
@@ -1396,6 +1517,15 @@ Process::PID LOOLWSD::createForKit()
     return child.id();
 }
 
+static void handleChildSignal(const int /* signal */)
+{
+    const uint64_t one = 1;
+    if (write(ChildSignalFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        Log::signalLog("Failed to signal the child eventfd.\n");
+    }
+}
+
 int LOOLWSD::main(const std::vector<std::string>& /*args*/)
 {
     Log::initialize("wsd");
@@ -1414,6 +1544,20 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
     Util::setTerminationSignals();
     Util::setFatalSignals();
 
+    // So the main loop notices the exit of forkit right away.
+    ChildSignalFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ChildSignalFd < 0)
+    {
+        Log::syserror("Failed to create the child eventfd.");
+        return Application::EXIT_SOFTWARE;
+    }
+
+    struct sigaction childAction;
+    sigemptyset(&childAction.sa_mask);
+    childAction.sa_flags = SA_RESTART;
+    childAction.sa_handler = handleChildSignal;
+    sigaction(SIGCHLD, &childAction, nullptr);
+
     if (access(Cache.c_str(), R_OK | W_OK | X_OK) != 0)
     {
         Log::syserror("Unable to access cache [" + Cache +
@@ -1507,6 +1651,8 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
 
     srv2.start();
 
+    TileCacheAccountant::instance().start(Cache);
+
     if ( (ForKitWritePipe = open(pipeLoolwsd.c_str(), O_WRONLY) ) < 0 )
     {
         Log::syserror("Failed to open pipe [" + pipeLoolwsd + "] for writing.");
@@ -1579,15 +1725,15 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
             // No child processes
             if (errno == ECHILD)
             {
-                TerminationFlag = true;
+                Util::setTerminationFlag();
                 continue;
             }
         }
         else // pid == 0, no children have died
         {
-            if (!std::getenv("LOOL_NO_AUTOSAVE"))
+            if (time(nullptr) >= last30SecCheck + 30)
             {
-                if (time(nullptr) >= last30SecCheck + 30)
+                if (!std::getenv("LOOL_NO_AUTOSAVE"))
                 {
                     try
                     {
@@ -1601,28 +1747,54 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
                     {
                         Log::error("Exception: " + std::string(exc.what()));
                     }
+                }
 
-                    last30SecCheck = time(nullptr);
+                last30SecCheck = time(nullptr);
+            }
+
+            // Sleep until the next check, unless a child changes state or termination is
+            // flagged. Unit tests are invoked every WSD_SLEEP_SECS.
+            int timeoutSecs = (UnitTestLibrary.empty() ? last30SecCheck + 30 - time(nullptr) : WSD_SLEEP_SECS);
+#if ENABLE_DEBUG
+            if (careerSpanSeconds > 0)
+                timeoutSecs = std::min<int>(timeoutSecs, startTimeSpan + careerSpanSeconds + 1 - time(nullptr));
+#endif
+            if (IoUtil::pollRead(ChildSignalFd, std::max(timeoutSecs, 1) * 1000) > 0)
+            {
+                uint64_t value = 0;
+                if (read(ChildSignalFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                {
+                    Log::syserror("Failed to read the child eventfd.");
                 }
             }
-            sleep(WSD_SLEEP_SECS);
         }
 #if ENABLE_DEBUG
         if (careerSpanSeconds > 0 && time(nullptr) > startTimeSpan + careerSpanSeconds)
         {
             Log::info(std::to_string(time(nullptr) - startTimeSpan) + " seconds gone, finishing as requested.");
-            TerminationFlag = true;
+            Util::setTerminationFlag();
         }
 #endif
     }
 
+    // Wake up the prisoners waiting for a client, under the lock so none misses it.
+    {
+        std::unique_lock<std::mutex> lock(AvailableChildSessionMutex);
+        AvailableChildSessionCV.notify_all();
+    }
+
     // stop the service, no more request
     srv.stop();
     srv2.stop();
 
+    // Finish the sessions still polled.
+    SocketPoll::get().stop();
+
     // close all websockets
     threadPool.joinAll();
 
+    TileCacheAccountant::instance().stop();
+
     // Terminate child processes
     Log::info("Requesting child process " + std::to_string(forKitPid) + " to terminate");
     Util::requestTermination(forKitPid);
@@ -47,6 +47,15 @@ public:
     static bool AllowLocalStorage;
     static bool SSLEnabled;
 
+    /// Show documents from an up to date tile cache, and only
+    /// get a kit for them when something is missing or edited.
+    static bool LazyKit;
+
+    /// Connects the client session to the kit of the document,
+    /// getting a kit for the document first if it has none yet.
+    static bool connectToKit(const std::shared_ptr<MasterProcessSession>& session,
+                             const std::shared_ptr<DocumentBroker>& docBroker);
+
     static
     std::string GenSessionId()
     {
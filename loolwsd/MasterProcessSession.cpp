@@ -18,6 +18,7 @@
 #include "LOOLSession.hpp"
 #include "LOOLWSD.hpp"
 #include "MasterProcessSession.hpp"
+#include "QueueHandler.hpp"
 #include "Rectangle.hpp"
 #include "Storage.hpp"
 #include "TileCache.hpp"
@@ -37,10 +38,21 @@ MasterProcessSession::MasterProcessSession(const std::string& id,
     LOOLSession(id, kind, ws),
     _curPart(0),
     _loadPart(-1),
+    _tileColors(false),
     _docBroker(docBroker),
-    _queue(queue)
+    _queue(queue),
+    _kitRequested(false)
 {
     Log::info("MasterProcessSession ctor [" + getName() + "].");
+
+    // A slow client mustn't hold up the kit forwarding to it, and with it the other clients.
+    if (kind == Kind::ToClient && ws)
+    {
+        _senderQueue = std::make_shared<SenderQueue>();
+
+        // Nor hold up a thread, once it doesn't read.
+        ws->setSendTimeout(Poco::Timespan(SEND_TIMEOUT_MS * 1000));
+    }
 }
 
 MasterProcessSession::~MasterProcessSession()
@@ -65,14 +77,17 @@ bool MasterProcessSession::_handleInput(const char *buffer, int length)
 
     if (tokens[0] == "loolclient")
     {
+        // Older minor versions are still served, as they always were.
         const auto versionTuple = ParseVersion(tokens[1]);
         if (std::get<0>(versionTuple) != ProtocolMajorVersionNumber ||
-            std::get<1>(versionTuple) != ProtocolMinorVersionNumber)
+            std::get<1>(versionTuple) < 0)
         {
             sendTextFrame("error: cmd=loolclient kind=badversion");
             return false;
         }
 
+        setFragment(static_cast<unsigned>(std::get<1>(versionTuple)) >= ProtocolFragmentMinorVersionNumber);
+        _tileColors = (static_cast<unsigned>(std::get<1>(versionTuple)) >= ProtocolTileColorMinorVersionNumber);
         sendTextFrame("loolserver " + GetProtocolVersion());
         return true;
     }
@@ -124,6 +139,7 @@ bool MasterProcessSession::_handleInput(const char *buffer, int length)
                             errorKind == "passwordrequired:to-modify" ||
                             errorKind == "wrongpassword")
                         {
+                            _docBroker->tileCache().setPasswordProtected();
                             forwardToPeer(buffer, length);
                             peer->_bLoadError = true;
                             return false;
@@ -179,8 +195,29 @@ bool MasterProcessSession::_handleInput(const char *buffer, int length)
                     !getTokenInteger(tokens[7], "tileheight", tileHeight))
                     assert(false);
 
+                // A tile of a single color comes as just its color, which is what we cache of it.
+                std::string color;
+                std::string header = "tile:";
+                for (size_t i = 1; i < tokens.count(); ++i)
+                {
+                    if (tokens[i].find("color=") == 0)
+                        color = tokens[i];
+                    else
+                        header += " " + tokens[i];
+                }
+
+                header += "\n";
+
+                // Not every client can draw it, so it goes the way of the cached tiles.
+                TileCache::Tile colorTile;
+                if (!color.empty())
+                    colorTile = std::make_shared<TileMessage>(TileKey(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight), color.data(), color.size());
+
                 assert(firstLine.size() < static_cast<std::string::size_type>(length));
-                _docBroker->tileCache().saveTile(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight, buffer + firstLine.size() + 1, length - firstLine.size() - 1);
+                if (!color.empty())
+                    _docBroker->tileCache().saveTile(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight, color.data(), color.size());
+                else
+                    _docBroker->tileCache().saveTile(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight, buffer + firstLine.size() + 1, length - firstLine.size() - 1);
                 auto lock = _docBroker->tileCache().getTilesBeingRenderedLock();
                 std::shared_ptr<TileBeingRendered> tileBeingRendered = _docBroker->tileCache().findTileBeingRendered(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
                 if (tileBeingRendered)
@@ -191,16 +228,35 @@ bool MasterProcessSession::_handleInput(const char *buffer, int length)
                         if (subscriber)
                         {
                             Log::debug("Sending tile also to subscriber " + subscriber->getName());
-                            subscriber->sendBinaryFrame(buffer, length);
+                            if (colorTile)
+                                subscriber->sendCachedTile(header, colorTile);
+                            else
+                                subscriber->sendBinaryFrame(buffer, length);
                         }
                     }
                     _docBroker->tileCache().forgetTileBeingRendered(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
                 }
                 lock.unlock();
+
+                if (colorTile)
+                {
+                    if (!peer->isCloseFrame())
+                        peer->sendCachedTile(header, colorTile);
+
+                    return true;
+                }
             }
             else if (tokens[0] == "status:")
             {
-                _docBroker->tileCache().saveTextFile(std::string(buffer, length), "status.txt");
+                const std::string status(buffer, length);
+                _docBroker->tileCache().saveTextFile(status, "status.txt");
+
+                if (peer->_cachedStatus == status)
+                {
+                    // The client has it from the cache already.
+                    peer->_cachedStatus.clear();
+                    return true;
+                }
 
                 // let clients know if they hold the edit lock
                 std::string message = "editlock: ";
@@ -296,7 +352,6 @@ bool MasterProcessSession::_handleInput(const char *buffer, int length)
              tokens[0] != "mouse" &&
              tokens[0] != "partpagerectangles" &&
              tokens[0] != "renderfont" &&
-             tokens[0] != "requestloksession" &&
              tokens[0] != "resetselection" &&
              tokens[0] != "saveas" &&
              tokens[0] != "selectgraphic" &&
@@ -355,6 +410,13 @@ bool MasterProcessSession::_handleInput(const char *buffer, int length)
         // LibreOfficeKitDocument session, i.e. need to be handled in
         // a child process.
 
+        if (_peer.expired() && (tokens[0] == "clientzoom" || tokens[0] == "clientvisiblearea"))
+        {
+            // No need for a kit just for these, but it'll need them.
+            _viewMessages[tokens[0]] = std::string(buffer, length);
+            return true;
+        }
+
         if (_peer.expired())
         {
             Log::trace("Dispatching child to handle [" + tokens[0] + "].");
@@ -372,7 +434,7 @@ bool MasterProcessSession::_handleInput(const char *buffer, int length)
             std::string dummyFrame = "dummymsg";
             forwardToPeer(dummyFrame.c_str(), dummyFrame.size());
         }
-        else if (tokens[0] != "requestloksession")
+        else
         {
             forwardToPeer(buffer, length);
         }
@@ -416,6 +478,26 @@ bool MasterProcessSession::loadDocument(const char* /*buffer*/, int /*length*/,
         std::string timestamp;
         parseDocOptions(tokens, _loadPart, timestamp);
 
+        if (_isDocPasswordProvided)
+        {
+            // Never show it from the cache to whoever doesn't know the password.
+            _docBroker->tileCache().setPasswordProtected();
+        }
+        else if (_peer.expired())
+        {
+            // Show it from the cache, until we need a kit.
+            _cachedStatus = _docBroker->tileCache().getTextFile("status.txt");
+            if (!_docBroker->tileCache().isPasswordProtected() && !_cachedStatus.empty())
+            {
+                Log::debug(getName() + ": Loading from the tile cache.");
+                sendTextFrame(_cachedStatus);
+                sendTextFrame("editlock: " + std::to_string(isEditLocked()));
+                return true;
+            }
+
+            _cachedStatus.clear();
+        }
+
         // Finally, wait for the Child to connect to Master,
         // link the document in jail and dispatch load to child.
         Log::trace("Dispatching child to handle [load].");
@@ -561,30 +643,18 @@ void MasterProcessSession::sendTile(const char *buffer, int length, StringTokeni
         return;
     }
 
-    const std::string response = "tile: " + Poco::cat(std::string(" "), tokens.begin() + 1, tokens.end()) + "\n";
-
-    std::vector<char> output;
-    output.reserve(4 * width * height);
-    output.resize(response.size());
-    std::memcpy(output.data(), response.data(), response.size());
-
-    std::unique_ptr<std::fstream> cachedTile = _docBroker->tileCache().lookupTile(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
+    TileCache::Tile cachedTile = _docBroker->tileCache().lookupTile(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
     if (cachedTile)
     {
-        assert(cachedTile->is_open());
-        cachedTile->seekg(0, std::ios_base::end);
-        size_t pos = output.size();
-        std::streamsize size = cachedTile->tellg();
-        output.resize(pos + size);
-        cachedTile->seekg(0, std::ios_base::beg);
-        cachedTile->read(output.data() + pos, size);
-        cachedTile->close();
-
-        sendBinaryFrame(output.data(), output.size());
-
+        const std::string response = "tile: " + Poco::cat(std::string(" "), tokens.begin() + 1, tokens.end()) + "\n";
+        sendCachedTile(response, cachedTile);
         return;
     }
 
+    // Before remembering it as being rendered, as it fails when there's no kit for it.
+    if (_peer.expired())
+        dispatchChild();
+
     auto lock = _docBroker->tileCache().getTilesBeingRenderedLock();
     std::shared_ptr<TileBeingRendered> tileBeingRendered = _docBroker->tileCache().findTileBeingRendered(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
     if (tileBeingRendered)
@@ -596,9 +666,46 @@ void MasterProcessSession::sendTile(const char *buffer, int length, StringTokeni
     _docBroker->tileCache().rememberTileAsBeingRendered(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
     lock.unlock();
 
-    if (_peer.expired())
-        dispatchChild();
-    forwardToPeer(buffer, length);
+    try
+    {
+        forwardToPeer(buffer, length);
+    }
+    catch (const Poco::Exception&)
+    {
+        // It won't come, so don't have the next request wait for it.
+        lock.lock();
+        _docBroker->tileCache().forgetTileBeingRendered(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
+        throw;
+    }
+}
+
+void MasterProcessSession::sendCachedTile(const std::string& response, const std::shared_ptr<const TileMessage>& tile)
+{
+    if (!tile->getColor().empty() && !_tileColors)
+    {
+        std::vector<char> output;
+        if (!tile->copyAsPng(response, output))
+        {
+            sendTextFrame("error: cmd=tile kind=failure");
+            return;
+        }
+
+        sendBinaryFrame(output.data(), output.size());
+        return;
+    }
+
+    if (tile->hasHeader(response))
+    {
+        // Already the message we need.
+        sendBinaryFrame(tile->data(), tile->size());
+        return;
+    }
+
+    // The request had more parameters, like an id, which we have to echo.
+    std::vector<char> output;
+    tile->copyWithHeader(response, output);
+
+    sendBinaryFrame(output.data(), output.size());
 }
 
 void MasterProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
@@ -660,11 +767,10 @@ void MasterProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*lengt
             return;
         }
 
-        std::unique_ptr<std::fstream> cachedTile = _docBroker->tileCache().lookupTile(part, pixelWidth, pixelHeight, x, y, tileWidth, tileHeight);
+        TileCache::Tile cachedTile = _docBroker->tileCache().lookupTile(part, pixelWidth, pixelHeight, x, y, tileWidth, tileHeight);
 
         if (cachedTile)
         {
-            assert(cachedTile->is_open());
             std::ostringstream oss;
             oss << "tile: part=" << part
                 << " width=" << pixelWidth
@@ -680,21 +786,7 @@ void MasterProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*lengt
             }
 
             oss << "\n";
-            const std::string response = oss.str();
-
-            std::vector<char> output;
-            output.reserve(4 * pixelWidth * pixelHeight);
-            output.resize(response.size());
-            std::memcpy(output.data(), response.data(), response.size());
-            cachedTile->seekg(0, std::ios_base::end);
-            const size_t pos = output.size();
-            const std::streamsize size = cachedTile->tellg();
-            output.resize(pos + size);
-            cachedTile->seekg(0, std::ios_base::beg);
-            cachedTile->read(output.data() + pos, size);
-            cachedTile->close();
-
-            sendBinaryFrame(output.data(), output.size());
+            sendCachedTile(oss.str(), cachedTile);
         }
         else
         {
@@ -730,6 +822,17 @@ void MasterProcessSession::sendCombinedTiles(const char* /*buffer*/, int /*lengt
 
 void MasterProcessSession::dispatchChild()
 {
+    const bool connect = _peer.expired();
+    if (connect)
+    {
+        // Served from the cache so far, now we need the document loaded.
+        Log::info(getName() + ": Connecting to a kit.");
+        if (!LOOLWSD::connectToKit(shared_from_this(), _docBroker))
+        {
+            throw Poco::ProtocolException(getName() + ": failed to connect to a kit.");
+        }
+    }
+
     std::ostringstream oss;
     oss << "load";
     oss << " url=" << _docBroker->getPublicUri().toString();
@@ -746,6 +849,51 @@ void MasterProcessSession::dispatchChild()
 
     const auto loadRequest = oss.str();
     forwardToPeer(loadRequest.c_str(), loadRequest.size());
+
+    if (connect)
+    {
+        for (const auto& it : _viewMessages)
+        {
+            forwardToPeer(it.second.data(), it.second.size());
+        }
+
+        _viewMessages.clear();
+        _docBroker->connectOtherSessions(getId());
+    }
+}
+
+void MasterProcessSession::setDispatcher(const std::shared_ptr<QueueDispatcher>& dispatcher)
+{
+    bool requested;
+    {
+        std::unique_lock<std::mutex> lock(_dispatcherMutex);
+        _dispatcher = dispatcher;
+        requested = _kitRequested;
+    }
+
+    if (requested)
+        requestKit();
+}
+
+void MasterProcessSession::requestKit()
+{
+    std::shared_ptr<QueueDispatcher> dispatcher;
+    {
+        std::unique_lock<std::mutex> lock(_dispatcherMutex);
+        _kitRequested = true;
+        dispatcher = _dispatcher.lock();
+    }
+
+    if (dispatcher)
+    {
+        // Not a message, as those come from the client.
+        const auto self = shared_from_this();
+        dispatcher->post([self]()
+            {
+                if (self->_peer.expired())
+                    self->dispatchChild();
+            });
+    }
 }
 
 void MasterProcessSession::forwardToPeer(const char *buffer, int length)
@@ -772,7 +920,7 @@ bool MasterProcessSession::shutdownPeer(Poco::UInt16 statusCode, const std::stri
     auto peer = _peer.lock();
     if (peer && !peer->isCloseFrame())
     {
-        peer->_ws->shutdown(statusCode, message);
+        peer->shutdown(statusCode, message);
     }
     return peer != nullptr;
 }
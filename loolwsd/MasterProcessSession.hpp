@@ -12,12 +12,20 @@
 
 #include <time.h>
 
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
 #include <Poco/Random.h>
 
 #include "LOOLSession.hpp"
 #include "MessageQueue.hpp"
 
 class DocumentBroker;
+class QueueDispatcher;
+class TileMessage;
 
 class MasterProcessSession final : public LOOLSession, public std::enable_shared_from_this<MasterProcessSession>
 {
@@ -47,6 +55,16 @@ class MasterProcessSession final : public LOOLSession, public std::enable_shared
 
     void setPeer(const std::shared_ptr<MasterProcessSession>& peer) { _peer = peer; }
 
+    /// False while the session is served from the tile cache only.
+    bool hasPeer() const { return !_peer.expired(); }
+
+    /// Where the messages of the client are handled.
+    void setDispatcher(const std::shared_ptr<QueueDispatcher>& dispatcher);
+
+    /// Connects the session to the kit of the document, if it isn't yet, from where its
+    /// messages are handled, so not while one is. Until setDispatcher(), that waits.
+    void requestKit();
+
     void setEditLock(const bool value) { _bEditLock = value; }
 
     bool isEditLocked() const { return _bEditLock; }
@@ -69,6 +87,9 @@ public:
     virtual void sendFontRendering(const char *buffer, int length, Poco::StringTokenizer& tokens) override;
 
  private:
+    /// Sends a tile from the cache, or one of a single color, with response as its header.
+    void sendCachedTile(const std::string& response, const std::shared_ptr<const TileMessage>& tile);
+
     void dispatchChild();
     void forwardToPeer(const char *buffer, int length);
 
@@ -88,11 +109,26 @@ public:
 
     int _curPart;
     int _loadPart;
+    /// The client draws tiles of a single color sent as just their color= parameter.
+    std::atomic<bool> _tileColors;
     /// Kind::ToClient instances store URLs of completed 'save as' documents.
     MessageQueue _saveAsQueue;
     std::shared_ptr<DocumentBroker> _docBroker;
     std::shared_ptr<BasicTileQueue> _queue;
 
+    /// The status: sent from the cache when loading without a kit,
+    /// which the kit need not repeat.
+    std::string _cachedStatus;
+
+    /// The last messages about the view of the client, kept for the
+    /// kit while there's none, by command.
+    std::map<std::string, std::string> _viewMessages;
+
+    std::weak_ptr<QueueDispatcher> _dispatcher;
+    /// requestKit() was called, maybe before there was a dispatcher.
+    bool _kitRequested;
+    std::mutex _dispatcherMutex;
+
     // If this document holds the edit lock.
     // An edit lock will only allow the current session to make edits,
     // while other session opening the same document can only see
@@ -10,6 +10,99 @@
 #include "MessageQueue.hpp"
 
 #include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <tuple>
+
+#include <Poco/StringTokenizer.h>
+
+#include "LOOLProtocol.hpp"
+
+using Poco::StringTokenizer;
+
+constexpr size_t BasicTileQueue::MaxOvertakes;
+constexpr size_t TileQueue::MaxBatch;
+constexpr size_t TileQueue::MaxBypass;
+
+namespace
+{
+
+bool isTileRequest(const MessageQueue::Payload& value)
+{
+    const std::string firstToken = LOOLProtocol::getFirstToken(value);
+    return firstToken == "tile" || firstToken == "tilecombine";
+}
+
+/// True if the message has the token, like "type=move".
+bool hasToken(const std::string& message, const std::string& token)
+{
+    size_t pos = message.find(token);
+    while (pos != std::string::npos)
+    {
+        const size_t end = pos + token.size();
+        if (pos > 0 && message[pos - 1] == ' ' && (end == message.size() || message[end] == ' '))
+            return true;
+
+        pos = message.find(token, pos + 1);
+    }
+
+    return false;
+}
+
+/// Divides both by their greatest common divisor.
+void reduce(int& numerator, int& denominator)
+{
+    int a = numerator;
+    int b = denominator;
+    while (b != 0)
+    {
+        const int remainder = a % b;
+        a = b;
+        b = remainder;
+    }
+
+    if (a != 0)
+    {
+        numerator /= a;
+        denominator /= a;
+    }
+}
+
+/// The positions in a list like "0,3840,7680", false if there are none.
+bool getPositions(const std::string& list, int& min, int& max)
+{
+    bool found = false;
+    const char* position = list.c_str();
+    while (*position != '\0')
+    {
+        char* end = nullptr;
+        const long number = std::strtol(position, &end, 10);
+        if (end == position)
+            break;
+
+        min = found ? std::min(min, static_cast<int>(number)) : static_cast<int>(number);
+        max = found ? std::max(max, static_cast<int>(number)) : static_cast<int>(number);
+        found = true;
+        position = *end == ',' ? end + 1 : end;
+    }
+
+    return found;
+}
+
+/// How far apart the rectangles are, in twips along both axes plus one, 0 if unknown or they overlap.
+int64_t getDistance(const Util::Rectangle& a, const Util::Rectangle& b)
+{
+    if (a._x1 > a._x2 || b._x1 > b._x2 || a.intersects(b))
+        return 0;
+
+    const int64_t dx = std::max<int64_t>(0, std::max<int64_t>(static_cast<int64_t>(a._x1) - b._x2,
+                                                                static_cast<int64_t>(b._x1) - a._x2));
+    const int64_t dy = std::max<int64_t>(0, std::max<int64_t>(static_cast<int64_t>(a._y1) - b._y2,
+                                                                static_cast<int64_t>(b._y1) - a._y2));
+    return dx + dy + 1;
+}
+
+}
 
 MessageQueue::~MessageQueue()
 {
@@ -31,6 +124,16 @@ MessageQueue::Payload MessageQueue::get()
     return get_impl();
 }
 
+bool MessageQueue::tryGet(Payload& value)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (!wait_impl())
+        return false;
+
+    value = get_impl();
+    return true;
+}
+
 void MessageQueue::clear()
 {
     std::unique_lock<std::mutex> lock(_mutex);
@@ -43,6 +146,22 @@ void MessageQueue::remove_if(std::function<bool(const Payload&)> pred)
     std::remove_if(_queue.begin(), _queue.end(), pred);
 }
 
+MessageQueue::Priority MessageQueue::getPriority(const Payload& value)
+{
+    const std::string firstToken = LOOLProtocol::getFirstToken(value);
+    if (firstToken == "key" || firstToken == "mouse" || firstToken == "uno" ||
+        firstToken == "selecttext" || firstToken == "selectgraphic" || firstToken == "resetselection" ||
+        firstToken == "clientzoom" || firstToken == "clientvisiblearea")
+    {
+        return Priority::Input;
+    }
+
+    if (firstToken == "tile" || firstToken == "tilecombine" || firstToken == "renderfont")
+        return Priority::Render;
+
+    return Priority::Other;
+}
+
 void MessageQueue::put_impl(const Payload& value)
 {
     _queue.push_back(value);
@@ -65,9 +184,45 @@ void MessageQueue::clear_impl()
     _queue.clear();
 }
 
+const BasicTileQueue::CoalescingRules& BasicTileQueue::getClientRules()
+{
+    static const CoalescingRules rules =
+    {
+        { "mouse", "type=move", CoalescingRule::Scope::Last },
+        { "clientzoom", "", CoalescingRule::Scope::Last },
+        { "clientvisiblearea", "", CoalescingRule::Scope::Last },
+        { "setclientpart", "", CoalescingRule::Scope::Last },
+        { "setclientpart", "", CoalescingRule::Scope::OtherParts }
+    };
+
+    return rules;
+}
+
+const BasicTileQueue::CoalescingRules& BasicTileQueue::getKitRules()
+{
+    static const CoalescingRules rules =
+    {
+        { "mouse", "type=move", CoalescingRule::Scope::Last },
+        { "clientzoom", "", CoalescingRule::Scope::Last },
+        { "clientvisiblearea", "", CoalescingRule::Scope::Last },
+        { "setclientpart", "", CoalescingRule::Scope::Last }
+    };
+
+    return rules;
+}
+
+BasicTileQueue::BasicTileQueue(const CoalescingRules& rules) :
+    _rules(rules),
+    _overtakes(0),
+    _coalesced(0)
+{
+}
+
 void BasicTileQueue::put_impl(const Payload& value)
 {
     const auto msg = std::string(&value[0], value.size());
+    coalesce(msg);
+
     if (msg == "canceltiles")
     {
         // remove all the existing tiles from the queue
@@ -91,21 +246,222 @@ void BasicTileQueue::put_impl(const Payload& value)
     }
 }
 
+MessageQueue::Payload BasicTileQueue::get_impl()
+{
+    Payload input;
+    if (getInput(input))
+        return input;
+
+    return MessageQueue::get_impl();
+}
+
+bool BasicTileQueue::getInput(Payload& value)
+{
+    size_t index = 0;
+    while (index < _queue.size() && getPriority(_queue[index]) == Priority::Render)
+    {
+        ++index;
+    }
+
+    if (index == 0)
+        return false;
+
+    if (index == _queue.size() || _overtakes >= MaxOvertakes || getPriority(_queue[index]) != Priority::Input)
+    {
+        // The rendering at the front goes next.
+        _overtakes = 0;
+        return false;
+    }
+
+    ++_overtakes;
+    value = _queue[index];
+    _queue.erase(_queue.begin() + index);
+    return true;
+}
+
+void BasicTileQueue::coalesce(const std::string& message)
+{
+    const std::string command = message.substr(0, message.find(' '));
+    for (const auto& rule : _rules)
+    {
+        if (rule._command != command || (!rule._token.empty() && !hasToken(message, rule._token)))
+            continue;
+
+        if (rule._scope == CoalescingRule::Scope::Last)
+        {
+            for (size_t i = _queue.size(); i-- > 0; )
+            {
+                if (getPriority(_queue[i]) == Priority::Render)
+                    continue;
+
+                const std::string queued(_queue[i].data(), _queue[i].size());
+                if (LOOLProtocol::getFirstToken(_queue[i]) == command &&
+                    (rule._token.empty() || hasToken(queued, rule._token)))
+                {
+                    _queue.erase(_queue.begin() + i);
+                    ++_coalesced;
+                }
+
+                break;
+            }
+        }
+        else
+        {
+            int part = -1;
+            if (message.size() <= command.size() ||
+                !LOOLProtocol::getTokenInteger(message.substr(command.size() + 1), "part", part))
+                continue;
+
+            const size_t size = _queue.size();
+            _queue.erase(std::remove_if(_queue.begin(), _queue.end(),
+                                        [part](const Payload& v)
+                                        {
+                                            const std::string queued(v.data(), v.size());
+                                            const std::string firstToken = LOOLProtocol::getFirstToken(v);
+                                            const size_t partPos = queued.find(" part=");
+                                            return (firstToken == "tile" || firstToken == "tilecombine") &&
+                                                   queued.find(" id=") == std::string::npos &&
+                                                   partPos != std::string::npos &&
+                                                   std::atoi(queued.c_str() + partPos + 6) != part;
+                                        }),
+                         _queue.end());
+            _coalesced += size - _queue.size();
+        }
+    }
+}
+
+TileQueue::RenderState::RenderState() :
+    _part(-1),
+    _pixelWidth(0),
+    _twipWidth(0),
+    _pixelHeight(0),
+    _twipHeight(0)
+{
+}
+
+bool TileQueue::RenderState::parse(const Payload& value)
+{
+    const std::string firstToken = LOOLProtocol::getFirstToken(value);
+    const bool isZoom = firstToken == "clientzoom";
+    if (!isZoom && firstToken != "tile" && firstToken != "tilecombine")
+        return false;
+
+    RenderState state;
+    std::string positionsX;
+    std::string positionsY;
+    // Scanned in place, this runs for every queued request on every get.
+    const std::string message(value.data(), value.size());
+    size_t begin = message.find(' ');
+    while (begin != std::string::npos)
+    {
+        const size_t end = message.find(' ', begin + 1);
+        const size_t equals = message.find('=', begin + 1);
+        if (equals < end)
+        {
+            const std::string name = message.substr(begin + 1, equals - begin - 1);
+            const char* text = message.c_str() + equals + 1;
+            if (name == "tileposx")
+                positionsX = message.substr(equals + 1, end - equals - 1);
+            else if (name == "tileposy")
+                positionsY = message.substr(equals + 1, end - equals - 1);
+            else if (name == "part")
+                state._part = std::atoi(text);
+            else if (name == (isZoom ? "tilepixelwidth" : "width"))
+                state._pixelWidth = std::atoi(text);
+            else if (name == (isZoom ? "tilepixelheight" : "height"))
+                state._pixelHeight = std::atoi(text);
+            else if (name == (isZoom ? "tiletwipwidth" : "tilewidth"))
+                state._twipWidth = std::atoi(text);
+            else if (name == (isZoom ? "tiletwipheight" : "tileheight"))
+                state._twipHeight = std::atoi(text);
+        }
+
+        begin = end;
+    }
+
+    if (state._twipWidth <= 0 || state._twipHeight <= 0)
+        return false;
+
+    int minX = 0;
+    int maxX = 0;
+    int minY = 0;
+    int maxY = 0;
+    if (getPositions(positionsX, minX, maxX) && getPositions(positionsY, minY, maxY))
+        state._area = Util::Rectangle(minX, minY, maxX - minX + state._twipWidth, maxY - minY + state._twipHeight);
+
+    reduce(state._pixelWidth, state._twipWidth);
+    reduce(state._pixelHeight, state._twipHeight);
+
+    // The part of the client comes with setclientpart.
+    if (isZoom)
+        state._part = _part;
+
+    *this = state;
+    return true;
+}
+
+bool TileQueue::RenderState::isSameZoom(const RenderState& other) const
+{
+    return _pixelWidth == other._pixelWidth && _twipWidth == other._twipWidth &&
+           _pixelHeight == other._pixelHeight && _twipHeight == other._twipHeight;
+}
+
+TileQueue::TileQueue(const CoalescingRules& rules) :
+    BasicTileQueue(rules),
+    _bypassed(0),
+    _arrivalSwitches(0),
+    _switches(0)
+{
+}
+
+void TileQueue::updateCursorPosition(const Util::Rectangle& cursor)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cursor = cursor;
+}
+
+bool TileQueue::isVisible(const RenderState& state) const
+{
+    return (_client._part < 0 || state._part == _client._part) &&
+           (_client._twipWidth == 0 || state.isSameZoom(_client));
+}
+
 void TileQueue::put_impl(const Payload& value)
 {
     const auto msg = std::string(&value[0], value.size());
+    if (msg.compare(0, 11, "clientzoom ") == 0)
+    {
+        _client.parse(value);
+    }
+    else if (msg.compare(0, 14, "setclientpart ") == 0)
+    {
+        LOOLProtocol::getTokenInteger(msg.substr(14), "part", _client._part);
+    }
+    else if (msg == "canceltiles")
+    {
+        _bypassed = 0;
+    }
+    else if (msg.compare(0, 18, "clientvisiblearea ") == 0)
+    {
+        int x = 0;
+        int y = 0;
+        int width = 0;
+        int height = 0;
+        StringTokenizer tokens(msg, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+        for (size_t i = 1; i < tokens.count(); ++i)
+        {
+            LOOLProtocol::getTokenInteger(tokens[i], "x", x);
+            LOOLProtocol::getTokenInteger(tokens[i], "y", y);
+            LOOLProtocol::getTokenInteger(tokens[i], "width", width);
+            LOOLProtocol::getTokenInteger(tokens[i], "height", height);
+        }
+
+        _visibleArea = width > 0 && height > 0 ? Util::Rectangle(x, y, width, height) : Util::Rectangle();
+    }
+
     if (msg.compare(0, 5, "tile ") == 0)
     {
-        // TODO: implement a real re-ordering here, so that the tiles closest to
-        // the cursor are returned first.
-        // * we will want to put just a general "tile" message to the queue
-        // * add a std::set that handles the tiles
-        // * change the get_impl() to decide which tile is the correct one to
-        //   be returned
-        // * we will also need to be informed about the position of the cursor
-        //   so that get_impl() returns optimal results
-        //
-        // For now: just don't put duplicates into the queue
+        // Don't put duplicates into the queue, get_impl() takes care of the order.
         for (auto it = _queue.cbegin(); it != _queue.cend(); ++it)
         {
             if (value == *it)
@@ -115,7 +471,87 @@ void TileQueue::put_impl(const Payload& value)
         }
     }
 
+    RenderState state;
+    if (isTileRequest(value) && state.parse(value))
+    {
+        if (_lastPut._twipWidth != 0 && (state._part != _lastPut._part || !state.isSameZoom(_lastPut)))
+            ++_arrivalSwitches;
+
+        _lastPut = state;
+    }
+
     BasicTileQueue::put_impl(value);
 }
 
+MessageQueue::Payload TileQueue::get_impl()
+{
+    Payload input;
+    if (getInput(input))
+        return input;
+
+    // Only the tile requests at the front are reordered, among themselves.
+    size_t count = 0;
+    while (count < _queue.size() && count < MaxBatch && isTileRequest(_queue[count]))
+    {
+        ++count;
+    }
+
+    if (count == 0)
+        return MessageQueue::get_impl();
+
+    std::vector<RenderState> states(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        states[i].parse(_queue[i]);
+    }
+
+    // Lower is sooner: the shown part and zoom, the cursor, the distance to the visible area,
+    // the part and zoom of the last one.
+    typedef std::tuple<bool, bool, int64_t, bool> Rank;
+    auto getRank = [this](const RenderState& state)
+                   {
+                       const bool isShown = state._twipWidth != 0 && isVisible(state);
+                       const bool isLast = _lastGot._twipWidth != 0 && state._twipWidth != 0 &&
+                                           state._part == _lastGot._part && state.isSameZoom(_lastGot);
+                       if (!isShown)
+                           return Rank(true, true, 0, !isLast);
+
+                       const bool atCursor = _cursor._x1 <= _cursor._x2 && state._area.intersects(_cursor);
+                       return Rank(false, !atCursor, getDistance(state._area, _visibleArea), !isLast);
+                   };
+
+    std::vector<Rank> ranks;
+    for (const auto& state : states)
+    {
+        ranks.push_back(getRank(state));
+    }
+
+    // The oldest of those in view, which may be passed over only so often.
+    const Rank inView(false, true, 0, true);
+    size_t oldest = 0;
+    while (oldest < count && inView < ranks[oldest])
+    {
+        ++oldest;
+    }
+
+    size_t next = std::min_element(ranks.begin(), ranks.end()) - ranks.begin();
+    if (oldest < count && _bypassed >= MaxBypass)
+        next = oldest;
+
+    _bypassed = next == oldest || oldest == count ? 0 : _bypassed + 1;
+
+    const RenderState& state = states[next];
+    if (state._twipWidth != 0)
+    {
+        if (_lastGot._twipWidth != 0 && (state._part != _lastGot._part || !state.isSameZoom(_lastGot)))
+            ++_switches;
+
+        _lastGot = state;
+    }
+
+    const Payload result = _queue[next];
+    _queue.erase(_queue.begin() + next);
+    return result;
+}
+
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
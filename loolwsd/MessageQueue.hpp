@@ -10,11 +10,16 @@
 #ifndef INCLUDED_MESSAGEQUEUE_HPP
 #define INCLUDED_MESSAGEQUEUE_HPP
 
+#include <atomic>
 #include <condition_variable>
 #include <mutex>
 #include <deque>
+#include <functional>
+#include <string>
 #include <vector>
 
+#include "Rectangle.hpp"
+
 /** Thread-safe message queue (FIFO).
 */
 class MessageQueue
@@ -23,6 +28,17 @@ public:
 
     typedef std::vector<char> Payload;
 
+    /// What a message is for, as far as the order of handling them goes.
+    enum class Priority
+    {
+        /// User input, and the view state the client sends along with it.
+        Input,
+        /// Rendering.
+        Render,
+        /// Anything else.
+        Other
+    };
+
     MessageQueue()
     {
     }
@@ -42,22 +58,28 @@ public:
     /// Thread safe obtaining of the message.
     Payload get();
 
+    /// Thread safe obtaining of the message, false without waiting if there is none.
+    bool tryGet(Payload& value);
+
     /// Thread safe removal of all the pending messages.
     void clear();
 
     /// Thread safe remove_if.
     void remove_if(std::function<bool(const Payload&)> pred);
 
+    static Priority getPriority(const Payload& value);
+
 private:
-    std::mutex _mutex;
     std::condition_variable _cv;
 
 protected:
+    std::mutex _mutex;
+
     virtual void put_impl(const Payload& value);
 
     bool wait_impl() const;
 
-    Payload get_impl();
+    virtual Payload get_impl();
 
     void clear_impl();
 
@@ -68,25 +90,148 @@ protected:
 
 Used for basic handling of incoming requests, only can remove tiles when it
 gets a "canceltiles" command.
+
+Input goes before the rendering queued ahead of it, so typing doesn't wait
+for the tiles of a scroll, but never before messages of any other kind,
+and in the order it came. At most MaxOvertakes input messages in a row go
+before waiting rendering, so that doesn't starve either.
+
+A message drops the queued ones it makes obsolete, as its coalescing rules
+say, like the earlier mouse moves of a drag or the earlier zooms. Only the
+queue of a client in wsd drops tile requests, the kit has to answer those
+it got, as wsd waits for them.
 */
 class BasicTileQueue : public MessageQueue
 {
+public:
+    static constexpr size_t MaxOvertakes = 8;
+
+    /// Which queued messages a new one makes obsolete.
+    struct CoalescingRule
+    {
+        enum class Scope
+        {
+            /// The last one like it, if only rendering is queued after it.
+            Last,
+            /// The tile requests for other parts than the one it sets, except those with an id.
+            OtherParts
+        };
+
+        /// The command, and a token the message has too if not empty.
+        std::string _command;
+        std::string _token;
+        Scope _scope;
+    };
+
+    typedef std::vector<CoalescingRule> CoalescingRules;
+
+    /// For the requests of a client in wsd.
+    static const CoalescingRules& getClientRules();
+
+    /// For the requests of a view in the kit.
+    static const CoalescingRules& getKitRules();
+
+    explicit BasicTileQueue(const CoalescingRules& rules = getClientRules());
+
+    /// How many queued messages were dropped as obsolete.
+    size_t getCoalesced() const { return _coalesced; }
+
 protected:
     virtual void put_impl(const Payload& value) override;
+
+    virtual Payload get_impl() override;
+
+    /// Takes the next input message if it goes before the rendering at the front.
+    bool getInput(Payload& value);
+
+private:
+    /// Drops the queued messages the new one makes obsolete.
+    void coalesce(const std::string& message);
+
+private:
+    const CoalescingRules _rules;
+    size_t _overtakes;
+    std::atomic<size_t> _coalesced;
 };
 
 /** MessageQueue specialized for priority handling of tiles.
 
 This class builds on BasicTileQueue, and additonaly provides de-duplication
-of tile requests.
-
-TODO: we'll need to add reordering of the tiles at some stage here too - so
-that the ones closest to the cursor position are returned first.
+of tile requests, and orders them to save the kit switching the part and
+the zoom of the document between them.
+
+Of the tile and tilecombine requests at the front of the queue, up to
+MaxBatch of them, the next one is at the part and zoom the client shows, as
+told by setclientpart and clientzoom, and of those the one at the cursor,
+else the closest to the area the client shows, as told by
+clientvisiblearea. Then the ones at the part and zoom of the last one come
+before the rest, otherwise the oldest goes first. So when the view moves,
+the requests for what scrolled away wait for those for what came into view.
+The oldest of the requests in view is passed over at most MaxBypass times,
+which bounds its latency. Input overtakes them as in BasicTileQueue. The
+other messages are never reordered.
 */
 class TileQueue : public BasicTileQueue
 {
+public:
+    static constexpr size_t MaxBatch = 256;
+    static constexpr size_t MaxBypass = 16;
+
+    explicit TileQueue(const CoalescingRules& rules = getKitRules());
+
+    /// Thread safe update of the cursor of the view, where an invalid rectangle is no cursor.
+    void updateCursorPosition(const Util::Rectangle& cursor);
+
+    /// How often the part or zoom changed between the tile requests in the order they came.
+    size_t getArrivalSwitches() const { return _arrivalSwitches; }
+
+    /// How often the part or zoom changed between the tile requests as returned.
+    size_t getSwitches() const { return _switches; }
+
+    size_t getSwitchesAvoided() const
+    {
+        const size_t switches = _switches;
+        const size_t arrivalSwitches = _arrivalSwitches;
+        return arrivalSwitches > switches ? arrivalSwitches - switches : 0;
+    }
+
 protected:
     virtual void put_impl(const Payload& value) override;
+
+    virtual Payload get_impl() override;
+
+private:
+    /// The part and zoom a tile is painted at, the zoom as reduced pixel to twip ratios.
+    struct RenderState
+    {
+        RenderState();
+
+        /// Reads a tile, tilecombine or clientzoom message, false if it's none.
+        /// The area of the tiles in twips is read too, it stays invalid for clientzoom.
+        bool parse(const Payload& value);
+
+        bool isSameZoom(const RenderState& other) const;
+
+        int _part;
+        int _pixelWidth;
+        int _twipWidth;
+        int _pixelHeight;
+        int _twipHeight;
+        Util::Rectangle _area;
+    };
+
+    /// True if the state of a tile request is what the client shows, as far as known.
+    bool isVisible(const RenderState& state) const;
+
+private:
+    RenderState _lastPut;
+    RenderState _lastGot;
+    RenderState _client;
+    Util::Rectangle _visibleArea;
+    Util::Rectangle _cursor;
+    size_t _bypassed;
+    std::atomic<size_t> _arrivalSwitches;
+    std::atomic<size_t> _switches;
 };
 
 #endif
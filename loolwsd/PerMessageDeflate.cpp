@@ -0,0 +1,244 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "PerMessageDeflate.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#include <Poco/String.h>
+#include <Poco/StringTokenizer.h>
+
+#include "LOOLProtocol.hpp"
+#include "Log.hpp"
+
+using Poco::StringTokenizer;
+
+constexpr size_t PerMessageDeflate::MaxInflatedSize;
+
+bool PerMessageDeflate::Enabled = true;
+size_t PerMessageDeflate::MinSize = 16;
+bool PerMessageDeflate::ContextTakeover = true;
+
+namespace
+{
+
+/// What a sync flush ends with, left out of the messages.
+const unsigned char FlushTail[] = { 0x00, 0x00, 0xff, 0xff };
+
+}
+
+PerMessageDeflate::PerMessageDeflate(const int windowBits, const bool contextTakeover) :
+    _contextTakeover(contextTakeover),
+    _failed(false),
+    _deflatedIn(0),
+    _deflatedOut(0),
+    _inflatedIn(0),
+    _inflatedOut(0)
+{
+    std::memset(&_deflate, 0, sizeof(_deflate));
+    std::memset(&_inflate, 0, sizeof(_inflate));
+
+    // Negative window bits for raw deflate, without the zlib header and checksum.
+    if (deflateInit2(&_deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        throw std::runtime_error("Failed to initialize deflate.");
+    }
+
+    // The window of the client is at most 15 bits, whatever it picks.
+    if (inflateInit2(&_inflate, -15) != Z_OK)
+    {
+        deflateEnd(&_deflate);
+        throw std::runtime_error("Failed to initialize inflate.");
+    }
+}
+
+PerMessageDeflate::~PerMessageDeflate()
+{
+    deflateEnd(&_deflate);
+    inflateEnd(&_inflate);
+}
+
+std::shared_ptr<PerMessageDeflate> PerMessageDeflate::negotiate(const std::string& offers,
+                                                                std::string& response)
+{
+    response.clear();
+    if (!Enabled)
+        return nullptr;
+
+    StringTokenizer offerTokens(offers, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+    for (const auto& offer : offerTokens)
+    {
+        StringTokenizer tokens(offer, ";", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+        if (tokens.count() == 0 || Poco::icompare(tokens[0], "permessage-deflate") != 0)
+            continue;
+
+        // The first offer with nothing we can't do is taken.
+        bool accepted = true;
+        bool contextTakeover = ContextTakeover;
+        int windowBits = 15;
+        bool windowBitsAsked = false;
+        std::set<std::string> names;
+        for (size_t i = 1; i < tokens.count() && accepted; ++i)
+        {
+            const size_t equal = tokens[i].find('=');
+            const std::string name = Poco::trim(tokens[i].substr(0, equal));
+            std::string value = (equal == std::string::npos ? "" : Poco::trim(tokens[i].substr(equal + 1)));
+            value.erase(std::remove(value.begin(), value.end(), '"'), value.end());
+
+            if (!names.insert(name).second)
+            {
+                accepted = false;
+            }
+            else if (name == "server_no_context_takeover" && value.empty())
+            {
+                contextTakeover = false;
+            }
+            else if (name == "server_max_window_bits")
+            {
+                // zlib doesn't do raw deflate with 8 bits.
+                int bits = 0;
+                accepted = LOOLProtocol::stringToInteger(value, bits) && bits >= 9 && bits <= 15;
+                windowBits = bits;
+                windowBitsAsked = true;
+            }
+            else if (name == "client_max_window_bits")
+            {
+                // Any window is inflated with the largest one.
+                int bits = 0;
+                accepted = value.empty() || (LOOLProtocol::stringToInteger(value, bits) && bits >= 8 && bits <= 15);
+            }
+            else if (name != "client_no_context_takeover" || !value.empty())
+            {
+                accepted = false;
+            }
+        }
+
+        if (!accepted)
+            continue;
+
+        response = "permessage-deflate";
+        if (!contextTakeover)
+            response += "; server_no_context_takeover";
+        if (windowBitsAsked)
+            response += "; server_max_window_bits=" + std::to_string(windowBits);
+
+        return std::make_shared<PerMessageDeflate>(windowBits, contextTakeover);
+    }
+
+    return nullptr;
+}
+
+bool PerMessageDeflate::deflate(const char* data, const size_t size, std::vector<char>& output)
+{
+    if (_failed || size < MinSize)
+        return false;
+
+    _deflate.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    _deflate.avail_in = size;
+
+    // Room for all of it, and the flush, almost always.
+    output.resize(deflateBound(&_deflate, size) + sizeof(FlushTail));
+    size_t used = 0;
+    do
+    {
+        if (used == output.size())
+            output.resize(output.size() * 2);
+
+        _deflate.next_out = reinterpret_cast<Bytef*>(output.data() + used);
+        _deflate.avail_out = output.size() - used;
+        const int result = ::deflate(&_deflate, Z_SYNC_FLUSH);
+        used = output.size() - _deflate.avail_out;
+        if (result != Z_OK && result != Z_BUF_ERROR)
+        {
+            // The client has what was sent before, but no longer what this stream would refer
+            // to, so the rest goes as is.
+            Log::error("Failed to deflate a message: " + std::to_string(result) + ".");
+            _failed = true;
+            return false;
+        }
+    }
+    while (_deflate.avail_out == 0);
+
+    assert(used >= sizeof(FlushTail) &&
+           std::memcmp(output.data() + used - sizeof(FlushTail), FlushTail, sizeof(FlushTail)) == 0);
+    output.resize(used - sizeof(FlushTail));
+
+    if (!_contextTakeover)
+    {
+        deflateReset(&_deflate);
+
+        // Nothing refers to it, so it can go as is if that's smaller.
+        if (output.size() >= size)
+            return false;
+    }
+
+    _deflatedIn += size;
+    _deflatedOut += output.size();
+    return true;
+}
+
+bool PerMessageDeflate::inflate(std::vector<char>& payload)
+{
+    const size_t size = payload.size();
+    payload.insert(payload.end(), FlushTail, FlushTail + sizeof(FlushTail));
+
+    _inflate.next_in = reinterpret_cast<Bytef*>(payload.data());
+    _inflate.avail_in = payload.size();
+
+    _inflated.resize(std::max(_inflated.capacity(), 4 * payload.size()));
+    size_t used = 0;
+    do
+    {
+        if (used == _inflated.size())
+        {
+            if (_inflated.size() >= MaxInflatedSize)
+            {
+                Log::error("Inflated message over " + std::to_string(MaxInflatedSize) + " bytes.");
+                return false;
+            }
+
+            _inflated.resize(std::min(_inflated.size() * 2, MaxInflatedSize));
+        }
+
+        _inflate.next_out = reinterpret_cast<Bytef*>(_inflated.data() + used);
+        _inflate.avail_out = _inflated.size() - used;
+        const int result = ::inflate(&_inflate, Z_SYNC_FLUSH);
+        used = _inflated.size() - _inflate.avail_out;
+        if (result != Z_OK && result != Z_BUF_ERROR)
+        {
+            Log::error("Failed to inflate a message: " + std::to_string(result) + ".");
+            return false;
+        }
+    }
+    while (_inflate.avail_out == 0);
+
+    _inflated.resize(used);
+    payload.swap(_inflated);
+
+    _inflatedIn += size;
+    _inflatedOut += used;
+    return true;
+}
+
+std::string PerMessageDeflate::getMetrics() const
+{
+    std::ostringstream oss;
+    oss << "deflated " << _deflatedIn / 1024 << " kB to " << _deflatedOut / 1024 << " kB";
+    if (_deflatedIn > 0)
+        oss << " (" << 100 - 100 * _deflatedOut / _deflatedIn << "% saved)";
+    oss << ", inflated " << _inflatedIn / 1024 << " kB to " << _inflatedOut / 1024 << " kB";
+    return oss.str();
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,91 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_PERMESSAGEDEFLATE_HPP
+#define INCLUDED_PERMESSAGEDEFLATE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+/** The permessage-deflate WebSocket extension (RFC 7692) of a client socket.
+
+Poco doesn't know about extensions, but sends the first byte of a frame
+as given, and hands it back when receiving, so the RSV1 bit marking a
+compressed message goes through it. The extension is negotiated before
+the WebSocket is accepted, by setting the response header.
+
+Only text messages are compressed, the tiles are PNG already, and only
+those of at least MinSize bytes. With ContextTakeover the messages are
+compressed with what was sent before as dictionary, which is what makes
+the many small, similar ones compress, at the cost of keeping a deflate
+state per client.
+
+Deflating and inflating may happen on different threads, but each only
+on one at a time.
+*/
+class PerMessageDeflate
+{
+public:
+    /// The largest message inflated, so a small one can't take all the memory.
+    static constexpr size_t MaxInflatedSize = 64 * 1024 * 1024;
+
+    /// Whether to accept the extension at all.
+    static bool Enabled;
+
+    /// The smallest text message compressed.
+    static size_t MinSize;
+
+    /// Keep the deflate state between messages, unless the client asks not to.
+    static bool ContextTakeover;
+
+    PerMessageDeflate(int windowBits, bool contextTakeover);
+    ~PerMessageDeflate();
+
+    PerMessageDeflate(const PerMessageDeflate&) = delete;
+    PerMessageDeflate& operator=(const PerMessageDeflate&) = delete;
+
+    /// The extension for the offers of a Sec-WebSocket-Extensions request header, and the
+    /// header to respond with in response, or null if none is accepted.
+    static std::shared_ptr<PerMessageDeflate> negotiate(const std::string& offers,
+                                                        std::string& response);
+
+    /// Compresses a message to send with RSV1 set into output, or returns false if it's to be
+    /// sent as is.
+    bool deflate(const char* data, size_t size, std::vector<char>& output);
+
+    /// Decompresses the payload of a message received with RSV1 set, false if it's corrupt.
+    bool inflate(std::vector<char>& payload);
+
+    /// The bytes of the messages compressed, and what they were compressed to.
+    size_t getDeflatedIn() const { return _deflatedIn; }
+    size_t getDeflatedOut() const { return _deflatedOut; }
+
+    std::string getMetrics() const;
+
+private:
+    const bool _contextTakeover;
+    z_stream _deflate;
+    z_stream _inflate;
+    bool _failed;
+    /// What's inflated into, swapped with the payload to keep both buffers.
+    std::vector<char> _inflated;
+    std::atomic<size_t> _deflatedIn;
+    std::atomic<size_t> _deflatedOut;
+    std::atomic<size_t> _inflatedIn;
+    std::atomic<size_t> _inflatedOut;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
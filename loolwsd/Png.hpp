@@ -36,7 +36,9 @@
  *        Chris Wilson <chris@chris-wilson.co.uk>
  */
 
-/* Unpremultiplies data and converts native endian ARGB => RGBA bytes */
+/* Unpremultiplies data and converts native endian ARGB => RGBA bytes
+ * Tiles are converted by Unpremultiply::toRGBA() now, this is kept as the
+ * reference it is measured against in test/UnpremultiplyBench.cpp */
 static void
 unpremultiply_data (png_structp /*png*/, png_row_infop row_info, png_bytep data)
 {
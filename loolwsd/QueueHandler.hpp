@@ -7,12 +7,19 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/.
  */
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
 #include <Poco/Runnable.h>
 
 #include "MessageQueue.hpp"
 #include "LOOLSession.hpp"
 #include "LOOLProtocol.hpp"
 #include "Util.hpp"
+#include "WorkerPool.hpp"
 
 /// This thread handles incoming messages on a given kit instance.
 class QueueHandler: public Poco::Runnable
@@ -65,4 +72,147 @@ private:
     const std::string _name;
 };
 
+/// Handles the incoming messages of a session like QueueHandler, but on the sessions pool of
+/// WorkerPool as they come, so an idle session doesn't cost a thread.
+class QueueDispatcher: public std::enable_shared_from_this<QueueDispatcher>
+{
+public:
+    /// onFinished is called when the session flags to finish, or fails to handle a message.
+    QueueDispatcher(std::shared_ptr<MessageQueue> queue,
+                    const std::shared_ptr<LOOLSession>& session,
+                    std::function<void()> onFinished):
+        _queue(queue),
+        _session(session),
+        _onFinished(onFinished),
+        _scheduled(false),
+        _finished(false)
+    {
+    }
+
+    /// Queues the message, to be handled on the pool unless finished.
+    void put(const MessageQueue::Payload& value)
+    {
+        _queue->put(value);
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        schedule();
+    }
+
+    /// Runs job where the messages are handled, before those still queued, unless finished.
+    /// For what wsd asks of the session, as the messages are what its client can send.
+    void post(WorkerPool::Job job)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_finished)
+            return;
+
+        _jobs.push_back(std::move(job));
+        schedule();
+    }
+
+    /// Handles what's queued, then waits until it's done, like joining the thread of a QueueHandler.
+    void finish()
+    {
+        put(MessageQueue::Payload({ 'e', 'o', 'f' }));
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [this]() { return _finished; });
+    }
+
+private:
+    /// Posts drain() unless it's posted or running already. Must be called with _mutex held.
+    void schedule()
+    {
+        if (_scheduled || _finished)
+            return;
+
+        _scheduled = true;
+        const auto self = shared_from_this();
+        WorkerPool::getSessions().post([self]() { self->drain(); });
+    }
+
+    void drain()
+    {
+        while (true)
+        {
+            MessageQueue::Payload input;
+            WorkerPool::Job job;
+            {
+                // Under the lock, so a put() either sees this one still at it, or schedules another.
+                std::unique_lock<std::mutex> lock(_mutex);
+                if (!_jobs.empty())
+                {
+                    job = std::move(_jobs.front());
+                    _jobs.pop_front();
+                }
+                else if (!_queue->tryGet(input))
+                {
+                    _scheduled = false;
+                    return;
+                }
+            }
+
+            if (job)
+            {
+                try
+                {
+                    job();
+                }
+                catch (const std::exception& exc)
+                {
+                    Log::error(std::string("QueueDispatcher::drain: Exception: ") + exc.what());
+                }
+
+                continue;
+            }
+
+            bool flagged = false;
+            if (LOOLProtocol::getFirstToken(input) == "eof")
+            {
+                Log::info("Received EOF. Finishing.");
+            }
+            else
+            {
+                try
+                {
+                    if (_session->handleInput(input.data(), input.size()))
+                        continue;
+
+                    Log::info("Socket handler flagged for finishing.");
+                }
+                catch (const std::exception& exc)
+                {
+                    Log::error(std::string("QueueDispatcher::drain: Exception: ") + exc.what());
+                }
+
+                flagged = true;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _finished = true;
+                _jobs.clear();
+            }
+
+            _cv.notify_all();
+            if (flagged)
+                _onFinished();
+
+            return;
+        }
+    }
+
+private:
+    std::shared_ptr<MessageQueue> _queue;
+    std::shared_ptr<LOOLSession> _session;
+    std::function<void()> _onFinished;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    /// Posted by wsd, run before the messages.
+    std::deque<WorkerPool::Job> _jobs;
+    /// True while a drain() is posted or running.
+    bool _scheduled;
+    bool _finished;
+};
+
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
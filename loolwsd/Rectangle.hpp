@@ -37,7 +37,7 @@ struct Rectangle
         , _y2(y + height)
     {}
 
-    void extend(Rectangle& rectangle)
+    void extend(const Rectangle& rectangle)
     {
         if (rectangle._x1 < _x1)
             _x1 = rectangle._x1;
@@ -73,6 +73,12 @@ struct Rectangle
     {
         return _x1 <= _x2 && _y1 <= _y2;
     }
+
+    bool intersects(const Rectangle& rectangle) const
+    {
+        return _x1 < rectangle._x2 && rectangle._x1 < _x2 &&
+               _y1 < rectangle._y2 && rectangle._y1 < _y2;
+    }
 };
 
 }
@@ -0,0 +1,260 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "SenderQueue.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <sstream>
+
+#include <Poco/Net/Socket.h>
+
+#include "IoUtil.hpp"
+#include "Log.hpp"
+#include "PerMessageDeflate.hpp"
+#include "Util.hpp"
+
+constexpr size_t SenderQueue::MaxBytes;
+
+namespace
+{
+
+/// The parameters naming a tile, the rest may differ between renders of it.
+const char* const TileParameters[] = { "part=", "width=", "height=", "tileposx=", "tileposy=",
+                                       "tilewidth=", "tileheight=", "id=" };
+
+/// The state updates where only the last one counts.
+const char* const StateCommands[] = { "invalidatecursor:", "textselection:", "textselectionstart:",
+                                      "textselectionend:", "cursorvisible:", "graphicselection:",
+                                      "cellcursor:", "cellformula:", "mousepointer:",
+                                      "statechanged:", "statusindicatorsetvalue:" };
+
+}
+
+SenderQueue::SenderQueue(const size_t maxBytes) :
+    _maxBytes(maxBytes),
+    _sending(false),
+    _fragment(false),
+    _overflown(false),
+    _closed(false),
+    _depth(0),
+    _bytes(0),
+    _peakDepth(0),
+    _peakBytes(0),
+    _dropped(0)
+{
+}
+
+SenderQueue::Pushed SenderQueue::push(const char* data, const size_t size, const int flags)
+{
+    Message message;
+    message._data.assign(data, data + size);
+    message._flags = flags;
+    message._key = getKey(data, size);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_overflown || _closed)
+        return Pushed::Dropped;
+
+    size_t bytes = _bytes;
+    if (!message._key.empty())
+    {
+        // Dropped rather than replaced, so this one goes at the end, after what came after them.
+        const auto end = std::remove_if(_queue.begin(), _queue.end(),
+                                        [&message, &bytes](const Message& queued)
+                                        {
+                                            if (queued._key != message._key)
+                                                return false;
+
+                                            bytes -= queued._data.size();
+                                            return true;
+                                        });
+        _dropped += _queue.end() - end;
+        _queue.erase(end, _queue.end());
+        _depth = _queue.size();
+    }
+
+    _bytes = bytes;
+    if (bytes + size > _maxBytes)
+    {
+        _overflown = true;
+        return Pushed::Overflow;
+    }
+
+    return enqueue(std::move(message));
+}
+
+SenderQueue::Pushed SenderQueue::pushClose(const Poco::UInt16 statusCode, const std::string& statusMessage)
+{
+    // As WebSocket::shutdown() has it, the status code in network byte order, then the message.
+    Message message;
+    message._data.push_back(static_cast<char>(statusCode >> 8));
+    message._data.push_back(static_cast<char>(statusCode & 0xff));
+    message._data.insert(message._data.end(), statusMessage.begin(), statusMessage.end());
+    message._flags = Poco::Net::WebSocket::FRAME_FLAG_FIN | Poco::Net::WebSocket::FRAME_OP_CLOSE;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_overflown || _closed)
+        return Pushed::Dropped;
+
+    _closed = true;
+    return enqueue(std::move(message));
+}
+
+SenderQueue::Pushed SenderQueue::enqueue(Message&& message)
+{
+    _bytes += message._data.size();
+    _queue.push_back(std::move(message));
+    _depth = _queue.size();
+    _peakBytes = std::max<size_t>(_peakBytes, _bytes);
+    _peakDepth = std::max<size_t>(_peakDepth, _depth);
+
+    if (_sending)
+        return Pushed::Queued;
+
+    _sending = true;
+    return Pushed::Wake;
+}
+
+bool SenderQueue::pop(std::deque<Message>& messages)
+{
+    messages.clear();
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_queue.empty())
+    {
+        _sending = false;
+        _sentCV.notify_all();
+        return false;
+    }
+
+    messages.swap(_queue);
+    _bytes = 0;
+    _depth = 0;
+    return true;
+}
+
+void SenderQueue::send(Poco::Net::WebSocket& ws)
+{
+    std::deque<Message> messages;
+    std::vector<char> compressed;
+    while (pop(messages))
+    {
+        try
+        {
+            for (const auto& message : messages)
+            {
+                const int opcode = message._flags & Poco::Net::WebSocket::FRAME_OP_BITMASK;
+                if (opcode == Poco::Net::WebSocket::FRAME_OP_CLOSE)
+                {
+                    ws.sendFrame(message._data.data(), message._data.size(), message._flags);
+                }
+                // The tiles are PNG already.
+                else if (_deflate && opcode == Poco::Net::WebSocket::FRAME_OP_TEXT &&
+                         _deflate->deflate(message._data.data(), message._data.size(), compressed))
+                {
+                    IoUtil::sendMessage(ws, compressed.data(), compressed.size(),
+                                        message._flags | Poco::Net::WebSocket::FRAME_FLAG_RSV1, _fragment);
+                }
+                else
+                {
+                    IoUtil::sendMessage(ws, message._data.data(), message._data.size(),
+                                        message._flags, _fragment);
+                }
+            }
+        }
+        catch (const std::exception& exc)
+        {
+            // Timed out, as the client isn't reading, or gone. Either way what's left of a frame
+            // can't follow anymore.
+            Log::error() << "SenderQueue::send: Disconnecting: " << exc.what() << Log::end;
+            disconnect(ws);
+        }
+    }
+}
+
+void SenderQueue::waitSent()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _sentCV.wait(lock, [this]() { return !_sending; });
+}
+
+void SenderQueue::disconnect(Poco::Net::WebSocket& ws)
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _closed = true;
+        _queue.clear();
+        _bytes = 0;
+        _depth = 0;
+    }
+
+    try
+    {
+        ws.impl()->shutdown();
+    }
+    catch (const std::exception& exc)
+    {
+        Log::warn() << "SenderQueue::disconnect: Exception: " << exc.what() << Log::end;
+    }
+}
+
+std::string SenderQueue::getKey(const char* data, const size_t size)
+{
+    const char* end = static_cast<const char*>(std::memchr(data, '\n', size));
+    if (end == nullptr)
+        end = data + size;
+
+    const char* space = std::find(data, end, ' ');
+    const std::string command(data, space);
+    if (command == "tile:")
+    {
+        std::string key = command;
+        while (space != end)
+        {
+            const char* token = space + 1;
+            space = std::find(token, end, ' ');
+            for (const char* parameter : TileParameters)
+            {
+                const size_t length = std::strlen(parameter);
+                if (static_cast<size_t>(space - token) > length && std::memcmp(token, parameter, length) == 0)
+                {
+                    key += ' ';
+                    key.append(token, space);
+                    break;
+                }
+            }
+        }
+
+        return key;
+    }
+
+    for (const char* stateCommand : StateCommands)
+    {
+        if (command == stateCommand)
+        {
+            // Each uno command has its own state.
+            return (command == "statechanged:" ? std::string(data, std::find(data, end, '=')) : command);
+        }
+    }
+
+    return std::string();
+}
+
+std::string SenderQueue::getMetrics() const
+{
+    std::ostringstream oss;
+    oss << _depth << " messages (" << _bytes / 1024 << " kB) queued, peak " << _peakDepth
+        << " (" << _peakBytes / 1024 << " kB), " << _dropped << " superseded"
+        << (_overflown ? ", overflown" : "") << (_closed ? ", closed" : "");
+    return oss.str();
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,148 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_SENDERQUEUE_HPP
+#define INCLUDED_SENDERQUEUE_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <Poco/Types.h>
+#include <Poco/Net/WebSocket.h>
+
+class PerMessageDeflate;
+
+/** The messages waiting to go out to a client, so whoever sends them, like
+the session of the kit forwarding tiles, doesn't wait for a slow client.
+
+A message drops the queued ones it supersedes: a tile the older ones of the
+same tile, and the state updates, like the cursor or the selection, the
+older ones of the same kind. It's still queued at the end, not in their
+place, so it doesn't overtake what was queued after them: a state that
+went out before an invalidation would be the one of before it. Past
+MaxBytes queued nothing is queued anymore, and the client is to be
+disconnected, as it's not keeping up.
+
+Thread safe, where one sender at a time takes the messages with pop(),
+which push() asks for when it queues the first one. All that's written to
+the socket goes through the queue, up to the close frame, so nothing gets
+in between the frames of a message or after the close. send() gives up on
+a socket, disconnecting it, when a write times out or fails.
+*/
+class SenderQueue
+{
+public:
+    static constexpr size_t MaxBytes = 32 * 1024 * 1024;
+
+    struct Message
+    {
+        std::vector<char> _data;
+        /// The WebSocket frame flags.
+        int _flags;
+        /// The kind of message it supersedes, empty if none.
+        std::string _key;
+    };
+
+    enum class Pushed
+    {
+        /// Queued, while being sent already.
+        Queued,
+        /// Queued, and a sender is to pop it.
+        Wake,
+        /// Over the limit, not queued.
+        Overflow,
+        /// Not queued, as the limit was reached before.
+        Dropped
+    };
+
+    explicit SenderQueue(size_t maxBytes = MaxBytes);
+
+    SenderQueue(const SenderQueue&) = delete;
+    SenderQueue& operator=(const SenderQueue&) = delete;
+
+    Pushed push(const char* data, size_t size, int flags);
+
+    /// Queues the close frame, over the limit too, after which nothing more is queued.
+    Pushed pushClose(Poco::UInt16 statusCode, const std::string& statusMessage);
+
+    /// Moves the queued messages to messages, or if there are none, returns false and the
+    /// next push() asks for a sender again.
+    bool pop(std::deque<Message>& messages);
+
+    /// Sends the queued messages to ws until there are no more, for when a push asks for it.
+    void send(Poco::Net::WebSocket& ws);
+
+    /// Waits until no sender is at it, so what was queued is sent or given up.
+    void waitSent();
+
+    /// What supersedes a message, or nothing if empty.
+    static std::string getKey(const char* data, size_t size);
+
+    /// Whether large messages are sent in several frames, see IoUtil::sendMessage.
+    void setFragment(bool fragment) { _fragment = fragment; }
+    bool isFragment() const { return _fragment; }
+
+    /// Compresses the text messages sent, to be set before the first is pushed.
+    void setDeflate(const std::shared_ptr<PerMessageDeflate>& deflate) { _deflate = deflate; }
+    const std::shared_ptr<PerMessageDeflate>& getDeflate() const { return _deflate; }
+
+    /// The messages queued.
+    size_t getDepth() const { return _depth; }
+
+    /// The bytes queued.
+    size_t getBytes() const { return _bytes; }
+
+    size_t getPeakDepth() const { return _peakDepth; }
+
+    size_t getPeakBytes() const { return _peakBytes; }
+
+    /// The messages dropped as superseded.
+    size_t getDropped() const { return _dropped; }
+
+    bool isOverflown() const { return _overflown; }
+
+    /// True once the close frame is queued, or the socket was given up.
+    bool isClosed() const { return _closed; }
+
+    std::string getMetrics() const;
+
+private:
+    /// Queues the message, with the lock taken.
+    Pushed enqueue(Message&& message);
+
+    /// Drops what's queued, and shuts ws down, so its socket poll finds it closed.
+    void disconnect(Poco::Net::WebSocket& ws);
+
+private:
+    const size_t _maxBytes;
+    std::mutex _mutex;
+    std::deque<Message> _queue;
+    /// True from the push() asking for a sender until its pop() finds nothing.
+    bool _sending;
+    std::condition_variable _sentCV;
+    std::atomic<bool> _fragment;
+    std::shared_ptr<PerMessageDeflate> _deflate;
+    std::atomic<bool> _overflown;
+    std::atomic<bool> _closed;
+    std::atomic<size_t> _depth;
+    std::atomic<size_t> _bytes;
+    std::atomic<size_t> _peakDepth;
+    std::atomic<size_t> _peakBytes;
+    std::atomic<size_t> _dropped;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
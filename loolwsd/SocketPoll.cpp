@@ -0,0 +1,389 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "SocketPoll.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <stdexcept>
+
+#include <Poco/Exception.h>
+#include <Poco/Net/Socket.h>
+
+#include "Common.hpp"
+#include "IoUtil.hpp"
+#include "Log.hpp"
+#include "LOOLSession.hpp"
+#include "Util.hpp"
+#include "WorkerPool.hpp"
+
+using Poco::Net::WebSocket;
+
+SocketPoll::SocketPoll(const size_t loopCount, const std::string& name) :
+    _name(name),
+    _next(0),
+    _stop(false),
+    _sockets(0),
+    _receiving(0),
+    _finishing(0)
+{
+    // The receives and the finishes run there, so they're to go after this.
+    WorkerPool::get();
+    WorkerPool::getSessions();
+    WorkerPool::getFinishing();
+
+    for (size_t i = 0; i < loopCount; ++i)
+    {
+        std::unique_ptr<Loop> loop(new Loop());
+        loop->_epoll = epoll_create1(EPOLL_CLOEXEC);
+        loop->_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->_epoll < 0 || loop->_wakeup < 0)
+        {
+            Log::syserror("Failed to create the epoll set of a socket loop.");
+            throw std::runtime_error("Failed to create the epoll set of a socket loop.");
+        }
+
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = loop->_wakeup;
+        epoll_ctl(loop->_epoll, EPOLL_CTL_ADD, loop->_wakeup, &event);
+
+        _loops.push_back(std::move(loop));
+    }
+
+    for (size_t i = 0; i < _loops.size(); ++i)
+    {
+        Loop& loop = *_loops[i];
+        loop._thread = std::thread([this, &loop, i]() { poll(loop, i); });
+    }
+}
+
+SocketPoll::~SocketPoll()
+{
+    stop();
+
+    for (auto& loop : _loops)
+    {
+        close(loop->_wakeup);
+        close(loop->_epoll);
+    }
+}
+
+SocketPoll& SocketPoll::get()
+{
+    static SocketPoll poll(std::max(std::thread::hardware_concurrency(), 1U), "wsd_poll");
+    return poll;
+}
+
+void SocketPoll::add(const std::shared_ptr<WebSocket>& ws,
+                     const std::shared_ptr<LOOLSession>& session, Handler handler,
+                     std::function<void()> closeFrame, std::function<void()> finish)
+{
+    auto entry = std::make_shared<Entry>();
+    entry->_ws = ws;
+    entry->_session = session;
+    entry->_handler = handler;
+    entry->_closeFrame = closeFrame;
+    entry->_finish = finish;
+
+    if (_stop)
+    {
+        this->finish(entry);
+        return;
+    }
+
+    // Once ready, a socket is read until it's drained, including the rest of a frame that came
+    // in part, so only a peer stalling in the middle of one for long is given up.
+    ws->setReceiveTimeout(Poco::Timespan(RECEIVE_TIMEOUT_MS * 1000));
+
+    Loop& loop = *_loops[_next++ % _loops.size()];
+    const int fd = ws->impl()->sockfd();
+    {
+        std::unique_lock<std::mutex> lock(loop._mutex);
+        loop._entries[fd] = entry;
+    }
+
+    ++_sockets;
+
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.fd = fd;
+    if (epoll_ctl(loop._epoll, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        Log::syserror("Failed to poll socket #" + std::to_string(fd) + ".");
+        {
+            std::unique_lock<std::mutex> lock(loop._mutex);
+            loop._entries.erase(fd);
+        }
+
+        --_sockets;
+        this->finish(entry);
+    }
+}
+
+void SocketPoll::remove(const std::shared_ptr<WebSocket>& ws)
+{
+    const int fd = ws->impl()->sockfd();
+    for (auto& loop : _loops)
+    {
+        std::shared_ptr<Entry> entry;
+        {
+            std::unique_lock<std::mutex> lock(loop->_mutex);
+            const auto it = loop->_entries.find(fd);
+            if (it != loop->_entries.end() && it->second->_ws == ws)
+                entry = it->second;
+        }
+
+        if (entry)
+        {
+            release(*loop, fd, entry);
+            return;
+        }
+    }
+}
+
+void SocketPoll::stop()
+{
+    if (!_stop.exchange(true))
+    {
+        for (auto& loop : _loops)
+        {
+            const uint64_t one = 1;
+            if (write(loop->_wakeup, &one, sizeof(one)) < 0)
+                Log::syserror("Failed to wake up a socket loop.");
+        }
+    }
+
+    for (auto& loop : _loops)
+    {
+        if (loop->_thread.joinable())
+            loop->_thread.join();
+    }
+
+    {
+        // The sockets being read are finished already, which ends their receive.
+        std::unique_lock<std::mutex> lock(_receivingMutex);
+        _receivingCV.wait(lock, [this]() { return _receiving == 0; });
+    }
+
+    std::unique_lock<std::mutex> lock(_finishingMutex);
+    _finishingCV.wait(lock, [this]() { return _finishing == 0; });
+}
+
+void SocketPoll::poll(Loop& loop, const size_t index)
+{
+    Util::setThreadName(_name + "_" + std::to_string(index));
+
+    const unsigned cores = std::max(std::thread::hardware_concurrency(), 1U);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(index % cores, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        Log::warn("Failed to pin socket loop #" + std::to_string(index) + " to a core.");
+
+    Log::debug("Thread started.");
+
+    epoll_event events[64];
+    while (!_stop)
+    {
+        const int count = epoll_wait(loop._epoll, events, sizeof(events) / sizeof(events[0]), -1);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            Log::syserror("epoll_wait failed.");
+            break;
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            const int fd = events[i].data.fd;
+            if (fd == loop._wakeup)
+            {
+                uint64_t value = 0;
+                if (read(loop._wakeup, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                    Log::syserror("Failed to read the wakeup of a socket loop.");
+
+                continue;
+            }
+
+            std::shared_ptr<Entry> entry;
+            {
+                std::unique_lock<std::mutex> lock(loop._mutex);
+                const auto it = loop._entries.find(fd);
+                if (it != loop._entries.end())
+                    entry = it->second;
+            }
+
+            if (entry)
+                dispatch(loop, fd, entry);
+        }
+    }
+
+    // Stopped, so the sockets left are finished.
+    std::map<int, std::shared_ptr<Entry>> entries;
+    {
+        std::unique_lock<std::mutex> lock(loop._mutex);
+        entries.swap(loop._entries);
+    }
+
+    for (const auto& pair : entries)
+    {
+        epoll_ctl(loop._epoll, EPOLL_CTL_DEL, pair.first, nullptr);
+        --_sockets;
+        finish(pair.second);
+    }
+
+    Log::debug("Thread finished.");
+}
+
+void SocketPoll::dispatch(Loop& loop, const int fd, const std::shared_ptr<Entry>& entry)
+{
+    {
+        std::unique_lock<std::mutex> lock(_receivingMutex);
+        ++_receiving;
+    }
+
+    WorkerPool::get().post([this, &loop, fd, entry]()
+        {
+            if (receive(*entry))
+            {
+                // Polled for the next message, unless it was removed meanwhile.
+                std::unique_lock<std::mutex> lock(loop._mutex);
+                const auto it = loop._entries.find(fd);
+                if (it != loop._entries.end() && it->second == entry)
+                {
+                    epoll_event event = {};
+                    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+                    event.data.fd = fd;
+                    if (epoll_ctl(loop._epoll, EPOLL_CTL_MOD, fd, &event) < 0)
+                    {
+                        Log::syserror("Failed to poll socket #" + std::to_string(fd) + " again.");
+                        lock.unlock();
+                        release(loop, fd, entry);
+                    }
+                }
+            }
+            else
+            {
+                release(loop, fd, entry);
+            }
+
+            std::unique_lock<std::mutex> lock(_receivingMutex);
+            if (--_receiving == 0)
+                _receivingCV.notify_all();
+        });
+}
+
+bool SocketPoll::receive(Entry& entry)
+{
+    try
+    {
+        const auto& senderQueue = entry._session->getSenderQueue();
+        PerMessageDeflate* deflate = (senderQueue ? senderQueue->getDeflate().get() : nullptr);
+
+        // Read on while the socket says there's more, as TLS can have buffered some that epoll
+        // can't see.
+        do
+        {
+            int flags = 0;
+            const IoUtil::Received received = IoUtil::receiveMessage(*entry._ws, entry._payload, flags,
+                                                                     deflate);
+            if (received == IoUtil::Received::Ping)
+            {
+                // Echoed as a normal frame, see IoUtil::SocketProcessor, after what's queued.
+                entry._session->sendTextFrame(std::string(entry._payload.data(), entry._payload.size()));
+                entry._payload.resize(0);
+            }
+            else if (received == IoUtil::Received::Closed)
+            {
+                entry._closeFrame();
+                Log::debug("Connection closed.");
+                return false;
+            }
+
+            if (received == IoUtil::Received::Message)
+            {
+                const bool success = entry._handler(entry._payload);
+                entry._payload.resize(0);
+                if (!success)
+                {
+                    Log::info("Socket handler flagged to finish.");
+                    return false;
+                }
+            }
+        }
+        while (entry._ws->poll(Poco::Timespan(0), Poco::Net::Socket::SELECT_READ));
+
+        return true;
+    }
+    catch (const Poco::Exception& exc)
+    {
+        Log::error("SocketPoll::receive: Exception: " + exc.message());
+    }
+    catch (const std::exception& exc)
+    {
+        Log::error("SocketPoll::receive: std::exception: " + std::string(exc.what()));
+    }
+
+    return false;
+}
+
+void SocketPoll::release(Loop& loop, const int fd, const std::shared_ptr<Entry>& entry)
+{
+    {
+        // The loop and remove() can both get here, the first one finishes it.
+        std::unique_lock<std::mutex> lock(loop._mutex);
+        const auto it = loop._entries.find(fd);
+        if (it == loop._entries.end() || it->second != entry)
+            return;
+
+        loop._entries.erase(it);
+        epoll_ctl(loop._epoll, EPOLL_CTL_DEL, fd, nullptr);
+    }
+
+    --_sockets;
+    finish(entry);
+}
+
+void SocketPoll::finish(const std::shared_ptr<Entry>& entry)
+{
+    {
+        std::unique_lock<std::mutex> lock(_finishingMutex);
+        ++_finishing;
+    }
+
+    WorkerPool::getFinishing().post([this, entry]()
+        {
+            try
+            {
+                entry->_finish();
+            }
+            catch (const std::exception& exc)
+            {
+                Log::error("SocketPoll::finish: Exception: " + std::string(exc.what()));
+            }
+
+            std::unique_lock<std::mutex> lock(_finishingMutex);
+            if (--_finishing == 0)
+                _finishingCV.notify_all();
+        });
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
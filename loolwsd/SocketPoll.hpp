@@ -0,0 +1,122 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_SOCKETPOLL_HPP
+#define INCLUDED_SOCKETPOLL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Poco/Net/WebSocket.h>
+
+class LOOLSession;
+
+/** Polls the WebSockets of wsd, so that an idle one doesn't cost a thread.
+
+Each of the loops, one per core and pinned to it, waits with epoll on the
+sockets given to it, and hands those ready to the WorkerPool. There the
+messages are read, as IoUtil::SocketProcessor does, and given to the
+handler of the socket, so a peer sending half a frame or a slow handler
+holds up no other socket. A socket isn't polled while it's being read, so
+its messages are handled one at a time and in order. A socket is polled
+until its handler returns false, it closes, it's removed, or stop() is
+called. Then its finish runs on WorkerPool::getFinishing(), as that may
+wait for saving and the like.
+*/
+class SocketPoll
+{
+public:
+    typedef std::function<bool(const std::vector<char>&)> Handler;
+
+    SocketPoll(size_t loopCount, const std::string& name);
+    ~SocketPoll();
+
+    SocketPoll(const SocketPoll&) = delete;
+    SocketPoll& operator=(const SocketPoll&) = delete;
+
+    /// The poll of this process, a loop per core.
+    static SocketPoll& get();
+
+    /// Polls ws, handing the messages to handler and calling closeFrame when it closes,
+    /// then finish once it's no longer polled. Pings are answered through the session writing
+    /// to ws, and compressed messages inflated as negotiated for its SenderQueue.
+    void add(const std::shared_ptr<Poco::Net::WebSocket>& ws,
+             const std::shared_ptr<LOOLSession>& session, Handler handler,
+             std::function<void()> closeFrame, std::function<void()> finish);
+
+    /// Stops polling ws, if it's still polled, and finishes it.
+    void remove(const std::shared_ptr<Poco::Net::WebSocket>& ws);
+
+    /// Stops polling, and waits for the finish of every socket.
+    void stop();
+
+    /// The sockets being polled.
+    size_t getSocketCount() const { return _sockets; }
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<Poco::Net::WebSocket> _ws;
+        Handler _handler;
+        std::function<void()> _closeFrame;
+        std::function<void()> _finish;
+        std::shared_ptr<LOOLSession> _session;
+        std::vector<char> _payload;
+    };
+
+    struct Loop
+    {
+        int _epoll;
+        /// An eventfd to wake the loop up.
+        int _wakeup;
+        std::mutex _mutex;
+        std::map<int, std::shared_ptr<Entry>> _entries;
+        std::thread _thread;
+    };
+
+    void poll(Loop& loop, size_t index);
+
+    /// Reads the ready socket on the WorkerPool, then polls it again or releases it.
+    void dispatch(Loop& loop, int fd, const std::shared_ptr<Entry>& entry);
+
+    /// Reads and handles the messages of a ready socket, false when it's done.
+    bool receive(Entry& entry);
+
+    /// Stops polling fd, if it's still entry, and finishes it.
+    void release(Loop& loop, int fd, const std::shared_ptr<Entry>& entry);
+
+    /// Runs the finish of the entry on the pool for finishing.
+    void finish(const std::shared_ptr<Entry>& entry);
+
+private:
+    const std::string _name;
+    std::vector<std::unique_ptr<Loop>> _loops;
+    std::atomic<size_t> _next;
+    std::atomic<bool> _stop;
+    std::atomic<size_t> _sockets;
+    /// The sockets being read on the WorkerPool.
+    size_t _receiving;
+    std::mutex _receivingMutex;
+    std::condition_variable _receivingCV;
+    /// The finishes not done yet.
+    size_t _finishing;
+    std::mutex _finishingMutex;
+    std::condition_variable _finishingCV;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
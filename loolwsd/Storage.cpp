@@ -13,6 +13,8 @@
 #include <string>
 #include <fstream>
 
+#include <Poco/DateTime.h>
+#include <Poco/DateTimeParser.h>
 #include <Poco/Net/HTTPResponse.h>
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/Net/HTTPClientSession.h>
@@ -174,7 +176,8 @@ StorageBase::FileInfo LocalStorage::getFileInfo(const Poco::URI& uri)
     const auto file = Poco::File(path);
     const auto lastModified = file.getLastModified();
     const auto size = file.getSize();
-    return FileInfo({filename, lastModified, size});
+    const auto version = std::to_string(lastModified.raw()) + "-" + std::to_string(size);
+    return FileInfo({filename, lastModified, size, version});
 }
 
 std::string LocalStorage::loadStorageFileToLocal()
@@ -267,6 +270,8 @@ StorageBase::FileInfo WopiStorage::getFileInfo(const Poco::URI& uri)
     // Parse the response.
     std::string filename;
     size_t size = 0;
+    Poco::Timestamp modifiedTime;
+    std::string version;
     std::string resMsg;
     Poco::StreamCopier::copyToString(rs, resMsg);
     Log::debug("WOPI::CheckFileInfo returned: " + resMsg);
@@ -279,10 +284,33 @@ StorageBase::FileInfo WopiStorage::getFileInfo(const Poco::URI& uri)
         const auto& object = result.extract<Poco::JSON::Object::Ptr>();
         filename = object->get("BaseFileName").toString();
         size = std::stoul (object->get("Size").toString(), nullptr, 0);
+
+        // Optional, but without any of them we can't tell whether the
+        // file changed, and the tile cache is not reused.
+        std::string lastModifiedTime;
+        if (object->has("LastModifiedTime"))
+        {
+            lastModifiedTime = object->get("LastModifiedTime").toString();
+            try
+            {
+                int tzd;
+                modifiedTime = Poco::DateTimeParser::parse(lastModifiedTime, tzd).timestamp();
+            }
+            catch (const Poco::SyntaxException&)
+            {
+                Log::warn("WOPI::CheckFileInfo returned invalid LastModifiedTime [" + lastModifiedTime + "].");
+            }
+        }
+
+        if (object->has("SHA256") && !object->get("SHA256").toString().empty())
+            version = "sha256:" + object->get("SHA256").toString();
+        else if (object->has("Version") && !object->get("Version").toString().empty())
+            version = "version:" + object->get("Version").toString();
+        else if (!lastModifiedTime.empty())
+            version = "modified:" + lastModifiedTime;
     }
 
-    // WOPI doesn't support file last modified time.
-    return FileInfo({filename, Poco::Timestamp(), size});
+    return FileInfo({filename, modifiedTime, size, version});
 }
 
 /// uri format: http://server/<...>/wopi*/files/<id>/content
@@ -384,7 +412,7 @@ StorageBase::FileInfo WebDAVStorage::getFileInfo(const Poco::URI& uri)
     Log::debug("Getting info for webdav uri [" + uri.toString() + "].");
     (void)uri;
     assert(!"Not Implemented!");
-    return FileInfo({"bazinga", Poco::Timestamp(), 0});
+    return FileInfo({"bazinga", Poco::Timestamp(), 0, ""});
 }
 
 std::string WebDAVStorage::loadStorageFileToLocal()
@@ -36,6 +36,10 @@ public:
         std::string _filename;
         Poco::Timestamp _modifiedTime;
         size_t _size;
+
+        /// Identifies the content of the file, changes whenever it's
+        /// modified. Empty when the storage doesn't tell.
+        std::string _version;
     };
 
     /// localStorePath the absolute root path of the chroot.
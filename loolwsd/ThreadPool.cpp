@@ -0,0 +1,105 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "ThreadPool.hpp"
+
+#include <exception>
+
+#include "Log.hpp"
+#include "Util.hpp"
+
+ThreadPool::ThreadPool(const size_t threadCount, const std::string& name) :
+    _stop(false)
+{
+    for (size_t i = 0; i < threadCount; ++i)
+    {
+        _threads.emplace_back([this, name]() { work(name); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+
+    _workCV.notify_all();
+    for (auto& thread : _threads)
+    {
+        thread.join();
+    }
+}
+
+void ThreadPool::run(const std::vector<Job>& jobs)
+{
+    if (jobs.empty())
+        return;
+
+    Batch batch;
+    batch._remaining = jobs.size();
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (const auto& job : jobs)
+    {
+        _queue.emplace_back(&job, &batch);
+    }
+
+    _workCV.notify_all();
+
+    // Help with whatever is queued, then wait for the jobs still running elsewhere.
+    while (batch._remaining > 0)
+    {
+        if (_queue.empty())
+        {
+            _doneCV.wait(lock);
+            continue;
+        }
+
+        const Entry entry = _queue.front();
+        _queue.pop_front();
+        runEntry(entry, lock);
+    }
+}
+
+void ThreadPool::work(const std::string& name)
+{
+    Util::setThreadName(name);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+        _workCV.wait(lock, [this]() { return _stop || !_queue.empty(); });
+        if (_queue.empty())
+            break;
+
+        const Entry entry = _queue.front();
+        _queue.pop_front();
+        runEntry(entry, lock);
+    }
+}
+
+void ThreadPool::runEntry(const Entry& entry, std::unique_lock<std::mutex>& lock)
+{
+    lock.unlock();
+    try
+    {
+        (*entry.first)();
+    }
+    catch (const std::exception& exc)
+    {
+        Log::error() << "ThreadPool::runEntry: Exception: " << exc.what() << Log::end;
+    }
+
+    lock.lock();
+    if (--entry.second->_remaining == 0)
+        _doneCV.notify_all();
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
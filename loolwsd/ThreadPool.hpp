@@ -0,0 +1,73 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_THREADPOOL_HPP
+#define INCLUDED_THREADPOOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** A fixed number of threads running batches of jobs.
+
+Used by the kit to encode the tiles of a combined render in parallel, where
+each job sends its tile when done, so the first ones go out while the
+others are still being encoded. The thread calling run() works on the
+batch too, so a pool of no threads runs everything on the caller.
+*/
+class ThreadPool
+{
+public:
+    typedef std::function<void()> Job;
+
+    /// Starts threadCount threads called name.
+    ThreadPool(size_t threadCount, const std::string& name);
+
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t getThreadCount() const { return _threads.size(); }
+
+    /// Runs the jobs, in any order and order of completion, and returns when all are done.
+    /// Exceptions thrown by a job are logged and otherwise ignored.
+    void run(const std::vector<Job>& jobs);
+
+private:
+    struct Batch
+    {
+        size_t _remaining;
+    };
+
+    typedef std::pair<const Job*, Batch*> Entry;
+
+    void work(const std::string& name);
+
+    /// Runs the job of the entry with the lock released.
+    void runEntry(const Entry& entry, std::unique_lock<std::mutex>& lock);
+
+private:
+    std::mutex _mutex;
+    /// Signalled for new jobs and stopping.
+    std::condition_variable _workCV;
+    /// Signalled when a batch is done.
+    std::condition_variable _doneCV;
+    std::deque<Entry> _queue;
+    bool _stop;
+    std::vector<std::thread> _threads;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -26,12 +26,13 @@
 #include <Poco/File.h>
 #include <Poco/Path.h>
 #include <Poco/StringTokenizer.h>
-#include <Poco/Timestamp.h>
 #include <Poco/URI.h>
 
 #include "Storage.hpp"
 #include "LOOLProtocol.hpp"
 #include "TileCache.hpp"
+#include "TileCacheAccountant.hpp"
+#include "TilePack.hpp"
 #include "Util.hpp"
 
 using Poco::DirectoryIterator;
@@ -39,11 +40,16 @@ using Poco::File;
 using Poco::FileException;
 using Poco::Path;
 using Poco::StringTokenizer;
-using Poco::Timestamp;
 using Poco::URI;
 
 using namespace LOOLProtocol;
 
+size_t TileCache::MaxMemoryBytes = 16 * 1024 * 1024;
+size_t TileCache::MaxTotalMemoryBytes = 128 * 1024 * 1024;
+std::atomic<size_t> TileCache::TotalMemoryBytes(0);
+size_t TileCache::MaxPendingBytes = 4 * 1024 * 1024;
+bool TileCache::PackTiles = false;
+
 void TileBeingRendered::subscribe(std::weak_ptr<MasterProcessSession> session)
 {
     _subscribers.push_back(session);
@@ -55,20 +61,33 @@ std::vector<std::weak_ptr<MasterProcessSession>> TileBeingRendered::getSubscribe
 }
 
 TileCache::TileCache(const std::string& docURL,
-                     const Timestamp& modifiedTime,
+                     const std::string& version,
                      const std::string& rootCacheDir) :
     _docURL(docURL),
     _rootCacheDir(rootCacheDir),
     _persCacheDir(Path(rootCacheDir, "persistent").toString()),
     _editCacheDir(Path(rootCacheDir, "editing").toString()),
+    _editGeneration(0),
     _isEditing(false),
-    _hasUnsavedChanges(false)
+    _hasUnsavedChanges(false),
+    _pendingBytes(0),
+    _isWriting(false),
+    _stopWriting(false),
+    _openTime(std::time(nullptr)),
+    _memBytes(0),
+    _memHits(0),
+    _memMisses(0),
+    _memEvictions(0)
 {
     Log::info("TileCache ctor for uri [" + _docURL + "].");
-    const bool cleanEverything = (getLastModified() < modifiedTime);
+
+    // Before touching the directory, so it isn't evicted under us.
+    TileCacheAccountant::instance().add(_rootCacheDir, this);
+
+    const bool cleanEverything = (version.empty() || getVersion() != version);
     if (cleanEverything)
     {
-        // document changed externally, clean up everything
+        // document changed externally, or we can't tell, clean up everything
         Util::removeFile(_rootCacheDir, true);
         Log::info("Completely cleared tilecache: " + _rootCacheDir);
     }
@@ -80,15 +99,58 @@ TileCache::TileCache(const std::string& docURL,
     }
 
     File(_rootCacheDir).createDirectories();
-    File(_editCacheDir).createDirectories();
+    File(cacheDirName(true)).createDirectories();
     File(_persCacheDir).createDirectories();
 
-    saveLastModified(modifiedTime);
+    if (PackTiles)
+    {
+        try
+        {
+            _editPack = std::make_shared<TilePack>(cacheDirName(true));
+            _persPack = std::make_shared<TilePack>(_persCacheDir);
+        }
+        catch (const std::exception& exc)
+        {
+            Log::error() << "TileCache: Failed to open tile packs, using files instead: "
+                         << exc.what() << Log::end;
+            _editPack.reset();
+            _persPack.reset();
+        }
+    }
+
+    saveVersion(version);
+
+    indexPersistentCache();
+
+    if (MaxPendingBytes > 0)
+        _writerThread = std::thread([this]() { writePendingTiles(); });
 }
 
 TileCache::~TileCache()
 {
-    Log::info("~TileCache dtor for uri [" + _docURL + "].");
+    Log::info() << "~TileCache dtor for uri [" << _docURL << "]. Memory hits: "
+                << _memHits << ", misses: " << _memMisses << ", evictions: "
+                << _memEvictions << ", dedup ratio: "
+                << getDedupRatio() << "." << Log::end;
+
+    // Write what's left.
+    if (_writerThread.joinable())
+    {
+        {
+            std::unique_lock<std::mutex> lock(_pendingMutex);
+            _stopWriting = true;
+        }
+
+        _pendingCV.notify_all();
+        _writerThread.join();
+    }
+
+    if (_promotionThread.joinable())
+        _promotionThread.join();
+
+    TileCacheAccountant::instance().remove(_rootCacheDir);
+
+    TotalMemoryBytes -= _memBytes;
 #if 0
     auto lock = getTilesBeingRenderedLock();
     _tilesBeingRendered.clear();
@@ -130,38 +192,81 @@ void TileCache::forgetTileBeingRendered(int part, int width, int height, int til
     _tilesBeingRendered.erase(cachedName);
 }
 
-std::unique_ptr<std::fstream> TileCache::lookupTile(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight)
+TileCache::Tile TileCache::lookupTile(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight)
 {
     const std::string cachedName = cacheFileName(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
+    const TileKey key(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
+    touchZoom(key);
+
+    Tile tile = lookupMemory(cachedName);
+    if (tile)
+    {
+        ++_memHits;
+        return tile;
+    }
+
+    ++_memMisses;
 
     if (_hasUnsavedChanges)
     {
         // Try the Editing cache first.
-        Path path(_editCacheDir, cachedName);
-        const std::string fileName = path.toString();
-        std::unique_ptr<std::fstream> result(new std::fstream(fileName, std::ios::in));
-        if (result && result->is_open())
+        tile = readTile(true, key, cachedName);
+        if (tile)
         {
-            Log::trace("Found editing tile: " + fileName);
-            return result;
+            Log::trace("Found editing tile: " + cachedName);
+            storeMemory(cachedName, tile);
+            return tile;
         }
     }
 
     // Skip tiles scheduled for removal from the Persistent cache (on save)
-    if (_toBeRemoved.find(cachedName) != _toBeRemoved.end())
+    bool inFrozen = false;
+    bool removedByFrozen = false;
+    std::string frozenDir;
+    std::shared_ptr<TilePack> frozenPack;
+    {
+        std::unique_lock<std::mutex> lock(_cacheMutex);
+        if (_toBeRemoved.find(cachedName) != _toBeRemoved.end())
+        {
+            Log::trace("Skipping perishable tile: " + cachedName);
+            return nullptr;
+        }
+
+        if (_frozen)
+        {
+            inFrozen = _frozen->_index.contains(key);
+            removedByFrozen = (_frozen->_toBeRemoved.find(cachedName) != _frozen->_toBeRemoved.end());
+            frozenDir = _frozen->_dir;
+            frozenPack = _frozen->_pack;
+        }
+    }
+
+    // Then the saved generation that is being promoted.
+    if (inFrozen)
+    {
+        tile = readTile(frozenDir, frozenPack.get(), key, cachedName);
+        if (tile)
+        {
+            Log::trace("Found saved tile: " + cachedName);
+            storeMemory(cachedName, tile);
+            return tile;
+        }
+
+        // Otherwise it was moved to the Persistent cache meanwhile.
+    }
+    else if (removedByFrozen)
     {
         Log::trace("Skipping perishable tile: " + cachedName);
         return nullptr;
     }
 
     // Default to the content of the Persistent cache.
-    Path path(_persCacheDir, cachedName);
-    const std::string fileName = path.toString();
-    std::unique_ptr<std::fstream> result(new std::fstream(fileName, std::ios::in));
-    if (result && result->is_open())
+    tile = readTile(false, key, cachedName);
+    if (tile)
     {
-        Log::trace("Found persistent tile: " + fileName);
-        return result;
+        Log::trace("Found persistent tile: " + cachedName);
+        storeMemory(cachedName, tile);
+        return tile;
     }
 
     return nullptr;
@@ -174,16 +279,55 @@ void TileCache::saveTile(int part, int width, int height, int tilePosX, int tile
         _hasUnsavedChanges = true;
     }
 
-    const std::string dirName = cacheDirName(_hasUnsavedChanges);
+    const std::string cachedName = cacheFileName(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
 
-    const std::string fileName = dirName + "/" + cacheFileName(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
-    Log::trace() << "Saving "
-                 << (_hasUnsavedChanges ? "editing" : "persistent") <<
-                 " tile: " << fileName << Log::end;
+    const TileKey key(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
+    touchZoom(key);
 
-    std::fstream outStream(fileName, std::ios::out);
-    outStream.write(data, size);
-    outStream.close();
+    const Tile tile = std::make_shared<TileMessage>(key, data, size);
+    const bool queued = _writerThread.joinable();
+    if (queued)
+        waitForPendingRoom(tile->size());
+
+    // Only index and keep in memory what lookupTile() would find on disk.
+    bool live = true;
+    {
+        // Written to the generation it's indexed in, and before that's promoted, as
+        // documentSaved() flushes the tiles queued until it starts the next one.
+        std::unique_lock<std::mutex> lock(_cacheMutex);
+        const std::string dirName = cacheDirName(_hasUnsavedChanges);
+        const std::shared_ptr<TilePack> pack = (_hasUnsavedChanges ? std::atomic_load(&_editPack) : _persPack);
+        Log::trace() << "Saving "
+                     << (_hasUnsavedChanges ? "editing" : "persistent") <<
+                     " tile: " << dirName << "/" << cachedName << Log::end;
+
+        if (queued)
+            queueTile(dirName, pack, key, cachedName, tile);
+        else
+            writeTile(dirName, pack.get(), key, cachedName, data, size);
+
+        if (_hasUnsavedChanges)
+        {
+            _editIndex.add(key);
+        }
+        else if (_toBeRemoved.find(cachedName) == _toBeRemoved.end())
+        {
+            _persIndex.add(key);
+        }
+        else
+        {
+            live = false;
+        }
+    }
+
+    if (live)
+    {
+        storeMemory(cachedName, tile);
+    }
+    else
+    {
+        removeMemory(cachedName);
+    }
 }
 
 std::string TileCache::getTextFile(std::string fileName)
@@ -194,7 +338,7 @@ std::string TileCache::getTextFile(std::string fileName)
     if (_hasUnsavedChanges)
     {
         // try the Editing cache first, and prefer it if it exists
-        const std::string editingDirName = _editCacheDir;
+        const std::string editingDirName = cacheDirName(true);
         File dir(editingDirName);
 
         File text(editingDirName + textFile);
@@ -202,6 +346,20 @@ std::string TileCache::getTextFile(std::string fileName)
             dirName = editingDirName;
     }
 
+    if (dirName == _persCacheDir)
+    {
+        // then the saved generation that is being promoted
+        std::string frozenDirName;
+        {
+            std::unique_lock<std::mutex> lock(_cacheMutex);
+            if (_frozen)
+                frozenDirName = _frozen->_dir;
+        }
+
+        if (!frozenDirName.empty() && File(frozenDirName + textFile).exists())
+            dirName = frozenDirName;
+    }
+
     if (!File(dirName).exists() || !File(dirName).isDirectory())
     {
         return "";
@@ -228,40 +386,182 @@ std::string TileCache::getTextFile(std::string fileName)
     return std::string(result.data(), result.size());
 }
 
-void TileCache::documentSaved()
+void TileCache::documentSaved(const std::string& version)
 {
     Log::debug("Persisting editing tiles.");
 
-    // first remove the invalidated tiles from the Persistent cache
-    for (const auto& it : _toBeRemoved)
+    // One generation is promoted at a time, the previous one is normally long done.
+    if (_promotionThread.joinable())
+        _promotionThread.join();
+
+    // Start the next generation of the Editing cache.
+    const unsigned nextGeneration = _editGeneration + 1;
+    const std::string nextDir = _editCacheDir + "/" + std::to_string(nextGeneration);
+    std::shared_ptr<TilePack> nextPack;
+    try
     {
-        Util::removeFile(_persCacheDir + "/" + it);
+        File(nextDir).createDirectories();
+        if (_persPack)
+            nextPack = std::make_shared<TilePack>(nextDir);
+    }
+    catch (const std::exception& exc)
+    {
+        Log::error() << "TileCache::documentSaved: Failed to create [" << nextDir << "]: "
+                     << exc.what() << Log::end;
     }
 
-    _toBeRemoved.clear();
+    std::unique_ptr<Generation> generation(new Generation());
 
-    // then move the new tiles from the Editing cache to Persistent
-    try
+    std::unique_lock<std::mutex> lock(_cacheMutex);
+
+    generation->_dir = cacheDirName(true);
+    generation->_pack = std::atomic_load(&_editPack);
+    generation->_index.swap(_editIndex);
+    generation->_toBeRemoved.swap(_toBeRemoved);
+    generation->_version = version;
+    _frozen = std::move(generation);
+
+    std::atomic_store(&_editPack, nextPack);
+    _editGeneration = nextGeneration;
+
+    // update status
+    _hasUnsavedChanges = false;
+
+    // The Persistent cache is of neither version until promoted, and is
+    // thrown away if we don't get that far.
+    Util::removeFile(_rootCacheDir + "/version.txt");
+
+    lock.unlock();
+
+    // The saved generation must be complete on disk. No more tiles are queued for it, as
+    // they're queued with the cache locked.
+    flushTiles();
+
+    _promotionThread = std::thread([this]() { promoteGeneration(); });
+}
+
+void TileCache::promoteGeneration()
+{
+    Util::setThreadName("tile_promotion");
+
+    // Only invalidation changes the generation, and only its index.
+    Generation* generation;
+    std::vector<TileKey> tiles;
     {
         std::unique_lock<std::mutex> lock(_cacheMutex);
-        for (auto tileIterator = DirectoryIterator(_editCacheDir); tileIterator != DirectoryIterator(); ++tileIterator)
+        generation = _frozen.get();
+        if (generation == nullptr)
+            return;
+
+        tiles = generation->_index.all();
+    }
+
+    Log::debug() << "Promoting " << tiles.size() << " tiles from " << generation->_dir << Log::end;
+
+    // first remove the invalidated tiles from the Persistent cache
+    for (const auto& it : generation->_toBeRemoved)
+    {
+        int part, width, height, tilePosX, tilePosY, tileWidth, tileHeight;
+        if (parseCacheFileName(it, part, width, height, tilePosX, tilePosY, tileWidth, tileHeight))
         {
-            tileIterator->moveTo(_persCacheDir);
+            eraseTile(false, TileKey(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight), it);
         }
+    }
 
-        // update status
-        _hasUnsavedChanges = false;
+    // then copy the new tiles to Persistent
+    std::vector<TileKey> failed;
+    if (generation->_pack && _persPack)
+    {
+        if (!_persPack->merge(*generation->_pack))
+        {
+            // Some may have made it, but don't trust any.
+            for (const auto& key : tiles)
+            {
+                _persPack->remove(key);
+            }
+
+            failed = tiles;
+        }
+    }
+    else
+    {
+        for (const auto& key : tiles)
+        {
+            const std::string cachedName = cacheFileName(key);
+            if (!generation->_pack && !_persPack)
+            {
+                try
+                {
+                    File(generation->_dir + "/" + cachedName).moveTo(_persCacheDir);
+                }
+                catch (const Poco::Exception& exc)
+                {
+                    Log::warn("Failed to promote tile " + cachedName + ": " + exc.displayText());
+                    failed.push_back(key);
+                }
+            }
+            else
+            {
+                // Only one of them is a pack.
+                const Tile tile = readTile(generation->_dir, generation->_pack.get(), key, cachedName);
+                if (tile)
+                    writeTile(false, key, cachedName, tile->getTileData(), tile->getTileSize());
+                else
+                    failed.push_back(key);
+            }
+        }
+    }
 
-        // FIXME should we take the exact time of the file for the local files?
-        saveLastModified(Timestamp());
+    // and the rest, like the text files
+    try
+    {
+        for (auto tileIterator = DirectoryIterator(generation->_dir); tileIterator != DirectoryIterator(); ++tileIterator)
+        {
+            int part, width, height, tilePosX, tilePosY, tileWidth, tileHeight;
+            const std::string fileName = tileIterator.name();
+            if (!TilePack::isPackFile(fileName) &&
+                !parseCacheFileName(fileName, part, width, height, tilePosX, tilePosY, tileWidth, tileHeight))
+            {
+                tileIterator->moveTo(_persCacheDir);
+            }
+        }
     }
     catch (const FileException& exc)
     {
         // Just log this exception, ignore it otherwise
-        Log::error() << "TileCache::documentSaved: Exception: " << exc.displayText()
+        Log::error() << "TileCache::promoteGeneration: Exception: " << exc.displayText()
                      << (exc.nested() ? " (" + exc.nested()->displayText() + ")" : "")
                      << Log::end;
     }
+
+    // Switch the readers over to the Persistent cache.
+    std::unique_ptr<Generation> superseded;
+    {
+        std::unique_lock<std::mutex> lock(_cacheMutex);
+        for (const auto& key : failed)
+        {
+            generation->_index.remove(key);
+        }
+
+        _persIndex.merge(generation->_index);
+        superseded = std::move(_frozen);
+    }
+
+    saveVersion(superseded->_version);
+
+    for (const auto& key : failed)
+    {
+        removeMemory(cacheFileName(key));
+    }
+
+    // Nothing looks into it anymore, except lookups that started before the
+    // switch, which are fine with the files gone.
+    const std::string dirName = superseded->_dir;
+    superseded.reset();
+    Util::removeFile(dirName, true);
+
+    Log::debug() << "Promoted " << tiles.size() - failed.size() << " tiles, failed "
+                 << failed.size() << ", removed " << dirName << Log::end;
 }
 
 void TileCache::setEditing(bool editing)
@@ -321,34 +621,59 @@ void TileCache::invalidateTiles(int part, int x, int y, int width, int height)
                  << ", width: " << width
                  << ", height: " << height << Log::end;
 
-    // in the Editing cache, remove immediately
-    File editingDir(_editCacheDir);
-    if (editingDir.exists() && editingDir.isDirectory())
+    std::vector<TileKey> editing;
+    std::vector<TileKey> frozen;
+    std::vector<TileKey> persistent;
     {
         std::unique_lock<std::mutex> lock(_cacheMutex);
-        for (auto tileIterator = DirectoryIterator(editingDir); tileIterator != DirectoryIterator(); ++tileIterator)
+
+        // in the Editing cache, remove immediately
+        editing = _editIndex.intersecting(part, x, y, width, height);
+        for (const auto& key : editing)
         {
-            const std::string fileName = tileIterator.path().getFileName();
-            if (intersectsTile(fileName, part, x, y, width, height))
-            {
-                Util::removeFile(tileIterator.path());
-            }
+            _editIndex.remove(key);
+            eraseTile(true, key, cacheFileName(key));
         }
-    }
 
-    // in the Persistent cache, add to _toBeRemoved for removal on save
-    File persistentDir(_persCacheDir);
-    if (persistentDir.exists() && persistentDir.isDirectory())
-    {
-        for (auto tileIterator = DirectoryIterator(persistentDir); tileIterator != DirectoryIterator(); ++tileIterator)
+        // in the saved generation, which will end up in the Persistent cache
+        // regardless, add to _toBeRemoved for removal on the next save
+        if (_frozen)
         {
-            const std::string fileName = tileIterator.path().getFileName();
-            if (_toBeRemoved.find(fileName) == _toBeRemoved.end() && intersectsTile(fileName, part, x, y, width, height))
+            frozen = _frozen->_index.intersecting(part, x, y, width, height);
+            for (const auto& key : frozen)
             {
-                _toBeRemoved.insert(fileName);
+                _frozen->_index.remove(key);
+                _toBeRemoved.insert(cacheFileName(key));
             }
         }
+
+        // in the Persistent cache, add to _toBeRemoved for removal on save
+        persistent = _persIndex.intersecting(part, x, y, width, height);
+        for (const auto& key : persistent)
+        {
+            _persIndex.remove(key);
+            _toBeRemoved.insert(cacheFileName(key));
+        }
+    }
+
+    // in memory, forget them regardless of where they came from
+    for (const auto& key : editing)
+    {
+        removeMemory(cacheFileName(key));
+    }
+
+    for (const auto& key : frozen)
+    {
+        removeMemory(cacheFileName(key));
+    }
+
+    for (const auto& key : persistent)
+    {
+        removeMemory(cacheFileName(key));
     }
+
+    Log::trace() << "Invalidated " << editing.size() << " editing, " << frozen.size()
+                 << " saved and " << persistent.size() << " persistent tiles." << Log::end;
 }
 
 void TileCache::invalidateTiles(const std::string& tiles)
@@ -382,13 +707,390 @@ void TileCache::invalidateTiles(const std::string& tiles)
 void TileCache::removeFile(const std::string fileName)
 {
     Log::warn("Removing tile: " + fileName);
-    Util::removeFile(_persCacheDir + "/" + fileName);
-    Util::removeFile(_editCacheDir + "/" + fileName);
+
+    int part, width, height, tilePosX, tilePosY, tileWidth, tileHeight;
+    if (parseCacheFileName(fileName, part, width, height, tilePosX, tilePosY, tileWidth, tileHeight))
+    {
+        const TileKey key(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
+        {
+            std::unique_lock<std::mutex> lock(_cacheMutex);
+            _editIndex.remove(key);
+            _persIndex.remove(key);
+
+            // It will still be promoted, so remove it on the next save.
+            if (_frozen && _frozen->_index.remove(key))
+                _toBeRemoved.insert(fileName);
+        }
+
+        eraseTile(true, key, fileName);
+        eraseTile(false, key, fileName);
+    }
+    else
+    {
+        Util::removeFile(_persCacheDir + "/" + fileName);
+        Util::removeFile(cacheDirName(true) + "/" + fileName);
+    }
+
+    removeMemory(fileName);
+}
+
+size_t TileCache::evictZoomLevels(const std::time_t unusedSince)
+{
+    std::set<TileIndex::Zoom> zooms;
+    {
+        std::unique_lock<std::mutex> lock(_cacheMutex);
+        zooms = _persIndex.getZooms();
+        const auto editZooms = _editIndex.getZooms();
+        zooms.insert(editZooms.begin(), editZooms.end());
+    }
+
+    std::vector<TileIndex::Zoom> stale;
+    {
+        std::unique_lock<std::mutex> lock(_zoomMutex);
+        for (const auto& zoom : zooms)
+        {
+            const auto it = _zoomLastUsed.find(zoom);
+            if ((it != _zoomLastUsed.end() ? it->second : _openTime) < unusedSince)
+                stale.push_back(zoom);
+        }
+    }
+
+    std::vector<TileKey> evicted;
+    {
+        std::unique_lock<std::mutex> lock(_cacheMutex);
+
+        // A saved generation would bring them back, try again next time.
+        if (_frozen)
+            return 0;
+
+        for (const auto& zoom : stale)
+        {
+            for (const auto& key : _editIndex.removeZoom(zoom))
+            {
+                eraseTile(true, key, cacheFileName(key));
+                evicted.push_back(key);
+            }
+
+            for (const auto& key : _persIndex.removeZoom(zoom))
+            {
+                eraseTile(false, key, cacheFileName(key));
+                evicted.push_back(key);
+            }
+        }
+    }
+
+    for (const auto& key : evicted)
+    {
+        removeMemory(cacheFileName(key));
+    }
+
+    if (!evicted.empty())
+    {
+        Log::debug() << "Evicted " << evicted.size() << " tiles of " << stale.size()
+                     << " unused zoom levels from " << _rootCacheDir << Log::end;
+    }
+
+    return evicted.size();
+}
+
+size_t TileCache::getMemoryBytes()
+{
+    std::unique_lock<std::mutex> lock(_memMutex);
+    return _memBytes;
+}
+
+void TileCache::touchZoom(const TileKey& key)
+{
+    const std::time_t now = std::time(nullptr);
+
+    std::unique_lock<std::mutex> lock(_zoomMutex);
+    _zoomLastUsed[TileIndex::getZoom(key)] = now;
+}
+
+void TileCache::waitForPendingRoom(const size_t size)
+{
+    // Hold up the sender while too much is waiting for the disk.
+    std::unique_lock<std::mutex> lock(_pendingMutex);
+    _pendingCV.wait(lock, [&]() { return _pendingBytes + size <= MaxPendingBytes || _pendingQueue.empty(); });
+}
+
+void TileCache::queueTile(const std::string& dirName, const std::shared_ptr<TilePack>& pack,
+                          const TileKey& key, const std::string& cachedName, const Tile& tile)
+{
+    const auto id = std::make_pair(dirName, cachedName);
+
+    std::unique_lock<std::mutex> lock(_pendingMutex);
+
+    auto it = _pendingTiles.find(id);
+    if (it != _pendingTiles.end())
+    {
+        // Not written yet, so just write the newer one instead.
+        _pendingBytes -= it->second._tile->size();
+        it->second._tile = tile;
+    }
+    else
+    {
+        _pendingTiles.emplace(id, PendingTile(key, tile, pack));
+        _pendingQueue.push_back(id);
+    }
+
+    _pendingBytes += tile->size();
+    _pendingCV.notify_all();
+}
+
+void TileCache::writePendingTiles()
+{
+    Util::setThreadName("tile_writer");
+
+    std::unique_lock<std::mutex> lock(_pendingMutex);
+    while (true)
+    {
+        _pendingCV.wait(lock, [this]() { return !_pendingQueue.empty() || _stopWriting; });
+        if (_pendingQueue.empty())
+            break;
+
+        const auto id = _pendingQueue.front();
+        _pendingQueue.pop_front();
+
+        const auto it = _pendingTiles.find(id);
+        if (it == _pendingTiles.end())
+        {
+            // Erased meanwhile.
+            continue;
+        }
+
+        // Keep it pending until written, so lookups find it meanwhile.
+        const PendingTile pending = it->second;
+        _isWriting = true;
+        lock.unlock();
+
+        writeTile(id.first, pending._pack.get(), pending._key, id.second,
+                  pending._tile->getTileData(), pending._tile->getTileSize());
+
+        lock.lock();
+        if (_pendingTiles.find(id) == _pendingTiles.end())
+        {
+            // Erased while we were writing, don't let it come back. Erasing doesn't wait for
+            // us, as it's done with the cache locked.
+            lock.unlock();
+            removeTile(id.first, pending._pack.get(), pending._key, id.second);
+            lock.lock();
+        }
+
+        _isWriting = false;
+
+        const auto written = _pendingTiles.find(id);
+        if (written != _pendingTiles.end())
+        {
+            if (written->second._tile == pending._tile)
+            {
+                _pendingBytes -= pending._tile->size();
+                _pendingTiles.erase(written);
+            }
+            else
+            {
+                // Saved again while we were writing.
+                _pendingQueue.push_back(id);
+            }
+        }
+
+        _pendingCV.notify_all();
+    }
+
+    Log::debug("Tile writer for " + _rootCacheDir + " finished.");
+}
+
+void TileCache::flushTiles()
+{
+    std::unique_lock<std::mutex> lock(_pendingMutex);
+    _pendingCV.wait(lock, [this]() { return _pendingQueue.empty() && !_isWriting; });
+}
+
+double TileCache::getDedupRatio()
+{
+    size_t tileBytes = 0;
+    size_t liveBytes = 0;
+    for (const auto& pack : { std::atomic_load(&_editPack), _persPack })
+    {
+        if (pack)
+        {
+            tileBytes += pack->getTileBytes();
+            liveBytes += pack->getLiveBytes();
+        }
+    }
+
+    return (liveBytes > 0 ? static_cast<double>(tileBytes) / liveBytes : 1.0);
+}
+
+TileCache::Tile TileCache::loadTile(const TileKey& key, const std::string& fileName)
+{
+    std::fstream tileStream(fileName, std::ios::in);
+    if (!tileStream.is_open())
+        return nullptr;
+
+    tileStream.seekg(0, std::ios_base::end);
+    const std::streamsize size = tileStream.tellg();
+    auto tile = std::make_shared<TileMessage>(key, size);
+    tileStream.seekg(0, std::ios_base::beg);
+    tileStream.read(tile->getPngData(), size);
+    tileStream.close();
+
+    // Not a PNG but the color of a tile of a single color.
+    if (TileMessage::isColor(tile->getPngData(), size))
+        return std::make_shared<TileMessage>(key, tile->getPngData(), size);
+
+    return tile;
+}
+
+TileCache::Tile TileCache::readTile(const std::string& dirName, TilePack* pack, const TileKey& key, const std::string& cachedName)
+{
+    if (pack)
+    {
+        const auto data = pack->get(key);
+        return (data ? std::make_shared<TileMessage>(key, data->data(), data->size()) : nullptr);
+    }
+
+    return loadTile(key, Path(dirName, cachedName).toString());
+}
+
+TileCache::Tile TileCache::readTile(const bool editing, const TileKey& key, const std::string& cachedName)
+{
+    {
+        std::unique_lock<std::mutex> lock(_pendingMutex);
+        const auto it = _pendingTiles.find(std::make_pair(cacheDirName(editing), cachedName));
+        if (it != _pendingTiles.end())
+            return it->second._tile;
+    }
+
+    const std::shared_ptr<TilePack> pack = (editing ? std::atomic_load(&_editPack) : _persPack);
+    return readTile(cacheDirName(editing), pack.get(), key, cachedName);
+}
+
+void TileCache::writeTile(const bool editing, const TileKey& key, const std::string& cachedName, const char *data, size_t size)
+{
+    const std::shared_ptr<TilePack> pack = (editing ? std::atomic_load(&_editPack) : _persPack);
+    writeTile(cacheDirName(editing), pack.get(), key, cachedName, data, size);
+}
+
+void TileCache::writeTile(const std::string& dirName, TilePack* pack, const TileKey& key, const std::string& cachedName, const char *data, size_t size)
+{
+    if (pack)
+    {
+        pack->put(key, data, size);
+        return;
+    }
+
+    std::fstream outStream(dirName + "/" + cachedName, std::ios::out);
+    outStream.write(data, size);
+    outStream.close();
+}
+
+void TileCache::eraseTile(const bool editing, const TileKey& key, const std::string& cachedName)
+{
+    {
+        // If it's being written right now, the writer removes it when done.
+        std::unique_lock<std::mutex> lock(_pendingMutex);
+        const auto it = _pendingTiles.find(std::make_pair(cacheDirName(editing), cachedName));
+        if (it != _pendingTiles.end())
+        {
+            _pendingBytes -= it->second._tile->size();
+            _pendingTiles.erase(it);
+            _pendingCV.notify_all();
+        }
+    }
+
+    removeTile(editing, key, cachedName);
+}
+
+void TileCache::removeTile(const bool editing, const TileKey& key, const std::string& cachedName)
+{
+    const std::shared_ptr<TilePack> pack = (editing ? std::atomic_load(&_editPack) : _persPack);
+    removeTile(cacheDirName(editing), pack.get(), key, cachedName);
+}
+
+void TileCache::removeTile(const std::string& dirName, TilePack* pack, const TileKey& key, const std::string& cachedName)
+{
+    if (pack)
+    {
+        pack->remove(key);
+        return;
+    }
+
+    Util::removeFile(dirName + "/" + cachedName);
+}
+
+TileCache::Tile TileCache::lookupMemory(const std::string& cachedName)
+{
+    std::unique_lock<std::mutex> lock(_memMutex);
+
+    auto it = _memIndex.find(cachedName);
+    if (it == _memIndex.end())
+        return nullptr;
+
+    // Mark as the most recently used.
+    _memTiles.splice(_memTiles.begin(), _memTiles, it->second);
+    return it->second->second;
+}
+
+void TileCache::storeMemory(const std::string& cachedName, const Tile& tile)
+{
+    if (MaxMemoryBytes == 0 || tile->size() > MaxMemoryBytes)
+    {
+        removeMemory(cachedName);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_memMutex);
+
+    auto it = _memIndex.find(cachedName);
+    if (it != _memIndex.end())
+    {
+        _memBytes -= it->second->second->size();
+        TotalMemoryBytes -= it->second->second->size();
+        _memTiles.erase(it->second);
+    }
+
+    _memTiles.emplace_front(cachedName, tile);
+    _memIndex[cachedName] = _memTiles.begin();
+    _memBytes += tile->size();
+    TotalMemoryBytes += tile->size();
+
+    trimMemory();
+}
+
+void TileCache::removeMemory(const std::string& cachedName)
+{
+    std::unique_lock<std::mutex> lock(_memMutex);
+
+    auto it = _memIndex.find(cachedName);
+    if (it != _memIndex.end())
+    {
+        _memBytes -= it->second->second->size();
+        TotalMemoryBytes -= it->second->second->size();
+        _memTiles.erase(it->second);
+        _memIndex.erase(it);
+    }
+}
+
+void TileCache::trimMemory()
+{
+    // We can only evict our own tiles, so when over the global budget
+    // the document that is adding tiles is the one that pays for it.
+    while (!_memTiles.empty() &&
+           (_memBytes > MaxMemoryBytes || TotalMemoryBytes > MaxTotalMemoryBytes))
+    {
+        const auto& victim = _memTiles.back();
+        _memBytes -= victim.second->size();
+        TotalMemoryBytes -= victim.second->size();
+        _memIndex.erase(victim.first);
+        _memTiles.pop_back();
+        ++_memEvictions;
+    }
 }
 
 std::string TileCache::cacheDirName(const bool useEditingCache)
 {
-    return (useEditingCache ? _editCacheDir : _persCacheDir);
+    return (useEditingCache ? _editCacheDir + "/" + std::to_string(_editGeneration) : _persCacheDir);
 }
 
 std::string TileCache::cacheFileName(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight)
@@ -400,50 +1102,96 @@ std::string TileCache::cacheFileName(int part, int width, int height, int tilePo
     return oss.str();
 }
 
+std::string TileCache::cacheFileName(const TileKey& key)
+{
+    return cacheFileName(key._part, key._width, key._height, key._tilePosX, key._tilePosY, key._tileWidth, key._tileHeight);
+}
+
 bool TileCache::parseCacheFileName(const std::string& fileName, int& part, int& width, int& height, int& tilePosX, int& tilePosY, int& tileWidth, int& tileHeight)
 {
     return (std::sscanf(fileName.c_str(), "%d_%dx%d.%d,%d.%dx%d.png", &part, &width, &height, &tilePosX, &tilePosY, &tileWidth, &tileHeight) == 7);
 }
 
-bool TileCache::intersectsTile(const std::string& fileName, int part, int x, int y, int width, int height)
+void TileCache::indexPersistentCache()
 {
-    int tilePart, tilePixelWidth, tilePixelHeight, tilePosX, tilePosY, tileWidth, tileHeight;
-    if (parseCacheFileName(fileName, tilePart, tilePixelWidth, tilePixelHeight, tilePosX, tilePosY, tileWidth, tileHeight))
+    std::unique_lock<std::mutex> lock(_cacheMutex);
+
+    _persIndex.clear();
+    if (_persPack)
+    {
+        for (const auto& key : _persPack->keys())
+        {
+            _persIndex.add(key);
+        }
+    }
+
+    try
     {
-        if (part != -1 && tilePart != part)
-            return false;
+        // Files left over from the other storage, when PackTiles was changed.
+        std::vector<std::string> stale;
 
-        const int left = std::max(x, tilePosX);
-        const int right = std::min(x + width, tilePosX + tileWidth);
-        const int top = std::max(y, tilePosY);
-        const int bottom = std::min(y + height, tilePosY + tileHeight);
+        for (auto tileIterator = DirectoryIterator(_persCacheDir); tileIterator != DirectoryIterator(); ++tileIterator)
+        {
+            const std::string fileName = tileIterator.name();
+            int part, width, height, tilePosX, tilePosY, tileWidth, tileHeight;
+            if (parseCacheFileName(fileName, part, width, height, tilePosX, tilePosY, tileWidth, tileHeight))
+            {
+                if (_persPack)
+                    stale.push_back(fileName);
+                else
+                    _persIndex.add(TileKey(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight));
+            }
+            else if (!_persPack && TilePack::isPackFile(fileName))
+            {
+                stale.push_back(fileName);
+            }
+        }
 
-        if (left <= right && top <= bottom)
-            return true;
+        for (const auto& fileName : stale)
+        {
+            Util::removeFile(_persCacheDir + "/" + fileName);
+        }
+    }
+    catch (const FileException& exc)
+    {
+        Log::error() << "TileCache::indexPersistentCache: Exception: " << exc.displayText()
+                     << (exc.nested() ? " (" + exc.nested()->displayText() + ")" : "")
+                     << Log::end;
     }
 
-    return false;
+    Log::info() << "Indexed " << _persIndex.size() << " persistent tiles in " << _persCacheDir << Log::end;
 }
 
-Timestamp TileCache::getLastModified()
+void TileCache::setPasswordProtected()
 {
-    std::fstream modTimeFile(_rootCacheDir + "/modtime.txt", std::ios::in);
+    // Next to the version, as it's about the document rather than about its tiles.
+    File(_rootCacheDir + "/passwordprotected.txt").createFile();
+}
 
-    if (!modTimeFile.is_open())
-        return 0;
+bool TileCache::isPasswordProtected()
+{
+    return File(_rootCacheDir + "/passwordprotected.txt").exists();
+}
+
+std::string TileCache::getVersion()
+{
+    std::fstream versionFile(_rootCacheDir + "/version.txt", std::ios::in);
+
+    if (!versionFile.is_open())
+        return "";
 
-    Timestamp::TimeVal result;
-    modTimeFile >> result;
+    std::string result;
+    std::getline(versionFile, result);
 
-    modTimeFile.close();
+    versionFile.close();
     return result;
 }
 
-void TileCache::saveLastModified(const Timestamp& timestamp)
+void TileCache::saveVersion(const std::string& version)
 {
-    std::fstream modTimeFile(_rootCacheDir + "/modtime.txt", std::ios::out);
-    modTimeFile << timestamp.raw() << std::endl;
-    modTimeFile.close();
+    std::fstream versionFile(_rootCacheDir + "/version.txt", std::ios::out);
+    versionFile << version << std::endl;
+    versionFile.close();
 }
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
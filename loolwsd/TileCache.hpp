@@ -10,13 +10,23 @@
 #ifndef INCLUDED_TILECACHE_HPP
 #define INCLUDED_TILECACHE_HPP
 
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
 #include <fstream>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
-#include <Poco/Timestamp.h>
+#include "TileIndex.hpp"
+#include "TileMessage.hpp"
 
 /** Handles the cache for tiles of one document.
 
@@ -26,9 +36,33 @@ The cache consists of 2 cache directories:
   * editing - that represents the document in the current state (with edits)
 
 The editing cache is cleared on startup, and copied to the persistent on each save.
+
+Each save starts a new generation of the editing cache, and promotes the
+previous one to the persistent cache in the background. Until that is done,
+lookups consult the saved generation before the persistent cache, so the save
+itself is only a swap of pointers for readers. The superseded generation is
+then removed.
+
+Saved tiles are written to disk in the background, so that they reach the
+clients first. Until then lookups find them in the queue of pending writes,
+which is flushed before each save and when the cache is closed.
+
+In front of both sits a bounded in-memory LRU of recently served tiles,
+which always holds what a lookup in the two directories would return. The
+tiles are kept there as their tile: messages, ready to be sent.
+
+The tiles in both directories are also kept in a spatial index, so that
+invalidation doesn't need to list and parse every file in the cache.
+
+Optionally, the tiles of each directory are stored in a TilePack instead of
+a file per tile; text files and renderings always remain separate files.
+
+The cache is registered with the TileCacheAccountant while it exists, which
+may evict its zoom levels that are no longer viewed to save disk space.
 */
 
 class MasterProcessSession;
+class TilePack;
 
 class TileBeingRendered
 {
@@ -42,14 +76,17 @@ public:
 class TileCache
 {
 public:
-    /// When the docURL is a non-file:// url, the timestamp has to be provided by the caller.
-    /// For file:// url's, it's ignored.
-    /// When it is missing for non-file:// url, it is assumed the document must be read, and no cached value used.
-    TileCache(const std::string& docURL, const Poco::Timestamp& modifiedTime, const std::string& rootCacheDir);
+    /// The version identifies the content of the document, as given by the storage.
+    /// The cached tiles are only reused when it matches the version they were
+    /// rendered from. When it is empty, the document must be read, and no cached value used.
+    TileCache(const std::string& docURL, const std::string& version, const std::string& rootCacheDir);
     ~TileCache();
 
     TileCache(const TileCache&) = delete;
 
+    /// A tile with the header of its message, shared between the in-memory cache and readers.
+    typedef std::shared_ptr<const TileMessage> Tile;
+
     std::unique_lock<std::mutex> getTilesBeingRenderedLock();
 
     void rememberTileAsBeingRendered(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight);
@@ -58,13 +95,14 @@ public:
 
     void forgetTileBeingRendered(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight);
 
-    std::unique_ptr<std::fstream> lookupTile(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight);
+    Tile lookupTile(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight);
 
     void saveTile(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight, const char *data, size_t size);
     std::string getTextFile(std::string fileName);
 
     /// Notify the cache that the document was saved - to copy tiles from the Editing cache to Persistent.
-    void documentSaved();
+    /// The version is that of the saved document, as given by the storage.
+    void documentSaved(const std::string& version);
 
     /// Notify whether we need to use the Editing cache.
     void setEditing(bool editing);
@@ -86,27 +124,152 @@ public:
     // Removes the given file from both editing and persistent cache
     void removeFile(const std::string fileName);
 
+    /// Remembers that the document needs a password, so that it's never
+    /// shown from the cache to sessions that haven't given it.
+    void setPasswordProtected();
+    bool isPasswordProtected();
+
+    /// Removes the tiles of the zoom levels not looked up or saved since
+    /// unusedSince. Returns the number of tiles removed.
+    size_t evictZoomLevels(std::time_t unusedSince);
+
+    /// Number of tile lookups served from, and missed by, the in-memory cache.
+    size_t getMemoryHits() const { return _memHits; }
+    size_t getMemoryMisses() const { return _memMisses; }
+
+    /// Number of tiles evicted from the in-memory cache to stay within the budgets.
+    size_t getMemoryEvictions() const { return _memEvictions; }
+
+    /// Bytes of tiles currently held in memory for this document.
+    size_t getMemoryBytes();
+
+    /// Bytes of the tiles on disk over the bytes actually stored, as
+    /// identical tiles are stored once. 1 when the tiles aren't packed.
+    double getDedupRatio();
+
+    /// Maximum bytes of tiles kept in memory per document, 0 to disable.
+    static size_t MaxMemoryBytes;
+
+    /// Maximum bytes of tiles kept in memory across all documents.
+    static size_t MaxTotalMemoryBytes;
+
+    /// Maximum bytes of saved tiles waiting to be written to disk,
+    /// per document, 0 to write them synchronously.
+    static size_t MaxPendingBytes;
+
+    /// Store the tiles of each cache directory in a TilePack.
+    static bool PackTiles;
+
 private:
+    /// An editing cache that was saved, and is being promoted
+    /// to the Persistent cache in the background.
+    struct Generation
+    {
+        std::string _dir;
+        std::shared_ptr<TilePack> _pack;
+
+        /// Its tiles, except those invalidated since the save.
+        TileIndex _index;
+
+        /// Tiles to remove from the Persistent cache before promoting it.
+        std::set<std::string> _toBeRemoved;
+
+        /// The version of the saved document, that of the Persistent cache once promoted.
+        std::string _version;
+    };
+
+    /// Promotes _frozen to the Persistent cache, and removes it.
+    void promoteGeneration();
+
+    /// Records that a tile of the zoom level of key is used now.
+    void touchZoom(const TileKey& key);
+
+    /// A saved tile waiting to be written to disk.
+    struct PendingTile
+    {
+        PendingTile(const TileKey& key, const Tile& tile, const std::shared_ptr<TilePack>& pack) :
+            _key(key),
+            _tile(tile),
+            _pack(pack)
+        {
+        }
+
+        TileKey _key;
+        Tile _tile;
+        /// The pack of the cache it was saved to, if packed. Its directory is in the id.
+        std::shared_ptr<TilePack> _pack;
+    };
+
+    /// Directory and name of a pending tile, where it's to be written.
+    typedef std::pair<std::string, std::string> PendingId;
+
+    /// Waits while too much is waiting for the disk to queue size more.
+    void waitForPendingRoom(size_t size);
+
+    /// Queues the tile to be written to dirName or pack by the writer thread.
+    /// Called with _cacheMutex held, so that the target is the one it's indexed in.
+    void queueTile(const std::string& dirName, const std::shared_ptr<TilePack>& pack,
+                   const TileKey& key, const std::string& cachedName, const Tile& tile);
+
+    /// The writer thread.
+    void writePendingTiles();
+
+    /// Waits until all the pending tiles are written.
+    void flushTiles();
+
+    /// Reads a whole tile file, returns nullptr if it doesn't exist.
+    Tile loadTile(const TileKey& key, const std::string& fileName);
+
+    /// Reads the tile from the pack if there is one, or from dirName.
+    Tile readTile(const std::string& dirName, TilePack* pack, const TileKey& key, const std::string& cachedName);
+
+    /// Access to the tiles of the Editing or the Persistent cache,
+    /// be it in a pack or in files, or still waiting to be written.
+    Tile readTile(bool editing, const TileKey& key, const std::string& cachedName);
+    void writeTile(bool editing, const TileKey& key, const std::string& cachedName, const char *data, size_t size);
+    void eraseTile(bool editing, const TileKey& key, const std::string& cachedName);
+
+    /// Writes the tile to the pack if there is one, or to dirName.
+    void writeTile(const std::string& dirName, TilePack* pack, const TileKey& key, const std::string& cachedName, const char *data, size_t size);
+
+    /// Removes the tile from the pack or directory, but not from the pending ones.
+    void removeTile(bool editing, const TileKey& key, const std::string& cachedName);
+    void removeTile(const std::string& dirName, TilePack* pack, const TileKey& key, const std::string& cachedName);
+
+    Tile lookupMemory(const std::string& cachedName);
+    void storeMemory(const std::string& cachedName, const Tile& tile);
+    void removeMemory(const std::string& cachedName);
+
+    /// Evicts the least recently used tiles until within both budgets.
+    /// Must be called with _memMutex held.
+    void trimMemory();
+
     /// Path of the (sub-)cache dir, the parameter specifies which (sub-)cache to use.
+    /// For the Editing cache, that's the directory of the current generation.
     std::string cacheDirName(bool useEditingCache);
 
     std::string cacheFileName(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight);
+    std::string cacheFileName(const TileKey& key);
     bool parseCacheFileName(const std::string& fileName, int& part, int& width, int& height, int& tilePosX, int& tilePosY, int& tileWidth, int& tileHeight);
 
-    /// Extract location from fileName, and check if it intersects with [x, y, width, height].
-    bool intersectsTile(const std::string& fileName, int part, int x, int y, int width, int height);
+    /// Rebuilds the index of the Persistent cache from the files on disk.
+    void indexPersistentCache();
 
-    /// Load the timestamp from modtime.txt.
-    Poco::Timestamp getLastModified();
+    /// Load the version of the document from version.txt.
+    std::string getVersion();
 
-    /// Store the timestamp to modtime.txt.
-    void saveLastModified(const Poco::Timestamp& timestamp);
+    /// Store the version of the document to version.txt.
+    void saveVersion(const std::string& version);
 
     const std::string _docURL;
     const std::string _rootCacheDir;
     const std::string _persCacheDir;
+    /// Parent of the directories of the Editing cache generations.
     const std::string _editCacheDir;
 
+    /// The current generation of the Editing cache.
+    std::atomic<unsigned> _editGeneration;
+
     /// The document is being edited.
     bool _isEditing;
 
@@ -116,11 +279,60 @@ private:
     /// Set of tiles that we want to remove from the Persistent cache on the next save.
     std::set<std::string> _toBeRemoved;
 
+    /// Tiles in the Editing cache.
+    TileIndex _editIndex;
+
+    /// Tiles in the Persistent cache, except those in _toBeRemoved.
+    TileIndex _persIndex;
+
+    /// The tiles of each cache when PackTiles is set, otherwise null.
+    /// _editPack is replaced on save, so it's only accessed atomically.
+    std::shared_ptr<TilePack> _editPack;
+    std::shared_ptr<TilePack> _persPack;
+
+    /// The saved generation being promoted, if any.
+    std::unique_ptr<Generation> _frozen;
+
+    std::thread _promotionThread;
+
+    /// Tiles waiting to be written, by the directory of the cache (or of
+    /// the generation of the Editing cache) they were saved to and name,
+    /// and the order in which to write them.
+    std::map<PendingId, PendingTile> _pendingTiles;
+    std::deque<PendingId> _pendingQueue;
+    size_t _pendingBytes;
+    /// The writer is writing a tile it took from the queue.
+    bool _isWriting;
+    bool _stopWriting;
+    std::mutex _pendingMutex;
+    std::condition_variable _pendingCV;
+
+    std::thread _writerThread;
+
     std::mutex _cacheMutex;
 
+    /// When each zoom level was last used, those not used since
+    /// the cache was opened count as used then.
+    std::map<TileIndex::Zoom, std::time_t> _zoomLastUsed;
+    const std::time_t _openTime;
+    std::mutex _zoomMutex;
+
     std::mutex _tilesBeingRenderedMutex;
 
     std::map<std::string, std::shared_ptr<TileBeingRendered>> _tilesBeingRendered;
+
+    /// Recently served tiles, the most recently used first.
+    std::list<std::pair<std::string, Tile>> _memTiles;
+    std::unordered_map<std::string, std::list<std::pair<std::string, Tile>>::iterator> _memIndex;
+    size_t _memBytes;
+    std::mutex _memMutex;
+
+    std::atomic<size_t> _memHits;
+    std::atomic<size_t> _memMisses;
+    std::atomic<size_t> _memEvictions;
+
+    /// Bytes held in memory by all TileCache instances.
+    static std::atomic<size_t> TotalMemoryBytes;
 };
 
 #endif
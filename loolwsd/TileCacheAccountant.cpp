@@ -0,0 +1,328 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include <Poco/DirectoryIterator.h>
+#include <Poco/Exception.h>
+#include <Poco/File.h>
+#include <Poco/Path.h>
+
+#include "TileCache.hpp"
+#include "TileCacheAccountant.hpp"
+#include "Util.hpp"
+
+using Poco::DirectoryIterator;
+using Poco::File;
+using Poco::Path;
+
+uint64_t TileCacheAccountant::MaxBytes = 0;
+unsigned TileCacheAccountant::IntervalSecs = 60;
+unsigned TileCacheAccountant::ZoomIdleSecs = 600;
+
+namespace
+{
+
+/// Added to the directory of a cache being removed.
+const std::string EvictedSuffix = ".evicted";
+
+class AccountingTask : public Poco::Util::TimerTask
+{
+public:
+    AccountingTask(TileCacheAccountant& accountant) :
+        _accountant(accountant)
+    {
+    }
+
+    void run() override
+    {
+        _accountant.account();
+    }
+
+private:
+    TileCacheAccountant& _accountant;
+};
+
+}
+
+TileCacheAccountant::TileCacheAccountant() :
+    _usedBytes(0),
+    _documentCount(0),
+    _evicting(nullptr)
+{
+}
+
+TileCacheAccountant::~TileCacheAccountant()
+{
+    stop();
+}
+
+void TileCacheAccountant::start(const std::string& cacheRoot)
+{
+    Log::info() << "Accounting for the tile caches in " << cacheRoot << ", limit: "
+                << MaxBytes << " bytes." << Log::end;
+
+    _cacheRoot = cacheRoot;
+    _task = new AccountingTask(*this);
+    _timer.schedule(_task, 0, std::max(1U, IntervalSecs) * 1000);
+}
+
+void TileCacheAccountant::stop()
+{
+    _timer.cancel(true);
+}
+
+void TileCacheAccountant::add(const std::string& rootCacheDir, TileCache* tileCache)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _caches[normalize(rootCacheDir)] = tileCache;
+}
+
+void TileCacheAccountant::remove(const std::string& rootCacheDir)
+{
+    const std::string dirName = normalize(rootCacheDir);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    const auto it = _caches.find(dirName);
+    if (it != _caches.end())
+    {
+        // It's going away, so it mustn't be in the middle of evicting.
+        TileCache* tileCache = it->second;
+        _caches.erase(it);
+        _evictingCV.wait(lock, [this, tileCache]() { return _evicting != tileCache; });
+    }
+
+    _lastClosed[dirName] = std::time(nullptr);
+}
+
+void TileCacheAccountant::account()
+{
+    Util::setThreadName("tile_accountant");
+
+    std::vector<DocumentUsage> usage;
+    scan(_cacheRoot, 4, usage);
+
+    uint64_t totalBytes = 0;
+    for (const auto& document : usage)
+    {
+        totalBytes += document._bytes;
+    }
+
+    Log::debug() << "Tile caches of " << usage.size() << " documents use "
+                 << totalBytes << " bytes." << Log::end;
+
+    if (MaxBytes > 0 && totalBytes > MaxBytes)
+    {
+        totalBytes = evict(usage, totalBytes);
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _usedBytes = totalBytes;
+    _documentCount = usage.size();
+}
+
+uint64_t TileCacheAccountant::evict(std::vector<DocumentUsage>& usage, uint64_t totalBytes)
+{
+    const uint64_t targetBytes = MaxBytes - MaxBytes / 10;
+
+    // First whole documents that are closed, the least recently used first.
+    std::sort(usage.begin(), usage.end(),
+              [](const DocumentUsage& a, const DocumentUsage& b) { return a._lastUsed < b._lastUsed; });
+
+    size_t evicted = 0;
+    for (const auto& document : usage)
+    {
+        if (totalBytes <= targetBytes)
+            break;
+
+        // Move it out of the way while nobody can open it,
+        // so the slow removal doesn't hold up opening others.
+        const std::string evictedDir = document._dir + EvictedSuffix;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_caches.find(document._dir) != _caches.end())
+                continue;
+
+            try
+            {
+                File(document._dir).renameTo(evictedDir);
+            }
+            catch (const Poco::Exception& exc)
+            {
+                Log::warn("Failed to evict tile cache " + document._dir + ": " + exc.displayText());
+                continue;
+            }
+
+            _lastClosed.erase(document._dir);
+        }
+
+        Util::removeFile(evictedDir, true);
+        totalBytes -= document._bytes;
+        ++evicted;
+    }
+
+    // Then zoom levels of the open documents; how much that frees is seen next time.
+    size_t evictedTiles = 0;
+    if (totalBytes > targetBytes)
+    {
+        const std::time_t unusedSince = std::time(nullptr) - ZoomIdleSecs;
+
+        std::vector<std::string> openDirs;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (const auto& it : _caches)
+            {
+                openDirs.push_back(it.first);
+            }
+        }
+
+        // Evicting deletes files, which mustn't hold up opening and closing the documents.
+        for (const auto& dirName : openDirs)
+        {
+            TileCache* tileCache = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                const auto it = _caches.find(dirName);
+                if (it == _caches.end())
+                    continue;
+
+                assert(_evicting == nullptr);
+                tileCache = _evicting = it->second;
+            }
+
+            evictedTiles += tileCache->evictZoomLevels(unusedSince);
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            _evicting = nullptr;
+            _evictingCV.notify_all();
+        }
+    }
+
+    Log::info() << "Tile caches over the limit of " << MaxBytes << " bytes, evicted "
+                << evicted << " documents and " << evictedTiles << " tiles of open ones, "
+                << totalBytes << " bytes left." << Log::end;
+
+    return totalBytes;
+}
+
+void TileCacheAccountant::scan(const std::string& dirName, const int depth, std::vector<DocumentUsage>& usage)
+{
+    try
+    {
+        for (auto dirIterator = DirectoryIterator(dirName); dirIterator != DirectoryIterator(); ++dirIterator)
+        {
+            if (!dirIterator->isDirectory())
+                continue;
+
+            const std::string path = normalize(dirIterator.path().toString());
+            if (depth == 1 && path.size() > EvictedSuffix.size() &&
+                path.compare(path.size() - EvictedSuffix.size(), EvictedSuffix.size(), EvictedSuffix) == 0)
+            {
+                // Left by a crash while evicting, as only we evict and we're done.
+                Log::info("Removing the half evicted tile cache " + path + ".");
+                Util::removeFile(path, true);
+                continue;
+            }
+
+            if (depth > 1)
+            {
+                scan(path, depth - 1, usage);
+                continue;
+            }
+
+            DocumentUsage document;
+            document._dir = path;
+            document._bytes = getDirectorySize(path);
+            document._lastUsed = getLastUsed(path);
+            usage.push_back(document);
+        }
+    }
+    catch (const Poco::Exception& exc)
+    {
+        Log::warn("Failed to scan tile caches in " + dirName + ": " + exc.displayText());
+    }
+}
+
+std::time_t TileCacheAccountant::getLastUsed(const std::string& dirName)
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_caches.find(dirName) != _caches.end())
+            return std::time(nullptr);
+
+        const auto it = _lastClosed.find(dirName);
+        if (it != _lastClosed.end())
+            return it->second;
+    }
+
+    // Otherwise when it was last opened, as of this process or an earlier one.
+    try
+    {
+        File versionFile(dirName + "/version.txt");
+        if (versionFile.exists())
+            return versionFile.getLastModified().epochTime();
+
+        return File(dirName).getLastModified().epochTime();
+    }
+    catch (const Poco::Exception&)
+    {
+        return 0;
+    }
+}
+
+uint64_t TileCacheAccountant::getDirectorySize(const std::string& dirName)
+{
+    uint64_t size = 0;
+    try
+    {
+        for (auto dirIterator = DirectoryIterator(dirName); dirIterator != DirectoryIterator(); ++dirIterator)
+        {
+            // Tiles come and go while we look.
+            try
+            {
+                if (dirIterator->isDirectory())
+                    size += getDirectorySize(dirIterator.path().toString());
+                else
+                    size += dirIterator->getSize();
+            }
+            catch (const Poco::FileNotFoundException&)
+            {
+            }
+        }
+    }
+    catch (const Poco::Exception& exc)
+    {
+        Log::debug("Failed to list " + dirName + ": " + exc.displayText());
+    }
+
+    return size;
+}
+
+std::string TileCacheAccountant::normalize(const std::string& dirName)
+{
+    // Collapses duplicate separators, so that paths built differently compare equal.
+    return Path(dirName).toString();
+}
+
+uint64_t TileCacheAccountant::getUsedBytes()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _usedBytes;
+}
+
+size_t TileCacheAccountant::getDocumentCount()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _documentCount;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,122 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TILECACHEACCOUNTANT_HPP
+#define INCLUDED_TILECACHEACCOUNTANT_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <Poco/Util/Timer.h>
+#include <Poco/Util/TimerTask.h>
+
+class TileCache;
+
+/** Keeps the tile caches of all the documents within a disk budget.
+
+Periodically sums up the size of each document's directory in the cache
+root. When the total is over MaxBytes, removes the caches of the least
+recently used documents that are not open, and if that's not enough, the
+zoom levels of open documents that nobody has looked at for ZoomIdleSecs.
+It stops at a bit under the budget, so it doesn't have to evict again on
+the very next round.
+
+Open documents register their TileCache, so that their directory is never
+removed under them.
+*/
+class TileCacheAccountant
+{
+public:
+    static TileCacheAccountant& instance()
+    {
+        static TileCacheAccountant accountant;
+        return accountant;
+    }
+
+    ~TileCacheAccountant();
+
+    /// Starts accounting for the caches in cacheRoot.
+    void start(const std::string& cacheRoot);
+    void stop();
+
+    /// Registers the cache of an open document in rootCacheDir.
+    void add(const std::string& rootCacheDir, TileCache* tileCache);
+    void remove(const std::string& rootCacheDir);
+
+    /// Sums up the usage, and evicts what's needed to stay within MaxBytes.
+    void account();
+
+    /// Bytes used by all the caches, as of the last accounting.
+    uint64_t getUsedBytes();
+
+    /// Number of document caches, as of the last accounting.
+    size_t getDocumentCount();
+
+    /// Maximum bytes of all the caches on disk, 0 for no limit.
+    static uint64_t MaxBytes;
+
+    /// Seconds between two accountings.
+    static unsigned IntervalSecs;
+
+    /// Seconds after which the zoom level of an open document may be evicted.
+    static unsigned ZoomIdleSecs;
+
+private:
+    TileCacheAccountant();
+
+    /// The cache of one document, as found on disk.
+    struct DocumentUsage
+    {
+        std::string _dir;
+        uint64_t _bytes;
+        std::time_t _lastUsed;
+    };
+
+    /// Evicts caches until a bit under MaxBytes, returns the bytes left.
+    uint64_t evict(std::vector<DocumentUsage>& usage, uint64_t totalBytes);
+
+    /// Finds the caches of the documents, which are depth levels below dirName.
+    void scan(const std::string& dirName, int depth, std::vector<DocumentUsage>& usage);
+
+    /// When the cache in dirName was last used, now if it's open.
+    std::time_t getLastUsed(const std::string& dirName);
+
+    /// Total size of the files in dirName, recursively.
+    static uint64_t getDirectorySize(const std::string& dirName);
+
+    static std::string normalize(const std::string& dirName);
+
+    std::string _cacheRoot;
+
+    /// Caches of the open documents, by their directory.
+    std::map<std::string, TileCache*> _caches;
+
+    /// When a document was last closed, for those closed since we started.
+    std::map<std::string, std::time_t> _lastClosed;
+
+    uint64_t _usedBytes;
+    size_t _documentCount;
+    std::mutex _mutex;
+
+    /// The open cache whose zoom levels are being evicted, which can't be removed meanwhile.
+    TileCache* _evicting;
+    std::condition_variable _evictingCV;
+
+    Poco::Util::Timer _timer;
+    Poco::Util::TimerTask::Ptr _task;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,190 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "TileClusters.hpp"
+
+#include <algorithm>
+#include <queue>
+#include <set>
+#include <tuple>
+
+constexpr int TileClusters::CallCost;
+
+namespace
+{
+
+bool contains(const Util::Rectangle& outer, const Util::Rectangle& inner)
+{
+    return outer._x1 <= inner._x1 && inner._x2 <= outer._x2 &&
+           outer._y1 <= inner._y1 && inner._y2 <= outer._y2;
+}
+
+/// Merging two clusters, as it was when they were last changed.
+struct Candidate
+{
+    long _saving;
+    size_t _first;
+    size_t _second;
+    unsigned _firstVersion;
+    unsigned _secondVersion;
+    Util::Rectangle _area;
+
+    /// The greatest saving first, and of those the first pair in order.
+    bool operator<(const Candidate& other) const
+    {
+        return std::make_tuple(_saving, other._first, other._second) <
+               std::make_tuple(other._saving, _first, _second);
+    }
+};
+
+}
+
+TileClusters::TileClusters(const std::vector<Util::Rectangle>& tiles, const int tileWidth,
+                           const int tileHeight, const size_t maxTiles) :
+    _tileWidth(tileWidth),
+    _tileHeight(tileHeight)
+{
+    Util::Rectangle bounds;
+    std::set<std::tuple<int, int, int, int>> seen;
+    for (size_t i = 0; i < tiles.size(); ++i)
+    {
+        const Util::Rectangle& tile = tiles[i];
+        if (!seen.insert(std::make_tuple(tile._x1, tile._y1, tile._x2, tile._y2)).second)
+            continue;
+
+        Cluster cluster;
+        cluster._area = tile;
+        cluster._tiles.push_back(i);
+        _clusters.push_back(cluster);
+        bounds.extend(tile);
+    }
+
+    if (!_clusters.empty() && getTileCount(bounds) == _clusters.size() && _clusters.size() <= maxTiles)
+    {
+        // No gaps, as when scrolling or loading, so all of them at once.
+        Cluster all;
+        all._area = bounds;
+        for (const auto& cluster : _clusters)
+        {
+            all._tiles.push_back(cluster._tiles[0]);
+        }
+
+        _clusters.assign(1, all);
+        return;
+    }
+
+    merge(maxTiles);
+
+    for (auto& cluster : _clusters)
+    {
+        std::sort(cluster._tiles.begin(), cluster._tiles.end());
+    }
+
+    std::sort(_clusters.begin(), _clusters.end(),
+              [](const Cluster& a, const Cluster& b)
+              {
+                  return a._area._y1 < b._area._y1 || (a._area._y1 == b._area._y1 && a._area._x1 < b._area._x1);
+              });
+}
+
+size_t TileClusters::getTileCount(const Util::Rectangle& area) const
+{
+    const size_t columns = (area._x2 - area._x1 + _tileWidth - 1) / _tileWidth;
+    const size_t rows = (area._y2 - area._y1 + _tileHeight - 1) / _tileHeight;
+    return columns * rows;
+}
+
+void TileClusters::merge(const size_t maxTiles)
+{
+    // Only clusters close to each other save anything merged, so there are few candidates,
+    // and only those of a merged cluster need to be found again. Those of clusters that
+    // changed since are skipped.
+    std::vector<size_t> counts;
+    std::vector<unsigned> versions(_clusters.size(), 0);
+    std::vector<bool> merged(_clusters.size(), false);
+    for (const auto& cluster : _clusters)
+    {
+        counts.push_back(getTileCount(cluster._area));
+    }
+
+    std::priority_queue<Candidate> candidates;
+    auto addCandidate = [&](const size_t first, const size_t second)
+    {
+        Util::Rectangle area = _clusters[first]._area;
+        area.extend(_clusters[second]._area);
+        const size_t count = getTileCount(area);
+        if (count > maxTiles)
+            return;
+
+        // What painting apart costs, a call more, over what painting together adds.
+        const long saving = static_cast<long>(CallCost + counts[first] + counts[second]) - count;
+        if (saving > 0)
+            candidates.push(Candidate{ saving, first, second, versions[first], versions[second], area });
+    };
+
+    for (size_t first = 0; first < _clusters.size(); ++first)
+    {
+        for (size_t second = first + 1; second < _clusters.size(); ++second)
+        {
+            addCandidate(first, second);
+        }
+    }
+
+    while (!candidates.empty())
+    {
+        const Candidate best = candidates.top();
+        candidates.pop();
+        if (merged[best._first] || merged[best._second] ||
+            versions[best._first] != best._firstVersion || versions[best._second] != best._secondVersion)
+        {
+            continue;
+        }
+
+        const size_t target = best._first;
+        _clusters[target]._area = best._area;
+        counts[target] = getTileCount(best._area);
+        ++versions[target];
+
+        // The second one and any others now inside the area come along for free.
+        for (size_t other = 0; other < _clusters.size(); ++other)
+        {
+            if (other == target || merged[other] ||
+                (other != best._second && !contains(best._area, _clusters[other]._area)))
+            {
+                continue;
+            }
+
+            std::vector<size_t>& tiles = _clusters[target]._tiles;
+            tiles.insert(tiles.end(), _clusters[other]._tiles.begin(), _clusters[other]._tiles.end());
+            merged[other] = true;
+        }
+
+        for (size_t other = 0; other < _clusters.size(); ++other)
+        {
+            if (other != target && !merged[other])
+                addCandidate(std::min(target, other), std::max(target, other));
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < _clusters.size(); ++i)
+    {
+        if (merged[i])
+            continue;
+
+        if (kept != i)
+            _clusters[kept] = std::move(_clusters[i]);
+
+        ++kept;
+    }
+
+    _clusters.resize(kept);
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
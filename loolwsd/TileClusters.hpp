@@ -0,0 +1,67 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TILECLUSTERS_HPP
+#define INCLUDED_TILECLUSTERS_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include "Rectangle.hpp"
+
+/** The areas to paint for the tiles of a tilecombine.
+
+Painting the bounding box of all the tiles renders everything between them
+when they are scattered, as after a few small invalidations, while a
+paintTile call per tile has a fixed cost of its own. So starting with a
+cluster per tile, the two whose common bounding box costs the least more
+than they do apart are merged, as long as that saves anything, where a
+cluster costs CallCost plus the tiles in its box. No box has more than
+maxTiles tiles, which bounds the pixmap, unless a single tile is larger.
+Tiles requested more than once are in just one cluster, once.
+
+The candidate merges are kept in a priority queue, so only those of the
+merged cluster are found again after each merge, O(n^2 log n) in all.
+*/
+class TileClusters
+{
+public:
+    /// What a paintTile call costs on top of painting its area, in tiles.
+    static constexpr int CallCost = 3;
+
+    struct Cluster
+    {
+        Util::Rectangle _area;
+        /// Indices of the tiles in the area.
+        std::vector<size_t> _tiles;
+    };
+
+    /// Clusters the tiles, tileWidth x tileHeight each and aligned to them.
+    TileClusters(const std::vector<Util::Rectangle>& tiles, int tileWidth, int tileHeight,
+                 size_t maxTiles);
+
+    /// The clusters from top left to bottom right.
+    const std::vector<Cluster>& getClusters() const { return _clusters; }
+
+private:
+    /// The tiles in the area.
+    size_t getTileCount(const Util::Rectangle& area) const;
+
+    /// Merges clusters as long as that makes the cost smaller.
+    void merge(size_t maxTiles);
+
+private:
+    const int _tileWidth;
+    const int _tileHeight;
+    std::vector<Cluster> _clusters;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
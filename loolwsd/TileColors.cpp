@@ -0,0 +1,104 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "TileColors.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+constexpr size_t TileColors::MaxPaletteSize;
+constexpr size_t TileColors::SlotCount;
+constexpr int TileColors::SlotBits;
+
+TileColors::TileColors(const unsigned char* pixmap, const int startX, const int startY,
+                       const int width, const int height, const int bufferWidth) :
+    _opaque(true)
+{
+    std::fill(_slotIndices, _slotIndices + SlotCount, 0);
+    _indices.resize(static_cast<size_t>(width) * height);
+
+    bool fits = true;
+    uint32_t lastColor = 0;
+    int lastIndex = -1;
+    for (int y = 0; y < height; ++y)
+    {
+        const unsigned char* row = pixmap + ((startY + y) * bufferWidth + startX) * 4;
+        unsigned char* indices = _indices.data() + static_cast<size_t>(y) * width;
+        for (int x = 0; x < width; ++x)
+        {
+            uint32_t color;
+            std::memcpy(&color, row + x * 4, sizeof(color));
+            _opaque = _opaque && row[x * 4 + 3] == 255;
+            if (!fits)
+                continue;
+
+            // Runs of the same color are the common case.
+            if (color != lastColor || lastIndex < 0)
+            {
+                lastColor = color;
+                lastIndex = indexOf(color);
+                fits = lastIndex >= 0;
+            }
+
+            indices[x] = lastIndex;
+        }
+
+        if (!fits && !_opaque)
+            break;
+    }
+
+    if (!fits)
+    {
+        _palette.clear();
+        _indices.clear();
+    }
+}
+
+bool TileColors::isUniform(const unsigned char* pixmap, const int startX, const int startY,
+                           const int width, const int height, const int bufferWidth)
+{
+    // The first row pixel by pixel, then the others against it.
+    const unsigned char* first = pixmap + (startY * bufferWidth + startX) * 4;
+    for (int x = 1; x < width; ++x)
+    {
+        if (std::memcmp(first, first + x * 4, 4) != 0)
+            return false;
+    }
+
+    for (int y = 1; y < height; ++y)
+    {
+        if (std::memcmp(first, first + y * bufferWidth * 4, width * 4) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+int TileColors::indexOf(const uint32_t color)
+{
+    // Fibonacci hashing, the top bits of the product.
+    size_t slot = static_cast<uint32_t>(color * 2654435761U) >> (32 - SlotBits);
+    while (_slotIndices[slot] != 0)
+    {
+        if (_slotColors[slot] == color)
+            return _slotIndices[slot] - 1;
+
+        slot = (slot + 1) % SlotCount;
+    }
+
+    if (_palette.size() == MaxPaletteSize)
+        return -1;
+
+    _palette.push_back(color);
+    _slotColors[slot] = color;
+    _slotIndices[slot] = _palette.size();
+    return _palette.size() - 1;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
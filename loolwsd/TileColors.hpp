@@ -0,0 +1,68 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TILECOLORS_HPP
+#define INCLUDED_TILECOLORS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/** The colors of an area of RGBA pixels, as far as the PNG color type goes.
+
+Most document tiles are opaque and have only a few colors, text on white,
+so they fit a palette of at most 256 colors, where each pixel is a byte
+instead of four. The palette is collected while scanning, together with
+the index of each pixel, and given up on at the 257th color.
+*/
+class TileColors
+{
+public:
+    static constexpr size_t MaxPaletteSize = 256;
+
+    /// Scans width x height pixels at startX, startY of a pixmap bufferWidth pixels wide.
+    TileColors(const unsigned char* pixmap, int startX, int startY, int width, int height,
+               int bufferWidth);
+
+    /// True if all width x height pixels at startX, startY are the same as the first one.
+    static bool isUniform(const unsigned char* pixmap, int startX, int startY, int width, int height,
+                          int bufferWidth);
+
+    /// True if the alpha of all pixels is 255.
+    bool isOpaque() const { return _opaque; }
+
+    /// True if there are at most MaxPaletteSize colors.
+    bool hasPalette() const { return !_palette.empty(); }
+
+    /// The colors, RGBA bytes as in the pixmap, in the order they first appear.
+    const std::vector<uint32_t>& getPalette() const { return _palette; }
+
+    /// The index of each pixel in the palette, row by row.
+    const std::vector<unsigned char>& getIndices() const { return _indices; }
+
+private:
+    /// The index of the color, added to the palette if new, or -1 if the palette is full.
+    int indexOf(uint32_t color);
+
+private:
+    static constexpr int SlotBits = 9;
+    static constexpr size_t SlotCount = 1 << SlotBits;
+
+    bool _opaque;
+    std::vector<uint32_t> _palette;
+    std::vector<unsigned char> _indices;
+
+    /// Open addressing from colors to their index + 1, 0 for an empty slot.
+    uint32_t _slotColors[SlotCount];
+    uint16_t _slotIndices[SlotCount];
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
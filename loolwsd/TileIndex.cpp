@@ -0,0 +1,267 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "TileIndex.hpp"
+
+#include <algorithm>
+#include <climits>
+
+namespace
+{
+
+/// Division rounding towards negative infinity.
+long long floorDiv(const long long value, const long long divisor)
+{
+    const long long quotient = value / divisor;
+    return (value % divisor != 0 && value < 0) ? quotient - 1 : quotient;
+}
+
+}
+
+bool TileKey::intersects(int part, int x, int y, int width, int height) const
+{
+    if (part != -1 && _part != part)
+        return false;
+
+    // Widen, as invalidations of everything come with INT_MAX sizes.
+    const long long left = std::max<long long>(x, _tilePosX);
+    const long long right = std::min<long long>(static_cast<long long>(x) + width,
+                                                static_cast<long long>(_tilePosX) + _tileWidth);
+    const long long top = std::max<long long>(y, _tilePosY);
+    const long long bottom = std::min<long long>(static_cast<long long>(y) + height,
+                                                 static_cast<long long>(_tilePosY) + _tileHeight);
+
+    return (left <= right && top <= bottom);
+}
+
+std::pair<long long, long long> TileIndex::getBucket(const TileKey& key)
+{
+    const long long bucketWidth = std::max(1LL, static_cast<long long>(key._tileWidth) * BucketTiles);
+    const long long bucketHeight = std::max(1LL, static_cast<long long>(key._tileHeight) * BucketTiles);
+    return std::make_pair(floorDiv(key._tilePosX, bucketWidth),
+                          floorDiv(key._tilePosY, bucketHeight));
+}
+
+bool TileIndex::add(const TileKey& key)
+{
+    auto& positions = _parts[key._part][getZoom(key)][getBucket(key)];
+    if (!positions.emplace(key._tilePosX, key._tilePosY).second)
+        return false;
+
+    ++_size;
+    return true;
+}
+
+bool TileIndex::remove(const TileKey& key)
+{
+    auto part = _parts.find(key._part);
+    if (part == _parts.end())
+        return false;
+
+    auto zoom = part->second.find(getZoom(key));
+    if (zoom == part->second.end())
+        return false;
+
+    auto bucket = zoom->second.find(getBucket(key));
+    if (bucket == zoom->second.end() ||
+        bucket->second.erase(std::make_pair(key._tilePosX, key._tilePosY)) == 0)
+        return false;
+
+    // Don't leave empty containers behind, they would slow down lookups.
+    if (bucket->second.empty())
+    {
+        zoom->second.erase(bucket);
+        if (zoom->second.empty())
+        {
+            part->second.erase(zoom);
+            if (part->second.empty())
+                _parts.erase(part);
+        }
+    }
+
+    --_size;
+    return true;
+}
+
+bool TileIndex::contains(const TileKey& key) const
+{
+    const auto part = _parts.find(key._part);
+    if (part == _parts.end())
+        return false;
+
+    const auto zoom = part->second.find(getZoom(key));
+    if (zoom == part->second.end())
+        return false;
+
+    const auto bucket = zoom->second.find(getBucket(key));
+    return (bucket != zoom->second.end() &&
+            bucket->second.find(std::make_pair(key._tilePosX, key._tilePosY)) != bucket->second.end());
+}
+
+std::vector<TileKey> TileIndex::intersecting(int part, int x, int y, int width, int height) const
+{
+    std::vector<TileKey> result;
+
+    if (part == -1)
+    {
+        for (const auto& it : _parts)
+        {
+            intersecting(it.first, it.second, x, y, width, height, result);
+        }
+    }
+    else
+    {
+        const auto it = _parts.find(part);
+        if (it != _parts.end())
+        {
+            intersecting(it->first, it->second, x, y, width, height, result);
+        }
+    }
+
+    return result;
+}
+
+void TileIndex::intersecting(int part, const std::map<Zoom, Grid>& zooms,
+                             int x, int y, int width, int height,
+                             std::vector<TileKey>& result) const
+{
+    for (const auto& zoom : zooms)
+    {
+        int pixelWidth, pixelHeight, tileWidth, tileHeight;
+        std::tie(pixelWidth, pixelHeight, tileWidth, tileHeight) = zoom.first;
+
+        // A tile touches the area when its top-left corner is
+        // within [x - tileWidth, x + width] x [y - tileHeight, y + height].
+        const TileKey first(part, pixelWidth, pixelHeight, x - tileWidth, y - tileHeight, tileWidth, tileHeight);
+        const TileKey last(part, pixelWidth, pixelHeight,
+                           static_cast<int>(std::min<long long>(INT_MAX, static_cast<long long>(x) + width)),
+                           static_cast<int>(std::min<long long>(INT_MAX, static_cast<long long>(y) + height)),
+                           tileWidth, tileHeight);
+        const auto from = getBucket(first);
+        const auto to = getBucket(last);
+
+        const Grid& grid = zoom.second;
+        auto bucket = grid.lower_bound(std::make_pair(from.first, from.second));
+        while (bucket != grid.end() && bucket->first.first <= to.first)
+        {
+            if (bucket->first.second < from.second)
+            {
+                // Skip to the first bucket of the area in this column.
+                bucket = grid.lower_bound(std::make_pair(bucket->first.first, from.second));
+                continue;
+            }
+
+            if (bucket->first.second > to.second)
+            {
+                // Skip to the next column.
+                bucket = grid.lower_bound(std::make_pair(bucket->first.first + 1, from.second));
+                continue;
+            }
+
+            for (const auto& position : bucket->second)
+            {
+                const TileKey key(part, pixelWidth, pixelHeight, position.first, position.second, tileWidth, tileHeight);
+                if (key.intersects(part, x, y, width, height))
+                {
+                    result.push_back(key);
+                }
+            }
+
+            ++bucket;
+        }
+    }
+}
+
+std::vector<TileKey> TileIndex::all() const
+{
+    std::vector<TileKey> result;
+    result.reserve(_size);
+
+    for (const auto& part : _parts)
+    {
+        for (const auto& zoom : part.second)
+        {
+            int pixelWidth, pixelHeight, tileWidth, tileHeight;
+            std::tie(pixelWidth, pixelHeight, tileWidth, tileHeight) = zoom.first;
+            for (const auto& bucket : zoom.second)
+            {
+                for (const auto& position : bucket.second)
+                {
+                    result.emplace_back(part.first, pixelWidth, pixelHeight,
+                                        position.first, position.second, tileWidth, tileHeight);
+                }
+            }
+        }
+    }
+
+    return result;
+}
+
+std::set<TileIndex::Zoom> TileIndex::getZooms() const
+{
+    std::set<Zoom> result;
+    for (const auto& part : _parts)
+    {
+        for (const auto& zoom : part.second)
+        {
+            result.insert(zoom.first);
+        }
+    }
+
+    return result;
+}
+
+std::vector<TileKey> TileIndex::removeZoom(const Zoom& zoom)
+{
+    int pixelWidth, pixelHeight, tileWidth, tileHeight;
+    std::tie(pixelWidth, pixelHeight, tileWidth, tileHeight) = zoom;
+
+    std::vector<TileKey> result;
+    for (auto part = _parts.begin(); part != _parts.end(); )
+    {
+        auto it = part->second.find(zoom);
+        if (it != part->second.end())
+        {
+            for (const auto& bucket : it->second)
+            {
+                for (const auto& position : bucket.second)
+                {
+                    result.emplace_back(part->first, pixelWidth, pixelHeight,
+                                        position.first, position.second, tileWidth, tileHeight);
+                }
+            }
+
+            part->second.erase(it);
+        }
+
+        if (part->second.empty())
+            part = _parts.erase(part);
+        else
+            ++part;
+    }
+
+    _size -= result.size();
+    return result;
+}
+
+void TileIndex::merge(const TileIndex& other)
+{
+    for (const auto& key : other.all())
+    {
+        add(key);
+    }
+}
+
+void TileIndex::clear()
+{
+    _parts.clear();
+    _size = 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
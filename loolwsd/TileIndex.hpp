@@ -0,0 +1,136 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TILEINDEX_HPP
+#define INCLUDED_TILEINDEX_HPP
+
+#include <cstddef>
+#include <map>
+#include <set>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/// Identifies a cached tile: the part, the size in pixels,
+/// and the position and size in twips.
+struct TileKey
+{
+    int _part;
+    int _width;
+    int _height;
+    int _tilePosX;
+    int _tilePosY;
+    int _tileWidth;
+    int _tileHeight;
+
+    TileKey(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight) :
+        _part(part),
+        _width(width),
+        _height(height),
+        _tilePosX(tilePosX),
+        _tilePosY(tilePosY),
+        _tileWidth(tileWidth),
+        _tileHeight(tileHeight)
+    {
+    }
+
+    bool operator<(const TileKey& other) const
+    {
+        return std::tie(_part, _width, _height, _tilePosX, _tilePosY, _tileWidth, _tileHeight) <
+               std::tie(other._part, other._width, other._height, other._tilePosX, other._tilePosY, other._tileWidth, other._tileHeight);
+    }
+
+    bool operator==(const TileKey& other) const
+    {
+        return std::tie(_part, _width, _height, _tilePosX, _tilePosY, _tileWidth, _tileHeight) ==
+               std::tie(other._part, other._width, other._height, other._tilePosX, other._tilePosY, other._tileWidth, other._tileHeight);
+    }
+
+    /// True if the tile is in the given part (any part when -1)
+    /// and touches or overlaps the given area.
+    bool intersects(int part, int x, int y, int width, int height) const;
+};
+
+/** In-memory spatial index of the tiles of one cache directory.
+
+Tiles are grouped by part and zoom (pixel and twip size), and within that
+into a grid of square buckets of BucketTiles x BucketTiles tiles, keyed by
+the bucket of the tile's top-left corner. Finding the tiles in an area
+only visits the buckets that area covers, instead of every tile.
+*/
+class TileIndex
+{
+public:
+    /// Pixel and twip size of the tiles, defines the zoom level.
+    typedef std::tuple<int, int, int, int> Zoom;
+
+    static Zoom getZoom(const TileKey& key)
+    {
+        return Zoom(key._width, key._height, key._tileWidth, key._tileHeight);
+    }
+
+    TileIndex() :
+        _size(0)
+    {
+    }
+
+    /// Adds the tile, returns false if it was already indexed.
+    bool add(const TileKey& key);
+
+    /// Removes the tile, returns false if it wasn't indexed.
+    bool remove(const TileKey& key);
+
+    bool contains(const TileKey& key) const;
+
+    /// Returns the tiles in the given part (all parts when -1)
+    /// touching or overlapping the given area.
+    std::vector<TileKey> intersecting(int part, int x, int y, int width, int height) const;
+
+    /// Returns all the indexed tiles.
+    std::vector<TileKey> all() const;
+
+    /// Returns the zoom levels with tiles, in any part.
+    std::set<Zoom> getZooms() const;
+
+    /// Removes the tiles of the zoom level in all parts, and returns them.
+    std::vector<TileKey> removeZoom(const Zoom& zoom);
+
+    /// Adds all the tiles of other to this index.
+    void merge(const TileIndex& other);
+
+    void clear();
+
+    void swap(TileIndex& other)
+    {
+        _parts.swap(other._parts);
+        std::swap(_size, other._size);
+    }
+
+    size_t size() const { return _size; }
+
+    /// Number of tiles, per side, in one grid bucket.
+    static constexpr int BucketTiles = 16;
+
+private:
+    /// Bucket coordinates mapped to the twip positions of its tiles.
+    typedef std::map<std::pair<long long, long long>, std::set<std::pair<int, int>>> Grid;
+
+    static std::pair<long long, long long> getBucket(const TileKey& key);
+
+    void intersecting(int part, const std::map<Zoom, Grid>& zooms,
+                      int x, int y, int width, int height,
+                      std::vector<TileKey>& result) const;
+
+    std::map<int, std::map<Zoom, Grid>> _parts;
+    size_t _size;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
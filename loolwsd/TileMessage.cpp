@@ -0,0 +1,127 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "TileMessage.hpp"
+
+#include <cstring>
+
+#include "Util.hpp"
+
+TileMessage::TileMessage(const TileKey& key, const size_t pngSize) :
+    _width(key._width),
+    _height(key._height)
+{
+    const std::string head = header(key);
+    _headerSize = head.size();
+
+    // Sized once, so the PNG is never moved.
+    _buffer.resize(_headerSize + pngSize);
+    std::memcpy(_buffer.data(), head.data(), _headerSize);
+}
+
+namespace
+{
+    /// color=rrggbbaa
+    const std::string ColorPrefix = "color=";
+    constexpr size_t ColorSize = 14;
+}
+
+TileMessage::TileMessage(const TileKey& key, const char* data, const size_t size) :
+    TileMessage(key, isColor(data, size) ? 0 : size)
+{
+    if (isColor(data, size))
+    {
+        _color.assign(data, size);
+
+        // At the end of the header, instead of a PNG.
+        _buffer.back() = ' ';
+        _buffer.insert(_buffer.end(), _color.begin(), _color.end());
+        _buffer.push_back('\n');
+        _headerSize = _buffer.size();
+    }
+    else if (size > 0)
+    {
+        std::memcpy(getPngData(), data, size);
+    }
+}
+
+std::string TileMessage::header(const TileKey& key)
+{
+    // The same order as the parameters of the tile command.
+    return "tile: part=" + std::to_string(key._part) +
+           " width=" + std::to_string(key._width) +
+           " height=" + std::to_string(key._height) +
+           " tileposx=" + std::to_string(key._tilePosX) +
+           " tileposy=" + std::to_string(key._tilePosY) +
+           " tilewidth=" + std::to_string(key._tileWidth) +
+           " tileheight=" + std::to_string(key._tileHeight) + "\n";
+}
+
+bool TileMessage::isColor(const char* data, const size_t size)
+{
+    return size == ColorSize && ColorPrefix.compare(0, ColorPrefix.size(), data, ColorPrefix.size()) == 0;
+}
+
+bool TileMessage::hasHeader(const std::string& header) const
+{
+    // The color comes after the parameters.
+    const size_t colorSize = (_color.empty() ? 0 : _color.size() + 1);
+    return !header.empty() && header.back() == '\n' &&
+           header.size() + colorSize == _headerSize &&
+           std::memcmp(_buffer.data(), header.data(), header.size() - 1) == 0;
+}
+
+void TileMessage::copyWithHeader(const std::string& header, std::vector<char>& output) const
+{
+    const size_t paramsSize = (!header.empty() && header.back() == '\n' ? header.size() - 1 : header.size());
+
+    output.clear();
+    output.reserve(paramsSize + _color.size() + 2 + getPngSize());
+    output.insert(output.end(), header.begin(), header.begin() + paramsSize);
+    if (!_color.empty())
+    {
+        output.push_back(' ');
+        output.insert(output.end(), _color.begin(), _color.end());
+    }
+
+    output.push_back('\n');
+    output.insert(output.end(), getPngData(), getPngData() + getPngSize());
+}
+
+bool TileMessage::copyAsPng(const std::string& header, std::vector<char>& output) const
+{
+    if (_color.empty())
+    {
+        copyWithHeader(header, output);
+        return true;
+    }
+
+    unsigned char rgba[4];
+    for (size_t i = 0; i < sizeof(rgba); ++i)
+    {
+        rgba[i] = std::stoul(_color.substr(ColorPrefix.size() + 2 * i, 2), nullptr, 16);
+    }
+
+    if (_width <= 0 || _height <= 0)
+        return false;
+
+    std::vector<unsigned char> pixmap(static_cast<size_t>(_width) * _height * 4);
+    for (size_t i = 0; i < pixmap.size(); i += 4)
+    {
+        std::memcpy(pixmap.data() + i, rgba, sizeof(rgba));
+    }
+
+    output.assign(header.begin(), header.end());
+    if (output.empty() || output.back() != '\n')
+        output.push_back('\n');
+
+    return Util::encodeBufferToPNG(pixmap.data(), _width, _height, output, LOK_TILEMODE_RGBA);
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,85 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TILEMESSAGE_HPP
+#define INCLUDED_TILEMESSAGE_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "TileIndex.hpp"
+
+/** A tile as it is sent to the clients: the tile: message header, then the PNG.
+
+The header carries only the parameters of the tile itself, which is what
+clients ask for unless they add an id or a timestamp, so a cached tile is
+sent as is, without building the message again. Once shared it's never
+modified, so the cache and any number of sessions sending it hold the same
+buffer.
+
+A tile of a single color has no PNG, only a color=rrggbbaa parameter at the
+end of the header, and that parameter is what the cache keeps of it.
+*/
+class TileMessage
+{
+public:
+    /// Room for pngSize bytes of PNG, to be filled through getPngData()
+    /// before the message is shared.
+    TileMessage(const TileKey& key, size_t pngSize);
+
+    /// From the data of the tile as cached, a PNG or a color parameter.
+    TileMessage(const TileKey& key, const char* data, size_t size);
+
+    TileMessage(const TileMessage&) = delete;
+    TileMessage& operator=(const TileMessage&) = delete;
+
+    /// The header of the message of the tile, including the final newline.
+    static std::string header(const TileKey& key);
+
+    /// True if the data of a tile is a color parameter rather than a PNG.
+    static bool isColor(const char* data, size_t size);
+
+    /// The whole message.
+    const char* data() const { return _buffer.data(); }
+    size_t size() const { return _buffer.size(); }
+
+    const char* getPngData() const { return _buffer.data() + _headerSize; }
+    char* getPngData() { return _buffer.data() + _headerSize; }
+    size_t getPngSize() const { return _buffer.size() - _headerSize; }
+
+    /// The color parameter of a tile of a single color, otherwise empty.
+    const std::string& getColor() const { return _color; }
+
+    /// What the cache keeps: the PNG, or the color parameter.
+    const char* getTileData() const { return (_color.empty() ? getPngData() : _color.data()); }
+    size_t getTileSize() const { return (_color.empty() ? getPngSize() : _color.size()); }
+
+    /// True if the message is header() of the tile with these parameters, and the color if any.
+    bool hasHeader(const std::string& header) const;
+
+    /// The message with a header that has more parameters than header().
+    void copyWithHeader(const std::string& header, std::vector<char>& output) const;
+
+    /// The message for clients that don't know the color parameter: the header, which may have
+    /// more parameters than header(), then a PNG of the color. False if it fails to encode.
+    bool copyAsPng(const std::string& header, std::vector<char>& output) const;
+
+private:
+    std::vector<char> _buffer;
+    size_t _headerSize;
+    std::string _color;
+    /// The size of the tile in pixels.
+    const int _width;
+    const int _height;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,959 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "TilePack.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "Log.hpp"
+
+const std::string TilePack::PackFileName = "tiles.pack";
+const std::string TilePack::IndexFileName = "tiles.idx";
+size_t TilePack::CompactMinBytes = 4 * 1024 * 1024;
+
+/// Start of the index file.
+struct TilePack::Header
+{
+    char _magic[8];
+    uint32_t _capacity;
+    /// Live entries.
+    uint32_t _count;
+    /// Live and removed entries, the rest are empty.
+    uint32_t _used;
+    uint32_t _reserved;
+    /// Size of the pack file this index describes.
+    uint64_t _packSize;
+    /// Bytes of data, shared data counted once.
+    uint64_t _liveBytes;
+    /// Bytes of the tiles, shared data counted for each.
+    uint64_t _tileBytes;
+};
+
+/// Slot of the index. Empty when both _size and _offset are 0,
+/// removed when _size is 0 but _offset isn't.
+struct TilePack::Entry
+{
+    int32_t _key[7];
+    uint32_t _size;
+    uint64_t _offset;
+    /// Of the data, to find identical tiles.
+    uint64_t _hash;
+};
+
+namespace
+{
+
+const char IndexMagic[8] = { 'L', 'O', 'O', 'L', 'T', 'I', 'X', '2' };
+
+const uint32_t RecordMagic = 0x4b50544c;
+const uint32_t RefMagic = 0x4650524c;
+
+const uint32_t InitialCapacity = 1024;
+
+const uint64_t RemovedOffset = 1;
+
+/// Precedes each tile in the pack. No data follows when _size is 0,
+/// which removes the tile. With RefMagic, the tile has the data of
+/// an earlier one, and only the distance back from the start of this
+/// record to that data follows, as a uint64_t.
+struct Record
+{
+    uint32_t _magic;
+    int32_t _key[7];
+    uint32_t _size;
+};
+
+const size_t RefRecordSize = sizeof(Record) + sizeof(uint64_t);
+
+/// Batches are flushed to the pack once they reach this size.
+const size_t CopyBatchBytes = 1024 * 1024;
+
+void toArray(const TileKey& key, int32_t* array)
+{
+    array[0] = key._part;
+    array[1] = key._width;
+    array[2] = key._height;
+    array[3] = key._tilePosX;
+    array[4] = key._tilePosY;
+    array[5] = key._tileWidth;
+    array[6] = key._tileHeight;
+}
+
+TileKey fromArray(const int32_t* array)
+{
+    return TileKey(array[0], array[1], array[2], array[3], array[4], array[5], array[6]);
+}
+
+/// FNV-1a of the key.
+uint32_t hashKey(const int32_t* key)
+{
+    uint32_t hash = 2166136261u;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(key);
+    for (size_t i = 0; i < 7 * sizeof(int32_t); ++i)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/// FNV-1a of the data, a word at a time, folding the high bits
+/// in as we go, as the low ones pick the hash table bucket.
+uint64_t hashData(const char* data, const size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+    for ( ; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+        hash ^= hash >> 32;
+    }
+
+    for ( ; i < size; ++i)
+    {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+std::string errorMessage(const std::string& what, const std::string& path)
+{
+    return what + " [" + path + "]: " + std::strerror(errno);
+}
+
+void readFully(const int fd, char* data, size_t size, uint64_t offset)
+{
+    while (size > 0)
+    {
+        const ssize_t len = pread(fd, data, size, offset);
+        if (len < 0 && errno == EINTR)
+            continue;
+
+        if (len <= 0)
+            throw std::runtime_error(len == 0 ? std::string("Unexpected end of file.") : std::string("Read failed: ") + std::strerror(errno));
+
+        data += len;
+        size -= len;
+        offset += len;
+    }
+}
+
+void writeFully(const int fd, const char* data, size_t size, uint64_t offset)
+{
+    while (size > 0)
+    {
+        const ssize_t len = pwrite(fd, data, size, offset);
+        if (len < 0 && errno == EINTR)
+            continue;
+
+        if (len <= 0)
+            throw std::runtime_error(std::string("Write failed: ") + std::strerror(errno));
+
+        data += len;
+        size -= len;
+        offset += len;
+    }
+}
+
+}
+
+TilePack::TilePack(const std::string& dirName) :
+    _packPath(dirName + "/" + PackFileName),
+    _indexPath(dirName + "/" + IndexFileName),
+    _packFd(-1),
+    _indexFd(-1),
+    _index(nullptr),
+    _indexSize(0)
+{
+    _packFd = open(_packPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (_packFd < 0)
+        throw std::runtime_error(errorMessage("Failed to open tile pack", _packPath));
+
+    _indexFd = open(_indexPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (_indexFd < 0)
+    {
+        const std::string message = errorMessage("Failed to open tile pack index", _indexPath);
+        close(_packFd);
+        throw std::runtime_error(message);
+    }
+
+    try
+    {
+        openIndex();
+    }
+    catch (const std::exception&)
+    {
+        unmapIndex();
+        close(_indexFd);
+        close(_packFd);
+        throw;
+    }
+
+    Log::debug() << "Opened tile pack " << _packPath << " with " << header()->_count
+                 << " tiles in " << header()->_packSize << " bytes." << Log::end;
+}
+
+TilePack::~TilePack()
+{
+    unmapIndex();
+    close(_indexFd);
+    close(_packFd);
+}
+
+std::shared_ptr<std::vector<char>> TilePack::get(const TileKey& key)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    const Entry* entry = find(key);
+    if (entry == nullptr)
+        return nullptr;
+
+    // Share the buffer with the readers of other tiles with the same data.
+    const auto blob = _blobs.find(entry->_offset);
+    if (blob != _blobs.end())
+    {
+        std::shared_ptr<std::vector<char>> tile = blob->second._data.lock();
+        if (tile)
+            return tile;
+    }
+
+    auto tile = std::make_shared<std::vector<char>>(entry->_size);
+    try
+    {
+        readFully(_packFd, tile->data(), entry->_size, entry->_offset);
+    }
+    catch (const std::exception& exc)
+    {
+        Log::error() << "TilePack::get: " << exc.what() << " [" << _packPath << "]" << Log::end;
+        return nullptr;
+    }
+
+    if (blob != _blobs.end())
+        blob->second._data = tile;
+
+    return tile;
+}
+
+void TilePack::put(const TileKey& key, const char* data, size_t size)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (size == 0 || size > UINT32_MAX)
+    {
+        Log::error() << "TilePack::put: Invalid tile size " << size << "." << Log::end;
+        return;
+    }
+
+    try
+    {
+        const uint64_t hash = hashData(data, size);
+        uint64_t offset = findData(data, size, hash);
+        if (offset != 0)
+        {
+            header()->_packSize = appendRef(key, size, offset);
+        }
+        else
+        {
+            offset = append(key, data, size);
+            header()->_packSize = offset + size;
+        }
+
+        insert(key, offset, size, hash);
+    }
+    catch (const std::exception& exc)
+    {
+        Log::error() << "TilePack::put: " << exc.what() << " [" << _packPath << "]" << Log::end;
+        return;
+    }
+
+    compactIfNeeded();
+}
+
+bool TilePack::remove(const TileKey& key)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    Entry* entry = find(key);
+    if (entry == nullptr)
+        return false;
+
+    try
+    {
+        // Record the removal, or it would come back if the index is rebuilt.
+        header()->_packSize = append(key, nullptr, 0);
+    }
+    catch (const std::exception& exc)
+    {
+        Log::error() << "TilePack::remove: " << exc.what() << " [" << _packPath << "]" << Log::end;
+        return false;
+    }
+
+    erase(entry);
+    compactIfNeeded();
+    return true;
+}
+
+bool TilePack::contains(const TileKey& key)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return (find(key) != nullptr);
+}
+
+std::vector<TileKey> TilePack::keys()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    std::vector<TileKey> result;
+    for (const auto& entry : liveEntries())
+    {
+        result.push_back(fromArray(entry._key));
+    }
+
+    return result;
+}
+
+bool TilePack::merge(TilePack& other)
+{
+    if (&other == this)
+        return true;
+
+    // other stays locked, so it can't change under us.
+    std::unique_lock<std::mutex> otherLock(other._mutex);
+
+    const std::vector<Entry> entries = other.liveEntries();
+
+    std::vector<char> records;
+    std::vector<uint64_t> dataOffsets;
+    size_t begin = 0;
+    while (begin < entries.size())
+    {
+        // Read outside our lock, and write one batch at a time,
+        // so that lookups in this pack are only held up briefly.
+        size_t end;
+        try
+        {
+            end = readRecords(other._packFd, entries, begin, records, dataOffsets);
+        }
+        catch (const std::exception& exc)
+        {
+            Log::error() << "TilePack::merge: " << exc.what() << " [" << other._packPath << "]" << Log::end;
+            return false;
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        const uint64_t offset = header()->_packSize;
+        try
+        {
+            writeFully(_packFd, records.data(), records.size(), offset);
+        }
+        catch (const std::exception& exc)
+        {
+            Log::error() << "TilePack::merge: " << exc.what() << " [" << _packPath << "]" << Log::end;
+
+            // Drop whatever was partially written.
+            if (ftruncate(_packFd, offset) != 0)
+                Log::error(errorMessage("Failed to truncate tile pack", _packPath));
+            return false;
+        }
+
+        for (size_t i = begin; i < end; ++i)
+        {
+            insert(fromArray(entries[i]._key), offset + dataOffsets[i - begin], entries[i]._size, entries[i]._hash);
+        }
+
+        header()->_packSize = offset + records.size();
+        begin = end;
+    }
+
+    Log::debug() << "Merged " << entries.size() << " tiles into tile pack " << _packPath << Log::end;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    compactIfNeeded();
+    return true;
+}
+
+void TilePack::clear()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (ftruncate(_packFd, 0) != 0)
+    {
+        Log::error(errorMessage("Failed to truncate tile pack", _packPath));
+    }
+
+    createIndex(InitialCapacity);
+}
+
+void TilePack::compact()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    compactLocked();
+}
+
+size_t TilePack::size()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return header()->_count;
+}
+
+size_t TilePack::getLiveBytes()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return header()->_liveBytes;
+}
+
+size_t TilePack::getTileBytes()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return header()->_tileBytes;
+}
+
+size_t TilePack::getPackBytes()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return header()->_packSize;
+}
+
+bool TilePack::isPackFile(const std::string& fileName)
+{
+    return (fileName.compare(0, PackFileName.size(), PackFileName) == 0 ||
+            fileName.compare(0, IndexFileName.size(), IndexFileName) == 0);
+}
+
+size_t TilePack::getIndexFileSize(const uint32_t capacity)
+{
+    return sizeof(Header) + static_cast<size_t>(capacity) * sizeof(Entry);
+}
+
+TilePack::Header* TilePack::header() const
+{
+    return reinterpret_cast<Header*>(_index);
+}
+
+TilePack::Entry* TilePack::entries() const
+{
+    return reinterpret_cast<Entry*>(_index + sizeof(Header));
+}
+
+void TilePack::openIndex()
+{
+    struct stat packStat;
+    struct stat indexStat;
+    if (fstat(_packFd, &packStat) != 0 || fstat(_indexFd, &indexStat) != 0)
+        throw std::runtime_error(errorMessage("Failed to stat tile pack", _packPath));
+
+    if (packStat.st_size == 0)
+    {
+        // New or empty pack, nothing to index.
+        createIndex(InitialCapacity);
+        return;
+    }
+
+    if (static_cast<size_t>(indexStat.st_size) >= sizeof(Header))
+    {
+        _indexSize = indexStat.st_size;
+        void* map = mmap(nullptr, _indexSize, PROT_READ | PROT_WRITE, MAP_SHARED, _indexFd, 0);
+        if (map == MAP_FAILED)
+            throw std::runtime_error(errorMessage("Failed to map tile pack index", _indexPath));
+
+        _index = static_cast<char*>(map);
+
+        const Header* hdr = header();
+        const uint32_t capacity = hdr->_capacity;
+        if (std::memcmp(hdr->_magic, IndexMagic, sizeof(IndexMagic)) == 0 &&
+            capacity != 0 && (capacity & (capacity - 1)) == 0 &&
+            _indexSize == getIndexFileSize(capacity) &&
+            hdr->_packSize == static_cast<uint64_t>(packStat.st_size))
+        {
+            loadBlobs();
+            return;
+        }
+    }
+
+    rebuildIndex();
+}
+
+void TilePack::createIndex(const uint32_t capacity)
+{
+    unmapIndex();
+
+    // Truncating first zeroes all the slots and invalidates the header
+    // until we are done, should we not get there.
+    const size_t size = getIndexFileSize(capacity);
+    if (ftruncate(_indexFd, 0) != 0 || ftruncate(_indexFd, size) != 0)
+        throw std::runtime_error(errorMessage("Failed to resize tile pack index", _indexPath));
+
+    void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _indexFd, 0);
+    if (map == MAP_FAILED)
+        throw std::runtime_error(errorMessage("Failed to map tile pack index", _indexPath));
+
+    _index = static_cast<char*>(map);
+    _indexSize = size;
+
+    std::memcpy(header()->_magic, IndexMagic, sizeof(IndexMagic));
+    header()->_capacity = capacity;
+
+    _blobs.clear();
+    _blobsByHash.clear();
+}
+
+void TilePack::rebuildIndex()
+{
+    Log::warn("Rebuilding tile pack index: " + _indexPath);
+
+    createIndex(InitialCapacity);
+
+    struct stat packStat;
+    if (fstat(_packFd, &packStat) != 0)
+        throw std::runtime_error(errorMessage("Failed to stat tile pack", _packPath));
+
+    const uint64_t packSize = packStat.st_size;
+    uint64_t offset = 0;
+    Record record;
+    std::vector<char> data;
+    while (offset + sizeof(Record) <= packSize)
+    {
+        readFully(_packFd, reinterpret_cast<char*>(&record), sizeof(Record), offset);
+        const TileKey key = fromArray(record._key);
+
+        if (record._magic == RefMagic)
+        {
+            if (offset + RefRecordSize > packSize)
+                break;
+
+            // The data it refers to must be in use at this point.
+            uint64_t distance;
+            readFully(_packFd, reinterpret_cast<char*>(&distance), sizeof(distance), offset + sizeof(Record));
+            const auto blob = (distance <= offset ? _blobs.find(offset - distance) : _blobs.end());
+            if (blob == _blobs.end() || blob->second._size != record._size)
+                break;
+
+            insert(key, offset - distance, record._size, blob->second._hash);
+            offset += RefRecordSize;
+            continue;
+        }
+
+        if (record._magic != RecordMagic || offset + sizeof(Record) + record._size > packSize)
+            break;
+
+        if (record._size > 0)
+        {
+            data.resize(record._size);
+            readFully(_packFd, data.data(), record._size, offset + sizeof(Record));
+            insert(key, offset + sizeof(Record), record._size, hashData(data.data(), record._size));
+        }
+        else
+        {
+            Entry* entry = find(key);
+            if (entry != nullptr)
+                erase(entry);
+        }
+
+        offset += sizeof(Record) + record._size;
+    }
+
+    if (offset != packSize)
+    {
+        // Torn write at the end, e.g. after a crash.
+        Log::warn() << "Truncating tile pack " << _packPath << " from " << packSize
+                    << " to " << offset << " bytes." << Log::end;
+        if (ftruncate(_packFd, offset) != 0)
+            throw std::runtime_error(errorMessage("Failed to truncate tile pack", _packPath));
+    }
+
+    header()->_packSize = offset;
+}
+
+void TilePack::unmapIndex()
+{
+    if (_index != nullptr)
+    {
+        munmap(_index, _indexSize);
+        _index = nullptr;
+        _indexSize = 0;
+    }
+}
+
+TilePack::Entry* TilePack::find(const TileKey& key) const
+{
+    int32_t array[7];
+    toArray(key, array);
+
+    const uint32_t mask = header()->_capacity - 1;
+    for (uint32_t slot = hashKey(array) & mask; ; slot = (slot + 1) & mask)
+    {
+        Entry* entry = entries() + slot;
+        if (entry->_size == 0)
+        {
+            if (entry->_offset == 0)
+                return nullptr;
+
+            // Removed, keep probing.
+            continue;
+        }
+
+        if (std::memcmp(entry->_key, array, sizeof(array)) == 0)
+            return entry;
+    }
+}
+
+void TilePack::insert(const TileKey& key, const uint64_t offset, const uint32_t size, const uint64_t hash)
+{
+    Entry* entry = find(key);
+    if (entry != nullptr)
+    {
+        // Reference the new data before releasing the old, which may be the same.
+        addRef(offset, size, hash);
+        releaseRef(entry->_offset);
+        header()->_tileBytes -= entry->_size;
+        header()->_tileBytes += size;
+        entry->_offset = offset;
+        entry->_size = size;
+        entry->_hash = hash;
+        return;
+    }
+
+    // Keep the load (including removed slots) under 70%.
+    if ((header()->_used + 1) * 10ull > header()->_capacity * 7ull)
+    {
+        const std::vector<Entry> live = liveEntries();
+        const Header saved = *header();
+
+        uint32_t capacity = InitialCapacity;
+        while ((live.size() + 1) * 10ull > capacity * 7ull / 2)
+            capacity *= 2;
+
+        createIndex(capacity);
+        header()->_packSize = saved._packSize;
+        for (const auto& it : live)
+        {
+            insert(fromArray(it._key), it._offset, it._size, it._hash);
+        }
+    }
+
+    int32_t array[7];
+    toArray(key, array);
+
+    const uint32_t mask = header()->_capacity - 1;
+    uint32_t slot = hashKey(array) & mask;
+    while (entries()[slot]._size != 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    entry = entries() + slot;
+    if (entry->_offset == 0)
+        ++header()->_used;
+
+    std::memcpy(entry->_key, array, sizeof(array));
+    entry->_offset = offset;
+    entry->_size = size;
+    entry->_hash = hash;
+    ++header()->_count;
+    header()->_tileBytes += size;
+    addRef(offset, size, hash);
+}
+
+void TilePack::erase(Entry* entry)
+{
+    releaseRef(entry->_offset);
+    header()->_tileBytes -= entry->_size;
+    --header()->_count;
+    entry->_size = 0;
+    entry->_offset = RemovedOffset;
+}
+
+void TilePack::addRef(const uint64_t offset, const uint32_t size, const uint64_t hash)
+{
+    auto it = _blobs.find(offset);
+    if (it == _blobs.end())
+    {
+        Blob blob;
+        blob._hash = hash;
+        blob._size = size;
+        blob._refs = 0;
+        it = _blobs.emplace(offset, blob).first;
+
+        // Keeps the existing one, should there be another copy.
+        _blobsByHash.emplace(hash, offset);
+        header()->_liveBytes += size;
+    }
+
+    ++it->second._refs;
+}
+
+void TilePack::releaseRef(const uint64_t offset)
+{
+    const auto it = _blobs.find(offset);
+    if (it == _blobs.end() || --it->second._refs > 0)
+        return;
+
+    header()->_liveBytes -= it->second._size;
+
+    const auto byHash = _blobsByHash.find(it->second._hash);
+    if (byHash != _blobsByHash.end() && byHash->second == offset)
+        _blobsByHash.erase(byHash);
+
+    _blobs.erase(it);
+}
+
+void TilePack::loadBlobs()
+{
+    _blobs.clear();
+    _blobsByHash.clear();
+    header()->_liveBytes = 0;
+
+    const Entry* begin = entries();
+    const Entry* end = begin + header()->_capacity;
+    for (const Entry* entry = begin; entry != end; ++entry)
+    {
+        if (entry->_size != 0)
+            addRef(entry->_offset, entry->_size, entry->_hash);
+    }
+}
+
+uint64_t TilePack::findData(const char* data, const uint32_t size, const uint64_t hash)
+{
+    const auto byHash = _blobsByHash.find(hash);
+    if (byHash == _blobsByHash.end())
+        return 0;
+
+    const uint64_t offset = byHash->second;
+    const Blob& blob = _blobs[offset];
+    if (blob._size != size)
+        return 0;
+
+    // Hashes can collide, so compare the data itself.
+    const std::shared_ptr<std::vector<char>> shared = blob._data.lock();
+    if (shared)
+        return (std::memcmp(shared->data(), data, size) == 0 ? offset : 0);
+
+    std::vector<char> existing(size);
+    readFully(_packFd, existing.data(), size, offset);
+    return (std::memcmp(existing.data(), data, size) == 0 ? offset : 0);
+}
+
+std::vector<TilePack::Entry> TilePack::liveEntries() const
+{
+    std::vector<Entry> result;
+    result.reserve(header()->_count);
+
+    const Entry* begin = entries();
+    const Entry* end = begin + header()->_capacity;
+    for (const Entry* entry = begin; entry != end; ++entry)
+    {
+        if (entry->_size != 0)
+            result.push_back(*entry);
+    }
+
+    std::sort(result.begin(), result.end(),
+              [](const Entry& a, const Entry& b) { return a._offset < b._offset; });
+    return result;
+}
+
+uint64_t TilePack::append(const TileKey& key, const char* data, const uint32_t size)
+{
+    Record record;
+    record._magic = RecordMagic;
+    toArray(key, record._key);
+    record._size = size;
+
+    const uint64_t offset = header()->_packSize;
+
+    struct iovec iov[2];
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(Record);
+    iov[1].iov_base = const_cast<char*>(data);
+    iov[1].iov_len = size;
+
+    const ssize_t expected = sizeof(Record) + size;
+    const ssize_t len = pwritev(_packFd, iov, (size > 0 ? 2 : 1), offset);
+    if (len != expected)
+    {
+        if (len < 0)
+            throw std::runtime_error(errorMessage("Failed to write tile pack", _packPath));
+
+        // Short write, complete it the slow way.
+        std::vector<char> buffer(reinterpret_cast<const char*>(&record), reinterpret_cast<const char*>(&record) + sizeof(Record));
+        buffer.insert(buffer.end(), data, data + size);
+        writeFully(_packFd, buffer.data() + len, expected - len, offset + len);
+    }
+
+    return offset + sizeof(Record);
+}
+
+uint64_t TilePack::appendRef(const TileKey& key, const uint32_t size, const uint64_t dataOffset)
+{
+    Record record;
+    record._magic = RefMagic;
+    toArray(key, record._key);
+    record._size = size;
+
+    const uint64_t offset = header()->_packSize;
+    const uint64_t distance = offset - dataOffset;
+
+    char buffer[RefRecordSize];
+    std::memcpy(buffer, &record, sizeof(Record));
+    std::memcpy(buffer + sizeof(Record), &distance, sizeof(distance));
+    writeFully(_packFd, buffer, sizeof(buffer), offset);
+
+    return offset + sizeof(buffer);
+}
+
+size_t TilePack::readRecords(const int fd, const std::vector<Entry>& entries, size_t begin,
+                             std::vector<char>& records, std::vector<uint64_t>& dataOffsets)
+{
+    records.clear();
+    dataOffsets.clear();
+
+    size_t dataStart = 0;
+    for ( ; begin < entries.size(); ++begin)
+    {
+        const Entry& entry = entries[begin];
+
+        // Only the first of the entries sharing data has it, the rest refer to it.
+        const bool shared = (!records.empty() && entry._offset == entries[begin - 1]._offset);
+        if (!shared && records.size() >= CopyBatchBytes)
+            break;
+
+        Record record;
+        record._magic = (shared ? RefMagic : RecordMagic);
+        std::memcpy(record._key, entry._key, sizeof(record._key));
+        record._size = entry._size;
+
+        const size_t start = records.size();
+        if (shared)
+        {
+            const uint64_t distance = start - dataStart;
+            records.resize(start + RefRecordSize);
+            std::memcpy(records.data() + start, &record, sizeof(Record));
+            std::memcpy(records.data() + start + sizeof(Record), &distance, sizeof(distance));
+        }
+        else
+        {
+            records.resize(start + sizeof(Record) + entry._size);
+            std::memcpy(records.data() + start, &record, sizeof(Record));
+            readFully(fd, records.data() + start + sizeof(Record), entry._size, entry._offset);
+            dataStart = start + sizeof(Record);
+        }
+
+        dataOffsets.push_back(dataStart);
+    }
+
+    return begin;
+}
+
+std::vector<uint64_t> TilePack::copyTiles(const int fromFd, const std::vector<Entry>& entries,
+                                          const int toFd, uint64_t& offset)
+{
+    std::vector<uint64_t> offsets;
+    offsets.reserve(entries.size());
+
+    std::vector<char> records;
+    std::vector<uint64_t> dataOffsets;
+    size_t begin = 0;
+    while (begin < entries.size())
+    {
+        begin = readRecords(fromFd, entries, begin, records, dataOffsets);
+        writeFully(toFd, records.data(), records.size(), offset);
+
+        for (const auto dataOffset : dataOffsets)
+        {
+            offsets.push_back(offset + dataOffset);
+        }
+
+        offset += records.size();
+    }
+
+    return offsets;
+}
+
+void TilePack::compactIfNeeded()
+{
+    // What a compacted pack would take: a record with the data of each blob,
+    // and a reference record for each other tile sharing it.
+    const Header* hdr = header();
+    const uint64_t used = hdr->_liveBytes + _blobs.size() * sizeof(Record) +
+                          (hdr->_count - _blobs.size()) * RefRecordSize;
+    const uint64_t garbage = (hdr->_packSize > used ? hdr->_packSize - used : 0);
+    if (garbage > CompactMinBytes && garbage > used)
+    {
+        compactLocked();
+    }
+}
+
+void TilePack::compactLocked()
+{
+    const uint64_t oldSize = header()->_packSize;
+    const std::vector<Entry> entries = liveEntries();
+
+    const std::string newPath = _packPath + ".new";
+    const int newFd = open(newPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (newFd < 0)
+    {
+        Log::error(errorMessage("Failed to create compacted tile pack", newPath));
+        return;
+    }
+
+    uint64_t end = 0;
+    std::vector<uint64_t> offsets;
+    try
+    {
+        offsets = copyTiles(_packFd, entries, newFd, end);
+    }
+    catch (const std::exception& exc)
+    {
+        Log::error() << "TilePack::compact: " << exc.what() << " [" << newPath << "]" << Log::end;
+        close(newFd);
+        unlink(newPath.c_str());
+        return;
+    }
+
+    if (rename(newPath.c_str(), _packPath.c_str()) != 0)
+    {
+        Log::error(errorMessage("Failed to replace tile pack", _packPath));
+        close(newFd);
+        unlink(newPath.c_str());
+        return;
+    }
+
+    close(_packFd);
+    _packFd = newFd;
+
+    uint32_t capacity = InitialCapacity;
+    while ((entries.size() + 1) * 10ull > capacity * 7ull / 2)
+        capacity *= 2;
+
+    createIndex(capacity);
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        insert(fromArray(entries[i]._key), offsets[i], entries[i]._size, entries[i]._hash);
+    }
+
+    header()->_packSize = end;
+
+    Log::info() << "Compacted tile pack " << _packPath << " from " << oldSize
+                << " to " << end << " bytes." << Log::end;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
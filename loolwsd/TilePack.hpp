@@ -0,0 +1,185 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TILEPACK_HPP
+#define INCLUDED_TILEPACK_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "TileIndex.hpp"
+
+/** Stores all the tiles of one cache directory in a single pack file.
+
+The pack (tiles.pack) is append-only: each tile is written after a small
+record header carrying its key, and removing a tile appends a record with
+no data. Replaced and removed tiles leave garbage behind, which is reclaimed
+by rewriting only the live tiles once there is more garbage than live data.
+
+The index (tiles.idx) is an open-addressing hash table from the tile key
+to the location of its data in the pack, mmap'ed, so a lookup is a probe
+in memory and a single pread, with no file to open. The index records the
+size of the pack it describes; when that doesn't match, e.g. after a crash,
+it is rebuilt by scanning the records of the pack.
+
+Identical tiles, like blank areas of pages, are stored once: a tile whose
+data is already in the pack only appends a record referring to it, and its
+index entry points at the same data. The data is reference counted, and
+becomes garbage when the last tile using it is removed. Readers of tiles
+sharing data also share one buffer, while any of them holds it.
+*/
+class TilePack
+{
+public:
+    /// Opens the pack in the given directory, creating it if necessary.
+    /// Throws std::runtime_error if it can't be opened.
+    explicit TilePack(const std::string& dirName);
+    ~TilePack();
+
+    TilePack(const TilePack&) = delete;
+    TilePack& operator=(const TilePack&) = delete;
+
+    /// Returns the data of the tile, nullptr if it isn't in the pack.
+    std::shared_ptr<std::vector<char>> get(const TileKey& key);
+
+    /// Adds or replaces the tile.
+    void put(const TileKey& key, const char* data, size_t size);
+
+    /// Removes the tile, returns false if it wasn't in the pack.
+    bool remove(const TileKey& key);
+
+    bool contains(const TileKey& key);
+
+    /// Returns the keys of all the tiles in the pack.
+    std::vector<TileKey> keys();
+
+    /// Appends all the tiles of other to this pack, replacing
+    /// existing ones, in large sequential writes. Lookups in this
+    /// pack are only held up for one write at a time.
+    /// Returns false if that failed, in which case only some of
+    /// the tiles may have been merged.
+    bool merge(TilePack& other);
+
+    /// Removes all the tiles.
+    void clear();
+
+    /// Rewrites the pack with only the live tiles.
+    void compact();
+
+    /// Number of tiles in the pack.
+    size_t size();
+
+    /// Bytes of tile data in the pack, without garbage and record headers,
+    /// counting data shared by several tiles once.
+    size_t getLiveBytes();
+
+    /// Bytes of all the tiles in the pack, as if none were shared.
+    size_t getTileBytes();
+
+    /// Size of the pack file.
+    size_t getPackBytes();
+
+    /// True for the files of a pack, which are not tiles themselves.
+    static bool isPackFile(const std::string& fileName);
+
+    static const std::string PackFileName;
+    static const std::string IndexFileName;
+
+    /// Garbage below which the pack is never compacted.
+    static size_t CompactMinBytes;
+
+private:
+    struct Header;
+    struct Entry;
+
+    /// Tile data in the pack, shared by _refs tiles.
+    struct Blob
+    {
+        uint64_t _hash;
+        uint32_t _size;
+        uint32_t _refs;
+
+        /// The data while some reader holds it.
+        std::weak_ptr<std::vector<char>> _data;
+    };
+
+    static size_t getIndexFileSize(uint32_t capacity);
+
+    Header* header() const;
+    Entry* entries() const;
+
+    void openIndex();
+    void createIndex(uint32_t capacity);
+    void rebuildIndex();
+    void unmapIndex();
+
+    Entry* find(const TileKey& key) const;
+    void insert(const TileKey& key, uint64_t offset, uint32_t size, uint64_t hash);
+    void erase(Entry* entry);
+
+    /// Counts a reference to the data at offset, or releases one.
+    void addRef(uint64_t offset, uint32_t size, uint64_t hash);
+    void releaseRef(uint64_t offset);
+
+    /// Rebuilds _blobs from the entries of the index.
+    void loadBlobs();
+
+    /// Returns the offset of data identical to the given one, 0 if there is none.
+    /// Throws if the data to compare with can't be read.
+    uint64_t findData(const char* data, uint32_t size, uint64_t hash);
+
+    /// Live entries, in the order of their data in the pack.
+    std::vector<Entry> liveEntries() const;
+
+    /// Appends a record to the pack and returns the offset of its data.
+    uint64_t append(const TileKey& key, const char* data, uint32_t size);
+
+    /// Appends a record of a tile with the data at dataOffset,
+    /// and returns the end of the record.
+    uint64_t appendRef(const TileKey& key, uint32_t size, uint64_t dataOffset);
+
+    /// Reads entries from begin on, as records ready to be appended to
+    /// a pack, until about a megabyte. Entries sharing data, which are
+    /// adjacent, are read together, the data only once. Sets dataOffsets
+    /// to the offset of the data of each, relative to the start of records.
+    /// Returns the end of what was read. Throws on failure.
+    static size_t readRecords(int fd, const std::vector<Entry>& entries, size_t begin,
+                              std::vector<char>& records, std::vector<uint64_t>& dataOffsets);
+
+    /// Copies the data of entries from fromFd to toFd starting at offset,
+    /// as records. Returns the new data offsets, in order,
+    /// and sets offset to the end of what was written. Throws on failure.
+    static std::vector<uint64_t> copyTiles(int fromFd, const std::vector<Entry>& entries,
+                                           int toFd, uint64_t& offset);
+
+    void compactIfNeeded();
+    void compactLocked();
+
+    const std::string _packPath;
+    const std::string _indexPath;
+    int _packFd;
+    int _indexFd;
+    char* _index;
+    size_t _indexSize;
+
+    /// The data in the pack by offset, and the offset of data by its hash.
+    std::unordered_map<uint64_t, Blob> _blobs;
+    std::unordered_map<uint64_t, uint64_t> _blobsByHash;
+
+    std::mutex _mutex;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
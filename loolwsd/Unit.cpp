@@ -140,7 +140,7 @@ void UnitBase::exitTest(TestResult result)
     _retValue = result == TestResult::TEST_OK ?
         Poco::Util::Application::EXIT_OK :
         Poco::Util::Application::EXIT_SOFTWARE;
-    TerminationFlag = true;
+    Util::setTerminationFlag();
 }
 
 void UnitBase::timeout()
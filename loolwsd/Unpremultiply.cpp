@@ -0,0 +1,229 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "Unpremultiply.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UNPREMULTIPLY_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+
+/// Reciprocals of the alphas, 0 for 0, so fully transparent pixels come out as 0.
+///
+/// A channel c of a pixel with alpha a becomes (c * 255 + a / 2) / a, rounded down.
+/// The dividend is below 2^16, so with the integer reciprocal, 2^32 / a rounded up,
+/// the quotient is off by less than 2^-16, and with the float one, the dividend
+/// moved up by 0.5 first, by less than 2^-15 either way. A quotient is at least
+/// 1 / a from the next integer, and then 0.5 / a, so neither changes the result.
+struct Reciprocals
+{
+    Reciprocals()
+    {
+        _integer[0] = 0;
+        _float[0] = 0;
+        for (uint32_t alpha = 1; alpha < 256; ++alpha)
+        {
+            _integer[alpha] = ((uint64_t(1) << 32) + alpha - 1) / alpha;
+            _float[alpha] = 1.0f / alpha;
+        }
+    }
+
+    uint64_t _integer[256];
+    float _float[256];
+};
+
+const Reciprocals& getReciprocals()
+{
+    static const Reciprocals reciprocals;
+    return reciprocals;
+}
+
+inline
+unsigned char scale(const uint32_t channel, const uint32_t alpha, const Reciprocals& reciprocals)
+{
+    const uint64_t value = (uint64_t(channel * 255 + alpha / 2) * reciprocals._integer[alpha]) >> 32;
+    return std::min<uint64_t>(value, 255);
+}
+
+void toRGBAScalar(unsigned char* data, const size_t pixels)
+{
+    const Reciprocals& reciprocals = getReciprocals();
+    for (size_t i = 0; i < pixels; ++i)
+    {
+        unsigned char* b = data + i * 4;
+        uint32_t pixel;
+        std::memcpy(&pixel, b, sizeof(pixel));
+
+        const uint32_t alpha = pixel >> 24;
+        const uint32_t red = (pixel >> 16) & 0xff;
+        const uint32_t green = (pixel >> 8) & 0xff;
+        const uint32_t blue = pixel & 0xff;
+        if (alpha == 255)
+        {
+            b[0] = red;
+            b[1] = green;
+            b[2] = blue;
+        }
+        else
+        {
+            b[0] = scale(red, alpha, reciprocals);
+            b[1] = scale(green, alpha, reciprocals);
+            b[2] = scale(blue, alpha, reciprocals);
+        }
+
+        b[3] = alpha;
+    }
+}
+
+#if UNPREMULTIPLY_X86
+
+__attribute__((target("sse2")))
+inline
+__m128i scaleSSE2(const __m128i channel, const __m128i half, const __m128 reciprocal)
+{
+    const __m128i dividend = _mm_add_epi32(_mm_sub_epi32(_mm_slli_epi32(channel, 8), channel), half);
+    const __m128 value = _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(dividend), _mm_set1_ps(0.5f)), reciprocal);
+    return _mm_cvttps_epi32(_mm_min_ps(value, _mm_set1_ps(255.0f)));
+}
+
+__attribute__((target("sse2")))
+void toRGBASSE2(unsigned char* data, const size_t pixels)
+{
+    const Reciprocals& reciprocals = getReciprocals();
+    const __m128i byteMask = _mm_set1_epi32(0xff);
+    const __m128i opaque = _mm_set1_epi32(0xff);
+    const __m128i alphaGreenMask = _mm_set1_epi32(0xff00ff00);
+
+    size_t i = 0;
+    for (; i + 4 <= pixels; i += 4)
+    {
+        __m128i* p = reinterpret_cast<__m128i*>(data + i * 4);
+        const __m128i pixel = _mm_loadu_si128(p);
+        const __m128i alpha = _mm_srli_epi32(pixel, 24);
+        const __m128i red = _mm_and_si128(_mm_srli_epi32(pixel, 16), byteMask);
+        const __m128i blue = _mm_and_si128(pixel, byteMask);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, opaque)) == 0xffff)
+        {
+            // Only swap red and blue.
+            const __m128i alphaGreen = _mm_and_si128(pixel, alphaGreenMask);
+            _mm_storeu_si128(p, _mm_or_si128(alphaGreen, _mm_or_si128(red, _mm_slli_epi32(blue, 16))));
+            continue;
+        }
+
+        alignas(16) uint32_t alphas[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(alphas), alpha);
+        const __m128 reciprocal = _mm_set_ps(reciprocals._float[alphas[3]], reciprocals._float[alphas[2]],
+                                             reciprocals._float[alphas[1]], reciprocals._float[alphas[0]]);
+
+        const __m128i half = _mm_srli_epi32(alpha, 1);
+        const __m128i green = _mm_and_si128(_mm_srli_epi32(pixel, 8), byteMask);
+        __m128i result = _mm_slli_epi32(alpha, 24);
+        result = _mm_or_si128(result, scaleSSE2(red, half, reciprocal));
+        result = _mm_or_si128(result, _mm_slli_epi32(scaleSSE2(green, half, reciprocal), 8));
+        result = _mm_or_si128(result, _mm_slli_epi32(scaleSSE2(blue, half, reciprocal), 16));
+        _mm_storeu_si128(p, result);
+    }
+
+    toRGBAScalar(data + i * 4, pixels - i);
+}
+
+__attribute__((target("avx2")))
+inline
+__m256i scaleAVX2(const __m256i channel, const __m256i half, const __m256 reciprocal)
+{
+    const __m256i dividend = _mm256_add_epi32(_mm256_sub_epi32(_mm256_slli_epi32(channel, 8), channel), half);
+    const __m256 value = _mm256_mul_ps(_mm256_add_ps(_mm256_cvtepi32_ps(dividend), _mm256_set1_ps(0.5f)), reciprocal);
+    return _mm256_cvttps_epi32(_mm256_min_ps(value, _mm256_set1_ps(255.0f)));
+}
+
+__attribute__((target("avx2")))
+void toRGBAAVX2(unsigned char* data, const size_t pixels)
+{
+    const Reciprocals& reciprocals = getReciprocals();
+    const __m256i byteMask = _mm256_set1_epi32(0xff);
+    const __m256i opaque = _mm256_set1_epi32(0xff);
+    const __m256i swapRedBlue = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                                 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    size_t i = 0;
+    for (; i + 8 <= pixels; i += 8)
+    {
+        __m256i* p = reinterpret_cast<__m256i*>(data + i * 4);
+        const __m256i pixel = _mm256_loadu_si256(p);
+        const __m256i alpha = _mm256_srli_epi32(pixel, 24);
+
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, opaque)) == -1)
+        {
+            _mm256_storeu_si256(p, _mm256_shuffle_epi8(pixel, swapRedBlue));
+            continue;
+        }
+
+        const __m256 reciprocal = _mm256_i32gather_ps(reciprocals._float, alpha, sizeof(float));
+        const __m256i half = _mm256_srli_epi32(alpha, 1);
+        const __m256i red = _mm256_and_si256(_mm256_srli_epi32(pixel, 16), byteMask);
+        const __m256i green = _mm256_and_si256(_mm256_srli_epi32(pixel, 8), byteMask);
+        const __m256i blue = _mm256_and_si256(pixel, byteMask);
+        __m256i result = _mm256_slli_epi32(alpha, 24);
+        result = _mm256_or_si256(result, scaleAVX2(red, half, reciprocal));
+        result = _mm256_or_si256(result, _mm256_slli_epi32(scaleAVX2(green, half, reciprocal), 8));
+        result = _mm256_or_si256(result, _mm256_slli_epi32(scaleAVX2(blue, half, reciprocal), 16));
+        _mm256_storeu_si256(p, result);
+    }
+
+    toRGBAScalar(data + i * 4, pixels - i);
+}
+
+#endif
+
+const std::pair<std::string, Unpremultiply::Function>& getBest()
+{
+    static const std::pair<std::string, Unpremultiply::Function> best = Unpremultiply::getImplementations().back();
+    return best;
+}
+
+}
+
+namespace Unpremultiply
+{
+    void toRGBA(unsigned char* data, const size_t pixels)
+    {
+        getBest().second(data, pixels);
+    }
+
+    const std::string& getImplementation()
+    {
+        return getBest().first;
+    }
+
+    std::vector<std::pair<std::string, Function>> getImplementations()
+    {
+        std::vector<std::pair<std::string, Function>> implementations;
+        implementations.emplace_back("scalar", toRGBAScalar);
+
+#if UNPREMULTIPLY_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2"))
+            implementations.emplace_back("sse2", toRGBASSE2);
+        if (__builtin_cpu_supports("avx2"))
+            implementations.emplace_back("avx2", toRGBAAVX2);
+#endif
+
+        return implementations;
+    }
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
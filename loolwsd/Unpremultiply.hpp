@@ -0,0 +1,43 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_UNPREMULTIPLY_HPP
+#define INCLUDED_UNPREMULTIPLY_HPP
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+/** Converts the pixels LOK paints in LOK_TILEMODE_BGRA - native endian
+premultiplied ARGB - into the unpremultiplied RGBA bytes PNG wants.
+
+Gives the same bytes as unpremultiply_data() in Png.hpp, without a division
+per channel: the channels are scaled by a reciprocal of alpha from a table,
+a vector of pixels at a time where the CPU can, and fully opaque pixels are
+only reordered. Channels larger than their alpha, which premultiplied data
+never has, come out as 255.
+*/
+namespace Unpremultiply
+{
+    typedef void (*Function)(unsigned char* data, size_t pixels);
+
+    /// Converts the pixels in place, with the fastest implementation this CPU has.
+    void toRGBA(unsigned char* data, size_t pixels);
+
+    /// The name of the implementation toRGBA() uses.
+    const std::string& getImplementation();
+
+    /// All the implementations this CPU can run, the portable one first.
+    std::vector<std::pair<std::string, Function>> getImplementations();
+}
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -10,10 +10,12 @@
 #include "config.h"
 
 #include <execinfo.h>
+#include <sys/eventfd.h>
 #include <sys/poll.h>
 #include <sys/prctl.h>
 #include <sys/uio.h>
 
+#include <atomic>
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
@@ -38,9 +40,11 @@
 #include <Poco/Timestamp.h>
 #include <Poco/Util/Application.h>
 
+#include "BufferPool.hpp"
 #include "Common.hpp"
+#include "TileColors.hpp"
+#include "Unpremultiply.hpp"
 #include "Util.hpp"
-#include "Png.hpp"
 
 // Callback functions for libpng
 
@@ -63,8 +67,58 @@ extern "C"
     }
 }
 
+namespace
+{
+    enum class PngColorType { Palette, RGB, RGBA, Count };
+
+    /// What encodeSubBufferToPNG() wrote, for one color type.
+    struct PngTypeMetrics
+    {
+        std::atomic<uint64_t> _tiles;
+        std::atomic<uint64_t> _pixels;
+        /// The size of the rows before deflate.
+        std::atomic<uint64_t> _rowBytes;
+        std::atomic<uint64_t> _pngBytes;
+    };
+
+    PngTypeMetrics PngMetrics[static_cast<int>(PngColorType::Count)];
+}
+
 volatile bool TerminationFlag = false;
 
+namespace
+{
+    /// Signalled by setTerminationFlag(), so it's only created outside of signal handlers.
+    std::atomic<int> TerminationFd(-1);
+    std::mutex TerminationFdMutex;
+
+    /// Replaces the eventfd, as the one inherited by a forked process would be signalled by
+    /// its parent.
+    void createTerminationFd()
+    {
+        const int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0)
+        {
+            Log::syserror("Failed to create the termination eventfd.");
+        }
+
+        const int old = TerminationFd.exchange(fd);
+        if (old >= 0)
+        {
+            close(old);
+        }
+
+        if (TerminationFlag && fd >= 0)
+        {
+            const uint64_t one = 1;
+            if (write(fd, &one, sizeof(one)) < 0)
+            {
+                Log::syserror("Failed to signal the termination eventfd.");
+            }
+        }
+    }
+}
+
 namespace Util
 {
 namespace rng
@@ -158,6 +212,58 @@ namespace Util
         if (bufferWidth < width || bufferHeight < height)
             return false;
 
+        BufferPool::Pixmap converted;
+        if (mode == LOK_TILEMODE_BGRA)
+        {
+            // All of it before encoding, rather than row by row in a libpng transform. Into a
+            // copy, as the pixmap may be encoded again, or by other threads, for other tiles.
+            converted = BufferPool::get().getPixmap(static_cast<size_t>(width) * height * 4);
+            for (int y = 0; y < height; ++y)
+            {
+                const size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
+                std::memcpy(converted.data() + y * width * 4, pixmap + position, width * 4);
+            }
+
+            Unpremultiply::toRGBA(converted.data(), static_cast<size_t>(width) * height);
+            pixmap = converted.data();
+            startX = 0;
+            startY = 0;
+            bufferWidth = width;
+        }
+
+        // The cheapest color type that holds the pixels: indices into a palette, RGB, or RGBA.
+        const TileColors colors(pixmap, startX, startY, width, height, bufferWidth);
+        const std::vector<uint32_t>& palette = colors.getPalette();
+
+        PngColorType colorType = PngColorType::RGBA;
+        int pngColorType = PNG_COLOR_TYPE_RGB_ALPHA;
+        int bitDepth = 8;
+        int channels = 4;
+        std::vector<png_color> pngPalette;
+        std::vector<png_byte> pngAlphas;
+        std::vector<png_byte> row;
+        if (colors.hasPalette())
+        {
+            colorType = PngColorType::Palette;
+            pngColorType = PNG_COLOR_TYPE_PALETTE;
+            channels = 1;
+            bitDepth = (palette.size() <= 2 ? 1 : palette.size() <= 4 ? 2 : palette.size() <= 16 ? 4 : 8);
+            for (const uint32_t color : palette)
+            {
+                png_byte rgba[4];
+                std::memcpy(rgba, &color, sizeof(rgba));
+                pngPalette.push_back(png_color{ rgba[0], rgba[1], rgba[2] });
+                pngAlphas.push_back(rgba[3]);
+            }
+        }
+        else if (colors.isOpaque())
+        {
+            colorType = PngColorType::RGB;
+            pngColorType = PNG_COLOR_TYPE_RGB;
+            channels = 3;
+            row.resize(width * 3);
+        }
+
         png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
 
         png_infop info_ptr = png_create_info_struct(png_ptr);
@@ -168,31 +274,92 @@ namespace Util
             return false;
         }
 
-        png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_set_IHDR(png_ptr, info_ptr, width, height, bitDepth, pngColorType, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+        if (colorType == PngColorType::Palette)
+        {
+            png_set_PLTE(png_ptr, info_ptr, pngPalette.data(), pngPalette.size());
+            if (!colors.isOpaque())
+                png_set_tRNS(png_ptr, info_ptr, pngAlphas.data(), pngAlphas.size(), nullptr);
+        }
 
         png_set_write_fn(png_ptr, &output, user_write_fn, user_flush_fn);
         png_set_write_status_fn(png_ptr, user_write_status_fn);
 
+        const size_t oldSize = output.size();
         png_write_info(png_ptr, info_ptr);
 
-        if (mode == LOK_TILEMODE_BGRA)
+        if (colorType == PngColorType::Palette)
         {
-            png_set_write_user_transform_fn (png_ptr, unpremultiply_data);
+            // One index per byte, libpng packs them to the bit depth.
+            png_set_packing(png_ptr);
+            for (int y = 0; y < height; ++y)
+            {
+                png_write_row(png_ptr, const_cast<png_bytep>(colors.getIndices().data()) + y * width);
+            }
         }
+        else if (colorType == PngColorType::RGB)
+        {
+            for (int y = 0; y < height; ++y)
+            {
+                const unsigned char* pixel = pixmap + ((startY + y) * bufferWidth * 4) + (startX * 4);
+                for (int x = 0; x < width; ++x, pixel += 4)
+                {
+                    std::memcpy(row.data() + x * 3, pixel, 3);
+                }
 
-        for (int y = 0; y < height; ++y)
+                png_write_row(png_ptr, row.data());
+            }
+        }
+        else
         {
-            size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
-            png_write_row(png_ptr, pixmap + position);
+            for (int y = 0; y < height; ++y)
+            {
+                size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
+                png_write_row(png_ptr, pixmap + position);
+            }
         }
 
         png_write_end(png_ptr, info_ptr);
 
         png_destroy_write_struct(&png_ptr, &info_ptr);
 
+        PngTypeMetrics& metrics = PngMetrics[static_cast<int>(colorType)];
+        ++metrics._tiles;
+        metrics._pixels += static_cast<uint64_t>(width) * height;
+        metrics._rowBytes += static_cast<uint64_t>(height) * ((width * channels * bitDepth + 7) / 8);
+        metrics._pngBytes += output.size() - oldSize;
+
         return true;
     }
 
+    std::string getPngMetrics()
+    {
+        static const char* const names[] = { "palette", "rgb", "rgba" };
+
+        std::ostringstream oss;
+        uint64_t pixels = 0;
+        uint64_t rowBytes = 0;
+        for (int i = 0; i < static_cast<int>(PngColorType::Count); ++i)
+        {
+            const PngTypeMetrics& metrics = PngMetrics[i];
+            const uint64_t tiles = metrics._tiles;
+            oss << (i ? ", " : "") << names[i] << ": " << tiles << " tiles";
+            if (tiles > 0)
+                oss << " of " << metrics._pngBytes / tiles << " bytes on average";
+
+            pixels += metrics._pixels;
+            rowBytes += metrics._rowBytes;
+        }
+
+        // What deflate gets to compress, against 4 bytes a pixel.
+        oss << "; " << rowBytes << " bytes of pixels instead of " << pixels * 4 << " as RGBA";
+        if (pixels > 0)
+            oss << " (" << (100 - rowBytes * 100 / (pixels * 4)) << "% saved)";
+
+        return oss.str();
+    }
+
     const char *signalName(const int signo)
     {
         switch (signo)
@@ -253,12 +420,39 @@ namespace Util
         }
     }
 
+    void setTerminationFlag()
+    {
+        TerminationFlag = true;
+
+        const int fd = TerminationFd;
+        if (fd >= 0)
+        {
+            // Never read, so it stays readable.
+            const uint64_t one = 1;
+            if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            {
+                Log::signalLog("Failed to signal the termination eventfd.\n");
+            }
+        }
+    }
+
+    int getTerminationFd()
+    {
+        std::unique_lock<std::mutex> lock(TerminationFdMutex);
+        if (TerminationFd < 0)
+        {
+            createTerminationFd();
+        }
+
+        return TerminationFd;
+    }
+
     static
     void handleTerminationSignal(const int signal)
     {
         if (!TerminationFlag)
         {
-            TerminationFlag = true;
+            setTerminationFlag();
 
             Log::signalLogPrefix();
             Log::signalLog(" Termination signal received: ");
@@ -269,6 +463,11 @@ namespace Util
 
     void setTerminationSignals()
     {
+        {
+            std::unique_lock<std::mutex> lock(TerminationFdMutex);
+            createTerminationFd();
+        }
+
         struct sigaction action;
 
         sigemptyset(&action.sa_mask);
@@ -52,12 +52,17 @@ namespace Util
 
     // Sadly, older libpng headers don't use const for the pixmap pointer parameter to
     // png_write_row(), so can't use const here for pixmap.
+    // In LOK_TILEMODE_BGRA the encoded part of the pixmap is converted to RGBA in a copy,
+    // the pixmap is left as is.
     bool encodeBufferToPNG(unsigned char* pixmap, int width, int height,
                            std::vector<char>& output, LibreOfficeKitTileMode mode);
     bool encodeSubBufferToPNG(unsigned char* pixmap, int startX, int startY, int width, int height,
                               int bufferWidth, int bufferHeight,
                               std::vector<char>& output, LibreOfficeKitTileMode mode);
 
+    /// The color types of the PNGs this process encoded and what they saved.
+    std::string getPngMetrics();
+
     /// Safely remove a file or directory.
     /// Supresses exception when the file is already removed.
     /// This can happen when there is a race (unavoidable) or when
@@ -102,6 +107,14 @@ namespace Util
 
     /// Trap signals to cleanup and exit the process gracefully.
     void setTerminationSignals();
+
+    /// Sets TerminationFlag and wakes up those waiting on getTerminationFd().
+    /// Async-signal-safe.
+    void setTerminationFlag();
+
+    /// An eventfd that turns readable once TerminationFlag is set, to poll along with what
+    /// one waits for.
+    int getTerminationFd();
     void setFatalSignals();
 
     void requestTermination(const Poco::Process::PID& pid);
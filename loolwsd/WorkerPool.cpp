@@ -0,0 +1,154 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "WorkerPool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+
+#include "Log.hpp"
+#include "Util.hpp"
+
+constexpr size_t WorkerPool::MaxIdle;
+constexpr int WorkerPool::IdleTimeoutMs;
+
+namespace
+{
+
+size_t getCoreCount()
+{
+    return std::max(std::thread::hardware_concurrency(), 1U);
+}
+
+}
+
+WorkerPool::WorkerPool(const std::string& name, const size_t maxThreads) :
+    _name(name),
+    _maxThreads(std::max<size_t>(maxThreads, 1)),
+    _idle(0),
+    _stop(false)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _stop = true;
+    _cv.notify_all();
+
+    // Each thread moves itself to the exited ones when it's done.
+    _cv.wait(lock, [this]() { return _threads.empty(); });
+    joinExited(lock);
+}
+
+WorkerPool& WorkerPool::get()
+{
+    static WorkerPool pool("wsd_io", getCoreCount() + 4);
+    return pool;
+}
+
+WorkerPool& WorkerPool::getSessions()
+{
+    static WorkerPool pool("wsd_session", 4 * getCoreCount() + 4);
+    return pool;
+}
+
+WorkerPool& WorkerPool::getFinishing()
+{
+    static WorkerPool pool("wsd_finish", 2 * getCoreCount() + 2);
+    return pool;
+}
+
+void WorkerPool::post(Job job)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _jobs.push_back(std::move(job));
+    if (_jobs.size() > _idle && _threads.size() < _maxThreads)
+    {
+        std::thread thread([this]() { work(); });
+        const auto id = thread.get_id();
+        _threads.emplace(id, std::move(thread));
+    }
+    else
+    {
+        _cv.notify_one();
+    }
+
+    if (!_exited.empty())
+        joinExited(lock);
+}
+
+size_t WorkerPool::getThreadCount() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _threads.size();
+}
+
+void WorkerPool::work()
+{
+    Util::setThreadName(_name);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+        if (_jobs.empty())
+        {
+            if (_stop)
+                break;
+
+            ++_idle;
+            const bool woken = _cv.wait_for(lock, std::chrono::milliseconds(IdleTimeoutMs),
+                                            [this]() { return _stop || !_jobs.empty(); });
+            --_idle;
+
+            // Enough others are idle to take what comes.
+            if (!woken && _idle >= MaxIdle)
+                break;
+
+            continue;
+        }
+
+        Job job = std::move(_jobs.front());
+        _jobs.pop_front();
+
+        lock.unlock();
+        try
+        {
+            job();
+        }
+        catch (const std::exception& exc)
+        {
+            Log::error() << "WorkerPool::work: Exception: " << exc.what() << Log::end;
+        }
+
+        lock.lock();
+    }
+
+    const auto it = _threads.find(std::this_thread::get_id());
+    _exited.push_back(std::move(it->second));
+    _threads.erase(it);
+    _cv.notify_all();
+}
+
+void WorkerPool::joinExited(std::unique_lock<std::mutex>& lock)
+{
+    std::vector<std::thread> exited;
+    exited.swap(_exited);
+
+    lock.unlock();
+    for (auto& thread : exited)
+    {
+        thread.join();
+    }
+
+    lock.lock();
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
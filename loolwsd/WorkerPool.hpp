@@ -0,0 +1,91 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_WORKERPOOL_HPP
+#define INCLUDED_WORKERPOOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** Threads running the jobs posted to them, as many as are busy at once, up
+to a limit.
+
+Used by wsd, so that only the sessions with something to do take a thread.
+A thread is started when none is idle, until there are maxThreads, then
+the jobs wait for one. Past MaxIdle idle threads, those idle for
+IdleTimeoutMs exit.
+
+The jobs of a pool don't wait for each other, or the pool could fill with
+the waiting ones, so wsd has one for each kind of job: get() for the
+socket reads and writes, which don't block for long, getSessions() for
+handling the messages of the sessions, which may wait for connecting to a
+kit, and getFinishing() for ending the sessions, which waits for saving and
+for their messages to be handled.
+*/
+class WorkerPool
+{
+public:
+    typedef std::function<void()> Job;
+
+    static constexpr size_t MaxIdle = 4;
+    static constexpr int IdleTimeoutMs = 10000;
+
+    WorkerPool(const std::string& name, size_t maxThreads);
+
+    /// Runs the jobs posted, then stops the threads.
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    /// The pool of this process for the socket I/O, a thread per core and a few more.
+    static WorkerPool& get();
+
+    /// The pool of this process for handling the messages of the sessions.
+    static WorkerPool& getSessions();
+
+    /// The pool of this process for ending the sessions.
+    static WorkerPool& getFinishing();
+
+    /// Runs job on a thread of the pool. Exceptions thrown by it are logged and otherwise ignored.
+    void post(Job job);
+
+    size_t getMaxThreads() const { return _maxThreads; }
+
+    size_t getThreadCount() const;
+
+private:
+    void work();
+
+    /// Joins the threads that exited, with the lock released.
+    void joinExited(std::unique_lock<std::mutex>& lock);
+
+private:
+    const std::string _name;
+    const size_t _maxThreads;
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<Job> _jobs;
+    size_t _idle;
+    bool _stop;
+    std::map<std::thread::id, std::thread> _threads;
+    /// The threads that exited, to be joined.
+    std::vector<std::thread> _exited;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
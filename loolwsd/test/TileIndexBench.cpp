@@ -0,0 +1,142 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Compares the cost of invalidating tiles through the TileIndex with the
+ * old approach of parsing the name of every tile file in the cache, for
+ * growing cache sizes. Build with 'make tileindexbench'.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "TileIndex.hpp"
+
+namespace
+{
+
+constexpr int TileTwips = 3840;
+constexpr int TilesPerRow = 20;
+constexpr int Invalidations = 200;
+
+std::string cacheFileName(const TileKey& key)
+{
+    std::ostringstream oss;
+    oss << key._part << '_' << key._width << 'x' << key._height << '.'
+        << key._tilePosX << ',' << key._tilePosY << '.'
+        << key._tileWidth << 'x' << key._tileHeight << ".png";
+    return oss.str();
+}
+
+/// What TileCache::invalidateTiles() used to do for every file in the cache directory.
+size_t scanNames(const std::vector<std::string>& names, int part, int x, int y, int width, int height)
+{
+    size_t found = 0;
+    for (const auto& name : names)
+    {
+        int tilePart, tilePixelWidth, tilePixelHeight, tilePosX, tilePosY, tileWidth, tileHeight;
+        if (std::sscanf(name.c_str(), "%d_%dx%d.%d,%d.%dx%d.png", &tilePart, &tilePixelWidth, &tilePixelHeight,
+                        &tilePosX, &tilePosY, &tileWidth, &tileHeight) == 7)
+        {
+            found += TileKey(tilePart, tilePixelWidth, tilePixelHeight, tilePosX, tilePosY, tileWidth, tileHeight)
+                         .intersects(part, x, y, width, height);
+        }
+    }
+
+    return found;
+}
+
+template <typename Func>
+double measureMicroseconds(Func func)
+{
+    const auto start = std::chrono::steady_clock::now();
+    func();
+    const auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(end - start).count() / Invalidations;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<size_t> sizes = { 1000, 10000, 100000 };
+    if (argc > 1)
+    {
+        sizes.clear();
+        for (int i = 1; i < argc; ++i)
+        {
+            sizes.push_back(std::strtoul(argv[i], nullptr, 10));
+        }
+    }
+
+    std::cout << std::setw(10) << "tiles"
+              << std::setw(16) << "scan (us)"
+              << std::setw(16) << "index (us)"
+              << std::setw(12) << "speedup" << std::endl;
+
+    for (const size_t size : sizes)
+    {
+        // A document with a single zoom level, parts of 20 x 50 tiles.
+        TileIndex index;
+        std::vector<std::string> names;
+        names.reserve(size);
+        for (size_t i = 0; i < size; ++i)
+        {
+            const int part = i / (TilesPerRow * 50);
+            const int row = (i / TilesPerRow) % 50;
+            const int column = i % TilesPerRow;
+            const TileKey key(part, 256, 256, column * TileTwips, row * TileTwips, TileTwips, TileTwips);
+            index.add(key);
+            names.push_back(cacheFileName(key));
+        }
+
+        // Typing invalidates a line or two, somewhere in the document.
+        const int parts = std::max<int>(1, size / (TilesPerRow * 50));
+        size_t scanFound = 0;
+        const double scan = measureMicroseconds([&]() {
+                for (int i = 0; i < Invalidations; ++i)
+                {
+                    scanFound += scanNames(names, i % parts, 1000, (i % 50) * TileTwips, 30000, 500);
+                }
+            });
+
+        size_t indexFound = 0;
+        const double indexed = measureMicroseconds([&]() {
+                for (int i = 0; i < Invalidations; ++i)
+                {
+                    indexFound += index.intersecting(i % parts, 1000, (i % 50) * TileTwips, 30000, 500).size();
+                }
+            });
+
+        if (scanFound != indexFound)
+        {
+            std::cerr << "Mismatch: scan found " << scanFound << " tiles, index " << indexFound << std::endl;
+            return 1;
+        }
+
+        std::cout << std::setw(10) << size
+                  << std::setw(16) << std::fixed << std::setprecision(1) << scan
+                  << std::setw(16) << indexed
+                  << std::setw(12) << std::setprecision(0) << scan / std::max(indexed, 0.001) << "x"
+                  << std::endl;
+    }
+
+    return 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,151 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Measures the throughput of serving tiles from the in-memory cache, as
+ * MasterProcessSession::sendTile() used to do it - a buffer of the size of
+ * the raw pixmap, the header and the PNG copied into it - and with cached
+ * tile: messages, for a few PNG sizes. Both end with the copy into the
+ * WebSocket frame. Build with 'make tilemessagebench'.
+ */
+
+#include "config.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "TileMessage.hpp"
+
+namespace
+{
+
+constexpr int TileTwips = 3840;
+constexpr int TilePixels = 256;
+constexpr int Tiles = 200;
+constexpr int Requests = 100000;
+
+/// Where the WebSocket would copy the frame to.
+std::vector<char> Frame;
+
+size_t sendFrame(const char* data, size_t size)
+{
+    if (Frame.size() < size)
+        Frame.resize(size);
+
+    std::memcpy(Frame.data(), data, size);
+    return size;
+}
+
+TileKey keyOf(int i)
+{
+    return TileKey(0, TilePixels, TilePixels, (i % 20) * TileTwips, (i / 20) * TileTwips, TileTwips, TileTwips);
+}
+
+std::string requestHeader(const TileKey& key)
+{
+    // As sendTile() builds it from the tokens of the request.
+    return "tile: part=" + std::to_string(key._part) + " width=" + std::to_string(key._width) +
+           " height=" + std::to_string(key._height) + " tileposx=" + std::to_string(key._tilePosX) +
+           " tileposy=" + std::to_string(key._tilePosY) + " tilewidth=" + std::to_string(key._tileWidth) +
+           " tileheight=" + std::to_string(key._tileHeight) + "\n";
+}
+
+template <typename Func>
+double measureTilesPerSecond(Func func)
+{
+    const auto start = std::chrono::steady_clock::now();
+    func();
+    const auto end = std::chrono::steady_clock::now();
+    return Requests / std::chrono::duration<double>(end - start).count();
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<size_t> sizes = { 1000, 16000, 64000 };
+    if (argc > 1)
+    {
+        sizes.clear();
+        for (int i = 1; i < argc; ++i)
+        {
+            sizes.push_back(std::strtoul(argv[i], nullptr, 10));
+        }
+    }
+
+    std::cout << std::setw(10) << "png bytes"
+              << std::setw(18) << "copy (tiles/s)"
+              << std::setw(18) << "cached (tiles/s)"
+              << std::setw(12) << "speedup" << std::endl;
+
+    for (const size_t size : sizes)
+    {
+        const std::vector<char> png(size, 'x');
+
+        std::unordered_map<int, std::shared_ptr<std::vector<char>>> pngs;
+        std::unordered_map<int, std::shared_ptr<const TileMessage>> messages;
+        std::vector<std::string> headers;
+        for (int i = 0; i < Tiles; ++i)
+        {
+            pngs[i] = std::make_shared<std::vector<char>>(png);
+            messages[i] = std::make_shared<TileMessage>(keyOf(i), png.data(), png.size());
+            headers.push_back(requestHeader(keyOf(i)));
+        }
+
+        size_t copiedBytes = 0;
+        const double copied = measureTilesPerSecond([&]() {
+                for (int i = 0; i < Requests; ++i)
+                {
+                    const std::string& response = headers[i % Tiles];
+                    std::vector<char> output;
+                    output.reserve(4 * TilePixels * TilePixels);
+                    output.resize(response.size());
+                    std::memcpy(output.data(), response.data(), response.size());
+
+                    const auto tile = pngs.find(i % Tiles)->second;
+                    output.insert(output.end(), tile->begin(), tile->end());
+                    copiedBytes += sendFrame(output.data(), output.size());
+                }
+            });
+
+        size_t cachedBytes = 0;
+        const double cached = measureTilesPerSecond([&]() {
+                for (int i = 0; i < Requests; ++i)
+                {
+                    const std::string& response = headers[i % Tiles];
+                    const auto tile = messages.find(i % Tiles)->second;
+                    if (tile->hasHeader(response))
+                        cachedBytes += sendFrame(tile->data(), tile->size());
+                }
+            });
+
+        if (copiedBytes != cachedBytes)
+        {
+            std::cerr << "Mismatch: sent " << copiedBytes << " bytes copying, " << cachedBytes << " cached" << std::endl;
+            return 1;
+        }
+
+        std::cout << std::setw(10) << size
+                  << std::setw(18) << std::fixed << std::setprecision(0) << copied
+                  << std::setw(18) << cached
+                  << std::setw(11) << std::setprecision(1) << cached / copied << "x"
+                  << std::endl;
+    }
+
+    return 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
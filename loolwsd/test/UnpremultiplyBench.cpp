@@ -0,0 +1,132 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Measures the conversion of LOK_TILEMODE_BGRA tiles to RGBA, as the libpng
+ * transform of Png.hpp did it row by row and with each implementation of
+ * Unpremultiply, for opaque tiles, tiles with some translucent pixels and
+ * ones with random alpha, and checks they all give the same bytes.
+ * Build with 'make unpremultiplybench'.
+ */
+
+#include "config.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <png.h>
+
+#include "Png.hpp"
+#include "Unpremultiply.hpp"
+
+namespace
+{
+
+constexpr int TilePixels = 256;
+constexpr size_t PixelCount = TilePixels * TilePixels;
+
+/// A tile of premultiplied pixels, translucent with the given probability.
+std::vector<unsigned char> makeTile(const double translucent, std::mt19937& rng)
+{
+    std::uniform_int_distribution<uint32_t> byte(0, 255);
+    std::bernoulli_distribution isTranslucent(translucent);
+
+    std::vector<unsigned char> tile(PixelCount * 4);
+    for (size_t i = 0; i < PixelCount; ++i)
+    {
+        const uint32_t alpha = isTranslucent(rng) ? byte(rng) : 255;
+        uint32_t pixel = alpha << 24;
+        for (int shift = 0; shift < 24; shift += 8)
+        {
+            pixel |= (byte(rng) * alpha / 255) << shift;
+        }
+
+        std::memcpy(tile.data() + i * 4, &pixel, sizeof(pixel));
+    }
+
+    return tile;
+}
+
+void unpremultiplyRows(unsigned char* data, size_t pixels)
+{
+    png_row_info rowInfo;
+    std::memset(&rowInfo, 0, sizeof(rowInfo));
+    rowInfo.rowbytes = TilePixels * 4;
+    for (size_t row = 0; row < pixels / TilePixels; ++row)
+    {
+        unpremultiply_data(nullptr, &rowInfo, data + row * rowInfo.rowbytes);
+    }
+}
+
+/// Tiles per second, converting copies of the tile as the kit converts fresh ones.
+double measureTilesPerSecond(Unpremultiply::Function func, const std::vector<unsigned char>& tile,
+                             const int iterations, std::vector<unsigned char>& result)
+{
+    std::vector<unsigned char> pixmap(tile.size());
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+    {
+        std::memcpy(pixmap.data(), tile.data(), tile.size());
+        func(pixmap.data(), PixelCount);
+    }
+
+    const auto end = std::chrono::steady_clock::now();
+    result = pixmap;
+    return iterations / std::chrono::duration<double>(end - start).count();
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    const int iterations = argc > 1 ? std::atoi(argv[1]) : 2000;
+
+    std::mt19937 rng(42);
+    const std::vector<std::pair<std::string, double>> tiles = {
+        { "opaque", 0 }, { "1% translucent", 0.01 }, { "random", 1 } };
+
+    std::cout << std::setw(16) << "tile" << std::setw(10) << "impl"
+              << std::setw(16) << "tiles/s" << std::setw(12) << "speedup" << std::endl;
+
+    for (const auto& kind : tiles)
+    {
+        const std::vector<unsigned char> tile = makeTile(kind.second, rng);
+
+        std::vector<unsigned char> expected;
+        const double rows = measureTilesPerSecond(unpremultiplyRows, tile, iterations, expected);
+        std::cout << std::setw(16) << kind.first << std::setw(10) << "libpng"
+                  << std::setw(16) << std::fixed << std::setprecision(0) << rows << std::endl;
+
+        for (const auto& implementation : Unpremultiply::getImplementations())
+        {
+            std::vector<unsigned char> result;
+            const double converted = measureTilesPerSecond(implementation.second, tile, iterations, result);
+            if (result != expected)
+            {
+                std::cerr << "Mismatch: " << implementation.first << " on " << kind.first << " tile" << std::endl;
+                return 1;
+            }
+
+            std::cout << std::setw(16) << kind.first << std::setw(10) << implementation.first
+                      << std::setw(16) << std::setprecision(0) << converted
+                      << std::setw(11) << std::setprecision(1) << converted / rows << "x" << std::endl;
+        }
+    }
+
+    return 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -9,10 +9,44 @@
 
 #include "config.h"
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+
+#include <Poco/File.h>
+#include <Poco/Path.h>
+
 #include <cppunit/extensions/HelperMacros.h>
 
+#include <BufferPool.hpp>
 #include <Common.hpp>
+#include <IoUtil.hpp>
+#include <MessageQueue.hpp>
+#include <PerMessageDeflate.hpp>
+#include <SenderQueue.hpp>
+#include <ThreadPool.hpp>
+#include <TileCache.hpp>
+#include <TileClusters.hpp>
+#include <TileColors.hpp>
+#include <TileIndex.hpp>
+#include <TileMessage.hpp>
+#include <TilePack.hpp>
+#include <Unpremultiply.hpp>
 #include <Util.hpp>
+#include <WorkerPool.hpp>
 
 /// WhiteBox unit-tests.
 class WhiteBoxTests : public CPPUNIT_NS::TestFixture
@@ -21,11 +55,45 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
 
     CPPUNIT_TEST(testRegexListMatcher);
     CPPUNIT_TEST(testRegexListMatcher_Init);
+    CPPUNIT_TEST(testTileIndex);
+    CPPUNIT_TEST(testTilePack);
+    CPPUNIT_TEST(testTileCacheMemory);
+    CPPUNIT_TEST(testTileMessage);
+    CPPUNIT_TEST(testUnpremultiply);
+    CPPUNIT_TEST(testTileColors);
+    CPPUNIT_TEST(testThreadPool);
+    CPPUNIT_TEST(testWorkerPool);
+    CPPUNIT_TEST(testBufferPool);
+    CPPUNIT_TEST(testTileClusters);
+    CPPUNIT_TEST(testTileQueueOrder);
+    CPPUNIT_TEST(testTileQueuePriority);
+    CPPUNIT_TEST(testInputLatency);
+    CPPUNIT_TEST(testQueueCoalescing);
+    CPPUNIT_TEST(testWakeupLatency);
+    CPPUNIT_TEST(testSenderQueue);
+    CPPUNIT_TEST(testPerMessageDeflate);
 
     CPPUNIT_TEST_SUITE_END();
 
     void testRegexListMatcher();
     void testRegexListMatcher_Init();
+    void testTileIndex();
+    void testTilePack();
+    void testTileCacheMemory();
+    void testTileMessage();
+    void testUnpremultiply();
+    void testTileColors();
+    void testThreadPool();
+    void testWorkerPool();
+    void testBufferPool();
+    void testTileClusters();
+    void testTileQueueOrder();
+    void testTileQueuePriority();
+    void testInputLatency();
+    void testQueueCoalescing();
+    void testWakeupLatency();
+    void testSenderQueue();
+    void testPerMessageDeflate();
 };
 
 void WhiteBoxTests::testRegexListMatcher()
@@ -103,6 +171,1107 @@ void WhiteBoxTests::testRegexListMatcher_Init()
     CPPUNIT_ASSERT(matcher.match("192.168.."));
 }
 
+void WhiteBoxTests::testTileIndex()
+{
+    TileIndex index;
+
+    // 10x10 tiles of 3840 twips at 256px, in parts 0 and 1.
+    for (int part = 0; part < 2; ++part)
+    {
+        for (int y = 0; y < 10; ++y)
+        {
+            for (int x = 0; x < 10; ++x)
+            {
+                CPPUNIT_ASSERT(index.add(TileKey(part, 256, 256, x * 3840, y * 3840, 3840, 3840)));
+            }
+        }
+    }
+
+    // Another zoom level in part 0.
+    CPPUNIT_ASSERT(index.add(TileKey(0, 256, 256, 0, 0, 7680, 7680)));
+    CPPUNIT_ASSERT(!index.add(TileKey(0, 256, 256, 0, 0, 7680, 7680)));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(201), index.size());
+
+    // Inside a single tile, and on a corner where touching tiles count too.
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), index.intersecting(1, 4000, 4000, 100, 100).size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), index.intersecting(1, 3840, 3840, 0, 0).size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4 + 1), index.intersecting(0, 3840, 3840, 0, 0).size());
+
+    // Everything, in one or all parts.
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(100), index.intersecting(1, 0, 0, INT_MAX, INT_MAX).size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(201), index.intersecting(-1, 0, 0, INT_MAX, INT_MAX).size());
+    CPPUNIT_ASSERT(index.intersecting(2, 0, 0, INT_MAX, INT_MAX).empty());
+
+    // Must match a brute-force search.
+    const auto all = index.all();
+    CPPUNIT_ASSERT_EQUAL(index.size(), all.size());
+    for (const auto& area : { std::make_tuple(-1, 10000, 20000, 5000, 70000),
+                              std::make_tuple(0, 35000, 0, 1, 1),
+                              std::make_tuple(1, -5000, -5000, 5000, 5000) })
+    {
+        int part, x, y, width, height;
+        std::tie(part, x, y, width, height) = area;
+
+        size_t expected = 0;
+        for (const auto& key : all)
+        {
+            expected += key.intersects(part, x, y, width, height);
+        }
+
+        CPPUNIT_ASSERT_EQUAL(expected, index.intersecting(part, x, y, width, height).size());
+    }
+
+    CPPUNIT_ASSERT(index.remove(TileKey(1, 256, 256, 3840, 3840, 3840, 3840)));
+    CPPUNIT_ASSERT(!index.remove(TileKey(1, 256, 256, 3840, 3840, 3840, 3840)));
+    CPPUNIT_ASSERT(!index.contains(TileKey(1, 256, 256, 3840, 3840, 3840, 3840)));
+    CPPUNIT_ASSERT(index.intersecting(1, 4000, 4000, 100, 100).empty());
+
+    TileIndex other;
+    other.add(TileKey(1, 256, 256, 3840, 3840, 3840, 3840));
+    index.merge(other);
+    CPPUNIT_ASSERT(index.contains(TileKey(1, 256, 256, 3840, 3840, 3840, 3840)));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(201), index.size());
+
+    // Dropping a whole zoom level, across parts.
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), index.getZooms().size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(200), index.removeZoom(TileIndex::Zoom(256, 256, 3840, 3840)).size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), index.size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), index.getZooms().size());
+    CPPUNIT_ASSERT(index.intersecting(1, 0, 0, INT_MAX, INT_MAX).empty());
+
+    index.clear();
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), index.size());
+    CPPUNIT_ASSERT(index.intersecting(-1, 0, 0, INT_MAX, INT_MAX).empty());
+}
+
+void WhiteBoxTests::testTilePack()
+{
+    const std::string dirName = Poco::Path::temp() + "loolwsd-whitebox-tilepack";
+    Poco::File dir(dirName);
+    if (dir.exists())
+        dir.remove(true);
+    dir.createDirectories();
+
+    const TileKey first(0, 256, 256, 0, 0, 3840, 3840);
+    const TileKey second(0, 256, 256, 3840, 0, 3840, 3840);
+    const std::string firstData(1000, 'a');
+    const std::string secondData(2000, 'b');
+
+    {
+        TilePack pack(dirName);
+        CPPUNIT_ASSERT(!pack.get(first));
+
+        pack.put(first, firstData.data(), firstData.size());
+        pack.put(second, firstData.data(), firstData.size());
+        pack.put(second, secondData.data(), secondData.size());
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), pack.size());
+        CPPUNIT_ASSERT_EQUAL(firstData.size() + secondData.size(), pack.getLiveBytes());
+
+        const auto tile = pack.get(second);
+        CPPUNIT_ASSERT(tile);
+        CPPUNIT_ASSERT_EQUAL(secondData, std::string(tile->data(), tile->size()));
+
+        CPPUNIT_ASSERT(pack.remove(first));
+        CPPUNIT_ASSERT(!pack.remove(first));
+        CPPUNIT_ASSERT(!pack.contains(first));
+    }
+
+    // Identical tiles share their data, also once reopened.
+    {
+        const TileKey third(0, 256, 256, 7680, 0, 3840, 3840);
+        TilePack pack(dirName);
+        pack.put(first, secondData.data(), secondData.size());
+        pack.put(third, secondData.data(), secondData.size());
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), pack.size());
+        CPPUNIT_ASSERT_EQUAL(secondData.size(), pack.getLiveBytes());
+        CPPUNIT_ASSERT_EQUAL(3 * secondData.size(), pack.getTileBytes());
+        CPPUNIT_ASSERT(pack.get(first) == pack.get(third));
+
+        CPPUNIT_ASSERT(pack.remove(first));
+        CPPUNIT_ASSERT(pack.remove(third));
+        CPPUNIT_ASSERT_EQUAL(secondData.size(), pack.getLiveBytes());
+        CPPUNIT_ASSERT_EQUAL(secondData.size(), pack.getTileBytes());
+    }
+
+    // Reopen, and again without the index, which is then rebuilt from the pack.
+    for (int i = 0; i < 2; ++i)
+    {
+        if (i == 1)
+            Poco::File(dirName + "/" + TilePack::IndexFileName).remove();
+
+        TilePack pack(dirName);
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), pack.size());
+        CPPUNIT_ASSERT(!pack.contains(first));
+        CPPUNIT_ASSERT(pack.contains(second));
+    }
+
+    {
+        TilePack pack(dirName);
+        pack.compact();
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), pack.size());
+        CPPUNIT_ASSERT(pack.getPackBytes() < firstData.size() + 2 * secondData.size());
+
+        const auto tile = pack.get(second);
+        CPPUNIT_ASSERT(tile);
+        CPPUNIT_ASSERT_EQUAL(secondData, std::string(tile->data(), tile->size()));
+
+        // Merge another pack in, as done on save.
+        Poco::File(dirName + "/other").createDirectories();
+        TilePack other(dirName + "/other");
+        other.put(first, firstData.data(), firstData.size());
+        other.put(second, firstData.data(), firstData.size());
+        CPPUNIT_ASSERT(pack.merge(other));
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), pack.size());
+        CPPUNIT_ASSERT_EQUAL(firstData.size(), pack.getLiveBytes());
+        CPPUNIT_ASSERT_EQUAL(2 * firstData.size(), pack.getTileBytes());
+
+        pack.clear();
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), pack.size());
+        CPPUNIT_ASSERT(!pack.get(second));
+    }
+
+    dir.remove(true);
+}
+
+void WhiteBoxTests::testTileCacheMemory()
+{
+    const std::string dirName = Poco::Path::temp() + "loolwsd-whitebox-tilecache";
+    Poco::File dir(dirName);
+    if (dir.exists())
+        dir.remove(true);
+
+    const auto maxMemoryBytes = TileCache::MaxMemoryBytes;
+    const auto maxPendingBytes = TileCache::MaxPendingBytes;
+    const auto packTiles = TileCache::PackTiles;
+
+    // Written right away, as files, so we can look for them.
+    TileCache::MaxPendingBytes = 0;
+    TileCache::PackTiles = false;
+
+    const std::string data(1000, 'a');
+    // Of the same size, header included.
+    const int tilePosX[] = { 1920, 3840, 5760, 7680 };
+    const auto tileSize = TileMessage(TileKey(0, 256, 256, 1920, 0, 1920, 1920), data.data(), data.size()).size();
+
+    // Room for 3 of them.
+    TileCache::MaxMemoryBytes = 3 * tileSize + tileSize / 2;
+
+    {
+        TileCache cache("http://localhost/whitebox.odt", "", dirName);
+        cache.setEditing(true);
+
+        const auto save = [&](int i) { cache.saveTile(0, 256, 256, tilePosX[i], 0, 1920, 1920, data.data(), data.size()); };
+        const auto lookup = [&](int i) { return cache.lookupTile(0, 256, 256, tilePosX[i], 0, 1920, 1920); };
+
+        save(0);
+        save(1);
+        save(2);
+        CPPUNIT_ASSERT_EQUAL(3 * tileSize, cache.getMemoryBytes());
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), cache.getMemoryEvictions());
+
+        // A hit makes it the most recently used, so the next one goes instead.
+        CPPUNIT_ASSERT(lookup(0));
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), cache.getMemoryHits());
+        save(3);
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), cache.getMemoryEvictions());
+        CPPUNIT_ASSERT_EQUAL(3 * tileSize, cache.getMemoryBytes());
+
+        // Now 3, 0, 2 from the most recently used.
+        CPPUNIT_ASSERT(lookup(0));
+        CPPUNIT_ASSERT(lookup(3));
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), cache.getMemoryHits());
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), cache.getMemoryMisses());
+
+        // 1 was evicted, but is still on disk, and back in memory it evicts 2.
+        CPPUNIT_ASSERT(lookup(1));
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), cache.getMemoryMisses());
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), cache.getMemoryEvictions());
+        CPPUNIT_ASSERT(lookup(0));
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), cache.getMemoryHits());
+        CPPUNIT_ASSERT(lookup(2));
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), cache.getMemoryMisses());
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), cache.getMemoryEvictions());
+
+        // Invalidating 0 and 1 removes them from memory and from disk, leaving 2.
+        const std::string fileName = dirName + "/editing/0/0_256x256.1920,0.1920x1920.png";
+        CPPUNIT_ASSERT(Poco::File(fileName).exists());
+        cache.invalidateTiles(0, 0, 0, 5000, 1920);
+        CPPUNIT_ASSERT(!Poco::File(fileName).exists());
+        CPPUNIT_ASSERT_EQUAL(tileSize, cache.getMemoryBytes());
+        CPPUNIT_ASSERT(!lookup(0));
+        CPPUNIT_ASSERT(!lookup(1));
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), cache.getMemoryMisses());
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), cache.getMemoryHits());
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), cache.getMemoryEvictions());
+    }
+
+    TileCache::MaxMemoryBytes = maxMemoryBytes;
+    TileCache::MaxPendingBytes = maxPendingBytes;
+    TileCache::PackTiles = packTiles;
+
+    dir.remove(true);
+}
+
+void WhiteBoxTests::testTileMessage()
+{
+    const TileKey key(1, 256, 256, 3840, 7680, 3840, 3840);
+    const std::string header = "tile: part=1 width=256 height=256 tileposx=3840 tileposy=7680 tilewidth=3840 tileheight=3840\n";
+    CPPUNIT_ASSERT_EQUAL(header, TileMessage::header(key));
+
+    const std::string png = "\x89PNG fake data";
+    const TileMessage message(key, png.data(), png.size());
+    CPPUNIT_ASSERT_EQUAL(header + png, std::string(message.data(), message.size()));
+    CPPUNIT_ASSERT_EQUAL(png, std::string(message.getPngData(), message.getPngSize()));
+
+    CPPUNIT_ASSERT(message.hasHeader(header));
+    CPPUNIT_ASSERT(!message.hasHeader("tile: part=1 width=256 height=256 tileposx=3840 tileposy=7680 tilewidth=3840 tileheight=3840 id=0\n"));
+    CPPUNIT_ASSERT(!message.hasHeader(header.substr(0, header.size() - 1)));
+
+    TileMessage empty(key, 0);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), empty.getPngSize());
+    CPPUNIT_ASSERT_EQUAL(header.size(), empty.size());
+
+    std::vector<char> output;
+    message.copyWithHeader("tile: part=1 width=256 height=256 tileposx=3840 tileposy=7680 tilewidth=3840 tileheight=3840 id=0\n", output);
+    CPPUNIT_ASSERT_EQUAL("tile: part=1 width=256 height=256 tileposx=3840 tileposy=7680 tilewidth=3840 tileheight=3840 id=0\n" + png,
+                         std::string(output.data(), output.size()));
+
+    // A tile of a single color.
+    const std::string color = "color=ffffffff";
+    CPPUNIT_ASSERT(TileMessage::isColor(color.data(), color.size()));
+    CPPUNIT_ASSERT(!TileMessage::isColor(png.data(), png.size()));
+
+    const TileMessage solid(key, color.data(), color.size());
+    const std::string solidHeader = "tile: part=1 width=256 height=256 tileposx=3840 tileposy=7680 tilewidth=3840 tileheight=3840 color=ffffffff\n";
+    CPPUNIT_ASSERT_EQUAL(solidHeader, std::string(solid.data(), solid.size()));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), solid.getPngSize());
+    CPPUNIT_ASSERT_EQUAL(color, std::string(solid.getTileData(), solid.getTileSize()));
+    CPPUNIT_ASSERT(solid.hasHeader(header));
+    CPPUNIT_ASSERT(!solid.hasHeader(solidHeader));
+
+    solid.copyWithHeader("tile: part=1 width=256 height=256 tileposx=3840 tileposy=7680 tilewidth=3840 tileheight=3840 timestamp=5\n", output);
+    CPPUNIT_ASSERT_EQUAL(std::string("tile: part=1 width=256 height=256 tileposx=3840 tileposy=7680 tilewidth=3840 tileheight=3840 timestamp=5 color=ffffffff\n"),
+                         std::string(output.data(), output.size()));
+
+    // For older clients, as a PNG of the color.
+    CPPUNIT_ASSERT(solid.copyAsPng(header, output));
+    CPPUNIT_ASSERT(output.size() > header.size() + 8);
+    CPPUNIT_ASSERT_EQUAL(header + "\x89PNG", std::string(output.data(), header.size() + 4));
+
+    CPPUNIT_ASSERT(message.copyAsPng(header, output));
+    CPPUNIT_ASSERT_EQUAL(header + png, std::string(output.data(), output.size()));
+}
+
+void WhiteBoxTests::testUnpremultiply()
+{
+    // Every valid channel with every alpha.
+    std::vector<unsigned char> pixels;
+    std::vector<unsigned char> expected;
+    for (uint32_t alpha = 0; alpha < 256; ++alpha)
+    {
+        for (uint32_t channel = 0; channel <= alpha; ++channel)
+        {
+            const uint32_t rgb[3] = { channel, channel / 2, alpha - channel };
+            const uint32_t pixel = (alpha << 24) | (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];
+            unsigned char bytes[4];
+            std::memcpy(bytes, &pixel, sizeof(pixel));
+            pixels.insert(pixels.end(), bytes, bytes + 4);
+
+            for (const uint32_t value : rgb)
+            {
+                expected.push_back(alpha == 0 ? 0 : (value * 255 + alpha / 2) / alpha);
+            }
+
+            expected.push_back(alpha);
+        }
+    }
+
+    // And a tail that doesn't fill a vector.
+    for (int i = 0; i < 3; ++i)
+    {
+        const uint32_t pixel = 0xff102030;
+        unsigned char bytes[4];
+        std::memcpy(bytes, &pixel, sizeof(pixel));
+        pixels.insert(pixels.end(), bytes, bytes + 4);
+        expected.insert(expected.end(), { 0x10, 0x20, 0x30, 0xff });
+    }
+
+    for (const auto& implementation : Unpremultiply::getImplementations())
+    {
+        std::vector<unsigned char> result = pixels;
+        implementation.second(result.data(), result.size() / 4);
+        CPPUNIT_ASSERT_MESSAGE(implementation.first, result == expected);
+    }
+
+    std::vector<unsigned char> result = pixels;
+    Unpremultiply::toRGBA(result.data(), result.size() / 4);
+    CPPUNIT_ASSERT(result == expected);
+}
+
+void WhiteBoxTests::testTileColors()
+{
+    // 4x2 pixels of text on white, the 2x2 on the right scanned alone.
+    const uint32_t white = 0xffffffff;
+    const uint32_t black = 0xff000000;
+    const uint32_t gray = 0xff808080;
+    std::vector<uint32_t> pixmap = { white, white, black, white,
+                                     white, black, gray, white };
+    const unsigned char* pixels = reinterpret_cast<const unsigned char*>(pixmap.data());
+
+    const TileColors colors(pixels, 2, 0, 2, 2, 4);
+    CPPUNIT_ASSERT(colors.isOpaque());
+    CPPUNIT_ASSERT(colors.hasPalette());
+    CPPUNIT_ASSERT(colors.getPalette() == std::vector<uint32_t>({ black, white, gray }));
+    CPPUNIT_ASSERT(colors.getIndices() == std::vector<unsigned char>({ 0, 1, 2, 1 }));
+
+    CPPUNIT_ASSERT(TileColors::isUniform(pixels, 0, 0, 2, 1, 4));
+    CPPUNIT_ASSERT(!TileColors::isUniform(pixels, 0, 0, 2, 2, 4));
+    CPPUNIT_ASSERT(!TileColors::isUniform(pixels, 2, 0, 2, 2, 4));
+    CPPUNIT_ASSERT(TileColors::isUniform(pixels, 3, 0, 1, 2, 4));
+
+    pixmap[7] = 0x80808080;
+    CPPUNIT_ASSERT(!TileColors(pixels, 0, 0, 4, 2, 4).isOpaque());
+    CPPUNIT_ASSERT(TileColors(pixels, 0, 0, 4, 2, 4).hasPalette());
+    CPPUNIT_ASSERT(TileColors(pixels, 0, 0, 2, 2, 4).isOpaque());
+
+    // One color too many for a palette.
+    pixmap.clear();
+    for (uint32_t i = 0; i <= TileColors::MaxPaletteSize; ++i)
+    {
+        pixmap.push_back(0xff000000 | i);
+    }
+
+    pixels = reinterpret_cast<const unsigned char*>(pixmap.data());
+    const TileColors many(pixels, 0, 0, pixmap.size(), 1, pixmap.size());
+    CPPUNIT_ASSERT(many.isOpaque());
+    CPPUNIT_ASSERT(!many.hasPalette());
+    CPPUNIT_ASSERT(many.getIndices().empty());
+    CPPUNIT_ASSERT(TileColors(pixels, 1, 0, pixmap.size() - 1, 1, pixmap.size()).hasPalette());
+}
+
+void WhiteBoxTests::testThreadPool()
+{
+    // Without threads, the caller runs everything.
+    ThreadPool none(0, "test_pool");
+    std::atomic<int> count(0);
+    const std::vector<ThreadPool::Job> jobs(100, [&count]() { ++count; });
+    none.run(jobs);
+    CPPUNIT_ASSERT_EQUAL(100, count.load());
+    none.run(std::vector<ThreadPool::Job>());
+
+    ThreadPool pool(2, "test_pool");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), pool.getThreadCount());
+    count = 0;
+    pool.run(jobs);
+    CPPUNIT_ASSERT_EQUAL(100, count.load());
+
+    // A job waiting for another one finishes only if they run at the same time.
+    std::atomic<bool> done(false);
+    std::atomic<bool> seen(false);
+    pool.run({ [&]()
+               {
+                   const auto end = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+                   while (!done && std::chrono::steady_clock::now() < end)
+                   {
+                       std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                   }
+
+                   seen = done.load();
+               },
+               [&]() { done = true; } });
+    CPPUNIT_ASSERT(seen);
+
+    // Failures don't stop the others.
+    count = 0;
+    pool.run({ []() { throw std::runtime_error("test"); }, [&count]() { ++count; } });
+    CPPUNIT_ASSERT_EQUAL(1, count.load());
+}
+
+void WhiteBoxTests::testWorkerPool()
+{
+    std::atomic<int> count(0);
+    {
+        WorkerPool pool("test_worker", 4);
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), pool.getThreadCount());
+
+        // A job waiting for another one doesn't hold it up.
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool done = false;
+        bool seen = false;
+        pool.post([&]()
+                  {
+                      std::unique_lock<std::mutex> lock(mutex);
+                      seen = cv.wait_for(lock, std::chrono::seconds(10), [&done]() { return done; });
+                      cv.notify_all();
+                  });
+        pool.post([&]()
+                  {
+                      std::unique_lock<std::mutex> lock(mutex);
+                      done = true;
+                      cv.notify_all();
+                  });
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait_for(lock, std::chrono::seconds(10), [&seen]() { return seen; });
+        }
+
+        CPPUNIT_ASSERT(seen);
+        CPPUNIT_ASSERT(pool.getThreadCount() >= 2);
+
+        // Failures don't stop the others, and those posted run before it goes.
+        pool.post([]() { throw std::runtime_error("test"); });
+        for (int i = 0; i < 100; ++i)
+        {
+            pool.post([&count]() { ++count; });
+        }
+    }
+
+    CPPUNIT_ASSERT_EQUAL(100, count.load());
+
+    // No more threads than the limit, the other jobs wait for one.
+    count = 0;
+    {
+        WorkerPool pool("test_worker", 2);
+        for (int i = 0; i < 10; ++i)
+        {
+            pool.post([&count]()
+                      {
+                          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                          ++count;
+                      });
+        }
+
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), pool.getThreadCount());
+    }
+
+    CPPUNIT_ASSERT_EQUAL(10, count.load());
+}
+
+void WhiteBoxTests::testBufferPool()
+{
+    BufferPool pool(4 * BufferPool::MinSize);
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+
+    unsigned char* data;
+    {
+        const BufferPool::Pixmap pixmap = pool.getPixmap(BufferPool::MinSize + 1);
+        data = pixmap.data();
+        CPPUNIT_ASSERT_EQUAL(BufferPool::MinSize + 1, pixmap.size());
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), reinterpret_cast<uintptr_t>(data) % pageSize);
+        std::memset(data, 1, pixmap.size());
+    }
+
+    // Given back, and reused for the same size class, not for another.
+    CPPUNIT_ASSERT_EQUAL(2 * BufferPool::MinSize, pool.getIdleBytes());
+    CPPUNIT_ASSERT(pool.getPixmap(2 * BufferPool::MinSize).data() == data);
+    CPPUNIT_ASSERT(pool.getPixmap(BufferPool::MinSize).data() != data);
+
+    // Only up to the idle limit is kept, the 64 kB one and one of these.
+    {
+        const BufferPool::Pixmap first = pool.getPixmap(2 * BufferPool::MinSize);
+        const BufferPool::Pixmap second = pool.getPixmap(2 * BufferPool::MinSize);
+        const BufferPool::Pixmap third = pool.getPixmap(2 * BufferPool::MinSize);
+    }
+
+    CPPUNIT_ASSERT_EQUAL(3 * BufferPool::MinSize, pool.getIdleBytes());
+
+    BufferPool outputs(4 * BufferPool::MinSize);
+    const char* outputData;
+    {
+        BufferPool::Output output = outputs.getOutput(1000);
+        CPPUNIT_ASSERT(output.get().empty());
+        CPPUNIT_ASSERT(output.get().capacity() >= 1000);
+        output.get().assign(100, 'x');
+        outputData = output.get().data();
+    }
+
+    BufferPool::Output output = outputs.getOutput(BufferPool::MinSize);
+    CPPUNIT_ASSERT(output.get().empty());
+    CPPUNIT_ASSERT(output.get().data() == outputData);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), outputs.getIdleBytes());
+}
+
+void WhiteBoxTests::testTileClusters()
+{
+    const int size = 3840;
+    auto tile = [](const int column, const int row) { return Util::Rectangle(column * size, row * size, size, size); };
+
+    // A 2x2 block and a repeated tile, all at once.
+    std::vector<Util::Rectangle> tiles = { tile(0, 0), tile(1, 0), tile(0, 1), tile(1, 1), tile(1, 0) };
+    std::vector<TileClusters::Cluster> clusters = TileClusters(tiles, size, size, 100).getClusters();
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), clusters.size());
+    CPPUNIT_ASSERT_EQUAL(0, clusters[0]._area._x1);
+    CPPUNIT_ASSERT_EQUAL(2 * size, clusters[0]._area._x2);
+    CPPUNIT_ASSERT(clusters[0]._tiles == std::vector<size_t>({ 0, 1, 2, 3 }));
+
+    // Far apart corners of a large area separately, but close ones together.
+    tiles = { tile(0, 0), tile(20, 0), tile(0, 20), tile(20, 20), tile(2, 0) };
+    clusters = TileClusters(tiles, size, size, 1000).getClusters();
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), clusters.size());
+    CPPUNIT_ASSERT(clusters[0]._tiles == std::vector<size_t>({ 0, 4 }));
+    CPPUNIT_ASSERT_EQUAL(3 * size, clusters[0]._area._x2);
+    CPPUNIT_ASSERT(clusters[1]._tiles == std::vector<size_t>({ 1 }));
+    CPPUNIT_ASSERT(clusters[2]._tiles == std::vector<size_t>({ 2 }));
+    CPPUNIT_ASSERT(clusters[3]._tiles == std::vector<size_t>({ 3 }));
+
+    // A dense area over the budget is split, but each part is within it.
+    tiles.clear();
+    for (int row = 0; row < 8; ++row)
+    {
+        for (int column = 0; column < 8; ++column)
+        {
+            tiles.push_back(tile(column, row));
+        }
+    }
+
+    clusters = TileClusters(tiles, size, size, 16).getClusters();
+    CPPUNIT_ASSERT(clusters.size() >= 4);
+    size_t count = 0;
+    for (const auto& cluster : clusters)
+    {
+        const auto area = cluster._area;
+        CPPUNIT_ASSERT((area._x2 - area._x1) / size * (area._y2 - area._y1) / size <= 16);
+        count += cluster._tiles.size();
+    }
+
+    CPPUNIT_ASSERT_EQUAL(tiles.size(), count);
+
+    // Many scattered ones, each in exactly one cluster.
+    tiles.clear();
+    for (int i = 0; i < 1000; ++i)
+    {
+        tiles.push_back(tile((i * 37) % 101, (i * 53) % 97));
+    }
+
+    clusters = TileClusters(tiles, size, size, 128).getClusters();
+    std::vector<size_t> found;
+    for (const auto& cluster : clusters)
+    {
+        const auto area = cluster._area;
+        CPPUNIT_ASSERT((area._x2 - area._x1) / size * (area._y2 - area._y1) / size <= 128);
+        found.insert(found.end(), cluster._tiles.begin(), cluster._tiles.end());
+    }
+
+    std::sort(found.begin(), found.end());
+    CPPUNIT_ASSERT_EQUAL(tiles.size(), found.size());
+    for (size_t i = 0; i < found.size(); ++i)
+    {
+        CPPUNIT_ASSERT_EQUAL(i, found[i]);
+    }
+
+    // A single tile is never split.
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), TileClusters({ tile(3, 3) }, size, size, 0).getClusters().size());
+}
+
+void WhiteBoxTests::testTileQueueOrder()
+{
+    auto tile = [](const int part, const int width, const int x)
+                {
+                    return "tile part=" + std::to_string(part) + " width=" + std::to_string(width) +
+                           " height=256 tileposx=" + std::to_string(x) +
+                           " tileposy=0 tilewidth=3840 tileheight=3840";
+                };
+    auto get = [](TileQueue& queue)
+               {
+                   const MessageQueue::Payload payload = queue.get();
+                   return std::string(payload.data(), payload.size());
+               };
+
+    // Those at the part and zoom of the last one first.
+    TileQueue queue;
+    queue.put(tile(0, 256, 0));
+    queue.put(tile(1, 256, 0));
+    queue.put(tile(0, 256, 3840));
+    queue.put(tile(1, 512, 0));
+    queue.put(tile(1, 256, 3840));
+    CPPUNIT_ASSERT_EQUAL(tile(0, 256, 0), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile(0, 256, 3840), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile(1, 256, 0), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile(1, 256, 3840), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile(1, 512, 0), get(queue));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), queue.getArrivalSwitches());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), queue.getSwitches());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), queue.getSwitchesAvoided());
+
+    // Then those the client shows, but not past other messages.
+    TileQueue shown;
+    shown.put("setclientpart part=2");
+    shown.put("clientzoom tilepixelwidth=512 tilepixelheight=256 tiletwipwidth=3840 tiletwipheight=3840");
+    shown.put(tile(1, 512, 0));
+    shown.put(tile(2, 256, 0));
+    shown.put(tile(2, 512, 0));
+    shown.put("status");
+    shown.put(tile(2, 512, 3840));
+    CPPUNIT_ASSERT_EQUAL(std::string("setclientpart part=2"), get(shown));
+    CPPUNIT_ASSERT_EQUAL(std::string("clientzoom"), get(shown).substr(0, 10));
+    CPPUNIT_ASSERT_EQUAL(tile(2, 512, 0), get(shown));
+    CPPUNIT_ASSERT_EQUAL(tile(1, 512, 0), get(shown));
+    CPPUNIT_ASSERT_EQUAL(tile(2, 256, 0), get(shown));
+    CPPUNIT_ASSERT_EQUAL(std::string("status"), get(shown));
+    CPPUNIT_ASSERT_EQUAL(tile(2, 512, 3840), get(shown));
+
+    // The oldest is passed over only so often.
+    TileQueue bypassed;
+    bypassed.put(tile(1, 256, 0));
+    CPPUNIT_ASSERT_EQUAL(tile(1, 256, 0), get(bypassed));
+    bypassed.put(tile(0, 256, 0));
+    for (size_t i = 1; i <= TileQueue::MaxBypass + 1; ++i)
+    {
+        bypassed.put(tile(1, 256, i * 3840));
+    }
+
+    for (size_t i = 1; i <= TileQueue::MaxBypass; ++i)
+    {
+        CPPUNIT_ASSERT_EQUAL(tile(1, 256, i * 3840), get(bypassed));
+    }
+
+    CPPUNIT_ASSERT_EQUAL(tile(0, 256, 0), get(bypassed));
+}
+
+void WhiteBoxTests::testTileQueuePriority()
+{
+    auto tile = [](const int x, const int y)
+                {
+                    return "tile part=0 width=256 height=256 tileposx=" + std::to_string(x) +
+                           " tileposy=" + std::to_string(y) + " tilewidth=3840 tileheight=3840";
+                };
+    auto get = [](TileQueue& queue)
+               {
+                   const MessageQueue::Payload payload = queue.get();
+                   return std::string(payload.data(), payload.size());
+               };
+
+    // Those in the visible area first, then the closest to it.
+    TileQueue queue;
+    queue.put("clientvisiblearea x=0 y=0 width=7680 height=7680");
+    CPPUNIT_ASSERT_EQUAL(std::string("clientvisiblearea x=0 y=0 width=7680 height=7680"), get(queue));
+    queue.put(tile(38400, 0));
+    queue.put(tile(7680, 0));
+    queue.put(tile(3840, 3840));
+    queue.put("tilecombine part=0 width=256 height=256 tileposx=0,23040 tileposy=3840,3840 "
+              "tilewidth=3840 tileheight=3840");
+    queue.put(tile(0, 0));
+    CPPUNIT_ASSERT_EQUAL(tile(3840, 3840), get(queue));
+    CPPUNIT_ASSERT_EQUAL(std::string("tilecombine"), get(queue).substr(0, 11));
+    CPPUNIT_ASSERT_EQUAL(tile(0, 0), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile(7680, 0), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile(38400, 0), get(queue));
+
+    // The ones at the cursor before the others in view.
+    queue.updateCursorPosition(Util::Rectangle(4000, 4000, 10, 300));
+    queue.put(tile(0, 0));
+    queue.put(tile(3840, 0));
+    queue.put(tile(3840, 3840));
+    CPPUNIT_ASSERT_EQUAL(tile(3840, 3840), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile(0, 0), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile(3840, 0), get(queue));
+    queue.updateCursorPosition(Util::Rectangle());
+
+    // When the view moves, what came into view goes before what scrolled away.
+    queue.put(tile(0, 0));
+    queue.put(tile(0, 3840));
+    queue.put("clientvisiblearea x=0 y=38400 width=7680 height=7680");
+    queue.put(tile(0, 38400));
+    queue.put("clientvisiblearea x=0 y=76800 width=7680 height=7680");
+    queue.put(tile(0, 76800));
+    queue.put(tile(0, 80640));
+    CPPUNIT_ASSERT_EQUAL(std::string("clientvisiblearea x=0 y=76800 width=7680 height=7680"), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile(0, 76800), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile(0, 80640), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile(0, 38400), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile(0, 3840), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile(0, 0), get(queue));
+}
+
+void WhiteBoxTests::testInputLatency()
+{
+    auto tile = [](const int x, const int y)
+                {
+                    return "tile part=0 width=256 height=256 tileposx=" + std::to_string(x) +
+                           " tileposy=" + std::to_string(y) + " tilewidth=3840 tileheight=3840";
+                };
+    auto key = [](const int i)
+               {
+                   return "key type=input char=" + std::to_string(97 + i) + " key=0";
+               };
+    auto get = [](MessageQueue& queue)
+               {
+                   const MessageQueue::Payload payload = queue.get();
+                   return std::string(payload.data(), payload.size());
+               };
+
+    // Typing while scrolling: every step brings a row of tiles and a key, and only half of
+    // the tiles get rendered before the next one. The latency of a key is in messages
+    // handled before it, the tiles keep getting rendered all the same.
+    for (int kit = 0; kit < 2; ++kit)
+    {
+        std::unique_ptr<BasicTileQueue> queue(kit ? new TileQueue() : new BasicTileQueue());
+        int keys = 0;
+        int tiles = 0;
+        for (int step = 0; step < 20; ++step)
+        {
+            for (int x = 0; x < 8; ++x)
+            {
+                queue->put(tile(x * 3840, step * 3840));
+            }
+
+            queue->put(key(step));
+
+            int latency = 0;
+            for (int i = 0; i < 5; ++i)
+            {
+                const std::string message = get(*queue);
+                if (message.compare(0, 4, "key ") == 0)
+                {
+                    CPPUNIT_ASSERT_EQUAL(key(keys), message);
+                    CPPUNIT_ASSERT_EQUAL(0, latency);
+                    ++keys;
+                }
+                else
+                {
+                    ++tiles;
+                    ++latency;
+                }
+            }
+        }
+
+        CPPUNIT_ASSERT_EQUAL(20, keys);
+        CPPUNIT_ASSERT_EQUAL(80, tiles);
+    }
+
+    // Input goes in its order, not past other messages, and not forever past the tiles.
+    BasicTileQueue queue;
+    queue.put(tile(0, 0));
+    queue.put("mouse type=buttondown x=0 y=0 count=1 buttons=1 modifier=0");
+    queue.put(tile(3840, 0));
+    queue.put("status");
+    queue.put(key(0));
+    CPPUNIT_ASSERT_EQUAL(std::string("mouse"), get(queue).substr(0, 5));
+    CPPUNIT_ASSERT_EQUAL(tile(0, 0), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile(3840, 0), get(queue));
+    CPPUNIT_ASSERT_EQUAL(std::string("status"), get(queue));
+    CPPUNIT_ASSERT_EQUAL(key(0), get(queue));
+
+    queue.put(tile(0, 0));
+    for (size_t i = 0; i <= BasicTileQueue::MaxOvertakes; ++i)
+    {
+        queue.put(key(i));
+    }
+
+    for (size_t i = 0; i < BasicTileQueue::MaxOvertakes; ++i)
+    {
+        CPPUNIT_ASSERT_EQUAL(key(i), get(queue));
+    }
+
+    CPPUNIT_ASSERT_EQUAL(tile(0, 0), get(queue));
+    CPPUNIT_ASSERT_EQUAL(key(BasicTileQueue::MaxOvertakes), get(queue));
+}
+
+void WhiteBoxTests::testQueueCoalescing()
+{
+    auto tile = [](const int part, const int x)
+                {
+                    return "tile part=" + std::to_string(part) + " width=256 height=256 tileposx=" +
+                           std::to_string(x) + " tileposy=0 tilewidth=3840 tileheight=3840";
+                };
+    auto mouse = [](const std::string& type, const int x)
+                 {
+                     return "mouse type=" + type + " x=" + std::to_string(x) + " y=0 count=1 buttons=1 modifier=0";
+                 };
+    auto get = [](MessageQueue& queue)
+               {
+                   const MessageQueue::Payload payload = queue.get();
+                   return std::string(payload.data(), payload.size());
+               };
+
+    // Of the moves of a drag only the last one is left, the tiles stay.
+    TileQueue drag;
+    drag.put(mouse("buttondown", 0));
+    for (int i = 0; i < 10; ++i)
+    {
+        drag.put(mouse("move", i));
+        drag.put(tile(0, i * 3840));
+    }
+
+    drag.put(mouse("buttonup", 9));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(9), drag.getCoalesced());
+    CPPUNIT_ASSERT_EQUAL(mouse("buttondown", 0), get(drag));
+    CPPUNIT_ASSERT_EQUAL(mouse("move", 9), get(drag));
+    CPPUNIT_ASSERT_EQUAL(mouse("buttonup", 9), get(drag));
+    for (int i = 0; i < 10; ++i)
+    {
+        CPPUNIT_ASSERT_EQUAL(tile(0, i * 3840), get(drag));
+    }
+
+    // But not past other input.
+    drag.put(mouse("move", 1));
+    drag.put("key type=input char=97 key=0");
+    drag.put(mouse("move", 2));
+    drag.put("clientzoom tilepixelwidth=256 tilepixelheight=256 tiletwipwidth=3840 tiletwipheight=3840");
+    drag.put("clientzoom tilepixelwidth=256 tilepixelheight=256 tiletwipwidth=1920 tiletwipheight=1920");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(10), drag.getCoalesced());
+    CPPUNIT_ASSERT_EQUAL(mouse("move", 1), get(drag));
+    CPPUNIT_ASSERT_EQUAL(std::string("key type=input char=97 key=0"), get(drag));
+    CPPUNIT_ASSERT_EQUAL(mouse("move", 2), get(drag));
+    CPPUNIT_ASSERT_EQUAL(std::string("clientzoom tilepixelwidth=256 tilepixelheight=256 tiletwipwidth=1920 tiletwipheight=1920"),
+                         get(drag));
+
+    // A client leaving a part drops its tiles in wsd, but not the previews, nor in the kit.
+    for (int kit = 0; kit < 2; ++kit)
+    {
+        std::unique_ptr<BasicTileQueue> queue(kit ? new TileQueue() : new BasicTileQueue());
+        queue->put(tile(0, 0));
+        queue->put(tile(0, 0) + " id=5");
+        queue->put("tilecombine part=0 width=256 height=256 tileposx=0,3840 tileposy=0,0 "
+                   "tilewidth=3840 tileheight=3840");
+        queue->put(tile(1, 0));
+        queue->put("setclientpart part=1");
+        queue->put("setclientpart part=1");
+        if (!kit)
+        {
+            CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), queue->getCoalesced());
+            CPPUNIT_ASSERT_EQUAL(tile(0, 0) + " id=5", get(*queue));
+            CPPUNIT_ASSERT_EQUAL(tile(1, 0), get(*queue));
+        }
+        else
+        {
+            CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), queue->getCoalesced());
+            CPPUNIT_ASSERT_EQUAL(tile(1, 0), get(*queue));
+            CPPUNIT_ASSERT_EQUAL(tile(0, 0), get(*queue));
+            CPPUNIT_ASSERT_EQUAL(tile(0, 0) + " id=5", get(*queue));
+            CPPUNIT_ASSERT_EQUAL(std::string("tilecombine"), get(*queue).substr(0, 11));
+        }
+
+        CPPUNIT_ASSERT_EQUAL(std::string("setclientpart part=1"), get(*queue));
+    }
+}
+
+void WhiteBoxTests::testWakeupLatency()
+{
+    int fds[2];
+    CPPUNIT_ASSERT_EQUAL(0, pipe(fds));
+    IoUtil::PipeReader reader("test_pipe", fds[0]);
+
+    // The ms from the event to the return of the reader waiting for it.
+    auto handoff = [&reader](const std::function<void()>& event, int& ready, std::string& line)
+                   {
+                       std::thread thread([&reader, &ready, &line]()
+                                          {
+                                              ready = reader.readLine(line, []() { return TerminationFlag; });
+                                          });
+
+                       // Well into the wait, and well before its timeout.
+                       std::this_thread::sleep_for(std::chrono::milliseconds(POLL_TIMEOUT_MS / 5));
+                       const auto start = std::chrono::steady_clock::now();
+                       event();
+                       thread.join();
+                       return std::chrono::duration_cast<std::chrono::milliseconds>(
+                                  std::chrono::steady_clock::now() - start).count();
+                   };
+
+    int ready = 0;
+    std::string line;
+    auto latency = handoff([&fds]()
+                           {
+                               CPPUNIT_ASSERT_EQUAL(static_cast<ssize_t>(6), write(fds[1], "hello\n", 6));
+                           }, ready, line);
+    std::cout << "Pipe handoff latency: " << latency << " ms." << std::endl;
+    CPPUNIT_ASSERT_EQUAL(1, ready);
+    CPPUNIT_ASSERT_EQUAL(std::string("hello"), line);
+    CPPUNIT_ASSERT(latency < POLL_TIMEOUT_MS / 10);
+
+    // Termination doesn't wait for a timeout either.
+    line.clear();
+    latency = handoff([]() { Util::setTerminationFlag(); }, ready, line);
+    std::cout << "Termination handoff latency: " << latency << " ms." << std::endl;
+    CPPUNIT_ASSERT_EQUAL(-1, ready);
+    CPPUNIT_ASSERT(latency < POLL_TIMEOUT_MS / 10);
+
+    // The rest of the tests still run.
+    uint64_t value = 0;
+    CPPUNIT_ASSERT_EQUAL(static_cast<ssize_t>(sizeof(value)),
+                         read(Util::getTerminationFd(), &value, sizeof(value)));
+    TerminationFlag = false;
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void WhiteBoxTests::testSenderQueue()
+{
+    auto tile = [](const int x, const std::string& extra)
+                {
+                    return "tile: part=0 width=256 height=256 tileposx=" + std::to_string(x) +
+                           " tileposy=0 tilewidth=3840 tileheight=3840" + extra + "\n\x89PNG";
+                };
+    auto push = [](SenderQueue& queue, const std::string& message)
+                {
+                    return queue.push(message.data(), message.size(), Poco::Net::WebSocket::FRAME_TEXT);
+                };
+    auto text = [](const SenderQueue::Message& message)
+                {
+                    return std::string(message._data.data(), message._data.size());
+                };
+
+    // The first message asks for a sender, the rest wait for it.
+    SenderQueue queue;
+    CPPUNIT_ASSERT(push(queue, tile(0, " ver=1")) == SenderQueue::Pushed::Wake);
+    CPPUNIT_ASSERT(push(queue, tile(3840, " ver=1")) == SenderQueue::Pushed::Queued);
+    CPPUNIT_ASSERT(push(queue, "invalidatecursor: 0, 0, 10, 10") == SenderQueue::Pushed::Queued);
+    CPPUNIT_ASSERT(push(queue, "statechanged: .uno:Bold=true") == SenderQueue::Pushed::Queued);
+    CPPUNIT_ASSERT(push(queue, "statechanged: .uno:Italic=false") == SenderQueue::Pushed::Queued);
+    CPPUNIT_ASSERT(push(queue, "invalidatetiles: EMPTY") == SenderQueue::Pushed::Queued);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(6), queue.getDepth());
+
+    // Newer renders of a tile and newer states supersede the queued ones, but not a tile
+    // requested with an id, nor the other uno commands.
+    CPPUNIT_ASSERT(push(queue, tile(0, " ver=2")) == SenderQueue::Pushed::Queued);
+    CPPUNIT_ASSERT(push(queue, tile(0, " id=1")) == SenderQueue::Pushed::Queued);
+    CPPUNIT_ASSERT(push(queue, "invalidatecursor: 20, 0, 10, 10") == SenderQueue::Pushed::Queued);
+    CPPUNIT_ASSERT(push(queue, "statechanged: .uno:Bold=false") == SenderQueue::Pushed::Queued);
+    CPPUNIT_ASSERT(push(queue, "invalidatetiles: EMPTY") == SenderQueue::Pushed::Queued);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), queue.getDropped());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(8), queue.getDepth());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(8), queue.getPeakDepth());
+
+    std::deque<SenderQueue::Message> messages;
+    CPPUNIT_ASSERT(queue.pop(messages));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(8), messages.size());
+    CPPUNIT_ASSERT_EQUAL(tile(3840, " ver=1"), text(messages[0]));
+    CPPUNIT_ASSERT_EQUAL(std::string("statechanged: .uno:Italic=false"), text(messages[1]));
+    CPPUNIT_ASSERT_EQUAL(std::string("invalidatetiles: EMPTY"), text(messages[2]));
+    CPPUNIT_ASSERT_EQUAL(tile(0, " ver=2"), text(messages[3]));
+    CPPUNIT_ASSERT_EQUAL(tile(0, " id=1"), text(messages[4]));
+    CPPUNIT_ASSERT_EQUAL(std::string("invalidatecursor: 20, 0, 10, 10"), text(messages[5]));
+    CPPUNIT_ASSERT_EQUAL(std::string("statechanged: .uno:Bold=false"), text(messages[6]));
+    CPPUNIT_ASSERT_EQUAL(std::string("invalidatetiles: EMPTY"), text(messages[7]));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), queue.getBytes());
+
+    // A newer state goes after what was queued after the one it supersedes, not in its place.
+    SenderQueue ordered;
+    CPPUNIT_ASSERT(push(ordered, "statechanged: .uno:Bold=true") == SenderQueue::Pushed::Wake);
+    CPPUNIT_ASSERT(push(ordered, "invalidatetiles: part=0 x=0 y=0 width=100 height=100") == SenderQueue::Pushed::Queued);
+    CPPUNIT_ASSERT(push(ordered, "statechanged: .uno:Bold=false") == SenderQueue::Pushed::Queued);
+    CPPUNIT_ASSERT(ordered.pop(messages));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), messages.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("invalidatetiles: part=0 x=0 y=0 width=100 height=100"), text(messages[0]));
+    CPPUNIT_ASSERT_EQUAL(std::string("statechanged: .uno:Bold=false"), text(messages[1]));
+
+    // Until the sender finds it empty, it's still the one sending.
+    CPPUNIT_ASSERT(push(queue, "invalidatetiles: EMPTY") == SenderQueue::Pushed::Queued);
+    CPPUNIT_ASSERT(queue.pop(messages));
+    CPPUNIT_ASSERT(!queue.pop(messages));
+    CPPUNIT_ASSERT(messages.empty());
+    CPPUNIT_ASSERT(push(queue, "invalidatetiles: EMPTY") == SenderQueue::Pushed::Wake);
+
+    // A client not keeping up is let go.
+    SenderQueue small(64);
+    const std::string message(40, 'x');
+    CPPUNIT_ASSERT(push(small, message) == SenderQueue::Pushed::Wake);
+    CPPUNIT_ASSERT(push(small, message) == SenderQueue::Pushed::Overflow);
+    CPPUNIT_ASSERT(small.isOverflown());
+    CPPUNIT_ASSERT(small.pop(messages));
+    CPPUNIT_ASSERT(push(small, message) == SenderQueue::Pushed::Dropped);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(40), small.getPeakBytes());
+
+    // The close frame goes after what's queued, over the limit too, and nothing goes after it.
+    SenderQueue closing(64);
+    const std::string reason(30, 'y');
+    CPPUNIT_ASSERT(push(closing, message) == SenderQueue::Pushed::Wake);
+    CPPUNIT_ASSERT(closing.pushClose(Poco::Net::WebSocket::WS_ENDPOINT_GOING_AWAY, reason) == SenderQueue::Pushed::Queued);
+    CPPUNIT_ASSERT(closing.isClosed());
+    CPPUNIT_ASSERT(!closing.isOverflown());
+    CPPUNIT_ASSERT(push(closing, "invalidatetiles: EMPTY") == SenderQueue::Pushed::Dropped);
+    CPPUNIT_ASSERT(closing.pushClose(Poco::Net::WebSocket::WS_NORMAL_CLOSE, "") == SenderQueue::Pushed::Dropped);
+    CPPUNIT_ASSERT(closing.pop(messages));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), messages.size());
+    CPPUNIT_ASSERT_EQUAL(message, text(messages[0]));
+    CPPUNIT_ASSERT_EQUAL(std::string("\x03\xe9") + reason, text(messages[1]));
+    CPPUNIT_ASSERT_EQUAL(static_cast<int>(Poco::Net::WebSocket::FRAME_FLAG_FIN | Poco::Net::WebSocket::FRAME_OP_CLOSE),
+                         messages[1]._flags);
+
+    // Sent once the sender finds it empty.
+    CPPUNIT_ASSERT(!closing.pop(messages));
+    closing.waitSent();
+}
+
+void WhiteBoxTests::testPerMessageDeflate()
+{
+    // The first offer we can do is taken, as much of it as we can do.
+    std::string response;
+    CPPUNIT_ASSERT(PerMessageDeflate::negotiate("permessage-deflate; client_max_window_bits", response));
+    CPPUNIT_ASSERT_EQUAL(std::string("permessage-deflate"), response);
+    CPPUNIT_ASSERT(PerMessageDeflate::negotiate("permessage-deflate; server_max_window_bits=8, "
+                                                "permessage-deflate; server_no_context_takeover", response));
+    CPPUNIT_ASSERT_EQUAL(std::string("permessage-deflate; server_no_context_takeover"), response);
+    CPPUNIT_ASSERT(PerMessageDeflate::negotiate("permessage-deflate; server_max_window_bits=\"10\"", response));
+    CPPUNIT_ASSERT_EQUAL(std::string("permessage-deflate; server_max_window_bits=10"), response);
+    CPPUNIT_ASSERT(!PerMessageDeflate::negotiate("x-webkit-deflate-frame", response));
+    CPPUNIT_ASSERT(!PerMessageDeflate::negotiate("permessage-deflate; client_no_context_takeover; "
+                                                 "client_no_context_takeover", response));
+    CPPUNIT_ASSERT(!PerMessageDeflate::negotiate("permessage-deflate; foo=1", response));
+    CPPUNIT_ASSERT(response.empty());
+
+    // The text of some typing, moving around and formatting.
+    std::vector<std::string> messages;
+    messages.push_back("commandvalues: {\"commandName\":\".uno:CharFontName\",\"commandValues\":{" +
+                       std::string(2000, ' ') + "\"Liberation Sans\":[],\"Liberation Serif\":[],"
+                       "\"Liberation Mono\":[],\"DejaVu Sans\":[],\"DejaVu Serif\":[]}}");
+    messages.push_back("partpagerectangles: 284, 284, 11906, 16838; 284, 17406, 11906, 16838; "
+                       "284, 34528, 11906, 16838; 284, 51650, 11906, 16838");
+    const char* const commands[] = { "Bold", "Italic", "Underline", "Strikeout", "LeftPara",
+                                     "CenterPara", "RightPara", "JustifyPara", "DefaultBullet" };
+    for (int i = 0; i < 200; ++i)
+    {
+        const std::string x = std::to_string(1418 + 113 * (i % 40));
+        const std::string y = std::to_string(1418 + 276 * (i / 40));
+        messages.push_back("invalidatecursor: " + x + ", " + y + ", 0, 276");
+        messages.push_back("invalidatetiles: part=0 x=0 y=" + y + " width=11906 height=276");
+        messages.push_back("textselection: " + x + ", " + y + ", 113, 276");
+        for (const char* command : commands)
+        {
+            messages.push_back(std::string("statechanged: .uno:") + command + (i % 7 ? "=false" : "=true"));
+        }
+
+        messages.push_back("statechanged: .uno:CharFontName=Liberation Serif");
+        messages.push_back("statechanged: .uno:FontHeight=12");
+    }
+
+    for (const bool contextTakeover : { true, false })
+    {
+        PerMessageDeflate sender(15, contextTakeover);
+        PerMessageDeflate receiver(15, true);
+        size_t bytes = 0;
+        size_t sent = 0;
+        std::vector<char> compressed;
+        for (const auto& message : messages)
+        {
+            bytes += message.size();
+            if (sender.deflate(message.data(), message.size(), compressed))
+            {
+                sent += compressed.size();
+                CPPUNIT_ASSERT(receiver.inflate(compressed));
+                CPPUNIT_ASSERT_EQUAL(message, std::string(compressed.data(), compressed.size()));
+            }
+            else
+            {
+                // Below the threshold, or not smaller, sent as is.
+                CPPUNIT_ASSERT(message.size() < PerMessageDeflate::MinSize || !contextTakeover);
+                sent += message.size();
+            }
+        }
+
+        std::cout << "Text of " << bytes << " bytes sent in " << sent << " bytes, "
+                  << (contextTakeover ? "with" : "without") << " context takeover: "
+                  << sender.getMetrics() << std::endl;
+        // The small messages only compress much against the ones before.
+        CPPUNIT_ASSERT(sent < bytes);
+        if (contextTakeover)
+            CPPUNIT_ASSERT(sent * 4 < bytes);
+    }
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(WhiteBoxTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
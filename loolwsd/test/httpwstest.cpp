@@ -35,6 +35,7 @@
 #include <Common.hpp>
 #include <UserMessages.hpp>
 #include <Util.hpp>
+#include <WorkerPool.hpp>
 #include <LOOLProtocol.hpp>
 
 #include "countloolkits.hpp"
@@ -68,6 +69,9 @@ class HTTPWSTest : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testPasswordProtectedDocumentWithCorrectPassword);
     CPPUNIT_TEST(testPasswordProtectedDocumentWithCorrectPasswordAgain);
     CPPUNIT_TEST(testImpressPartCountChanged);
+    CPPUNIT_TEST(testIdleSessionThreads);
+    CPPUNIT_TEST(testLargeMessageFrames);
+    CPPUNIT_TEST(testLargeSingleFrame);
 
     // This should be the last test:
     CPPUNIT_TEST(testNoExtraLoolKitsLeft);
@@ -92,6 +96,9 @@ class HTTPWSTest : public CPPUNIT_NS::TestFixture
     void testPasswordProtectedDocumentWithCorrectPassword();
     void testPasswordProtectedDocumentWithCorrectPasswordAgain();
     void testImpressPartCountChanged();
+    void testIdleSessionThreads();
+    void testLargeMessageFrames();
+    void testLargeSingleFrame();
     void testNoExtraLoolKitsLeft();
 
     void loadDoc(const std::string& documentURL);
@@ -108,6 +115,9 @@ class HTTPWSTest : public CPPUNIT_NS::TestFixture
                             std::string& response,
                             const bool isLine);
 
+    static
+    int countLoolWSDThreads();
+
     std::shared_ptr<Poco::Net::WebSocket>
     connectLOKit(Poco::Net::HTTPRequest& request,
                  Poco::Net::HTTPResponse& response);
@@ -995,6 +1005,166 @@ void HTTPWSTest::testImpressPartCountChanged()
     }
 }
 
+void HTTPWSTest::testIdleSessionThreads()
+{
+    const std::string documentPath = Util::getTempFilePath(TDOC, "hello.odt");
+    const std::string documentURL = "file://" + Poco::Path(documentPath).makeAbsolute().toString();
+    const int sessionCount = 10;
+
+    try
+    {
+        // Load a document, so the kit and the socket polls are up.
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, documentURL);
+        std::vector<std::shared_ptr<Poco::Net::WebSocket>> sockets;
+        sockets.push_back(connectLOKit(request, _response));
+        sendTextFrame(*sockets.back(), "load url=" + documentURL);
+        CPPUNIT_ASSERT_MESSAGE("cannot load the document " + documentURL, isDocumentLoaded(*sockets.back()));
+
+        const int threads = countLoolWSDThreads();
+        CPPUNIT_ASSERT(threads > 0);
+
+        for (int i = 0; i < sessionCount; ++i)
+        {
+            sockets.push_back(connectLOKit(request, _response));
+            sendTextFrame(*sockets.back(), "load url=" + documentURL);
+            CPPUNIT_ASSERT_MESSAGE("cannot load the document " + documentURL, isDocumentLoaded(*sockets.back()));
+        }
+
+        // An idle session mustn't cost a thread, be it for its sockets or its queue, only the
+        // worker pools for I/O and for the sessions may have kept the few that were busy at once.
+        const int added = countLoolWSDThreads() - threads;
+        std::cout << "Threads added for " << sessionCount << " sessions: " << added << std::endl;
+        CPPUNIT_ASSERT(added <= static_cast<int>(2 * WorkerPool::MaxIdle));
+
+        for (auto& socket : sockets)
+        {
+            socket->shutdown();
+        }
+
+        Util::removeFile(documentPath);
+    }
+    catch (const Poco::Exception& exc)
+    {
+        CPPUNIT_FAIL(exc.displayText());
+    }
+}
+
+void HTTPWSTest::testLargeMessageFrames()
+{
+    const std::string documentPath = Util::getTempFilePath(TDOC, "hello.odt");
+    const std::string documentURL = "file://" + Poco::Path(documentPath).makeAbsolute().toString();
+
+    try
+    {
+        // Only clients from 0.2 on get the large tile without a nextmessage: before it.
+        for (const std::string version : { "0.1", "0.2" })
+        {
+            Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, documentURL);
+            Poco::Net::WebSocket socket = *connectLOKit(request, _response);
+
+            sendTextFrame(socket, "loolclient " + version);
+            std::string response;
+            getResponseMessage(socket, "loolserver ", response, true);
+            CPPUNIT_ASSERT_EQUAL(LOOLProtocol::GetProtocolVersion(), response);
+
+            sendTextFrame(socket, "load url=" + documentURL);
+            CPPUNIT_ASSERT_MESSAGE("cannot load the document " + documentURL, isDocumentLoaded(socket));
+
+            sendTextFrame(socket, "tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840");
+
+            bool announced = false;
+            std::vector<char> payload;
+            int flags;
+            do
+            {
+                payload.resize(MAX_FRAME_SIZE);
+                const int n = socket.receiveFrame(payload.data(), payload.size(), flags);
+                CPPUNIT_ASSERT(n > 0);
+                CPPUNIT_ASSERT((flags & Poco::Net::WebSocket::FRAME_OP_BITMASK) != Poco::Net::WebSocket::FRAME_OP_CLOSE);
+                payload.resize(n);
+                if (LOOLProtocol::getFirstLine(payload).find("nextmessage:") == 0)
+                    announced = true;
+            }
+            while (LOOLProtocol::getFirstLine(payload).find("tile:") != 0);
+
+            std::cout << "Tile of " << payload.size() << " bytes to a " << version << " client"
+                      << (announced ? " announced." : ".") << std::endl;
+            CPPUNIT_ASSERT(payload.size() > static_cast<size_t>(SMALL_MESSAGE_SIZE));
+            CPPUNIT_ASSERT_EQUAL(version == "0.1", announced);
+
+            socket.shutdown();
+        }
+
+        Util::removeFile(documentPath);
+    }
+    catch (const Poco::Exception& exc)
+    {
+        CPPUNIT_FAIL(exc.displayText());
+    }
+}
+
+void HTTPWSTest::testLargeSingleFrame()
+{
+    const std::string documentPath = Util::getTempFilePath(TDOC, "hello.odt");
+    const std::string documentURL = "file://" + Poco::Path(documentPath).makeAbsolute().toString();
+
+    try
+    {
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, documentURL);
+        Poco::Net::WebSocket socket = *connectLOKit(request, _response);
+
+        // So that the selection comes back in frames we can read.
+        sendTextFrame(socket, "loolclient 0.2");
+        std::string response;
+        getResponseMessage(socket, "loolserver ", response, true);
+
+        sendTextFrame(socket, "load url=" + documentURL);
+        CPPUNIT_ASSERT_MESSAGE("cannot load the document " + documentURL, isDocumentLoaded(socket));
+
+        sendTextFrame(socket, "uno .uno:SelectAll");
+        sendTextFrame(socket, "uno .uno:Delete");
+
+        // Paste more than MAX_FRAME_SIZE in a single frame, without a nextmessage: before it.
+        std::string text;
+        while (text.size() <= static_cast<size_t>(MAX_FRAME_SIZE))
+            text += "aaa bbb ccc ";
+        text += "end";
+        sendTextFrame(socket, "paste mimetype=text/plain;charset=utf-8\n" + text);
+
+        sendTextFrame(socket, "uno .uno:SelectAll");
+        sendTextFrame(socket, "gettextselection mimetype=text/plain;charset=utf-8");
+
+        const std::string prefix = "textselectioncontent: ";
+        std::vector<char> payload;
+        int flags;
+        do
+        {
+            // Reassemble the frames of each message.
+            payload.clear();
+            do
+            {
+                const size_t offset = payload.size();
+                payload.resize(offset + MAX_FRAME_SIZE);
+                const int n = socket.receiveFrame(payload.data() + offset, MAX_FRAME_SIZE, flags);
+                CPPUNIT_ASSERT(n > 0);
+                CPPUNIT_ASSERT((flags & Poco::Net::WebSocket::FRAME_OP_BITMASK) != Poco::Net::WebSocket::FRAME_OP_CLOSE);
+                payload.resize(offset + n);
+            }
+            while ((flags & Poco::Net::WebSocket::FRAME_FLAG_FIN) == 0);
+        }
+        while (LOOLProtocol::getFirstLine(payload).find(prefix) != 0);
+
+        CPPUNIT_ASSERT_EQUAL(text, LOOLProtocol::getFirstLine(payload).substr(prefix.size()));
+
+        socket.shutdown();
+        Util::removeFile(documentPath);
+    }
+    catch (const Poco::Exception& exc)
+    {
+        CPPUNIT_FAIL(exc.displayText());
+    }
+}
+
 void HTTPWSTest::testNoExtraLoolKitsLeft()
 {
     int countNow = countLoolKitProcesses();
@@ -1160,6 +1330,48 @@ int countLoolKitProcesses()
     return result;
 }
 
+int HTTPWSTest::countLoolWSDThreads()
+{
+    // Give the sessions time to settle.
+    Poco::Thread::sleep(POLL_TIMEOUT_MS*5);
+
+    int result = 0;
+
+    for (auto i = Poco::DirectoryIterator(std::string("/proc")); i != Poco::DirectoryIterator(); ++i)
+    {
+        try
+        {
+            Poco::Path procEntry = i.path();
+            const std::string& fileName = procEntry.getFileName();
+            if (fileName.empty() || fileName.find_first_not_of("0123456789") != std::string::npos)
+            {
+                continue;
+            }
+
+            Poco::FileInputStream status(procEntry.toString() + "/status");
+            std::string line;
+            bool isLoolWSD = false;
+            while (std::getline(status, line))
+            {
+                if (line.find("Name:") == 0)
+                {
+                    isLoolWSD = (line.find("loolwsd") != std::string::npos);
+                }
+                else if (isLoolWSD && line.find("Threads:") == 0)
+                {
+                    result += std::stoi(line.substr(std::string("Threads:").size()));
+                    break;
+                }
+            }
+        }
+        catch (const Poco::Exception&)
+        {
+        }
+    }
+
+    return result;
+}
+
 // Connecting to a Kit process is managed by document broker, that it does several
 // jobs to establish the bridge connection between the Client and Kit process,
 // The result, it is mostly time outs to get messages in the unit test and it could fail.